@@ -0,0 +1,134 @@
+
+//------------------------------------------------------------------
+//Tunes the explicit CPU solver's tiles, threads and steps per block
+//(source/cpu_stepper.h) for some grid sizes on this machine, saves
+//the winners where the CPU backends look for them, and prints how
+//they compare with plain stepExplicit() as JSON.
+//
+//    cpu_autotune [-seconds 0.05] [-retune] [size ...]
+//
+//Sizes already tuned on this machine are loaded rather than tuned
+//again, unless -retune is given. Each tuning is also checked to step
+//exactly like stepExplicit() over a pool with barriers in it.
+//------------------------------------------------------------------
+
+#include "cpu_stepper.h"
+#include "water_sweep.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+const double SECONDS_PER_CASE = 0.3; //Steps are timed for at least this long
+const int CHECK_STEPS = 37;          //Not a multiple of any block size
+
+//A pool with the zigzag barriers and a wave going through it
+void fillPool(CPUWaterGrid &grid, int size)
+{
+    grid.resize(size, size);
+    std::fill(grid.heights.begin(), grid.heights.end(), 2.0f);
+    std::vector<unsigned char> mask;
+    sweepBarrierMask(SWEEP_BARRIERS_ZIGZAG, size, size, mask);
+    applyMask(grid, &mask[0]);
+    injectWater(grid, 0.25f, 0.5f, 0.15f, 1.0f);
+}
+
+//Milliseconds per step, with the stepper or (stepper NULL) stepExplicit()
+double timeSteps(CPUWaterGrid &grid, CPUStepper *stepper)
+{
+    CPUSolverSettings solver;
+    int block = stepper ? stepper->tuning().blockSteps : 1;
+    int steps = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0.0);
+    while (elapsed.count() < SECONDS_PER_CASE || steps < 3 * block)
+    {
+        if (stepper)
+            stepper->step(grid, solver, block);
+        else
+            stepExplicit(grid, solver);
+        steps += block;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return elapsed.count() * 1000.0 / steps;
+}
+
+//Largest difference from stepExplicit() after CHECK_STEPS steps
+float checkTuning(int size, CPUStepper &stepper)
+{
+    CPUSolverSettings solver;
+    CPUWaterGrid expected, tiled;
+    fillPool(expected, size);
+    fillPool(tiled, size);
+    for (int i = 0; i < CHECK_STEPS; i++)
+        stepExplicit(expected, solver);
+    stepper.step(tiled, solver, CHECK_STEPS);
+
+    float error = 0.0f;
+    for (std::size_t i = 0; i < expected.heights.size(); i++)
+    {
+        error = std::max(error, std::fabs(expected.heights[i] - tiled.heights[i]));
+        error = std::max(error, std::fabs(expected.velocities[i] - tiled.velocities[i]));
+    }
+    return error;
+}
+
+int main(int argc, char *argv[])
+{
+    float trialSeconds = 0.05f;
+    bool retune = false;
+    std::vector<int> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-seconds") == 0 && i + 1 < argc)
+            trialSeconds = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "-retune") == 0)
+            retune = true;
+        else if (atoi(argv[i]) >= 4)
+            sizes.push_back(atoi(argv[i]));
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (sizes.empty())
+        sizes = { 256, 512, 1024 };
+
+    printf("{\n  \"machine\": \"%s\",\n  \"file\": \"%s\",\n  \"results\": [\n", stepperMachineName().c_str(),
+           stepperTuningFile().c_str());
+    for (std::size_t s = 0; s < sizes.size(); s++)
+    {
+        int size = sizes[s];
+        CPUStepTuning tuning;
+        bool cached = !retune && loadStepperTuning(size, size, tuning);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!cached)
+        {
+            tuning = tuneStepper(size, size, trialSeconds);
+            if (!saveStepperTuning(size, size, tuning))
+                fprintf(stderr, "Couldn't write %s\n", stepperTuningFile().c_str());
+        }
+        std::chrono::duration<double> tuneSeconds = std::chrono::steady_clock::now() - start;
+
+        CPUStepper stepper;
+        stepper.init(tuning);
+        CPUWaterGrid grid;
+        fillPool(grid, size);
+        double plainMs = timeSteps(grid, NULL);
+        double tunedMs = timeSteps(grid, &stepper);
+
+        printf("    {\"size\": %d, \"cached\": %s, \"tuneSeconds\": %.3g, \"tileWidth\": %d, \"tileHeight\": %d, "
+               "\"threads\": %d, \"blockSteps\": %d, \"stepExplicitMs\": %.4g, \"tunedMs\": %.4g, \"speedup\": %.3g, "
+               "\"maxError\": %g}%s\n",
+               size, cached ? "true" : "false", cached ? 0.0 : tuneSeconds.count(), tuning.tileWidth, tuning.tileHeight,
+               tuning.threads, tuning.blockSteps, plainMs, tunedMs, plainMs / tunedMs, checkTuning(size, stepper),
+               s == sizes.size() - 1 ? "" : ",");
+        fflush(stdout);
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+
+//------------------------------------------------------------------
+//Compares where the CPU solver's grids get their memory from (see
+//source/memory_arena.h): the plain heap they used to come from, and
+//mapped arenas in normal, transparent huge and explicit huge pages.
+//Prints the results as JSON.
+//
+//For each size and backing it times sizing the grid (mapping plus
+//first touch) and stepping it with both solvers, and counts heap
+//allocations made while stepping, which should always be zero.
+//
+//    grid_allocation [size ...]
+//
+//Explicit huge pages need a pool (vm.nr_hugepages); without one the
+//arena falls back, and "backing" says what it really got.
+//------------------------------------------------------------------
+
+#include "cpu_solver.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+const double SECONDS_PER_CASE = 0.3; //Steps are timed for at least this long
+const int MIN_STEPS = 3;
+const int MIN_SIZE = 16;
+const int MAX_SIZE = 16384;
+
+static const char *pageNames[] = { "heap", "pages", "transparentHugePages", "explicitHugePages" };
+
+//Every allocation in the program goes through here, so stepping can be checked for them
+static std::atomic<long long> heapAllocations(0);
+
+void *operator new(std::size_t bytes)
+{
+    heapAllocations++;
+    void *memory = malloc(bytes ? bytes : 1);
+    if (!memory)
+        throw std::bad_alloc();
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+    free(memory);
+}
+
+struct StepTiming
+{
+    double msPerStep = 0.0;
+    long long allocations = 0;
+};
+
+StepTiming timeSteps(CPUWaterGrid &grid, bool implicit)
+{
+    CPUSolverSettings settings;
+    StepTiming timing;
+    long long allocationsBefore = heapAllocations;
+    int steps = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0.0);
+    while (elapsed.count() < SECONDS_PER_CASE || steps < MIN_STEPS)
+    {
+        if (implicit)
+            stepImplicit(grid, settings, 120.0f);
+        else
+            stepExplicit(grid, settings);
+        steps++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    timing.msPerStep = elapsed.count() * 1000.0 / steps;
+    timing.allocations = heapAllocations - allocationsBefore;
+    return timing;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<int> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        char *end = NULL;
+        long size = strtol(argv[i], &end, 10);
+        if (end == argv[i] || *end != '\0' || size < MIN_SIZE || size > MAX_SIZE)
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            fprintf(stderr, "Usage: grid_allocation [size ...], sizes from %d to %d\n", MIN_SIZE, MAX_SIZE);
+            return 1;
+        }
+        sizes.push_back((int)size);
+    }
+    if (sizes.empty())
+        sizes = { 512, 1024, 2048 };
+
+    printf("{\n  \"results\": [\n");
+    for (std::size_t s = 0; s < sizes.size(); s++)
+    {
+        for (int p = ARENA_HEAP; p <= ARENA_EXPLICIT_HUGE_PAGES; p++)
+        {
+            MemoryArena::setPages((ArenaPages)p);
+            CPUWaterGrid grid;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            grid.resize(sizes[s], sizes[s]);
+            std::chrono::duration<double, std::milli> resizeMs = std::chrono::steady_clock::now() - start;
+
+            std::fill(grid.heights.begin(), grid.heights.end(), 2.0f);
+            injectWater(grid, 0.25f, 0.5f, 0.15f, 1.0f);
+            StepTiming explicitSteps = timeSteps(grid, false);
+            StepTiming implicitSteps = timeSteps(grid, true);
+
+            bool last = (s == sizes.size() - 1 && p == ARENA_EXPLICIT_HUGE_PAGES);
+            printf("    {\"size\": %d, \"pages\": \"%s\", \"backing\": \"%s\", \"megabytes\": %.1f, \"resizeMs\": %.4g, "
+                   "\"explicitMsPerStep\": %.4g, \"implicitMsPerStep\": %.4g, \"stepAllocations\": %lld}%s\n",
+                   sizes[s], pageNames[p], pageNames[grid.memory().backing()], grid.memory().capacity() / (1024.0 * 1024.0),
+                   resizeMs.count(), explicitSteps.msPerStep, implicitSteps.msPerStep,
+                   explicitSteps.allocations + implicitSteps.allocations, last ? "" : ",");
+            fflush(stdout);
+        }
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+
+//------------------------------------------------------------------
+//Times the CPU ocean (water_ocean.h) at a few sizes and thread
+//counts, checks its FFTs against a direct DFT, and prints the
+//results as JSON.
+//
+//A frame is what the demo's CPU engine does every frame: the
+//spectrum at that moment, three inverse FFTs, and the textures.
+//------------------------------------------------------------------
+
+#include "fft.h"
+#include "water_ocean.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+const double SECONDS_PER_CASE = 0.5; //Frames are timed for at least this long
+const int ERROR_SIZE = 32;           //The direct DFT is O(N^4)
+
+//Largest difference between FFT2D::inverse() and the sum it stands for, relative to the largest output
+double fftError()
+{
+    const int n = ERROR_SIZE;
+    const double TWO_PI = 6.28318530717958647692;
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    std::vector<float> real(n * n), imaginary(n * n);
+    for (int i = 0; i < n * n; i++)
+    {
+        real[i] = uniform(random);
+        imaginary[i] = uniform(random);
+    }
+
+    std::vector<double> expectedReal(n * n, 0.0), expectedImaginary(n * n, 0.0);
+    double largest = 0.0;
+    for (int y = 0; y < n; y++)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            double sumReal = 0.0, sumImaginary = 0.0;
+            for (int v = 0; v < n; v++)
+            {
+                for (int u = 0; u < n; u++)
+                {
+                    double angle = TWO_PI * ((u * x + v * y) % n) / n;
+                    double c = std::cos(angle), s = std::sin(angle);
+                    sumReal += real[v * n + u] * c - imaginary[v * n + u] * s;
+                    sumImaginary += real[v * n + u] * s + imaginary[v * n + u] * c;
+                }
+            }
+            expectedReal[y * n + x] = sumReal;
+            expectedImaginary[y * n + x] = sumImaginary;
+            largest = std::max(largest, std::sqrt(sumReal * sumReal + sumImaginary * sumImaginary));
+        }
+    }
+
+    FFT2D fft;
+    fft.init(n, 1);
+    float *fieldsReal[] = { &real[0] };
+    float *fieldsImaginary[] = { &imaginary[0] };
+    fft.inverse(fieldsReal, fieldsImaginary, 1);
+    double error = 0.0;
+    for (int i = 0; i < n * n; i++)
+    {
+        error = std::max(error, std::fabs(real[i] - expectedReal[i]));
+        error = std::max(error, std::fabs(imaginary[i] - expectedImaginary[i]));
+    }
+    return error / largest;
+}
+
+//Milliseconds per frame, and the significant wave height it came out with
+double timeOcean(int size, int threads, double &waveHeight)
+{
+    OceanSettings settings;
+    settings.size = size;
+    settings.threads = threads;
+    OceanSpectrum ocean;
+    ocean.create(settings);
+    std::vector<float> height(size * size * 4), surfaceData(size * size * 4);
+
+    int frames = 0;
+    double seconds = 0.0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0.0);
+    while (elapsed.count() < SECONDS_PER_CASE || frames < 10)
+    {
+        ocean.evaluate(seconds);
+        ocean.writeTextures(&height[0], &surfaceData[0]);
+        seconds += 1.0 / 60.0;
+        frames++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    double sum = 0.0, sumSquares = 0.0;
+    for (int i = 0; i < size * size; i++)
+    {
+        sum += height[i * 4 + 1];
+        sumSquares += height[i * 4 + 1] * height[i * 4 + 1];
+    }
+    double mean = sum / (size * size);
+    waveHeight = 4.0 * std::sqrt(std::max(sumSquares / (size * size) - mean * mean, 0.0));
+    return elapsed.count() * 1000.0 / frames;
+}
+
+int main()
+{
+    const int sizes[] = { 64, 128, 256, 512 };
+    const int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+    int hardwareThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+    int threadCounts[] = { 1, hardwareThreads };
+    int threadCases = (hardwareThreads > 1) ? 2 : 1;
+
+    printf("{\n  \"fftRelativeError\": %.6g,\n  \"fftErrorSize\": %d,\n", fftError(), ERROR_SIZE);
+    printf("  \"targetWaveHeight\": %g,\n  \"results\": [\n", OceanSettings().waveHeight);
+    for (int s = 0; s < sizeCount; s++)
+    {
+        for (int t = 0; t < threadCases; t++)
+        {
+            double waveHeight = 0.0;
+            double ms = timeOcean(sizes[s], threadCounts[t], waveHeight);
+            printf("    {\"size\": %d, \"threads\": %d, \"msPerFrame\": %.6g, \"waveHeight\": %.6g}%s\n",
+                   sizes[s], threadCounts[t], ms, waveHeight, (s == sizeCount - 1 && t == threadCases - 1) ? "" : ",");
+        }
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
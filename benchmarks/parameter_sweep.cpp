@@ -0,0 +1,116 @@
+
+//------------------------------------------------------------------
+//Runs every combination of a grid of water parameters as its own
+//headless simulation, spread over every core, and prints one table
+//(CSV) with a row per run. See source/water_sweep.h.
+//
+//    parameter_sweep -gravity 0.05,0.1,0.2 -decay 0.995,0.998
+//                    -brushSize 0.1,0.2 -brushPower 25 -barriers 0,1,2,3
+//                    -res 128 -seconds 2 -threads 0 -implicit 120
+//
+//Lists are comma separated; anything left out keeps the demo's
+//default. Barrier layouts are 0 (none), 1 (wall), 2 (gap) and
+//3 (zigzag), as Space cycles through them in the demo. A summary of
+//the whole sweep goes to stderr, so the table can be redirected.
+//------------------------------------------------------------------
+
+#include "water_sweep.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+template <typename T>
+void parseList(const char *text, std::vector<T> &values)
+{
+    values.clear();
+    while (*text)
+    {
+        char *end = NULL;
+        double value = strtod(text, &end);
+        if (end == text)
+            break;
+        values.push_back((T)value);
+        text = (*end == ',') ? end + 1 : end;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    SweepGrid grid;
+    grid.gravity = { 0.05f, 0.1f, 0.2f };
+    grid.decay = { 0.995f, 0.998f };
+    grid.brushSize = { 0.1f, 0.15f };
+    grid.barriers = { SWEEP_BARRIERS_NONE, SWEEP_BARRIERS_WALL, SWEEP_BARRIERS_GAP, SWEEP_BARRIERS_ZIGZAG };
+    SweepSettings settings;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : "";
+        if (strcmp(argv[i], "-gravity") == 0)
+            parseList(value, grid.gravity);
+        else if (strcmp(argv[i], "-decay") == 0)
+            parseList(value, grid.decay);
+        else if (strcmp(argv[i], "-brushSize") == 0)
+            parseList(value, grid.brushSize);
+        else if (strcmp(argv[i], "-brushPower") == 0)
+            parseList(value, grid.brushPower);
+        else if (strcmp(argv[i], "-barriers") == 0)
+            parseList(value, grid.barriers);
+        else if (strcmp(argv[i], "-res") == 0)
+        {
+            int count = sscanf(value, "%dx%d", &settings.width, &settings.height);
+            if (count == 1)
+                settings.height = settings.width;
+        }
+        else if (strcmp(argv[i], "-seconds") == 0)
+            settings.seconds = (float)atof(value);
+        else if (strcmp(argv[i], "-threads") == 0)
+            settings.threads = atoi(value);
+        else if (strcmp(argv[i], "-implicit") == 0)
+        {
+            settings.implicit = true;
+            settings.implicitStepsPerSecond = (float)atof(value);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+
+    for (std::size_t i = 0; i < grid.barriers.size(); i++)
+    {
+        if (grid.barriers[i] < 0 || grid.barriers[i] >= SWEEP_BARRIER_LAYOUTS)
+        {
+            fprintf(stderr, "Barrier layouts go from 0 to %d, not %d\n", SWEEP_BARRIER_LAYOUTS - 1, grid.barriers[i]);
+            return 1;
+        }
+    }
+    if (settings.width < 4 || settings.height < 4 || settings.seconds <= 0.0f ||
+        (settings.implicit && settings.implicitStepsPerSecond <= 0.0f))
+    {
+        fprintf(stderr, "Bad -res, -seconds or -implicit\n");
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<SweepResult> results = runSweep(grid, settings);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printSweepTable(stdout, results);
+
+    double runSeconds = 0.0;
+    int unstable = 0;
+    for (std::size_t i = 0; i < results.size(); i++)
+    {
+        runSeconds += results[i].ms / 1000.0;
+        unstable += results[i].stable ? 0 : 1;
+    }
+    fprintf(stderr, "%d runs of %dx%d for %gs each in %.2fs (%.2fs of runs, %.1fx), %d unstable\n",
+            (int)results.size(), settings.width, settings.height, settings.seconds, elapsed.count(), runSeconds,
+            runSeconds / elapsed.count(), unstable);
+    return 0;
+}
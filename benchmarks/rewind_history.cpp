@@ -0,0 +1,169 @@
+
+//------------------------------------------------------------------
+//Records a pool with the demo's zigzag barriers and the brush moving
+//around it into a WaterHistory (source/water_history.h), then seeks
+//back through it at random, and prints as JSON how much history the
+//budget held, how long seeks took and how far the restored water is
+//from the real thing.
+//
+//    rewind_history [-res 256] [-budget 16] [-interval 32] [-seconds 20]
+//
+//The budget is in megabytes. A record is taken every frame (at 60
+//frames a second, 12.5 explicit steps), and exact seeks step the
+//solver from the record before.
+//------------------------------------------------------------------
+
+#include "water_history.h"
+#include "water_sweep.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+const float FRAME_RATE = 60.0f;
+const int SEEKS = 200;
+const int CHECKS = 20; //Seeks compared with the real water, which is kept raw for this
+
+struct SeekTimes
+{
+    double averageMs = 0.0;
+    double maxMs = 0.0;
+    double averageDecodes = 0.0;
+};
+
+int main(int argc, char *argv[])
+{
+    int size = 256;
+    double budgetMegabytes = 16.0;
+    int interval = 32;
+    float seconds = 20.0f;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-res") == 0)
+            size = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-budget") == 0)
+            budgetMegabytes = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "-interval") == 0)
+            interval = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-seconds") == 0)
+            seconds = (float)atof(argv[i + 1]);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    WaterHistorySettings settings;
+    settings.budgetBytes = (std::size_t)(budgetMegabytes * 1024 * 1024);
+    settings.keyFrameInterval = interval;
+    WaterHistory history(settings);
+
+    CPUWaterGrid grid;
+    grid.resize(size, size);
+    std::fill(grid.heights.begin(), grid.heights.end(), 2.0f);
+    std::vector<unsigned char> mask;
+    sweepBarrierMask(SWEEP_BARRIERS_ZIGZAG, size, size, mask);
+    applyMask(grid, &mask[0]);
+    CPUSolverSettings solver;
+
+    //The brush goes around in a circle, on for half of every second
+    int frames = (int)(seconds * FRAME_RATE);
+    std::vector<CPUWaterGrid> checkGrids(CHECKS);
+    std::vector<unsigned long long> checkSteps(CHECKS);
+    int checkFirst = frames * 9 / 10; //Late enough to still be in the history, with a big enough budget
+    unsigned long long step = 0;
+    double accumulator = 0.0;
+    double recordMs = 0.0;
+    float maxRecordMs = 0.0f;
+    for (int frame = 0; frame < frames; frame++)
+    {
+        float time = frame / FRAME_RATE;
+        if (std::fmod(time, 1.0f) < 0.5f)
+            injectWater(grid, 0.5f + 0.3f * std::cos(time), 0.5f + 0.3f * std::sin(time), 0.08f, 10.0f / FRAME_RATE);
+        accumulator += EXPLICIT_STEPS_PER_SECOND / FRAME_RATE;
+        for (; accumulator >= 1.0; accumulator -= 1.0, step++)
+            stepExplicit(grid, solver);
+
+        if (!history.record(step, grid))
+            return 1;
+        recordMs += history.stats().lastRecordMs;
+        maxRecordMs = std::max(maxRecordMs, history.stats().lastRecordMs);
+
+        //Some steps between records, for the exact seeks
+        int check = (frame - checkFirst) * CHECKS / (frames - checkFirst);
+        if (frame >= checkFirst && check < CHECKS && checkGrids[check].width == 0)
+        {
+            stepExplicit(grid, solver);
+            step++;
+            accumulator -= 1.0;
+            checkGrids[check] = grid;
+            checkSteps[check] = step;
+        }
+    }
+    WaterHistoryStats recorded = history.stats();
+
+    //Random seeks. Most start again from their key frame.
+    std::mt19937 random(11);
+    std::uniform_int_distribution<unsigned long long> anyStep(history.oldestStep(), history.newestStep());
+    CPUWaterGrid restored;
+    SeekTimes randomSeeks;
+    for (int i = 0; i < SEEKS; i++)
+    {
+        history.restore(anyStep(random), restored);
+        randomSeeks.averageMs += history.stats().lastSeekMs / SEEKS;
+        randomSeeks.maxMs = std::max(randomSeeks.maxMs, (double)history.stats().lastSeekMs);
+        randomSeeks.averageDecodes += history.stats().lastSeekDecodes / (double)SEEKS;
+    }
+
+    //Scrubbing forward a record at a time carries on from the one before
+    SeekTimes scrub;
+    int scrubbed = 0;
+    for (unsigned long long s = history.oldestStep(); s <= history.newestStep() && scrubbed < SEEKS; s += 12, scrubbed++)
+    {
+        history.restore(s, restored);
+        scrub.averageMs += history.stats().lastSeekMs;
+        scrub.maxMs = std::max(scrub.maxMs, (double)history.stats().lastSeekMs);
+        scrub.averageDecodes += history.stats().lastSeekDecodes;
+    }
+    scrub.averageMs /= std::max(scrubbed, 1);
+    scrub.averageDecodes /= std::max(scrubbed, 1);
+
+    //Exact seeks against the real water
+    float maxHeightError = 0.0f, maxVelocityError = 0.0f;
+    double exactMs = 0.0;
+    int exactSeeks = 0;
+    for (int i = 0; i < CHECKS; i++)
+    {
+        if (checkGrids[i].width == 0 || !history.seek(checkSteps[i], restored, solver))
+            continue;
+        exactMs += history.stats().lastSeekMs;
+        exactSeeks++;
+        for (std::size_t c = 0; c < restored.heights.size(); c++)
+        {
+            maxHeightError = std::max(maxHeightError, std::fabs(restored.heights[c] - checkGrids[i].heights[c]));
+            maxVelocityError = std::max(maxVelocityError, std::fabs(restored.velocities[c] - checkGrids[i].velocities[c]));
+        }
+    }
+
+    double heldSeconds = (recorded.newestStep - recorded.oldestStep) / EXPLICIT_STEPS_PER_SECOND;
+    printf("{\n  \"size\": %d,\n  \"keyFrameInterval\": %d,\n  \"budgetBytes\": %zu,\n  \"usedBytes\": %zu,\n", size,
+           interval, recorded.budgetBytes, recorded.usedBytes);
+    printf("  \"records\": %d,\n  \"keyFrames\": %d,\n  \"secondsHeld\": %.3g,\n  \"secondsRecorded\": %.3g,\n",
+           recorded.records, recorded.keyFrames, heldSeconds, step / EXPLICIT_STEPS_PER_SECOND);
+    printf("  \"bytesPerRecord\": %.0f,\n  \"rawBytesPerRecord\": %.0f,\n  \"compression\": %.3g,\n",
+           (double)recorded.usedBytes / recorded.records, recorded.rawBytesPerRecord,
+           recorded.rawBytesPerRecord * recorded.records / recorded.usedBytes);
+    printf("  \"recordMs\": {\"average\": %.4g, \"max\": %.4g},\n", recordMs / frames, maxRecordMs);
+    printf("  \"randomSeekMs\": {\"average\": %.4g, \"max\": %.4g, \"averageDecodes\": %.3g},\n", randomSeeks.averageMs,
+           randomSeeks.maxMs, randomSeeks.averageDecodes);
+    printf("  \"scrubSeekMs\": {\"average\": %.4g, \"max\": %.4g, \"averageDecodes\": %.3g},\n", scrub.averageMs,
+           scrub.maxMs, scrub.averageDecodes);
+    printf("  \"exactSeeks\": %d,\n  \"exactSeekMs\": %.4g,\n  \"maxHeightError\": %g,\n  \"maxVelocityError\": %g\n}\n",
+           exactSeeks, exactSeeks ? exactMs / exactSeeks : 0.0, maxHeightError, maxVelocityError);
+    return 0;
+}
@@ -0,0 +1,204 @@
+
+//------------------------------------------------------------------
+//Compares the explicit and implicit water solvers against a reference
+//run, and prints the results as JSON.
+//
+//The reference is the explicit solver at 4x its normal rate, which is
+//as close to converged in time as we can cheaply get on the same grid.
+//Each engine is scored on the heights a viewer would see at 60 FPS.
+//------------------------------------------------------------------
+
+#include "cpu_solver.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+const int GRID_SIZE = 128;
+const float DURATION = 2.0f;    //Seconds of simulated time
+const float FRAME_RATE = 60.0f; //How often the error is sampled
+const float BASE_HEIGHT = 2.0f;
+
+struct Scenario
+{
+    const char *name;
+    bool hardBrush; //The demo's hard edged brush, otherwise a smooth drop
+    bool barriers;  //The zigzag barrier configuration
+};
+
+struct Engine
+{
+    const char *name;
+    bool implicit;
+    float stepsPerSecond;
+};
+
+void setupScenario(CPUWaterGrid &grid, const Scenario &scenario)
+{
+    grid.resize(GRID_SIZE, GRID_SIZE);
+    for (int y = 0; y < GRID_SIZE; y++)
+    {
+        for (int x = 0; x < GRID_SIZE; x++)
+        {
+            int i = grid.index(x, y);
+            float u = (x + 0.5f) / GRID_SIZE;
+            float v = (y + 0.5f) / GRID_SIZE;
+
+            //Roughly the walls from cycleBarriers(), in texture space
+            if (scenario.barriers)
+            {
+                bool wall = (std::fabs(u - 0.233f) < 0.033f && v > 0.067f) ||
+                            (std::fabs(u - 0.5f) < 0.033f && v < 0.933f) ||
+                            (std::fabs(u - 0.767f) < 0.033f && v > 0.067f);
+                if (wall)
+                {
+                    grid.masks[i] = 1.0f;
+                    continue;
+                }
+            }
+
+            float dist = std::sqrt((u - 0.1f) * (u - 0.1f) + (v - 0.5f) * (v - 0.5f));
+            float bump = 0.0f;
+            if (scenario.hardBrush)
+                bump = (dist <= 0.08f) ? 1.0f : 0.0f;
+            else if (dist < 0.08f)
+                bump = 0.5f + 0.5f * std::cos(3.14159265f * dist / 0.08f);
+            grid.heights[i] = BASE_HEIGHT + bump;
+        }
+    }
+}
+
+//Runs one engine over the whole duration, keeping every sampled frame of heights and
+//the diagnostics of the last one
+double runEngine(const Scenario &scenario, const Engine &engine, const CPUSolverSettings &baseSettings,
+                 std::vector<std::vector<float> > &frames, WaterDiagnostics &finalDiagnostics)
+{
+    CPUWaterGrid grid;
+    setupScenario(grid, scenario);
+
+    //The explicit solver has no dt, so running it at another rate means rescaling its constants
+    float r = EXPLICIT_STEPS_PER_SECOND / engine.stepsPerSecond;
+    CPUSolverSettings settings = baseSettings;
+    if (!engine.implicit)
+    {
+        settings.gravity = baseSettings.gravity * r * r;
+        settings.decay = std::pow(baseSettings.decay, r);
+    }
+
+    frames.clear();
+    double accumulator = 0.0;
+    double stepTime = 1.0 / engine.stepsPerSecond;
+    int frameCount = (int)(DURATION * FRAME_RATE);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frameCount; frame++)
+    {
+        accumulator += 1.0 / FRAME_RATE;
+        while (accumulator >= stepTime)
+        {
+            if (engine.implicit)
+                stepImplicit(grid, settings, engine.stepsPerSecond);
+            else
+                stepExplicit(grid, settings);
+            accumulator -= stepTime;
+        }
+        frames.push_back(std::vector<float>(grid.heights.begin(), grid.heights.end()));
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    finalDiagnostics = reduceDiagnostics(grid);
+    return elapsed.count();
+}
+
+double totalVolume(const std::vector<float> &heights)
+{
+    double volume = 0.0;
+    for (std::size_t i = 0; i < heights.size(); i++)
+        volume += heights[i];
+    return volume;
+}
+
+//Prints a number, or null if the engine blew up
+void printNumber(const char *name, double value, bool comma)
+{
+    if (std::isfinite(value))
+        printf("\"%s\": %.6g%s", name, value, comma ? ", " : "");
+    else
+        printf("\"%s\": null%s", name, comma ? ", " : "");
+}
+
+int main()
+{
+    const Scenario scenarios[] = {
+        { "smooth_drop", false, false },
+        { "hard_brush_zigzag", true, true }
+    };
+    const Engine reference = { "explicit_reference", false, EXPLICIT_STEPS_PER_SECOND * 4.0f };
+    const Engine engines[] = {
+        { "explicit", false, 750.0f },
+        { "explicit", false, 120.0f },
+        { "implicit", true, 240.0f },
+        { "implicit", true, 120.0f },
+        { "implicit", true, 60.0f }
+    };
+    const int engineCount = sizeof(engines) / sizeof(engines[0]);
+    CPUSolverSettings settings;
+
+    printf("{\n  \"grid\": [%d, %d],\n  \"duration\": %g,\n  \"results\": [\n", GRID_SIZE, GRID_SIZE, DURATION);
+    for (int s = 0; s < 2; s++)
+    {
+        std::vector<std::vector<float> > referenceFrames;
+        WaterDiagnostics referenceDiagnostics;
+        runEngine(scenarios[s], reference, settings, referenceFrames, referenceDiagnostics);
+
+        //Error is relative to how much the reference surface actually moves
+        double signal = 0.0;
+        for (std::size_t f = 0; f < referenceFrames.size(); f++)
+        {
+            const std::vector<float> &heights = referenceFrames[f];
+            double mean = totalVolume(heights) / heights.size();
+            for (std::size_t i = 0; i < heights.size(); i++)
+                signal += (heights[i] - mean) * (heights[i] - mean);
+        }
+
+        for (int e = 0; e < engineCount; e++)
+        {
+            std::vector<std::vector<float> > frames;
+            WaterDiagnostics finalDiagnostics;
+            double ms = runEngine(scenarios[s], engines[e], settings, frames, finalDiagnostics);
+
+            double error = 0.0;
+            double maxError = 0.0;
+            for (std::size_t f = 0; f < frames.size(); f++)
+            {
+                for (std::size_t i = 0; i < frames[f].size(); i++)
+                {
+                    double diff = frames[f][i] - referenceFrames[f][i];
+                    error += diff * diff;
+                    maxError = std::max(maxError, std::fabs(diff));
+                }
+            }
+            if (!std::isfinite(error))
+                maxError = error;
+
+            double startVolume = totalVolume(frames.front());
+            double volumeDrift = (totalVolume(frames.back()) - startVolume) / startVolume;
+
+            printf("    {\"scenario\": \"%s\", \"engine\": \"%s\", \"stepsPerSecond\": %g, ",
+                   scenarios[s].name, engines[e].name, engines[e].stepsPerSecond);
+            printNumber("relativeError", std::sqrt(error / signal), true);
+            printNumber("maxError", maxError, true);
+            printNumber("volumeDrift", volumeDrift, true);
+            printNumber("cpuMsPerSimulatedSecond", ms / DURATION, true);
+            printNumber("finalVolume", finalDiagnostics.volume, true);
+            printNumber("finalKineticEnergy", finalDiagnostics.kineticEnergy, true);
+            printNumber("finalMaxVelocity", finalDiagnostics.maxVelocity, true);
+            printNumber("finalActiveCells", finalDiagnostics.activeCells, false);
+            printf("}%s\n", (s == 1 && e == engineCount - 1) ? "" : ",");
+        }
+    }
+    printf("  ]\n}\n");
+
+    return 0;
+}
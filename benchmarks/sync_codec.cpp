@@ -0,0 +1,398 @@
+//------------------------------------------------------------------
+//Measures the state sync codec (water_codec.h) on the CPU solver's
+//water, and prints the results as JSON.
+//
+//Each scenario runs twice. In process, every frame is decoded and
+//acknowledged straight away, and checked against the quantized grid.
+//Over localhost, a simulating thread streams frames through TCP to a
+//viewer that acknowledges them, which adds real round trips: frames
+//are coded against whatever was acknowledged by the time they're sent.
+//------------------------------------------------------------------
+
+#include "cpu_solver.h"
+#include "water_codec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET Socket;
+#define closeSocket closesocket
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int Socket;
+#define closeSocket close
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+const int GRID_SIZE = 256;
+const float DURATION = 5.0f;    //Seconds of simulated time
+const float FRAME_RATE = 60.0f; //Frames sent per simulated second
+const float BASE_HEIGHT = 2.0f;
+
+struct Scenario
+{
+    const char *name;
+    float dropInterval; //Seconds between drops, 0 for only the first
+};
+
+struct Results
+{
+    int frames = 0;
+    int keyFrames = 0;
+    int failures = 0;
+    double bytes = 0.0;
+    double encodeUs = 0.0;
+    double decodeUs = 0.0;
+    double latencyUs = 0.0; //Localhost only, from encoding to decoded
+    double maxHeightError = 0.0;
+    double maxVelocityError = 0.0;
+    double wallMs = 0.0;
+};
+
+//The simulation being streamed: a pool with a wall across part of it, and drops landing in it
+struct Simulation
+{
+    CPUWaterGrid grid;
+    CPUSolverSettings settings;
+    Scenario scenario;
+    unsigned int random;
+    double accumulator;
+    double nextDrop;
+    double time;
+
+    Simulation(const Scenario &dropScenario) : scenario(dropScenario), random(12345), accumulator(0.0), nextDrop(0.0), time(0.0)
+    {
+        grid.resize(GRID_SIZE, GRID_SIZE);
+        for (int y = 0; y < GRID_SIZE; y++)
+        {
+            for (int x = 0; x < GRID_SIZE; x++)
+            {
+                int i = grid.index(x, y);
+                bool wall = x > GRID_SIZE / 2 - 4 && x < GRID_SIZE / 2 + 4 && y > GRID_SIZE / 4;
+                grid.masks[i] = wall ? 1.0f : 0.0f;
+                grid.heights[i] = wall ? 0.0f : BASE_HEIGHT;
+            }
+        }
+    }
+
+    float nextRandom()
+    {
+        random = random * 1664525u + 1013904223u;
+        return (random >> 8) / 16777216.0f;
+    }
+
+    void advanceFrame()
+    {
+        const double stepTime = 1.0 / EXPLICIT_STEPS_PER_SECOND;
+        time += 1.0 / FRAME_RATE;
+        if (time >= nextDrop)
+        {
+            injectWater(grid, 0.1f + 0.8f * nextRandom(), 0.1f + 0.8f * nextRandom(), 0.03f, 0.5f);
+            nextDrop = scenario.dropInterval > 0.0f ? nextDrop + scenario.dropInterval : 1e30;
+        }
+        accumulator += 1.0 / FRAME_RATE;
+        while (accumulator >= stepTime)
+        {
+            stepExplicit(grid, settings);
+            accumulator -= stepTime;
+        }
+    }
+};
+
+double microsecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+void compareGrids(const CPUWaterGrid &original, const CPUWaterGrid &decoded, Results &results)
+{
+    for (std::size_t i = 0; i < original.heights.size(); i++)
+    {
+        results.maxHeightError = std::max(results.maxHeightError, (double)std::fabs(original.heights[i] - decoded.heights[i]));
+        results.maxVelocityError = std::max(results.maxVelocityError, (double)std::fabs(original.velocities[i] - decoded.velocities[i]));
+    }
+}
+
+bool isKeyFrame(const std::vector<unsigned char> &bytes)
+{
+    return bytes[8] == 0xFF && bytes[9] == 0xFF && bytes[10] == 0xFF && bytes[11] == 0xFF;
+}
+
+Results runInProcess(const Scenario &scenario)
+{
+    Results results;
+    Simulation simulation(scenario);
+    WaterEncoder encoder;
+    WaterDecoder decoder;
+    CPUWaterGrid decoded;
+    std::vector<unsigned char> bytes;
+
+    int frameCount = (int)(DURATION * FRAME_RATE);
+    Clock::time_point start = Clock::now();
+    for (int f = 0; f < frameCount; f++)
+    {
+        simulation.advanceFrame();
+
+        bytes.clear();
+        Clock::time_point encodeStart = Clock::now();
+        encoder.encode(simulation.grid, bytes);
+        results.encodeUs += microsecondsSince(encodeStart);
+
+        uint32_t frame;
+        Clock::time_point decodeStart = Clock::now();
+        bool decodedFrame = decoder.decode(&bytes[0], bytes.size(), decoded, &frame);
+        results.decodeUs += microsecondsSince(decodeStart);
+        if (decodedFrame)
+            encoder.acknowledge(frame);
+        else
+            results.failures++;
+
+        results.frames++;
+        results.keyFrames += isKeyFrame(bytes) ? 1 : 0;
+        results.bytes += bytes.size();
+        compareGrids(simulation.grid, decoded, results);
+    }
+    results.wallMs = microsecondsSince(start) / 1000.0;
+    return results;
+}
+
+//-----------------------------------------------------------------
+//Localhost
+//-----------------------------------------------------------------
+bool sendAll(Socket socket, const void *data, std::size_t size)
+{
+    const char *bytes = (const char *)data;
+    while (size > 0)
+    {
+        int sent = send(socket, bytes, (int)size, 0);
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool receiveAll(Socket socket, void *data, std::size_t size)
+{
+    char *bytes = (char *)data;
+    while (size > 0)
+    {
+        int received = recv(socket, bytes, (int)size, 0);
+        if (received <= 0)
+            return false;
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+bool readable(Socket socket)
+{
+    fd_set sockets;
+    FD_ZERO(&sockets);
+    FD_SET(socket, &sockets);
+    timeval timeout = { 0, 0 };
+    return select((int)socket + 1, &sockets, NULL, NULL, &timeout) > 0;
+}
+
+void setNoDelay(Socket socket)
+{
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+}
+
+//Each message is the frame's length, the time it was encoded (microseconds after start) and the
+//frame. A length of 0 ends the stream. The viewer answers every frame it decodes with its number.
+struct MessageHeader
+{
+    uint32_t size;
+    uint32_t reserved;
+    double encodedAt;
+};
+
+void serve(Socket socket, const Scenario &scenario, Clock::time_point start, Results &results, CPUWaterGrid &finalGrid)
+{
+    Simulation simulation(scenario);
+    WaterEncoder encoder;
+    std::vector<unsigned char> bytes;
+
+    int frameCount = (int)(DURATION * FRAME_RATE);
+    for (int f = 0; f < frameCount; f++)
+    {
+        simulation.advanceFrame();
+
+        while (readable(socket))
+        {
+            uint32_t frame;
+            if (!receiveAll(socket, &frame, sizeof(frame)))
+                return;
+            encoder.acknowledge(frame);
+        }
+
+        bytes.clear();
+        Clock::time_point encodeStart = Clock::now();
+        encoder.encode(simulation.grid, bytes);
+        results.encodeUs += microsecondsSince(encodeStart);
+
+        MessageHeader header = { (uint32_t)bytes.size(), 0, microsecondsSince(start) };
+        if (!sendAll(socket, &header, sizeof(header)) || !sendAll(socket, &bytes[0], bytes.size()))
+            return;
+        results.frames++;
+        results.keyFrames += isKeyFrame(bytes) ? 1 : 0;
+        results.bytes += bytes.size() + sizeof(header);
+    }
+    MessageHeader end = { 0, 0, 0.0 };
+    sendAll(socket, &end, sizeof(end));
+    copyGridState(simulation.grid, finalGrid);
+}
+
+void view(Socket socket, Clock::time_point start, Results &results, CPUWaterGrid &decoded)
+{
+    WaterDecoder decoder;
+    std::vector<unsigned char> bytes;
+    MessageHeader header;
+    while (receiveAll(socket, &header, sizeof(header)) && header.size > 0)
+    {
+        bytes.resize(header.size);
+        if (!receiveAll(socket, &bytes[0], bytes.size()))
+            return;
+
+        uint32_t frame;
+        Clock::time_point decodeStart = Clock::now();
+        bool decodedFrame = decoder.decode(&bytes[0], bytes.size(), decoded, &frame);
+        results.decodeUs += microsecondsSince(decodeStart);
+        results.latencyUs += microsecondsSince(start) - header.encodedAt;
+        if (!decodedFrame)
+        {
+            results.failures++;
+            continue;
+        }
+        if (!sendAll(socket, &frame, sizeof(frame)))
+            return;
+    }
+}
+
+bool runLocalhost(const Scenario &scenario, Results &results)
+{
+    Socket listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0; //Any free port
+    socklen_t addressSize = sizeof(address);
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (sockaddr *)&address, &addressSize) != 0)
+    {
+        closeSocket(listener);
+        return false;
+    }
+
+    Socket viewer = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (connect(viewer, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        closeSocket(viewer);
+        closeSocket(listener);
+        return false;
+    }
+    Socket server = accept(listener, NULL, NULL);
+    closeSocket(listener);
+    setNoDelay(server);
+    setNoDelay(viewer);
+
+    Results serverResults;
+    CPUWaterGrid finalGrid;
+    CPUWaterGrid decoded;
+    Clock::time_point start = Clock::now();
+    std::thread serverThread(serve, server, scenario, start, std::ref(serverResults), std::ref(finalGrid));
+    view(viewer, start, results, decoded);
+    serverThread.join();
+    results.wallMs = microsecondsSince(start) / 1000.0;
+    closeSocket(server);
+    closeSocket(viewer);
+
+    results.frames = serverResults.frames;
+    results.keyFrames = serverResults.keyFrames;
+    results.bytes = serverResults.bytes;
+    results.encodeUs = serverResults.encodeUs;
+    if (finalGrid.width != decoded.width || finalGrid.height != decoded.height)
+        return false;
+    compareGrids(finalGrid, decoded, results);
+    return true;
+}
+
+//Prints a number, or null if there isn't one
+void printNumber(const char *name, double value, bool comma)
+{
+    if (std::isfinite(value))
+        printf("\"%s\": %.6g%s", name, value, comma ? ", " : "");
+    else
+        printf("\"%s\": null%s", name, comma ? ", " : "");
+}
+
+void printResults(const Scenario &scenario, const char *transport, const Results &results, bool last)
+{
+    double frames = results.frames > 0 ? results.frames : NAN;
+    printf("    {\"scenario\": \"%s\", \"transport\": \"%s\", \"frames\": %d, \"keyFrames\": %d, \"failures\": %d, ",
+           scenario.name, transport, results.frames, results.keyFrames, results.failures);
+    printNumber("bytesPerFrame", results.bytes / frames, true);
+    printNumber("compressionRatio", (double)GRID_SIZE * GRID_SIZE * 3 * sizeof(float) * frames / results.bytes, true);
+    printNumber("encodeUs", results.encodeUs / frames, true);
+    printNumber("decodeUs", results.decodeUs / frames, true);
+    printNumber("latencyUs", results.latencyUs > 0.0 ? results.latencyUs / frames : NAN, true);
+    printNumber("maxHeightError", results.maxHeightError, true);
+    printNumber("maxVelocityError", results.maxVelocityError, true);
+    printNumber("wallMs", results.wallMs, false);
+    printf("}%s\n", last ? "" : ",");
+}
+
+int main()
+{
+#ifdef _WIN32
+    WSADATA winsock;
+    WSAStartup(MAKEWORD(2, 2), &winsock);
+#endif
+
+    const Scenario scenarios[] = {
+        { "single_drop", 0.0f },
+        { "rain", 0.1f }
+    };
+    const int scenarioCount = sizeof(scenarios) / sizeof(scenarios[0]);
+    WaterCodecSettings codec;
+
+    printf("{\n  \"grid\": [%d, %d],\n  \"duration\": %g,\n  \"frameRate\": %g,\n", GRID_SIZE, GRID_SIZE, DURATION, FRAME_RATE);
+    printf("  \"heightStep\": %g,\n  \"velocityStep\": %g,\n  \"rawBytesPerFrame\": %d,\n  \"results\": [\n",
+           codec.heightStep, codec.velocityStep, (int)(GRID_SIZE * GRID_SIZE * 3 * sizeof(float)));
+    for (int s = 0; s < scenarioCount; s++)
+    {
+        printResults(scenarios[s], "in_process", runInProcess(scenarios[s]), false);
+
+        Results results;
+        if (!runLocalhost(scenarios[s], results))
+            results.failures++;
+        printResults(scenarios[s], "localhost_tcp", results, s == scenarioCount - 1);
+    }
+    printf("  ]\n}\n");
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
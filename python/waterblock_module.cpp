@@ -0,0 +1,592 @@
+
+//------------------------------------------------------------------
+//Python bindings for the CPU simulation core (source/cpu_solver.h),
+//for driving the water from analysis scripts. Built as the
+//`waterblock` module when CMake finds the Python 3 headers.
+//
+//    import numpy, waterblock
+//    water = waterblock.Water(256, 256)
+//    heights = numpy.asarray(water.heights)       # (256, 256) float32, no copy
+//    heights[:] = 2.0
+//    water.inject_many(brushes)                   # (n, 4) float32: x, y, radius, amount
+//    water.step(750)
+//    samples = numpy.asarray(water.query(points)) # (n, 2) float32: velocity, height
+//
+//velocities, heights and masks hand out the grid's own memory through
+//the buffer protocol, rows first, so NumPy (or anything else that
+//reads buffers) works on it in place. They stay valid across steps;
+//the grid can't be resized while any of them is alive. Writing to
+//masks directly doesn't drain the cells it blocks, set_mask() does.
+//
+//step(), inject_many(), query() and the rest let go of the GIL while
+//they work, so other Python threads carry on, and each Water has a
+//lock of its own so calls from several threads take turns. The
+//arrays double as the solver's scratch while a step runs, so reading
+//them during a step in another thread gets scratch, not the water.
+//------------------------------------------------------------------
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "cpu_stepper.h"
+
+#include <cstring>
+#include <mutex>
+
+//Everything a Water needs that Python can't hold itself
+struct WaterState
+{
+    CPUWaterGrid grid;
+    CPUSolverSettings solver;
+    CPUStepper stepper;
+    bool implicit = false;
+    float implicitStepsPerSecond = IMPLICIT_STEPS_PER_SECOND;
+    unsigned long long steps = 0;
+    std::mutex mutex;
+
+    //Where the channels were when the grid was sized. The arrays are handed out from here, as stepping
+    //moves velocities and heights between these and scratch until settleChannels().
+    float *homeVelocities = NULL;
+    float *homeHeights = NULL;
+    float *homeMasks = NULL;
+};
+
+struct WaterObject
+{
+    PyObject_HEAD
+    WaterState *state;
+    Py_ssize_t exports; //Buffers handed out and not yet released
+    int resizing;       //resize() calls under way. No buffers are handed out meanwhile.
+};
+
+//One channel of a Water, as a buffer
+struct ChannelObject
+{
+    PyObject_HEAD
+    WaterObject *water;
+    int channel;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+};
+
+enum Channel { CHANNEL_VELOCITIES, CHANNEL_HEIGHTS, CHANNEL_MASKS };
+
+static PyTypeObject *channelType = NULL;
+
+//Runs work on the grid with the GIL released and the Water's lock held
+template <typename Work>
+static void withGrid(WaterObject *self, Work work)
+{
+    Py_BEGIN_ALLOW_THREADS
+    {
+        std::lock_guard<std::mutex> lock(self->state->mutex);
+        work(*self->state);
+    }
+    Py_END_ALLOW_THREADS
+}
+
+static bool checkState(WaterObject *self)
+{
+    if (self->state)
+        return true;
+    PyErr_SetString(PyExc_RuntimeError, "Water.__init__() was not called");
+    return false;
+}
+
+//Stepping swaps velocities and heights with scratch, but the arrays handed out keep the addresses
+//they were given. waterStep() steps in an even number of blocks, so only a single explicit step
+//ends on the other blocks, and is copied back into the first ones.
+static void settleChannels(WaterState &state)
+{
+    CPUWaterGrid &grid = state.grid;
+    GridChannel *channels[] = { &grid.velocities, &grid.heights };
+    float *homes[] = { state.homeVelocities, state.homeHeights };
+    GridChannel *spares[] = { &grid.scratchA, &grid.scratchB };
+    for (int c = 0; c < 2; c++)
+    {
+        if (channels[c]->data() == homes[c])
+            continue;
+        for (int s = 0; s < 2; s++)
+        {
+            if (spares[s]->data() == homes[c] && spares[s]->size() == channels[c]->size())
+            {
+                std::copy(channels[c]->begin(), channels[c]->end(), spares[s]->begin());
+                channels[c]->swap(*spares[s]);
+                break;
+            }
+        }
+    }
+}
+
+static void homeChannels(WaterState &state)
+{
+    state.homeVelocities = state.grid.velocities.data();
+    state.homeHeights = state.grid.heights.data();
+    state.homeMasks = state.grid.masks.data();
+}
+
+//A C contiguous buffer of float32, columns to a row
+static bool getFloats(PyObject *object, Py_buffer *view, Py_ssize_t columns, bool writable, const char *name)
+{
+    int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0);
+    if (PyObject_GetBuffer(object, view, flags) != 0)
+        return false;
+
+    const char *format = view->format ? view->format : "B";
+    if (*format == '@' || *format == '=' || *format == '<')
+        format++;
+    if (strcmp(format, "f") != 0 || view->itemsize != sizeof(float))
+    {
+        PyErr_Format(PyExc_TypeError, "%s must be float32, not format '%s'", name, view->format ? view->format : "B");
+        PyBuffer_Release(view);
+        return false;
+    }
+    if ((view->len / view->itemsize) % columns != 0)
+    {
+        PyErr_Format(PyExc_ValueError, "%s must have %zd values to a row", name, columns);
+        PyBuffer_Release(view);
+        return false;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------
+//Channel buffers
+//-----------------------------------------------------------------
+static int channelGetBuffer(PyObject *object, Py_buffer *view, int flags)
+{
+    //Called with the GIL but not the Water's lock, so a step may be under way in another thread. The
+    //homes and the size only change in resize(), which counts itself in resizing before letting go of
+    //the GIL.
+    ChannelObject *self = (ChannelObject *)object;
+    WaterState *state = self->water->state;
+    if (!state || self->water->resizing > 0)
+    {
+        PyErr_SetString(PyExc_BufferError, state ? "The water is being resized" : "The water is gone");
+        view->obj = NULL;
+        return -1;
+    }
+
+    const CPUWaterGrid &grid = state->grid;
+    float *homes[] = { state->homeVelocities, state->homeHeights, state->homeMasks };
+    self->shape[0] = grid.height;
+    self->shape[1] = grid.width;
+    self->strides[0] = grid.width * sizeof(float);
+    self->strides[1] = sizeof(float);
+
+    view->buf = homes[self->channel];
+    view->obj = object;
+    view->len = (Py_ssize_t)grid.width * grid.height * sizeof(float);
+    view->readonly = 0;
+    view->itemsize = sizeof(float);
+    view->format = (flags & PyBUF_FORMAT) ? (char *)"f" : NULL;
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    Py_INCREF(object);
+    self->water->exports++;
+    return 0;
+}
+
+static void channelReleaseBuffer(PyObject *object, Py_buffer *)
+{
+    ((ChannelObject *)object)->water->exports--;
+}
+
+static void channelDealloc(PyObject *object)
+{
+    PyTypeObject *type = Py_TYPE(object);
+    Py_XDECREF(((ChannelObject *)object)->water);
+    type->tp_free(object);
+    Py_DECREF(type);
+}
+
+static PyType_Slot channelSlots[] = {
+    { Py_tp_dealloc, (void *)channelDealloc },
+    { Py_bf_getbuffer, (void *)channelGetBuffer },
+    { Py_bf_releasebuffer, (void *)channelReleaseBuffer },
+    { Py_tp_doc, (void *)"One channel of a Water's grid, as a (height, width) float32 buffer" },
+    { 0, NULL }
+};
+
+static PyType_Spec channelSpec = { "waterblock.Channel", sizeof(ChannelObject), 0, Py_TPFLAGS_DEFAULT, channelSlots };
+
+//A memoryview over the channel, which NumPy takes without copying
+static PyObject *channelView(WaterObject *self, int channel)
+{
+    if (!checkState(self))
+        return NULL;
+    ChannelObject *buffer = PyObject_New(ChannelObject, channelType);
+    if (!buffer)
+        return NULL;
+    Py_INCREF(self);
+    buffer->water = self;
+    buffer->channel = channel;
+    PyObject *view = PyMemoryView_FromObject((PyObject *)buffer);
+    Py_DECREF(buffer);
+    return view;
+}
+
+//-----------------------------------------------------------------
+//Water
+//-----------------------------------------------------------------
+static int waterInit(PyObject *object, PyObject *args, PyObject *kwargs)
+{
+    WaterObject *self = (WaterObject *)object;
+    static const char *keywords[] = { "width", "height", "gravity", "decay", "implicit",
+                                      "implicit_steps_per_second", "tune", NULL };
+    int width = 0, height = 0, implicit = 0, tune = 0;
+    CPUSolverSettings solver;
+    float implicitStepsPerSecond = IMPLICIT_STEPS_PER_SECOND;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii|ffpfp", (char **)keywords, &width, &height, &solver.gravity,
+                                     &solver.decay, &implicit, &implicitStepsPerSecond, &tune))
+        return -1;
+    if (width < 1 || height < 1 || implicitStepsPerSecond <= 0.0f)
+    {
+        PyErr_SetString(PyExc_ValueError, "width, height and implicit_steps_per_second must be positive");
+        return -1;
+    }
+    //Another thread could be stepping the state this would replace
+    if (self->state)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "A Water can only be initialised once");
+        return -1;
+    }
+
+    WaterState *state = new WaterState();
+    state->solver = solver;
+    state->implicit = implicit != 0;
+    state->implicitStepsPerSecond = implicitStepsPerSecond;
+    bool failed = false;
+    Py_BEGIN_ALLOW_THREADS
+    try
+    {
+        state->stepper.init(stepperTuningFor(width, height, tune != 0));
+        state->stepper.prepare(state->grid, width, height);
+        homeChannels(*state);
+    }
+    catch (const std::bad_alloc &)
+    {
+        failed = true;
+    }
+    Py_END_ALLOW_THREADS
+    if (failed)
+    {
+        delete state;
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    self->state = state;
+    return 0;
+}
+
+static void waterDealloc(PyObject *object)
+{
+    PyTypeObject *type = Py_TYPE(object);
+    delete ((WaterObject *)object)->state;
+    type->tp_free(object);
+    Py_DECREF(type);
+}
+
+static PyObject *waterStep(PyObject *object, PyObject *args)
+{
+    WaterObject *self = (WaterObject *)object;
+    int steps = 1;
+    if (!checkState(self) || !PyArg_ParseTuple(args, "|i", &steps))
+        return NULL;
+    if (steps < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "steps can't be negative");
+        return NULL;
+    }
+
+    withGrid(self, [steps](WaterState &state) {
+        if (state.implicit)
+        {
+            for (int i = 0; i < steps; i++)
+                stepImplicit(state.grid, state.solver, state.implicitStepsPerSecond);
+        }
+        else
+            state.stepper.stepInPlace(state.grid, state.solver, steps);
+        settleChannels(state);
+        state.steps += steps;
+    });
+    Py_RETURN_NONE;
+}
+
+static PyObject *waterInject(PyObject *object, PyObject *args)
+{
+    WaterObject *self = (WaterObject *)object;
+    float x, y, radius, amount;
+    if (!checkState(self) || !PyArg_ParseTuple(args, "ffff", &x, &y, &radius, &amount))
+        return NULL;
+    withGrid(self, [=](WaterState &state) { injectWater(state.grid, x, y, radius, amount); });
+    Py_RETURN_NONE;
+}
+
+static PyObject *waterInjectMany(PyObject *object, PyObject *args)
+{
+    WaterObject *self = (WaterObject *)object;
+    PyObject *brushes;
+    Py_buffer view;
+    if (!checkState(self) || !PyArg_ParseTuple(args, "O", &brushes) || !getFloats(brushes, &view, 4, false, "brushes"))
+        return NULL;
+
+    const float *values = (const float *)view.buf;
+    Py_ssize_t count = view.len / (4 * sizeof(float));
+    withGrid(self, [values, count](WaterState &state) {
+        for (Py_ssize_t i = 0; i < count; i++)
+            injectWater(state.grid, values[i * 4], values[i * 4 + 1], values[i * 4 + 2], values[i * 4 + 3]);
+    });
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
+}
+
+static PyObject *waterQuery(PyObject *object, PyObject *args, PyObject *kwargs)
+{
+    WaterObject *self = (WaterObject *)object;
+    static const char *keywords[] = { "positions", "out", NULL };
+    PyObject *positions, *out = Py_None;
+    Py_buffer in;
+    if (!checkState(self) || !PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", (char **)keywords, &positions, &out) ||
+        !getFloats(positions, &in, 2, false, "positions"))
+        return NULL;
+    Py_ssize_t count = in.len / (2 * sizeof(float));
+
+    //Without an out, the results go in a new (n, 2) float32 memoryview. cast() won't make one with no
+    //rows, so that one is described by hand, over no memory at all.
+    PyObject *result = NULL;
+    if (out == Py_None && count == 0)
+    {
+        static float nothing[2];
+        static Py_ssize_t emptyShape[2] = { 0, 2 };
+        static Py_ssize_t emptyStrides[2] = { 2 * sizeof(float), sizeof(float) };
+        Py_buffer empty = { nothing, NULL, 0, sizeof(float), 0, 2, (char *)"f", emptyShape, emptyStrides, NULL, NULL };
+        result = PyMemoryView_FromBuffer(&empty);
+    }
+    else if (out == Py_None)
+    {
+        PyObject *bytes = PyByteArray_FromStringAndSize(NULL, count * 2 * sizeof(float));
+        PyObject *flat = bytes ? PyMemoryView_FromObject(bytes) : NULL;
+        Py_XDECREF(bytes);
+        result = flat ? PyObject_CallMethod(flat, "cast", "s(nn)", "f", count, (Py_ssize_t)2) : NULL;
+        Py_XDECREF(flat);
+    }
+    else
+    {
+        Py_INCREF(out);
+        result = out;
+    }
+
+    Py_buffer samples;
+    if (!result || !getFloats(result, &samples, 2, true, "out"))
+    {
+        Py_XDECREF(result);
+        PyBuffer_Release(&in);
+        return NULL;
+    }
+    if (samples.len != in.len)
+    {
+        PyErr_SetString(PyExc_ValueError, "out must have a row for every position");
+        PyBuffer_Release(&samples);
+        Py_DECREF(result);
+        PyBuffer_Release(&in);
+        return NULL;
+    }
+
+    const float *xy = (const float *)in.buf;
+    float *sampled = (float *)samples.buf;
+    withGrid(self, [xy, sampled, count](WaterState &state) {
+        for (Py_ssize_t i = 0; i < count; i++)
+            sampleGrid(state.grid, xy[i * 2], xy[i * 2 + 1], &sampled[i * 2], &sampled[i * 2 + 1]);
+    });
+    PyBuffer_Release(&samples);
+    PyBuffer_Release(&in);
+    return result;
+}
+
+static PyObject *waterSample(PyObject *object, PyObject *args)
+{
+    WaterObject *self = (WaterObject *)object;
+    float x, y, velocity = 0.0f, height = 0.0f;
+    if (!checkState(self) || !PyArg_ParseTuple(args, "ff", &x, &y))
+        return NULL;
+    withGrid(self, [&](WaterState &state) { sampleGrid(state.grid, x, y, &velocity, &height); });
+    return Py_BuildValue("(ff)", velocity, height);
+}
+
+static PyObject *waterSetMask(PyObject *object, PyObject *args)
+{
+    WaterObject *self = (WaterObject *)object;
+    PyObject *mask;
+    if (!checkState(self) || !PyArg_ParseTuple(args, "O", &mask))
+        return NULL;
+    if (mask == Py_None)
+    {
+        withGrid(self, [](WaterState &state) { applyMask(state.grid, NULL); });
+        Py_RETURN_NONE;
+    }
+
+    Py_buffer view;
+    if (PyObject_GetBuffer(mask, &view, PyBUF_C_CONTIGUOUS) != 0)
+        return NULL;
+    if (view.len != (Py_ssize_t)self->state->grid.width * self->state->grid.height)
+    {
+        PyErr_Format(PyExc_ValueError, "mask must be %d x %d bytes", self->state->grid.width,
+                     self->state->grid.height);
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    const unsigned char *bytes = (const unsigned char *)view.buf;
+    withGrid(self, [bytes](WaterState &state) { applyMask(state.grid, bytes); });
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
+}
+
+static PyObject *waterResize(PyObject *object, PyObject *args)
+{
+    WaterObject *self = (WaterObject *)object;
+    int width, height;
+    if (!checkState(self) || !PyArg_ParseTuple(args, "ii", &width, &height))
+        return NULL;
+    if (width < 1 || height < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "width and height must be positive");
+        return NULL;
+    }
+    if (self->exports > 0)
+    {
+        PyErr_SetString(PyExc_BufferError, "Can't resize a Water while its arrays are in use");
+        return NULL;
+    }
+
+    bool failed = false;
+    self->resizing++;
+    withGrid(self, [&](WaterState &state) {
+        try
+        {
+            CPUStepTuning tuning;
+            if (loadStepperTuning(width, height, tuning))
+                state.stepper.init(tuning);
+            state.stepper.resize(state.grid, width, height);
+            homeChannels(state);
+        }
+        catch (const std::bad_alloc &)
+        {
+            failed = true;
+        }
+    });
+    self->resizing--;
+    if (failed)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+static PyObject *waterDiagnostics(PyObject *object, PyObject *)
+{
+    WaterObject *self = (WaterObject *)object;
+    if (!checkState(self))
+        return NULL;
+    WaterDiagnostics diagnostics;
+    withGrid(self, [&](WaterState &state) { diagnostics = reduceDiagnostics(state.grid); });
+    return Py_BuildValue("{sfsfsfsf}", "volume", diagnostics.volume, "kinetic_energy", diagnostics.kineticEnergy,
+                         "max_velocity", diagnostics.maxVelocity, "active_cells", diagnostics.activeCells);
+}
+
+static PyObject *waterVelocities(PyObject *object, void *) { return channelView((WaterObject *)object, CHANNEL_VELOCITIES); }
+static PyObject *waterHeights(PyObject *object, void *) { return channelView((WaterObject *)object, CHANNEL_HEIGHTS); }
+static PyObject *waterMasks(PyObject *object, void *) { return channelView((WaterObject *)object, CHANNEL_MASKS); }
+
+static PyObject *waterWidth(PyObject *object, void *)
+{
+    WaterObject *self = (WaterObject *)object;
+    return checkState(self) ? PyLong_FromLong(self->state->grid.width) : NULL;
+}
+
+static PyObject *waterHeight(PyObject *object, void *)
+{
+    WaterObject *self = (WaterObject *)object;
+    return checkState(self) ? PyLong_FromLong(self->state->grid.height) : NULL;
+}
+
+static PyObject *waterSteps(PyObject *object, void *)
+{
+    WaterObject *self = (WaterObject *)object;
+    return checkState(self) ? PyLong_FromUnsignedLongLong(self->state->steps) : NULL;
+}
+
+static PyObject *waterStepsPerSecond(PyObject *object, void *)
+{
+    WaterObject *self = (WaterObject *)object;
+    if (!checkState(self))
+        return NULL;
+    return PyFloat_FromDouble(self->state->implicit ? self->state->implicitStepsPerSecond : EXPLICIT_STEPS_PER_SECOND);
+}
+
+static PyMethodDef waterMethods[] = {
+    { "step", (PyCFunction)waterStep, METH_VARARGS, "step(steps=1): runs the solver, without the GIL" },
+    { "inject", (PyCFunction)waterInject, METH_VARARGS,
+      "inject(x, y, radius, amount): adds water around a point in texture coordinates" },
+    { "inject_many", (PyCFunction)waterInjectMany, METH_VARARGS,
+      "inject_many(brushes): inject() for every row of an (n, 4) float32 buffer, without the GIL" },
+    { "query", (PyCFunction)(void (*)(void))waterQuery, METH_VARARGS | METH_KEYWORDS,
+      "query(positions, out=None): bilinear (velocity, height) at every row of an (n, 2) float32 buffer, "
+      "into out or a new (n, 2) float32 memoryview, without the GIL" },
+    { "sample", (PyCFunction)waterSample, METH_VARARGS, "sample(x, y): (velocity, height) at one point" },
+    { "set_mask", (PyCFunction)waterSetMask, METH_VARARGS,
+      "set_mask(mask): width * height bytes, nonzero is a barrier and loses its water. None clears them." },
+    { "resize", (PyCFunction)waterResize, METH_VARARGS,
+      "resize(width, height): resamples the water and clears the barriers. Not while arrays are in use." },
+    { "diagnostics", (PyCFunction)waterDiagnostics, METH_NOARGS,
+      "diagnostics(): volume, kinetic_energy, max_velocity and active_cells" },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef waterProperties[] = {
+    { "velocities", waterVelocities, NULL, "(height, width) float32 memoryview of the grid's velocities", NULL },
+    { "heights", waterHeights, NULL, "(height, width) float32 memoryview of the grid's heights", NULL },
+    { "masks", waterMasks, NULL, "(height, width) float32 memoryview of the grid's barriers", NULL },
+    { "width", waterWidth, NULL, "Cells across", NULL },
+    { "height", waterHeight, NULL, "Cells down", NULL },
+    { "steps", waterSteps, NULL, "Steps run so far", NULL },
+    { "steps_per_second", waterStepsPerSecond, NULL, "Steps to a simulated second", NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyType_Slot waterSlots[] = {
+    { Py_tp_new, (void *)PyType_GenericNew },
+    { Py_tp_init, (void *)waterInit },
+    { Py_tp_dealloc, (void *)waterDealloc },
+    { Py_tp_methods, waterMethods },
+    { Py_tp_getset, waterProperties },
+    { Py_tp_doc, (void *)"Water(width, height, gravity=0.1, decay=0.998, implicit=False, "
+                         "implicit_steps_per_second=60, tune=False): a grid of water on the CPU solver. "
+                         "The implicit solver takes exact steps, stable at any rate and keeping the volume" },
+    { 0, NULL }
+};
+
+static PyType_Spec waterSpec = { "waterblock.Water", sizeof(WaterObject), 0, Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+                                 waterSlots };
+
+static PyModuleDef waterModule = { PyModuleDef_HEAD_INIT, "waterblock", "The WaterBlock CPU simulation core", -1,
+                                   NULL, NULL, NULL, NULL, NULL };
+
+PyMODINIT_FUNC PyInit_waterblock()
+{
+    PyObject *module = PyModule_Create(&waterModule);
+    if (!module)
+        return NULL;
+    channelType = (PyTypeObject *)PyType_FromSpec(&channelSpec);
+    PyObject *waterType = PyType_FromSpec(&waterSpec);
+    if (!channelType || !waterType || PyModule_AddObject(module, "Water", waterType) != 0)
+    {
+        Py_XDECREF(waterType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    PyModule_AddObject(module, "EXPLICIT_STEPS_PER_SECOND", PyFloat_FromDouble(EXPLICIT_STEPS_PER_SECOND));
+    return module;
+}
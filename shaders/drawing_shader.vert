@@ -1,12 +0,0 @@
-#version 430 core
-
-layout(location = 0) in vec3 vPosition;
-layout(location = 1) in vec2 vTexCoords;
-
-out vec2 texCoords;
-
-void main()
-{
-   gl_Position = vec4(vPosition, 1.0);
-   texCoords = vTexCoords;
-}
\ No newline at end of file
@@ -0,0 +1,21 @@
+#version 430 core
+
+out vec4 fragColor;
+
+in vec2 texCoords;
+uniform sampler2DArray color_texture;
+uniform int tiles; //Layers are laid out in a square grid, this many to a side
+
+//Shows every layer of an array texture side by side, the way image_shader.frag shows one texture
+void main()
+{
+   vec2 tileCoords = texCoords * float(tiles);
+   ivec2 tile = ivec2(floor(tileCoords));
+   int layer = tile.y * tiles + tile.x;
+   if (layer >= textureSize(color_texture, 0).z)
+   {
+      fragColor = vec4(0.0, 0.0, 0.0, 1.0);
+      return;
+   }
+   fragColor = vec4(vec3(texture(color_texture, vec3(fract(tileCoords), float(layer))).y), 1.0);
+}
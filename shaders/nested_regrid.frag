@@ -0,0 +1,22 @@
+#version 430 core
+
+out vec4 fragColor;
+
+in vec2 texCoords;
+uniform sampler2D fine_texture;
+uniform sampler2D coarse_texture;
+uniform vec2 fineOrigin;     //Where the nested grid is moving to, in the coarse grid's texture coordinates
+uniform vec2 previousOrigin; //Where it was
+uniform vec2 fineExtent;
+
+//Moves a nested grid without starting it over. Cells it already had are copied across (grids move by
+//whole coarse cells, so they land exactly on texels), and the newly covered ones are filled in from the coarse grid.
+void main()
+{
+   vec2 coarseCoords = fineOrigin + texCoords * fineExtent;
+   vec2 previousCoords = (coarseCoords - previousOrigin) / fineExtent;
+   if (all(greaterThanEqual(previousCoords, vec2(0.0))) && all(lessThanEqual(previousCoords, vec2(1.0))))
+      fragColor = texture(fine_texture, previousCoords);
+   else
+      fragColor = texture(coarse_texture, coarseCoords);
+}
@@ -0,0 +1,29 @@
+#version 430 core
+
+out vec4 fragColor;
+
+in vec2 texCoords;
+uniform sampler2D source_texture;
+uniform vec2 targetSize;
+
+//Copies a simulation texture into one of a different size. Growing just uses the linear filter,
+//shrinking averages every source texel under the new one so small waves don't alias away.
+void main()
+{
+   vec2 sourceSize = vec2(textureSize(source_texture, 0));
+   ivec2 footprint = clamp(ivec2(ceil(sourceSize / targetSize)), ivec2(1), ivec2(32));
+   if (footprint == ivec2(1))
+   {
+      fragColor = texture(source_texture, texCoords);
+      return;
+   }
+
+   vec2 texel = 1.0 / sourceSize;
+   vec2 corner = texCoords - 0.5 * vec2(footprint - 1) * texel;
+   vec4 sum = vec4(0.0);
+   for (int y = 0; y < footprint.y; y++)
+      for (int x = 0; x < footprint.x; x++)
+         sum += texture(source_texture, corner + vec2(x, y) * texel);
+
+   fragColor = sum / float(footprint.x * footprint.y);
+}
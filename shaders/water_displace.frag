@@ -0,0 +1,16 @@
+#version 430 core
+
+//Hard edged, like the brush in water_physics.frag. Only the height changes, and not on barriers.
+in vec2 texCoords;
+flat in vec4 circle;
+
+uniform sampler2D mask;
+
+layout(location = 0) out vec4 heightColor;
+
+void main()
+{
+   if (distance(texCoords, circle.xy) > circle.z || texelFetch(mask, ivec2(gl_FragCoord.xy), 0).r > 0.0)
+      discard;
+   heightColor = vec4(0.0, circle.w, 0.0, 0.0);
+}
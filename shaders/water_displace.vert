@@ -0,0 +1,24 @@
+#version 430 core
+
+//Water pushed aside by floating bodies (WaterBodies::displace), blended additively into the height
+//texture. One instance per circle, each a quad over its circle's bounds.
+struct Circle
+{
+   vec4 shape; //Center (x, y) and radius in texture coordinates, then the height added inside
+};
+
+layout(std430, binding = 0) readonly buffer Circles
+{
+   Circle circles[];
+};
+
+out vec2 texCoords;
+flat out vec4 circle;
+
+void main()
+{
+   circle = circles[gl_InstanceID].shape;
+   vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+   texCoords = circle.xy + corner * circle.z;
+   gl_Position = vec4(texCoords * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,17 @@
+#version 430 core
+
+//The CPU backends' grid as it's uploaded (GridTextures in water_block_gl.cpp): velocities, heights
+//and masks, one layer each. Put back together into a height texture laid out like the GL backends'.
+in vec2 texCoords;
+
+layout(location = 0) out vec4 heightColor;
+
+uniform sampler2DArray planes;
+
+void main()
+{
+   ivec2 cell = ivec2(gl_FragCoord.xy);
+   heightColor = vec4(texelFetch(planes, ivec3(cell, 0), 0).r,
+                      texelFetch(planes, ivec3(cell, 1), 0).r,
+                      texelFetch(planes, ivec3(cell, 2), 0).r, 1.0);
+}
@@ -1,24 +1,116 @@
 #version 430 core
 
-precision highp float;
+//Variants (defined by the program that loads this shader, see ShaderVariant):
+//BRUSH        - First step of a frame. The user's brush and the mask texture are folded in as cells are sampled.
+//SURFACE_DATA - Last step of a frame. Also writes normals and velocity for water_surface.frag.
+//MASK         - 1 if any barriers are baked into the mask, 0 to skip all mask handling.
+//NESTED       - A fine grid inside the main (coarse) one. Cells past its edges are read from coarse_texture,
+//               and the brush and mask are placed in the coarse grid's coordinates. COARSE_WIDTH, COARSE_HEIGHT
+//               and NORMAL_SCALE (fine cells per coarse cell) come with it.
+//GRID_WIDTH, GRID_HEIGHT, GRAVITY, DECAY, PRECISION - Simulation settings, baked in as constants.
+//The defaults below are only used if nothing was defined.
+#ifndef GRID_WIDTH
+#define GRID_WIDTH 128.0
+#endif
+#ifndef GRID_HEIGHT
+#define GRID_HEIGHT 128.0
+#endif
+#ifndef GRAVITY
+#define GRAVITY 0.1
+#endif
+#ifndef DECAY
+#define DECAY 0.998
+#endif
+#ifndef MASK
+#define MASK 1
+#endif
+#ifndef PRECISION
+#define PRECISION highp
+#endif
+#ifndef NORMAL_SCALE
+#define NORMAL_SCALE 1.0
+#endif
+
+precision PRECISION float;
 
 in vec2 texCoords;
 
 layout(location = 0) out vec4 heightColor;
+#ifdef SURFACE_DATA
 layout(location = 1) out vec4 surfaceData;
+#endif
 
 uniform sampler2D height_texture;
 
-//uniform float delta;
+#ifdef BRUSH
+uniform sampler2D mask_texture;
+
+uniform vec2 mousePosition;
+uniform float brushSize = 0.15f;
+uniform float brushAmount; //Height added under the brush (brush power * time it was held down)
+#endif
+
+#ifdef NESTED
+uniform sampler2D coarse_texture;
+
+uniform vec2 fineOrigin; //Lower left corner of this grid, in the coarse grid's texture coordinates
+uniform vec2 fineExtent; //Size of this grid, in the coarse grid's texture coordinates
+
+const vec2 coarseSize = vec2(COARSE_WIDTH, COARSE_HEIGHT);
+#endif
 
 //Step size for texture sampling (1.0 / dimensions)
-float stepsize = 1.0 / 128.0;
+const vec2 stepsize = vec2(1.0 / GRID_WIDTH, 1.0 / GRID_HEIGHT);
 
 //Global acceleration
-float g = 0.1;
+const float g = GRAVITY;
 
 //Waveform decay constant
-float decay = 0.998;
+const float decay = DECAY;
+
+//Where a cell is in the coarse grid, which the brush and mask are drawn in
+vec2 coarseCoords(vec2 coords)
+{
+#ifdef NESTED
+   return fineOrigin + coords * fineExtent;
+#else
+   return coords;
+#endif
+}
+
+vec3 sampleCell(vec2 coords)
+{
+#ifdef NESTED
+   //Ghost cells past the edges come from the coarse grid, which is how the levels exchange boundaries
+   vec3 cell;
+   if (any(lessThan(coords, vec2(0.0))) || any(greaterThan(coords, vec2(1.0))))
+      cell = texture(coarse_texture, coarseCoords(coords)).xyz;
+   else
+      cell = texture(height_texture, coords).xyz;
+#else
+   vec3 cell = texture(height_texture, coords).xyz;
+#endif
+#ifdef BRUSH
+   vec2 brushCoords = coarseCoords(coords);
+
+   //Hard brush
+   cell.y += step(distance(mousePosition, brushCoords), brushSize) * brushAmount;
+
+   //Smooth brush
+   //cell.y += smoothstep(brushSize, 0.05*brushSize, distance(mousePosition, brushCoords)) * brushAmount;
+
+   //Store the mask color in the blue channel
+#if MASK && defined(NESTED)
+   //Nearest coarse cell, so a fine cell is masked exactly when the coarse cell it's in is
+   cell.z = texture(mask_texture, (floor(brushCoords * coarseSize) + 0.5) / coarseSize).r;
+#elif MASK
+   cell.z = texture(mask_texture, coords).r;
+#else
+   cell.z = 0.0;
+#endif
+#endif
+   return cell;
+}
 
 //The variables used are based on this naming convention.
 //        [ C ]
@@ -29,24 +121,27 @@ float decay = 0.998;
 void main()
 {
    //Do nothing if we're in a masked area
-   float Hm = texture(height_texture, texCoords).z;
+   vec3 m = sampleCell(texCoords);
+#if MASK
+   float Hm = m.z;
    if (Hm > 0.0)
    {
       heightColor = vec4(0.0, 0.0, Hm, 1.0);
       return;
    }
+#endif
 
-   //Gather all of the texture samples we need (10 in total)
+   //Gather all of the texture samples we need (5 in total, or 10 with the brush)
    //"Velocity" is stored in the red (x) channel, height is stored in the green (y) channel,
    //and mask value is stored in the blue (z) channel.
-   vec2 u = vec2(stepsize, 0.0);
-   vec3 m = texture(height_texture, texCoords).xyz;
-   vec3 a = texture(height_texture, texCoords - u).xyz;
-   vec3 b = texture(height_texture, texCoords + u).xyz;
-   u = vec2(0.0, stepsize);
-   vec3 c = texture(height_texture, texCoords + u).xyz;
-   vec3 d = texture(height_texture, texCoords - u).xyz;
-
+   vec2 u = vec2(stepsize.x, 0.0);
+   vec3 a = sampleCell(texCoords - u);
+   vec3 b = sampleCell(texCoords + u);
+   u = vec2(0.0, stepsize.y);
+   vec3 c = sampleCell(texCoords + u);
+   vec3 d = sampleCell(texCoords - u);
+
+#if MASK
    //Any cells sampled in the mask zone should be seen as equal to m (like GL_CLAMP_TO_EDGE)
    //In case of filtering, use the step function so we get 0 or 1 when mixing
 
@@ -58,6 +153,7 @@ void main()
    b.xy = mix(b.xy, m.xy, Hb);
    c.xy = mix(c.xy, m.xy, Hc);
    d.xy = mix(d.xy, m.xy, Hd);
+#endif
 
    //Smooth things out with waveform decay
    m.x *= decay;
@@ -82,10 +178,12 @@ void main()
    //Water column height
    heightColor = vec4(m.x, m.y, m.z, 1.0);
 
+#ifdef SURFACE_DATA
    //---------------------------------------------------
    //Surface Data
    //---------------------------------------------------
-   vec2 normal = vec2( (a.y - b.y), (d.y - c.y) );
+   vec2 normal = vec2( (a.y - b.y), (d.y - c.y) ) * NORMAL_SCALE;
    //surfaceData = vec4(normal, abs(deltaVm), 1.0f);
    surfaceData = vec4(normal, abs(m.x), 1.0f);
+#endif
 }
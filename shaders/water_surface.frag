@@ -5,12 +5,15 @@
 vec4 waterColor = vec4(0.875, 0.875, 1.0, 1.0);
 vec4 fogColor = vec4(0.333, 0.247, 0.137, 1.0); //Mud
 vec4 turbulenceColor = vec4(1.0, 0.89, 0.89, 1.0f);
+vec4 seaColor = vec4(0.059, 0.196, 0.255, 1.0); //Open water, instead of mud
 //----------------------------------------------------
 
 in vec3 fragPos;
 in vec2 texCoords;
 in vec4 vertColor; //Only 0 or 1
 in vec4 glPos;
+in vec2 oceanCoords;
+in float gridWeight;
 
 out vec4 fragColor;
 
@@ -21,6 +24,28 @@ uniform sampler2D scene_texture;
 uniform sampler2D depth_texture;
 uniform samplerCube cubemap_texture;
 
+//Nested grids cover parts of surfaceData_texture in more detail (see NestedGrid in main.cpp)
+uniform int nestedCount = 0;
+uniform vec2 nestedOrigins[2];
+uniform vec2 nestedExtents[2];
+uniform sampler2D nestedSurfaceData_textures[2];
+
+vec4 sampleSurfaceData(vec2 coords)
+{
+   for (int i = 0; i < nestedCount; i++)
+   {
+      vec2 local = (coords - nestedOrigins[i]) / nestedExtents[i];
+      if (all(greaterThanEqual(local, vec2(0.0))) && all(lessThanEqual(local, vec2(1.0))))
+         return texture(nestedSurfaceData_textures[i], local);
+   }
+   return texture(surfaceData_texture, coords);
+}
+
+//Open water around the grid, see water_surface.vert
+uniform bool ocean = false;
+uniform bool farField = false;
+uniform sampler2D oceanSurfaceData_texture;
+
 uniform float fogDensity;
 uniform float turbulenceStrength;
 uniform float refractionStrength;
@@ -38,8 +63,14 @@ vec3 ambientColor = vec3(0.1, 0.075, 0.075);
 
 void main()
 {
+   //The far field leaves the grid's rectangle to the grid's own plane
+   if (farField && all(greaterThan(texCoords, vec2(0.0))) && all(lessThan(texCoords, vec2(1.0))))
+      discard;
+
    //Normal offset
-   vec4 surfaceData = texture(surfaceData_texture, texCoords);
+   vec4 surfaceData = sampleSurfaceData(texCoords);
+   if (ocean)
+      surfaceData = mix(texture(oceanSurfaceData_texture, oceanCoords), surfaceData, gridWeight);
    vec2 surfaceNormal = surfaceData.xy;
    vec3 normal = normalize(vec3(0.0, 1.0, 0.0) + vec3(surfaceNormal.x, 0.0, surfaceNormal.y));
 
@@ -59,6 +90,8 @@ void main()
    float depthDiff = imageDepth - surfaceDepth;
    depthDiff *= 0.35; //This constant has a big effect depending on how far away our water is.
    float depthf = pow(depthDiff*0.1, 2);
+   if (ocean)
+      depthf = min(depthf, 1.0); //Nothing but sky under open water
 
    //Water surface + refraction
    surfaceNormal *= refractionStrength;
@@ -73,10 +106,10 @@ void main()
    vec4 reflectionColor = vec4(texture(cubemap_texture, R).rgb, 1.0);
 
    //Adjust the color based on water depth
-   surfaceColor = mix(surfaceColor, fogColor, fogDensity * depthf);
+   surfaceColor = mix(surfaceColor, ocean ? seaColor : fogColor, fogDensity * depthf);
 
    //Mix with reflections last so that the reflection color isn't effected by other factors
    vec4 finalColor = mix(surfaceColor, reflectionColor, reflectionStrength * depthf) * vertColor;
 
    fragColor = clamp(finalColor, vec4(0.0), vec4(1.0));
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -7,26 +7,72 @@ out vec2 texCoords;
 out vec4 vertColor;
 out vec3 fragPos;
 out vec4 glPos;
+out vec2 oceanCoords;
+out float gridWeight; //How much of the grid there is here, against the ocean around it
 
 uniform mat4 ModelViewProjection_mat;
 uniform sampler2D height_texture;
 
+//Nested grids cover parts of height_texture in more detail (see NestedGrid in main.cpp)
+uniform int nestedCount = 0;
+uniform vec2 nestedOrigins[2];
+uniform vec2 nestedExtents[2];
+uniform sampler2D nestedHeight_textures[2];
+
+vec4 sampleHeight(vec2 coords)
+{
+   for (int i = 0; i < nestedCount; i++)
+   {
+      vec2 local = (coords - nestedOrigins[i]) / nestedExtents[i];
+      if (all(greaterThanEqual(local, vec2(0.0))) && all(lessThanEqual(local, vec2(1.0))))
+         return texture(nestedHeight_textures[i], local);
+   }
+   return texture(height_texture, coords);
+}
+
+//Open water around the grid (see water_ocean.h), a tile repeated every oceanTileSize world units.
+//The grid fades into it over the oceanBlend band inside its edges. The far field is a second, larger
+//plane drawn with farField set, which leaves the grid's rectangle to the grid's own plane.
+uniform bool ocean = false;
+uniform bool farField = false;
+uniform sampler2D oceanHeight_texture;
+uniform float oceanTileSize = 64.0;
+uniform float oceanLevel = 0.0; //The grid's mean height, so the two meet level
+uniform float oceanLod = 0.0;   //Mip level to match the plane's vertex spacing
+uniform float oceanBlend = 0.15;
+uniform vec2 gridSize = vec2(16.0); //World units the grid is stretched over
+
 //Only used for color blending.
 float maxHeight = 10.0f;
 
 void main()
 {
    vec3 newPosition = vPosition;
-   float f = texture(height_texture, vTexCoords).y;
+   float f = sampleHeight(vTexCoords).y;
    newPosition.y = f;
+   texCoords = vTexCoords;
+   gridWeight = 1.0;
+   oceanCoords = vec2(0.0);
+
+   if (ocean)
+   {
+      //The far field's texture coordinates are its own, so both planes work from the position
+      texCoords = vec2(vPosition.x / gridSize.x + 0.5, 0.5 - vPosition.z / gridSize.y);
+      vec2 edge = min(texCoords, 1.0 - texCoords);
+      gridWeight = farField ? 0.0 : smoothstep(0.0, oceanBlend, min(edge.x, edge.y));
+      oceanCoords = vec2(vPosition.x, -vPosition.z) / oceanTileSize;
+      vec4 o = textureLod(oceanHeight_texture, oceanCoords, oceanLod);
+      newPosition.y = mix(oceanLevel + o.y, f, gridWeight);
+      newPosition.xz += (1.0 - gridWeight) * vec2(o.z, -o.w);
+   }
 
    //Transform the vertex position
    gl_Position = ModelViewProjection_mat * vec4(newPosition, 1.0f);
    glPos = gl_Position;
    fragPos = vec3(mat4(1.0) * vec4(vPosition, 1.0));
 
-   texCoords = vTexCoords;
- 
-   //Hide the water at 0 height
+   //Hide the water at 0 height. The ocean has none to hide.
    vertColor = mix(vec4(0.0f), vec4(1.0f), step(0.005f, f));
-}
\ No newline at end of file
+   if (ocean)
+      vertColor = vec4(1.0f);
+}
\ No newline at end of file
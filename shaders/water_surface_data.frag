@@ -0,0 +1,30 @@
+#version 430 core
+
+//Surface data for the implicit engine, which has no fragment pass of its own.
+//Same output as the SURFACE_DATA variant of water_physics.frag, read from the finished height texture.
+#ifndef GRID_WIDTH
+#define GRID_WIDTH 128.0
+#endif
+#ifndef GRID_HEIGHT
+#define GRID_HEIGHT 128.0
+#endif
+
+in vec2 texCoords;
+
+layout(location = 1) out vec4 surfaceData;
+
+uniform sampler2D height_texture;
+
+const vec2 stepsize = vec2(1.0 / GRID_WIDTH, 1.0 / GRID_HEIGHT);
+
+void main()
+{
+   vec2 m = texture(height_texture, texCoords).xy;
+   float a = texture(height_texture, texCoords - vec2(stepsize.x, 0.0)).y;
+   float b = texture(height_texture, texCoords + vec2(stepsize.x, 0.0)).y;
+   float c = texture(height_texture, texCoords + vec2(0.0, stepsize.y)).y;
+   float d = texture(height_texture, texCoords - vec2(0.0, stepsize.y)).y;
+
+   vec2 normal = vec2( (a - b), (d - c) );
+   surfaceData = vec4(normal, abs(m.x), 1.0f);
+}
@@ -4,13 +4,29 @@
 
 #include "common.h"
 
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
 //-----------------------------------------------------------------
 //Texture creation
 //-----------------------------------------------------------------
+static std::string textureDescription(const char *kind, Vector2u size, unsigned int layers = 1)
+{
+    std::stringstream ss;
+    ss << kind << " " << size.x << "x" << size.y;
+    if (layers > 1)
+        ss << "x" << layers;
+    return ss.str();
+}
+
 void texture2D(Vector2u size, int format, const void* pixelData, unsigned int *glTexture)
 {
     glGenTextures(1, glTexture);
-    glBindTexture(GL_TEXTURE_2D, *glTexture);
+    bindTexture(GL_TEXTURE_2D, *glTexture);
+    trackGPUResource(GPU_TEXTURE, *glTexture, textureBytes(size, format), textureDescription("2D texture", size));
 
     if (format == GL_DEPTH_COMPONENT)
         glTexImage2D(GL_TEXTURE_2D, 0, format, size.x, size.y, 0, GL_DEPTH_COMPONENT, GL_FLOAT, pixelData);
@@ -26,97 +42,896 @@ void texture2D(Vector2u size, int format, const void* pixelData, unsigned int *g
     //Set the filtering options
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); //In theory, GL_NEAREST should be "faster"
-    glBindTexture(GL_TEXTURE_2D, 0);
+    bindTexture(GL_TEXTURE_2D, 0);
+}
+
+void enableTexture2D(unsigned int textureUnit, unsigned int textureID)
+{
+    activeTexture(textureUnit);
+    bindTexture(GL_TEXTURE_2D, textureID);
+}
+
+//Every layer has the same size and format, and a single level. The contents start out undefined.
+void textureArray(Vector2u size, unsigned int layers, int format, unsigned int *glTexture)
+{
+    glGenTextures(1, glTexture);
+    bindTexture(GL_TEXTURE_2D_ARRAY, *glTexture);
+    trackGPUResource(GPU_TEXTURE, *glTexture, textureBytes(size, format, layers), textureDescription("texture array", size, layers));
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, format, size.x, size.y, layers);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void enableTextureArray(unsigned int textureUnit, unsigned int textureID)
+{
+    activeTexture(textureUnit);
+    bindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+}
+
+void enableTextureCube(unsigned int textureUnit, unsigned int textureID)
+{
+    activeTexture(textureUnit);
+    bindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+}
+
+void disableTexture(unsigned int textureUnit)
+{
+    //Just unbind everything. The cache skips any target that is already empty.
+    activeTexture(textureUnit);
+    bindTexture(GL_TEXTURE_2D, 0);
+    bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+//Straight GPU side copy between two textures of the same size and format. Both have to be complete,
+//and nothing here touches the texture bindings.
+void copyTexture2D(Vector2u size, unsigned int sourceID, unsigned int destinationID)
+{
+    glCopyImageSubData(sourceID, GL_TEXTURE_2D, 0, 0, 0, 0,
+                       destinationID, GL_TEXTURE_2D, 0, 0, 0, 0,
+                       size.x, size.y, 1);
 }
 
-bool texture2D(const char* imageName, int format, unsigned int *glTexture)
+//-----------------------------------------------------------------
+//GL state cache
+//-----------------------------------------------------------------
+//Every value starts out as "unknown" so the first call always goes through.
+const unsigned int UNKNOWN_STATE = 0xFFFFFFFF;
+const int MAX_TEXTURE_UNITS = 16;
+const int MAX_TEXTURE_TARGETS = 3;
+const int MAX_IMAGE_UNITS = 8;
+const int MAX_ATTACHMENTS = 5; //4 color + depth
+const int MAX_DRAW_BUFFERS = 4;
+
+struct FramebufferState
+{
+    unsigned int attachments[MAX_ATTACHMENTS];
+    int drawBufferCount;
+    GLenum drawBuffers[MAX_DRAW_BUFFERS];
+};
+
+//What an image unit has bound. The same texture as one layer, or in another format, is another binding.
+struct ImageBinding
 {
-    //Load the image
-    sf::Image image;
-    if (!image.loadFromFile(imageName))
+    unsigned int texture;
+    GLenum format;
+    bool layered;
+};
+
+struct GLStateCache
+{
+    unsigned int activeTexture;
+    unsigned int textures[MAX_TEXTURE_UNITS][MAX_TEXTURE_TARGETS];
+    ImageBinding images[MAX_IMAGE_UNITS];
+    unsigned int program;
+    unsigned int VAO;
+    unsigned int FBO;
+    int viewport[4];
+    GLBlending blending;
+    std::map<unsigned int, FramebufferState> framebuffers;
+    GLCallStats stats;
+
+    GLStateCache() { invalidate(); }
+
+    void invalidate()
     {
-        std::cout << "Failed to Load Image: " << imageName << std::endl;
-        return false;
+        activeTexture = UNKNOWN_STATE;
+        for (int i = 0; i < MAX_TEXTURE_UNITS; i++)
+            for (int j = 0; j < MAX_TEXTURE_TARGETS; j++)
+                textures[i][j] = UNKNOWN_STATE;
+        for (int i = 0; i < MAX_IMAGE_UNITS; i++)
+            images[i].texture = UNKNOWN_STATE;
+        program = UNKNOWN_STATE;
+        VAO = UNKNOWN_STATE;
+        FBO = UNKNOWN_STATE;
+        viewport[0] = viewport[1] = viewport[2] = viewport[3] = -1;
+        blending.enabled = -1;
+        blending.source = blending.destination = UNKNOWN_STATE;
+        //Attachments and draw buffers belong to our own framebuffer objects, which nobody else touches
     }
 
-    int width = image.getSize().x;
-    int height = image.getSize().y;
+    FramebufferState &framebuffer()
+    {
+        std::map<unsigned int, FramebufferState>::iterator it = framebuffers.find(FBO);
+        if (it == framebuffers.end())
+        {
+            FramebufferState state;
+            for (int i = 0; i < MAX_ATTACHMENTS; i++)
+                state.attachments[i] = UNKNOWN_STATE;
+            state.drawBufferCount = -1;
+            it = framebuffers.insert(std::make_pair(FBO, state)).first;
+        }
+        return it->second;
+    }
+};
 
-    glGenTextures(1, glTexture);
-    glBindTexture(GL_TEXTURE_2D, *glTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.getPixelsPtr());
-    glGenerateMipmap(GL_TEXTURE_2D);
+GLStateCache glState;
+
+int textureTargetIndex(GLenum target)
+{
+    if (target == GL_TEXTURE_CUBE_MAP)
+        return 1;
+    if (target == GL_TEXTURE_2D_ARRAY)
+        return 2;
+    return 0;
+}
 
-    //Set the texture wrapping options
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+int attachmentIndex(GLenum attachment)
+{
+    if (attachment == GL_DEPTH_ATTACHMENT)
+        return MAX_ATTACHMENTS - 1;
+    return attachment - GL_COLOR_ATTACHMENT0;
+}
 
-    //Set the texture filtering options
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+void activeTexture(unsigned int textureUnit)
+{
+    if (glState.activeTexture == textureUnit)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glActiveTexture(GL_TEXTURE0 + textureUnit);
+    glState.activeTexture = textureUnit;
+    glState.stats.issued++;
+}
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+void bindTexture(GLenum target, unsigned int textureID)
+{
+    //An unknown active unit means we can't trust anything below it
+    unsigned int *bound = NULL;
+    if (glState.activeTexture < (unsigned int)MAX_TEXTURE_UNITS)
+        bound = &glState.textures[glState.activeTexture][textureTargetIndex(target)];
 
-    return true;
+    if (bound && *bound == textureID)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glBindTexture(target, textureID);
+    if (bound)
+        *bound = textureID;
+    glState.stats.issued++;
 }
 
-//aka cubemap
-void textureCube(std::string imageName, unsigned int *glTexture)
+//Whole level 0 of a texture, for reading and writing from compute shaders. Layered binds every
+//layer of an array texture at once.
+void bindImageTexture(unsigned int imageUnit, unsigned int textureID, GLenum format, bool layered)
 {
-    glGenTextures(1, glTexture);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, *glTexture);
-
-    std::string suffix[6] = {
-        "_right.png",
-        "_left.png",
-        "_top.png",
-        "_bottom.png",
-        "_front.png",
-        "_back.png"
-    };
+    ImageBinding *bound = (imageUnit < (unsigned int)MAX_IMAGE_UNITS) ? &glState.images[imageUnit] : NULL;
+    if (bound && bound->texture == textureID && bound->format == format && bound->layered == layered)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glBindImageTexture(imageUnit, textureID, 0, layered ? GL_TRUE : GL_FALSE, 0, GL_READ_WRITE, format);
+    if (bound)
+    {
+        bound->texture = textureID;
+        bound->format = format;
+        bound->layered = layered;
+    }
+    glState.stats.issued++;
+}
 
-    for(unsigned int i = 0; i < 6; i++)
+void useProgram(unsigned int programID)
+{
+    if (glState.program == programID)
     {
-        std::string fileName = imageName + suffix[i];
-        sf::Image image;
-        if (!image.loadFromFile(fileName.c_str()))
-        {
-            std::cout << "Failed to Load Image: " << imageName << std::endl;
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glState.stats.skipped++;
+        return;
+    }
+    glUseProgram(programID);
+    glState.program = programID;
+    glState.stats.issued++;
+}
+
+void bindVertexArray(unsigned int VAO)
+{
+    if (glState.VAO == VAO)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glBindVertexArray(VAO);
+    glState.VAO = VAO;
+    glState.stats.issued++;
+}
+
+void bindFramebuffer(unsigned int FBO)
+{
+    if (glState.FBO == FBO)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glState.FBO = FBO;
+    glState.stats.issued++;
+}
+
+//Attaches to whatever framebuffer was last bound through bindFramebuffer()
+void framebufferTexture2D(GLenum attachment, unsigned int textureID)
+{
+    unsigned int &attached = glState.framebuffer().attachments[attachmentIndex(attachment)];
+    if (attached == textureID)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, textureID, 0);
+    attached = textureID;
+    glState.stats.issued++;
+}
+
+void drawBuffers(int count, const GLenum *buffers)
+{
+    FramebufferState &state = glState.framebuffer();
+    if (state.drawBufferCount == count && memcmp(state.drawBuffers, buffers, count * sizeof(GLenum)) == 0)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glDrawBuffers(count, buffers);
+    state.drawBufferCount = count;
+    memcpy(state.drawBuffers, buffers, count * sizeof(GLenum));
+    glState.stats.issued++;
+}
+
+void setViewport(int x, int y, int width, int height)
+{
+    int *v = glState.viewport;
+    if (v[0] == x && v[1] == y && v[2] == width && v[3] == height)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glViewport(x, y, width, height);
+    v[0] = x;
+    v[1] = y;
+    v[2] = width;
+    v[3] = height;
+    glState.stats.issued++;
+}
+
+//The blend function is left alone while blending is off
+void setBlending(bool enabled, GLenum source, GLenum destination)
+{
+    GLBlending &current = glState.blending;
+    if (current.enabled == (int)enabled)
+    {
+        glState.stats.skipped++;
+    }
+    else
+    {
+        if (enabled)
+            glEnable(GL_BLEND);
+        else
+            glDisable(GL_BLEND);
+        current.enabled = enabled;
+        glState.stats.issued++;
+    }
+    if (!enabled)
+        return;
+    if (current.source == source && current.destination == destination)
+    {
+        glState.stats.skipped++;
+        return;
+    }
+    glBlendFunc(source, destination);
+    current.source = source;
+    current.destination = destination;
+    glState.stats.issued++;
+}
+
+void setBlending(const GLBlending &blending)
+{
+    if (blending.enabled >= 0)
+        setBlending(blending.enabled != 0, blending.source, blending.destination);
+}
+
+GLBlending currentBlending()
+{
+    return glState.blending;
+}
+
+GLDrawBindings currentDrawBindings()
+{
+    GLint value;
+    if (glState.program == UNKNOWN_STATE)
+    {
+        glGetIntegerv(GL_CURRENT_PROGRAM, &value);
+        glState.program = value;
+    }
+    if (glState.VAO == UNKNOWN_STATE)
+    {
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &value);
+        glState.VAO = value;
+    }
+    if (glState.FBO == UNKNOWN_STATE)
+    {
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &value);
+        glState.FBO = value;
+    }
+    if (glState.viewport[2] < 0)
+        glGetIntegerv(GL_VIEWPORT, glState.viewport);
+
+    GLDrawBindings bindings;
+    bindings.program = glState.program;
+    bindings.VAO = glState.VAO;
+    bindings.FBO = glState.FBO;
+    memcpy(bindings.viewport, glState.viewport, sizeof(bindings.viewport));
+    return bindings;
+}
+
+void setDrawBindings(const GLDrawBindings &bindings)
+{
+    useProgram(bindings.program);
+    bindVertexArray(bindings.VAO);
+    bindFramebuffer(bindings.FBO);
+    setViewport(bindings.viewport[0], bindings.viewport[1], bindings.viewport[2], bindings.viewport[3]);
+}
+
+//Copy the color of one framebuffer into a region of another. Leaves the destination bound.
+void blitFramebuffer(unsigned int sourceFBO, Vector2u sourceSize, unsigned int destinationFBO, int x, int y, Vector2u destinationSize)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sourceFBO);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, destinationFBO);
+    glBlitFramebuffer(0, 0, sourceSize.x, sourceSize.y,
+                      x, y, x + destinationSize.x, y + destinationSize.y,
+                      GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, destinationFBO);
+    glState.FBO = destinationFBO;
+    glState.stats.issued += 4;
+}
+
+//GL silently unbinds deleted objects, and their names can be handed out again. Keep the cache in step.
+void deleteFramebuffers(int count, const unsigned int *FBOs)
+{
+    for (int i = 0; i < count; i++)
+    {
+        untrackGPUResource(GPU_FRAMEBUFFER, FBOs[i]);
+        glState.framebuffers.erase(FBOs[i]);
+        if (glState.FBO == FBOs[i])
+            glState.FBO = 0;
+    }
+    glDeleteFramebuffers(count, FBOs);
+    glState.stats.issued++;
+}
+
+void deleteVertexArrays(int count, const unsigned int *VAOs)
+{
+    for (int i = 0; i < count; i++)
+    {
+        untrackGPUResource(GPU_VERTEX_ARRAY, VAOs[i]);
+        if (glState.VAO == VAOs[i])
+            glState.VAO = 0;
+    }
+    glDeleteVertexArrays(count, VAOs);
+    glState.stats.issued++;
+}
+
+//Deleted textures are unbound from every unit, and can't be left looking attached to a framebuffer
+//for a new texture that gets the same name
+void deleteTextures(int count, const unsigned int *textures)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (textures[i] == 0)
             continue;
+        untrackGPUResource(GPU_TEXTURE, textures[i]);
+        for (int unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+            for (int target = 0; target < MAX_TEXTURE_TARGETS; target++)
+                if (glState.textures[unit][target] == textures[i])
+                    glState.textures[unit][target] = 0;
+        for (int unit = 0; unit < MAX_IMAGE_UNITS; unit++)
+            if (glState.images[unit].texture == textures[i])
+                glState.images[unit].texture = UNKNOWN_STATE;
+        for (std::map<unsigned int, FramebufferState>::iterator it = glState.framebuffers.begin(); it != glState.framebuffers.end(); ++it)
+            for (int attachment = 0; attachment < MAX_ATTACHMENTS; attachment++)
+                if (it->second.attachments[attachment] == textures[i])
+                    it->second.attachments[attachment] = UNKNOWN_STATE;
+    }
+    glDeleteTextures(count, textures);
+    glState.stats.issued++;
+}
+
+void deleteBuffers(int count, const unsigned int *buffers)
+{
+    for (int i = 0; i < count; i++)
+        if (buffers[i] != 0)
+            untrackGPUResource(GPU_BUFFER, buffers[i]);
+    glDeleteBuffers(count, buffers);
+    glState.stats.issued++;
+}
+
+//A program stays in use after it's deleted, until another one is, so the cache can't say it's bound
+void deleteProgram(unsigned int program)
+{
+    if (program == 0)
+        return;
+    untrackGPUResource(GPU_PROGRAM, program);
+    if (glState.program == program)
+        glState.program = UNKNOWN_STATE;
+    glDeleteProgram(program);
+    glState.stats.issued++;
+}
+
+void deleteGPUResource(GPUResourceType type, unsigned int id)
+{
+    switch (type)
+    {
+    case GPU_TEXTURE:
+        deleteTextures(1, &id);
+        break;
+    case GPU_BUFFER:
+        deleteBuffers(1, &id);
+        break;
+    case GPU_VERTEX_ARRAY:
+        deleteVertexArrays(1, &id);
+        break;
+    case GPU_FRAMEBUFFER:
+        deleteFramebuffers(1, &id);
+        break;
+    case GPU_PROGRAM:
+        deleteProgram(id);
+        break;
+    default:
+        break;
+    }
+}
+
+void invalidateGLState()
+{
+    glState.invalidate();
+}
+
+//For calls that don't go through the cache (draws, clears, uniforms) but should still show up in the count
+void countGLCalls(unsigned int count)
+{
+    glState.stats.issued += count;
+}
+
+GLCallStats getGLCallStats()
+{
+    return glState.stats;
+}
+
+void resetGLCallStats()
+{
+    glState.stats = GLCallStats();
+}
+
+//-----------------------------------------------------------------
+//GPU memory registry
+//-----------------------------------------------------------------
+struct GPUResourceRecord
+{
+    unsigned long long bytes;
+    std::string description;
+};
+
+std::map<unsigned int, GPUResourceRecord> gpuResources[GPU_RESOURCE_TYPES];
+
+void trackGPUResource(GPUResourceType type, unsigned int id, unsigned long long bytes, const std::string &description)
+{
+    GPUResourceRecord &record = gpuResources[type][id];
+    record.bytes = bytes;
+    record.description = description;
+}
+
+void untrackGPUResource(GPUResourceType type, unsigned int id)
+{
+    gpuResources[type].erase(id);
+}
+
+static unsigned int bytesPerTexel(int format)
+{
+    switch (format)
+    {
+    case GL_R8:
+        return 1;
+    case GL_R16F:
+        return 2;
+    case GL_RGB16F:
+    case GL_RGBA16F:
+    case GL_RG32F:
+        return 8;
+    case GL_RGB32F:
+    case GL_RGBA32F:
+        return 16;
+    default:
+        return 4; //GL_R32F, 8 bit RGB(A), and depth
+    }
+}
+
+unsigned long long textureBytes(Vector2u size, int format, unsigned int layers, bool mipmaps)
+{
+    unsigned long long texels = 0;
+    while (true)
+    {
+        texels += (unsigned long long)size.x * size.y;
+        if (!mipmaps || (size.x <= 1 && size.y <= 1))
+            break;
+        size = Vector2u(std::max(1u, size.x / 2), std::max(1u, size.y / 2));
+    }
+    return texels * layers * bytesPerTexel(format);
+}
+
+GPUMemoryReport getGPUMemoryReport()
+{
+    GPUMemoryReport report;
+    for (int type = 0; type < GPU_RESOURCE_TYPES; type++)
+    {
+        std::map<unsigned int, GPUResourceRecord>::const_iterator it;
+        for (it = gpuResources[type].begin(); it != gpuResources[type].end(); ++it)
+            report.bytes[type] += it->second.bytes;
+        report.count[type] = gpuResources[type].size();
+        report.totalBytes += report.bytes[type];
+    }
+    return report;
+}
+
+const char *gpuResourceTypeName(GPUResourceType type)
+{
+    const char *names[GPU_RESOURCE_TYPES] = { "texture", "buffer", "vertex array", "framebuffer", "program" };
+    return (type < GPU_RESOURCE_TYPES) ? names[type] : "unknown";
+}
+
+bool reportGPULeaks()
+{
+    bool leaked = false;
+    for (int type = 0; type < GPU_RESOURCE_TYPES; type++)
+    {
+        std::map<unsigned int, GPUResourceRecord>::const_iterator it;
+        for (it = gpuResources[type].begin(); it != gpuResources[type].end(); ++it)
+        {
+            std::cout << "Leaked " << gpuResourceTypeName((GPUResourceType)type) << " " << it->first << ": ";
+            std::cout << it->second.description << " (" << it->second.bytes << " bytes)" << std::endl;
+            leaked = true;
         }
+    }
+    return leaked;
+}
 
-        int width = image.getSize().x;
-        int height = image.getSize().y;
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.getPixelsPtr());
+unsigned int newBuffer(GLenum target, unsigned long long bytes, const void *data, GLenum usage, const char *description)
+{
+    unsigned int buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(target, buffer);
+    glBufferData(target, bytes, data, usage);
+    countGLCalls(3);
+    trackGPUResource(GPU_BUFFER, buffer, bytes, description);
+    return buffer;
+}
+
+unsigned int newVertexArray(const char *description)
+{
+    unsigned int VAO;
+    glGenVertexArrays(1, &VAO);
+    countGLCalls(1);
+    bindVertexArray(VAO);
+    trackGPUResource(GPU_VERTEX_ARRAY, VAO, 0, description);
+    return VAO;
+}
+
+unsigned int newFramebuffer(const char *description)
+{
+    unsigned int FBO;
+    glGenFramebuffers(1, &FBO);
+    countGLCalls(1);
+    trackGPUResource(GPU_FRAMEBUFFER, FBO, 0, description);
+    return FBO;
+}
+
+//-----------------------------------------------------------------
+//GPU timing
+//-----------------------------------------------------------------
+void GPUTimer::init()
+{
+    glGenQueries(QUERY_COUNT, queries);
+    for (int i = 0; i < QUERY_COUNT; i++)
+        pending[i] = false;
+}
+
+void GPUTimer::release()
+{
+    glDeleteQueries(QUERY_COUNT, queries);
+}
+
+void GPUTimer::begin()
+{
+    //If the GPU is so far behind that every query is still in flight, skip timing this one
+    if (pending[next])
+        return;
+    glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+    running = true;
+}
+
+void GPUTimer::end()
+{
+    if (!running)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    pending[next] = true;
+    next = (next + 1) % QUERY_COUNT;
+    running = false;
+}
+
+double GPUTimer::poll()
+{
+    double totalMs = 0.0;
+    while (pending[oldest])
+    {
+        int available = 0;
+        glGetQueryObjectiv(queries[oldest], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(queries[oldest], GL_QUERY_RESULT, &nanoseconds);
+        lastMs = nanoseconds / 1000000.0;
+        totalMs += lastMs;
+        pending[oldest] = false;
+        oldest = (oldest + 1) % QUERY_COUNT;
     }
+    return totalMs;
+}
 
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+void GPUReadback::init(unsigned int bytes)
+{
+    size = bytes;
+    for (int i = 0; i < BUFFER_COUNT; i++)
+    {
+        buffers[i] = newBuffer(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STREAM_READ, "readback buffer");
+        fences[i] = 0;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
-void enableTexture2D(unsigned int textureUnit, unsigned int textureID)
+void GPUReadback::release()
 {
-    glActiveTexture(GL_TEXTURE0 + textureUnit);
-    glBindTexture(GL_TEXTURE_2D, textureID);
+    for (int i = 0; i < BUFFER_COUNT; i++)
+    {
+        if (fences[i])
+            glDeleteSync(fences[i]);
+        fences[i] = 0;
+    }
+    deleteBuffers(BUFFER_COUNT, buffers);
 }
 
-void enableTextureCube(unsigned int textureUnit, unsigned int textureID)
+unsigned int GPUReadback::begin()
 {
-    glActiveTexture(GL_TEXTURE0 + textureUnit);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+    if (fences[next])
+        return 0;
+    return buffers[next];
 }
 
-void disableTexture(unsigned int textureUnit)
+void GPUReadback::end()
 {
-    glActiveTexture(GL_TEXTURE0 + textureUnit);
-    //Just unbind everything
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    if (fences[next])
+        return;
+    fences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    next = (next + 1) % BUFFER_COUNT;
+}
+
+bool GPUReadback::poll(void *result)
+{
+    bool found = false;
+    while (fences[oldest])
+    {
+        //A timeout of 0 only asks, it never waits
+        GLenum status = glClientWaitSync(fences[oldest], 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+
+        glBindBuffer(GL_COPY_READ_BUFFER, buffers[oldest]);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, size, result);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteSync(fences[oldest]);
+        fences[oldest] = 0;
+        oldest = (oldest + 1) % BUFFER_COUNT;
+        found = true;
+    }
+    return found;
+}
+
+void GPUUpload::init(unsigned int bytes)
+{
+    size = bytes;
+    next = 0;
+    persistent = GLEW_ARB_buffer_storage;
+    if (!persistent)
+    {
+        fallback.resize(size);
+        return;
+    }
+
+    //Coherent, so whatever we write is visible to the GPU without flushing
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(BUFFER_COUNT, buffers);
+    for (int i = 0; i < BUFFER_COUNT; i++)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+        trackGPUResource(GPU_BUFFER, buffers[i], size, "upload buffer");
+        mapped[i] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+        fences[i] = 0;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    fetchGLErrors("Error creating upload buffers:");
+}
+
+void GPUUpload::release()
+{
+    if (persistent)
+    {
+        for (int i = 0; i < BUFFER_COUNT; i++)
+        {
+            if (fences[i])
+                glDeleteSync(fences[i]);
+            fences[i] = 0;
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        deleteBuffers(BUFFER_COUNT, buffers);
+    }
+    fallback.clear();
+    size = 0;
+}
+
+//With three buffers, the one we're after was handed to the GPU two uploads ago, so the wait is
+//almost always already over
+void *GPUUpload::slot()
+{
+    if (!persistent)
+        return &fallback[0];
+
+    if (fences[next])
+    {
+        glClientWaitSync(fences[next], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        glDeleteSync(fences[next]);
+        fences[next] = 0;
+    }
+    return mapped[next];
+}
+
+void *GPUUpload::begin()
+{
+    void *data = slot();
+    if (persistent)
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[next]);
+    return data;
+}
+
+const void *GPUUpload::pixels(unsigned int offset)
+{
+    if (!persistent)
+        return &fallback[offset];
+    return (const void *)(std::size_t)offset;
+}
+
+void GPUUpload::end()
+{
+    if (!persistent)
+        return;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    fences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    next = (next + 1) % BUFFER_COUNT;
+}
+
+//-----------------------------------------------------------------
+//Program binary cache
+//-----------------------------------------------------------------
+bool programBinaryCache = true;
+ProgramCacheStats programCacheStats;
+
+//Some drivers have the extension but no formats, which means no binaries either
+static bool programBinariesSupported()
+{
+    static int formats = -1;
+    if (formats < 0)
+    {
+        formats = 0;
+        if (GLEW_ARB_get_program_binary)
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    }
+    return programBinaryCache && formats > 0;
+}
+
+//The sources go in with their terminators, so text can't move from one stage to the other unnoticed
+static unsigned long long programKey(const std::string &firstStage, const std::string &secondStage)
+{
+    static unsigned long long driverKey = 0;
+    if (driverKey == 0)
+    {
+        driverKey = HASH_SEED;
+        const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+        for (int i = 0; i < 3; i++)
+        {
+            const char *text = (const char *)glGetString(driverStrings[i]);
+            if (text)
+                driverKey = hashBytes(text, std::strlen(text) + 1, driverKey);
+        }
+    }
+    unsigned long long key = hashBytes(firstStage.c_str(), firstStage.size() + 1, driverKey);
+    return hashBytes(secondStage.c_str(), secondStage.size() + 1, key);
+}
+
+static std::string programCacheName(unsigned long long key)
+{
+    char name[40];
+    std::snprintf(name, sizeof(name), "program_%016llx.bin", key);
+    return name;
+}
+
+//0 if there's no binary for this key, or the driver turns it down
+static unsigned int loadProgramBinary(unsigned long long key, const std::string &description)
+{
+    std::vector<unsigned char> data;
+    if (!readCacheFile(programCacheName(key), key, data) || data.size() <= sizeof(GLenum))
+        return 0;
+
+    GLenum format;
+    std::memcpy(&format, &data[0], sizeof(format));
+    unsigned int program = glCreateProgram();
+    glProgramBinary(program, format, &data[sizeof(format)], (GLsizei)(data.size() - sizeof(format)));
+
+    int status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glDeleteProgram(program);
+        return 0;
+    }
+    programCacheStats.loaded++;
+    trackGPUResource(GPU_PROGRAM, program, data.size() - sizeof(format), description);
+    return program;
+}
+
+//Stored as the binary's format followed by the binary. Its length is the program's size in the registry.
+static void saveProgramBinary(unsigned int program, unsigned long long key, const std::string &description)
+{
+    int length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    trackGPUResource(GPU_PROGRAM, program, length, description);
+
+    std::vector<unsigned char> data(sizeof(GLenum) + length);
+    GLenum format;
+    glGetProgramBinary(program, length, NULL, &format, &data[sizeof(format)]);
+    std::memcpy(&data[0], &format, sizeof(format));
+    if (!writeCacheFile(programCacheName(key), key, &data[0], data.size()))
+        std::cout << "Couldn't write " << cacheDirectory << programCacheName(key) << std::endl;
+}
+
+ProgramCacheStats getProgramCacheStats()
+{
+    return programCacheStats;
 }
 
 //-----------------------------------------------------------------
@@ -138,17 +953,49 @@ const char* getShaderProgram(const char *filePath, std::string &shader)
 	return shader.c_str();
 }
 
+//#version has to stay the first statement, so the defines go in on the line after it
+void injectDefines(std::string &shader, const char *defines)
+{
+    if (defines == NULL || defines[0] == '\0')
+        return;
+
+    std::size_t position = 0;
+    if (shader.compare(0, 8, "#version") == 0)
+    {
+        position = shader.find('\n');
+        position = (position == std::string::npos) ? shader.size() : position + 1;
+    }
+    shader.insert(position, std::string(defines) + "\n");
+}
+
 unsigned int LoadShaders(ShaderInfo shaderInfo)
 {
+	//Both stages are read first, since the binary cache is keyed by them
+	std::string vertexText;
+	std::string fragmentText;
+	getShaderProgram(shaderInfo.vShaderFile, vertexText);
+	injectDefines(vertexText, shaderInfo.defines);
+	getShaderProgram(shaderInfo.fShaderFile, fragmentText);
+	injectDefines(fragmentText, shaderInfo.defines);
+
+	std::string description = std::string(shaderInfo.vShaderFile) + " + " + shaderInfo.fShaderFile;
+	unsigned long long key = 0;
+	if (programBinariesSupported())
+	{
+		key = programKey(vertexText, fragmentText);
+		unsigned int cached = loadProgramBinary(key, description);
+		if (cached)
+			return cached;
+	}
+
 	unsigned int program;
 	unsigned int vertexShader;
 	unsigned int fragmentShader;
 	vertexShader = glCreateShader(GL_VERTEX_SHADER); //create a vertex shader object
 	fragmentShader = glCreateShader(GL_FRAGMENT_SHADER); //create a fragment shader object
 
-	//Load and compile vertex shader
-	std::string shaderProgramText;
-	const char* text = getShaderProgram(shaderInfo.vShaderFile, shaderProgramText);
+	//Compile vertex shader
+	const char* text = vertexText.c_str();
 	glShaderSource(vertexShader, 1, &text, NULL);
 	glCompileShader(vertexShader);
 
@@ -166,9 +1013,8 @@ unsigned int LoadShaders(ShaderInfo shaderInfo)
 	for (int i = 0; i < length; i++)
 		std::cout << errorLog[i];
 
-	//Load and compile fragment shader
-	shaderProgramText = "";
-	text = getShaderProgram(shaderInfo.fShaderFile, shaderProgramText);
+	//Compile fragment shader
+	text = fragmentText.c_str();
 	glShaderSource(fragmentShader, 1, &text, NULL);
 	glCompileShader(fragmentShader);
 
@@ -184,17 +1030,23 @@ unsigned int LoadShaders(ShaderInfo shaderInfo)
 
 	//Create the shader program
 	program = glCreateProgram();
+	trackGPUResource(GPU_PROGRAM, program, 0, description);
 
 	//Attach the shaders to program
 	glAttachShader(program, vertexShader);
 	glAttachShader(program, fragmentShader);
 
 	//Link the objects for an executable program
+	if (key)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(program);
 
 	glGetProgramiv(program, GL_LINK_STATUS, &status);
 	if (status != GL_TRUE)
 		std::cout << "Link failed..." << std::endl;
+	else if (key)
+		saveProgramBinary(program, key, description);
+	programCacheStats.compiled++;
 
     //Cleanup shaders
     glDetachShader(program, vertexShader);
@@ -206,16 +1058,200 @@ unsigned int LoadShaders(ShaderInfo shaderInfo)
 	return program;
 }
 
+unsigned int LoadComputeShader(const char *shaderFile, const char *defines)
+{
+	std::string shaderProgramText;
+	getShaderProgram(shaderFile, shaderProgramText);
+	injectDefines(shaderProgramText, defines);
+
+	unsigned long long key = 0;
+	if (programBinariesSupported())
+	{
+		key = programKey(shaderProgramText, "");
+		unsigned int cached = loadProgramBinary(key, shaderFile);
+		if (cached)
+			return cached;
+	}
+
+	unsigned int program;
+	unsigned int computeShader = glCreateShader(GL_COMPUTE_SHADER);
+
+	//Compile the compute shader
+	const char* text = shaderProgramText.c_str();
+	glShaderSource(computeShader, 1, &text, NULL);
+	glCompileShader(computeShader);
+
+	int status;
+	glGetShaderiv(computeShader, GL_COMPILE_STATUS, &status);
+
+	if (status != GL_TRUE)
+		std::cerr << "\nCompute Shader '" << shaderFile << "' compilation failed..." << '\n';
+
+    //Get errors from the compute shader
+    GLsizei length;
+    GLsizei bufferSize = 200;
+	std::vector<char> errorLog(bufferSize);
+	glGetShaderInfoLog(computeShader, bufferSize, &length, &errorLog[0]);
+	for (int i = 0; i < length; i++)
+		std::cout << errorLog[i];
+
+	//Create the shader program and link it
+	program = glCreateProgram();
+	trackGPUResource(GPU_PROGRAM, program, 0, shaderFile);
+	glAttachShader(program, computeShader);
+	if (key)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE)
+		std::cout << "Link failed..." << std::endl;
+	else if (key)
+		saveProgramBinary(program, key, shaderFile);
+	programCacheStats.compiled++;
+
+    //Cleanup shaders
+    glDetachShader(program, computeShader);
+	glDeleteShader(computeShader);
+
+	return program;
+}
+
+//-----------------------------------------------------------------
+//Shader variants
+//-----------------------------------------------------------------
+ShaderVariant::ShaderVariant(const char *vertexFile, const char *fragmentFile)
+{
+    vShaderFile = vertexFile;
+    fShaderFile = fragmentFile;
+    cShaderFile = NULL;
+}
+
+ShaderVariant::ShaderVariant(const char *computeFile)
+{
+    vShaderFile = NULL;
+    fShaderFile = NULL;
+    cShaderFile = computeFile;
+}
+
+ShaderVariant &ShaderVariant::define(const char *name)
+{
+    defines[name] = "";
+    return *this;
+}
+
+ShaderVariant &ShaderVariant::define(const char *name, int value)
+{
+    std::stringstream ss;
+    ss << value;
+    defines[name] = ss.str();
+    return *this;
+}
+
+ShaderVariant &ShaderVariant::define(const char *name, float value)
+{
+    //Enough digits to survive the round trip, and always written as a float literal
+    std::stringstream ss;
+    ss.precision(9);
+    ss << value;
+    std::string text = ss.str();
+    if (text.find_first_of(".e") == std::string::npos)
+        text += ".0";
+    defines[name] = text;
+    return *this;
+}
+
+ShaderVariant &ShaderVariant::define(const char *name, const char *value)
+{
+    defines[name] = value;
+    return *this;
+}
+
+ShaderVariant &ShaderVariant::sampler(const char *name, int textureUnit)
+{
+    samplers[name] = textureUnit;
+    return *this;
+}
+
+std::string ShaderVariant::defineBlock() const
+{
+    std::string block;
+    for (std::map<std::string, std::string>::const_iterator it = defines.begin(); it != defines.end(); ++it)
+    {
+        block += "#define " + it->first;
+        if (!it->second.empty())
+            block += " " + it->second;
+        block += "\n";
+    }
+    return block;
+}
+
+std::string ShaderVariant::key() const
+{
+    if (cShaderFile)
+        return std::string(cShaderFile) + "|" + defineBlock();
+    return std::string(vShaderFile) + "|" + fShaderFile + "|" + defineBlock();
+}
+
+std::map<std::string, ShaderProgram> shaderVariantCache;
+
+ShaderProgram &loadShaderVariant(const ShaderVariant &variant)
+{
+    std::string key = variant.key();
+    std::map<std::string, ShaderProgram>::iterator it = shaderVariantCache.find(key);
+    if (it != shaderVariantCache.end())
+        return it->second;
+
+    std::string defines = variant.defineBlock();
+    ShaderProgram &program = shaderVariantCache[key];
+    if (variant.cShaderFile)
+    {
+        program.programID = LoadComputeShader(variant.cShaderFile, defines.c_str());
+    }
+    else
+    {
+        ShaderInfo shader;
+        shader.vShaderFile = variant.vShaderFile;
+        shader.fShaderFile = variant.fShaderFile;
+        shader.defines = defines.c_str();
+        program.programID = LoadShaders(shader);
+    }
+    for (std::map<std::string, int>::const_iterator sampler = variant.samplers.begin(); sampler != variant.samplers.end(); ++sampler)
+        program.setUniform(sampler->first.c_str(), sampler->second);
+
+    return program;
+}
+
+unsigned int shaderVariantCount()
+{
+    return shaderVariantCache.size();
+}
+
+void releaseShaderVariants()
+{
+    for (std::map<std::string, ShaderProgram>::iterator it = shaderVariantCache.begin(); it != shaderVariantCache.end(); ++it)
+        it->second.release();
+    shaderVariantCache.clear();
+}
+
 void ShaderProgram::enable()
 {
     active = true;
-    glUseProgram(programID);
+    useProgram(programID);
 }
 
 void ShaderProgram::disable()
 {
     active = false;
-    glUseProgram(0);
+    useProgram(0);
+}
+
+void ShaderProgram::release()
+{
+    deleteProgram(programID);
+    programID = 0;
+    active = false;
+    uniformLocations.clear();
 }
 
 void ShaderProgram::setUniform(const char *attributeName, int value)
@@ -223,8 +1259,9 @@ void ShaderProgram::setUniform(const char *attributeName, int value)
     //if (!active)
         enable();
 
-    unsigned int uniform_loc = glGetUniformLocation(programID, attributeName);
+    int uniform_loc = uniformLocation(attributeName);
     glUniform1i(uniform_loc, value);
+    countGLCalls(1);
     //disable();
 }
 
@@ -233,8 +1270,9 @@ void ShaderProgram::setUniform(const char *attributeName, float value)
     //if (!active)
         enable();
 
-    unsigned int uniform_loc = glGetUniformLocation(programID, attributeName);
+    int uniform_loc = uniformLocation(attributeName);
     glUniform1f(uniform_loc, value);
+    countGLCalls(1);
     //disable();
 }
 
@@ -243,8 +1281,9 @@ void ShaderProgram::setUniform(const char *attributeName, Vector2 vec)
     //if (!active)
         enable();
 
-    unsigned int uniform_loc = glGetUniformLocation(programID, attributeName);
+    int uniform_loc = uniformLocation(attributeName);
     glUniform2f(uniform_loc, (float)vec.x, (float)vec.y);
+    countGLCalls(1);
     //disable();
 }
 
@@ -253,8 +1292,9 @@ void ShaderProgram::setUniform(const char *attributeName, Vector3 vec)
     //if (!active)
         enable();
 
-    unsigned int uniform_loc = glGetUniformLocation(programID, attributeName);
+    int uniform_loc = uniformLocation(attributeName);
     glUniform3f(uniform_loc, (float)vec.x, (float)vec.y, (float)vec.z);
+    countGLCalls(1);
     //disable();
 }
 
@@ -263,11 +1303,68 @@ void ShaderProgram::setUniform(const char *attributeName, Matrix4 matrix)
     //if (!active)
         enable();
 
-    unsigned int uniform_loc = glGetUniformLocation(programID, attributeName);
+    int uniform_loc = uniformLocation(attributeName);
     glUniformMatrix4fv(uniform_loc, 1, GL_FALSE, glm::value_ptr(matrix));
+    countGLCalls(1);
     //disable();
 }
 
+//Uniform locations never change after linking, so only ask GL once per name
+int ShaderProgram::uniformLocation(const char *attributeName)
+{
+    std::map<std::string, int>::iterator it = uniformLocations.find(attributeName);
+    if (it != uniformLocations.end())
+        return it->second;
+
+    int location = glGetUniformLocation(programID, attributeName);
+    uniformLocations[attributeName] = location;
+    countGLCalls(1);
+    return location;
+}
+
+//-----------------------------------------------------------------
+//Disk cache
+//-----------------------------------------------------------------
+std::string cacheDirectory = "cache/";
+
+unsigned long long hashBytes(const void *data, std::size_t size, unsigned long long hash)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (std::size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+//Each file starts with its key and the size of what follows, so a stale or cut short one is turned down
+bool readCacheFile(const std::string &name, unsigned long long key, std::vector<unsigned char> &data)
+{
+    std::ifstream file((cacheDirectory + name).c_str(), std::ios::binary);
+    unsigned long long header[2];
+    if (!file.read((char *)header, sizeof(header)) || header[0] != key)
+        return false;
+
+    file.seekg(0, std::ios::end);
+    if ((unsigned long long)file.tellg() != sizeof(header) + header[1])
+        return false;
+    file.seekg(sizeof(header));
+    data.resize(header[1]);
+    return header[1] == 0 || (bool)file.read((char *)&data[0], header[1]);
+}
+
+bool writeCacheFile(const std::string &name, unsigned long long key, const void *data, std::size_t size)
+{
+#ifdef _WIN32
+    _mkdir(cacheDirectory.c_str());
+#else
+    mkdir(cacheDirectory.c_str(), 0755);
+#endif
+    std::ofstream file((cacheDirectory + name).c_str(), std::ios::binary | std::ios::trunc);
+    unsigned long long header[2] = { key, size };
+    file.write((const char *)header, sizeof(header));
+    file.write((const char *)data, size);
+    return (bool)file;
+}
+
 //-----------------------------------------------------------------
 //Geometry creation
 //-----------------------------------------------------------------
@@ -336,13 +1433,8 @@ void newCube(Vector3 position, Vector3 size, unsigned int *VAO, float n)
     }
 
     //
-    glGenVertexArrays(1, VAO);
-    glBindVertexArray(*VAO);
-
-    unsigned int buffer;
-    glGenBuffers(1, &buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    *VAO = newVertexArray("cube");
+    unsigned int buffer = newBuffer(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW, "cube vertices");
 
     //Vertex data
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8*sizeof(float), (GLvoid*)(0));
@@ -355,7 +1447,11 @@ void newCube(Vector3 position, Vector3 size, unsigned int *VAO, float n)
     glEnableVertexAttribArray(2);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    bindVertexArray(0);
+
+    //The vertex array keeps its buffer alive by itself, so the buffer goes when it does
+    deleteBuffers(1, &buffer);
+    trackGPUResource(GPU_VERTEX_ARRAY, *VAO, sizeof(vertices), "cube");
 }
 
 //Generate a plane with the desired size and quad density
@@ -428,13 +1524,10 @@ void newPlane(Vector2 dimensions, Vector2 density, unsigned int *VAO, unsigned i
     std::size_t vertices_size = vertices.size() * sizeof(Vector3);
     std::size_t texCoords_size = texCoords.size() * sizeof(Vector2);
 
-    glGenVertexArrays(1, VAO);
-    glBindVertexArray(*VAO);
+    *VAO = newVertexArray("plane");
 
     unsigned int buffers[2];
-    glGenBuffers(2, buffers);
-    glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
-    glBufferData(GL_ARRAY_BUFFER, (vertices_size + texCoords_size), NULL, GL_STATIC_DRAW);
+    buffers[0] = newBuffer(GL_ARRAY_BUFFER, vertices_size + texCoords_size, NULL, GL_STATIC_DRAW, "plane vertices");
     glBufferSubData(GL_ARRAY_BUFFER, 0, vertices_size, &vertices[0]);
     glBufferSubData(GL_ARRAY_BUFFER, vertices_size, texCoords_size, &texCoords[0]);
 
@@ -443,10 +1536,13 @@ void newPlane(Vector2 dimensions, Vector2 density, unsigned int *VAO, unsigned i
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vector2), (GLvoid*)(vertices_size));
     glEnableVertexAttribArray(1);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, *elements*sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+    buffers[1] = newBuffer(GL_ELEMENT_ARRAY_BUFFER, *elements*sizeof(GLushort), &indices[0], GL_STATIC_DRAW, "plane indices");
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    bindVertexArray(0);
+
+    //The vertex array keeps its buffers alive by itself, so they go when it does
+    deleteBuffers(2, buffers);
+    trackGPUResource(GPU_VERTEX_ARRAY, *VAO, vertices_size + texCoords_size + *elements*sizeof(GLushort), "plane");
 }
 
 //-----------------------------------------------------------------
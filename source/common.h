@@ -4,8 +4,6 @@
 #define GLEW_STATIC
 
 #include <GL/glew.h>
-#include <SFML/OpenGL.hpp>
-#include <SFML/Graphics.hpp>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/rotate_vector.hpp>
@@ -17,7 +15,10 @@
 #include <sstream>
 #include <string>
 #include <cstring>
+#include <cstdio>
 #include <vector>
+#include <algorithm>
+#include <map>
 
 typedef glm::vec2 Vector2;
 typedef glm::uvec2 Vector2u;
@@ -26,11 +27,216 @@ typedef glm::mat4x4 Matrix4;
 
 //Textures
 void texture2D(Vector2u size, int format, const void* pixelData, unsigned int *glTexture);
-bool texture2D(const char* imageName, int format, unsigned int *glTexture);
-void textureCube(std::string imageName, unsigned int *glTexture);
+void textureArray(Vector2u size, unsigned int layers, int format, unsigned int *glTexture);
 void enableTexture2D(unsigned int textureUnit, unsigned int textureID);
+void enableTextureArray(unsigned int textureUnit, unsigned int textureID);
 void enableTextureCube(unsigned int textureUnit, unsigned int textureID);
 void disableTexture(unsigned int textureUnit);
+void copyTexture2D(Vector2u size, unsigned int sourceID, unsigned int destinationID);
+
+//GL state cache. Binds made through these are tracked so that redundant calls never reach the driver.
+//Anything that changes GL state behind our back (SFML text drawing, for one) must be followed by invalidateGLState().
+struct GLCallStats
+{
+    unsigned int issued = 0;
+    unsigned int skipped = 0;
+};
+
+void activeTexture(unsigned int textureUnit);
+void bindTexture(GLenum target, unsigned int textureID);
+void bindImageTexture(unsigned int imageUnit, unsigned int textureID, GLenum format, bool layered = false);
+void useProgram(unsigned int programID);
+void bindVertexArray(unsigned int VAO);
+void bindFramebuffer(unsigned int FBO);
+void framebufferTexture2D(GLenum attachment, unsigned int textureID);
+void drawBuffers(int count, const GLenum *buffers);
+void setViewport(int x, int y, int width, int height);
+
+//Blending is tracked too, so draws that need their own can put back what was there without asking GL.
+//Unknown after invalidateGLState() until it's next set.
+struct GLBlending
+{
+    int enabled; //-1 when unknown
+    GLenum source;
+    GLenum destination;
+};
+void setBlending(bool enabled, GLenum source = GL_ONE, GLenum destination = GL_ZERO);
+void setBlending(const GLBlending &blending); //Does nothing if it's unknown
+GLBlending currentBlending();
+
+//What draws go through, so passes run in the middle of someone else's draw can put it back after.
+//Whatever the cache doesn't know is asked of GL.
+struct GLDrawBindings
+{
+    unsigned int program;
+    unsigned int VAO;
+    unsigned int FBO;
+    int viewport[4];
+};
+GLDrawBindings currentDrawBindings();
+void setDrawBindings(const GLDrawBindings &bindings);
+void blitFramebuffer(unsigned int sourceFBO, Vector2u sourceSize, unsigned int destinationFBO, int x, int y, Vector2u destinationSize);
+void deleteFramebuffers(int count, const unsigned int *FBOs);
+void deleteVertexArrays(int count, const unsigned int *VAOs);
+void invalidateGLState();
+void countGLCalls(unsigned int count);
+GLCallStats getGLCallStats();
+void resetGLCallStats();
+
+//GPU memory registry. Objects made through the helpers here are registered along with an estimate
+//of their size, and unregistered when they're deleted through them, so what's live on the GPU can
+//be totalled up by type at any time. Whatever is still registered at shutdown has leaked.
+enum GPUResourceType
+{
+    GPU_TEXTURE,
+    GPU_BUFFER,
+    GPU_VERTEX_ARRAY, //Counts the buffers only it keeps alive
+    GPU_FRAMEBUFFER,
+    GPU_PROGRAM,
+    GPU_RESOURCE_TYPES
+};
+
+struct GPUMemoryReport
+{
+    unsigned int count[GPU_RESOURCE_TYPES] = {};
+    unsigned long long bytes[GPU_RESOURCE_TYPES] = {};
+    unsigned long long totalBytes = 0;
+};
+
+void trackGPUResource(GPUResourceType type, unsigned int id, unsigned long long bytes, const std::string &description); //Again to resize
+void untrackGPUResource(GPUResourceType type, unsigned int id);
+unsigned long long textureBytes(Vector2u size, int format, unsigned int layers = 1, bool mipmaps = false); //RGB padded to RGBA, as drivers store it
+GPUMemoryReport getGPUMemoryReport();
+const char *gpuResourceTypeName(GPUResourceType type);
+bool reportGPULeaks(); //Prints whatever is still registered, and returns true if there was anything
+
+//Made and registered. Buffers and vertex arrays are left bound.
+unsigned int newBuffer(GLenum target, unsigned long long bytes, const void *data, GLenum usage, const char *description);
+unsigned int newVertexArray(const char *description);
+unsigned int newFramebuffer(const char *description);
+
+//Unregistered, then deleted. Zeros are skipped.
+void deleteTextures(int count, const unsigned int *textures);
+void deleteBuffers(int count, const unsigned int *buffers);
+void deleteProgram(unsigned int program);
+void deleteGPUResource(GPUResourceType type, unsigned int id); //Through whichever of the above (or below) matches
+
+//Owns one GL object, and deletes it through deleteGPUResource() when it goes. Move-only. It passes
+//for the object's name wherever one is taken, and helpers that make an object fill it in through
+//replace(), which deletes whatever it held first:
+//
+//    TextureHandle mask;
+//    texture2D(size, GL_R8, NULL, mask.replace());
+//    enableTexture2D(0, mask);
+template <GPUResourceType Type>
+class GPUHandle
+{
+public:
+    GPUHandle() : id(0) {}
+    explicit GPUHandle(unsigned int object) : id(object) {}
+    ~GPUHandle() { reset(); }
+    GPUHandle(GPUHandle &&other) : id(other.id) { other.id = 0; }
+    GPUHandle &operator=(GPUHandle &&other)
+    {
+        if (this != &other)
+        {
+            reset();
+            id = other.id;
+            other.id = 0;
+        }
+        return *this;
+    }
+
+    operator unsigned int() const { return id; }
+    void reset()
+    {
+        if (id)
+            deleteGPUResource(Type, id);
+        id = 0;
+    }
+    unsigned int *replace()
+    {
+        reset();
+        return &id;
+    }
+    unsigned int release() //Hands the object over without deleting it
+    {
+        unsigned int object = id;
+        id = 0;
+        return object;
+    }
+
+private:
+    GPUHandle(const GPUHandle &);
+    GPUHandle &operator=(const GPUHandle &);
+
+    unsigned int id;
+};
+
+typedef GPUHandle<GPU_TEXTURE> TextureHandle;
+typedef GPUHandle<GPU_BUFFER> BufferHandle;
+typedef GPUHandle<GPU_VERTEX_ARRAY> VertexArrayHandle;
+typedef GPUHandle<GPU_FRAMEBUFFER> FramebufferHandle;
+typedef GPUHandle<GPU_PROGRAM> ProgramHandle;
+
+//GPU timing. Queries are read back a few frames late so that asking never stalls the pipeline.
+struct GPUTimer
+{
+    static const int QUERY_COUNT = 4;
+    unsigned int queries[QUERY_COUNT];
+    bool pending[QUERY_COUNT];
+    int next = 0;
+    int oldest = 0;
+    bool running = false;
+    double lastMs = 0.0;
+
+    void init();
+    void release();
+    void begin();
+    void end();
+    double poll(); //Milliseconds of every query finished since the last poll
+};
+
+//Small results copied back from the GPU without waiting on it. Each result is written into the next
+//of a few buffers and fenced, and poll() hands back the newest one the GPU has finished.
+struct GPUReadback
+{
+    static const int BUFFER_COUNT = 3;
+    unsigned int buffers[BUFFER_COUNT];
+    GLsync fences[BUFFER_COUNT];
+    unsigned int size = 0;
+    int next = 0;
+    int oldest = 0;
+
+    void init(unsigned int bytes);
+    void release();
+    unsigned int begin();    //Buffer to write the next result into, or 0 if they're all still in flight
+    void end();              //Call after the commands that write the buffer from begin()
+    bool poll(void *result); //Copies out the newest finished result, if there is one
+};
+
+//Pixels streamed to the GPU without a copy of our own or a stall. Each upload is written straight
+//into the next of a few persistently mapped pixel buffers (GL_ARB_buffer_storage), and fenced so a
+//buffer is only written again once the GPU has finished reading it. Without buffer storage the
+//data goes through plain client memory instead.
+struct GPUUpload
+{
+    static const int BUFFER_COUNT = 3;
+    unsigned int buffers[BUFFER_COUNT];
+    void *mapped[BUFFER_COUNT];
+    GLsync fences[BUFFER_COUNT];
+    unsigned int size = 0;
+    int next = 0;
+    bool persistent = false;
+    std::vector<unsigned char> fallback;
+
+    void init(unsigned int bytes);
+    void release();
+    void *slot();                            //Where to write the next upload, with nothing bound, so it can be filled in over a while
+    void *begin();                           //slot(), with its buffer bound for unpacking
+    const void *pixels(unsigned int offset); //What to hand glTexSubImage2D for the data at offset
+    void end();                              //Call after the glTexSubImage2D calls
+};
 
 //Shaders
 struct ShaderInfo
@@ -39,23 +245,72 @@ struct ShaderInfo
 	const char *vShaderFile;
 	GLenum fTarget;
 	const char *fShaderFile;
+	const char *defines = ""; //Lines of "#define NAME VALUE" placed right after #version in both stages
 };
 
 struct ShaderProgram
 {
     unsigned int programID;
     bool active = false;
+    std::map<std::string, int> uniformLocations;
     void enable();
     void disable();
+    void release(); //Deletes the program
     void setUniform(const char *attributeName, int value);
     void setUniform(const char *attributeName, float value);
     void setUniform(const char *attributeName, Vector2 vec);
     void setUniform(const char *attributeName, Vector3 vec);
     void setUniform(const char *attributeName, Matrix4 matrix);
+    int uniformLocation(const char *attributeName);
 };
 
+//Builds a program specialized with compile-time #defines. Each unique combination of files and defines
+//is compiled once, then handed back from the cache on every later request.
+struct ShaderVariant
+{
+    const char *vShaderFile;
+    const char *fShaderFile;
+    const char *cShaderFile; //Compute shaders stand alone
+    std::map<std::string, std::string> defines; //Sorted, so the same settings always give the same key
+    std::map<std::string, int> samplers; //Set once, right after the program is linked
+
+    ShaderVariant(const char *vertexFile, const char *fragmentFile);
+    ShaderVariant(const char *computeFile);
+    ShaderVariant &define(const char *name);
+    ShaderVariant &define(const char *name, int value);
+    ShaderVariant &define(const char *name, float value);
+    ShaderVariant &define(const char *name, const char *value);
+    ShaderVariant &sampler(const char *name, int textureUnit);
+    std::string defineBlock() const;
+    std::string key() const;
+};
+
+//Linked programs are kept in the disk cache as driver binaries, keyed by their sources and the
+//driver, and loaded from there instead of compiled whenever neither has changed
+struct ProgramCacheStats
+{
+    unsigned int loaded = 0;   //From the cache
+    unsigned int compiled = 0; //From source
+};
+extern bool programBinaryCache; //False compiles every program from source
+
 unsigned int LoadShaders(ShaderInfo shaderInfo);
+unsigned int LoadComputeShader(const char *shaderFile, const char *defines = "");
+ProgramCacheStats getProgramCacheStats();
+ShaderProgram &loadShaderVariant(const ShaderVariant &variant);
+unsigned int shaderVariantCount();
+void releaseShaderVariants(); //Deletes every cached variant. Any references to them are left dangling.
 const char* getShaderProgram(const char *filePath, std::string &shaderProgramText);
+void injectDefines(std::string &shaderProgramText, const char *defines);
+
+//Disk cache. Whatever is slow to build at startup (program binaries, mip chains) is kept in a file
+//under cacheDirectory, keyed by a hash of everything that went into it. A missing, stale or cut
+//short file only means building it again.
+extern std::string cacheDirectory;
+const unsigned long long HASH_SEED = 14695981039346656037ull;
+unsigned long long hashBytes(const void *data, std::size_t size, unsigned long long hash = HASH_SEED); //FNV-1a
+bool readCacheFile(const std::string &name, unsigned long long key, std::vector<unsigned char> &data);
+bool writeCacheFile(const std::string &name, unsigned long long key, const void *data, std::size_t size);
 
 //Geometry
 void newCube(Vector3 position, Vector3 dimensions, unsigned int *VAO, float n = 1.0f);
@@ -0,0 +1,620 @@
+
+#include "cpu_solver.h"
+
+#include <cmath>
+#include <algorithm>
+#include <new>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CPU_SOLVER_SSE2
+#endif
+
+//Carves the next block of the arena into a channel of count floats
+static void carveChannel(MemoryArena &arena, float *&values, std::size_t &count, std::size_t newCount, bool zero)
+{
+    values = arena.allocatePadded<float>(newCount);
+    count = newCount;
+    if (zero)
+        std::fill(values, values + count, 0.0f);
+}
+
+void CPUWaterGrid::resize(int newWidth, int newHeight, bool zero)
+{
+    width = newWidth;
+    height = newHeight;
+    std::size_t cells = (std::size_t)width * height;
+    std::size_t bytes = MemoryArena::paddedBytes(cells * sizeof(float)) * 7;
+    if (bytes > arena.capacity() && !arena.reserve(bytes))
+        throw std::bad_alloc();
+    arena.reset();
+
+    GridChannel *channels[7] = { &velocities, &heights, &masks, &scratchA, &scratchB, &scratchC, &scratchD };
+    for (int c = 0; c < 7; c++)
+        carveChannel(arena, channels[c]->values, channels[c]->count, cells, zero);
+}
+
+CPUWaterGrid::CPUWaterGrid(const CPUWaterGrid &other)
+{
+    copyGridState(other, *this);
+}
+
+CPUWaterGrid &CPUWaterGrid::operator=(const CPUWaterGrid &other)
+{
+    if (this != &other)
+        copyGridState(other, *this);
+    return *this;
+}
+
+//Whole grids, arenas and all, so every channel stays in the arena that holds it
+void CPUWaterGrid::swap(CPUWaterGrid &other)
+{
+    std::swap(width, other.width);
+    std::swap(height, other.height);
+    arena.swap(other.arena);
+    velocities.swap(other.velocities);
+    heights.swap(other.heights);
+    masks.swap(other.masks);
+    scratchA.swap(other.scratchA);
+    scratchB.swap(other.scratchB);
+    scratchC.swap(other.scratchC);
+    scratchD.swap(other.scratchD);
+}
+
+//-----------------------------------------------------------------
+//Explicit solver
+//-----------------------------------------------------------------
+//Cell by cell port of water_physics.frag. The texture there is sampled at texel centers with
+//GL_CLAMP_TO_EDGE, so the neighbours past an edge are the cell itself.
+void stepExplicitCells(const float *v, const float *h, const float *mask, float *newV, float *newH,
+                       int width, int height, int x0, int y0, int x1, int y1, const CPUSolverSettings &settings)
+{
+    const float g = settings.gravity;
+    const float decay = settings.decay;
+
+    for (int y = y0; y < y1; y++)
+    {
+        int up = std::min(y + 1, height - 1);
+        int down = std::max(y - 1, 0);
+        for (int x = x0; x < x1; x++)
+        {
+            int m = y * width + x;
+
+            //Do nothing if we're in a masked area
+            if (mask[m] > 0.0f)
+            {
+                newV[m] = 0.0f;
+                newH[m] = 0.0f;
+                continue;
+            }
+
+            //        [ C ]
+            //   [ A ][ M ][ B ]
+            //        [ D ]
+            //Any cells in the mask zone are seen as equal to m
+            int a = y * width + std::max(x - 1, 0);
+            int b = y * width + std::min(x + 1, width - 1);
+            int c = up * width + x;
+            int d = down * width + x;
+            float ha = (mask[a] >= 0.01f) ? h[m] : h[a];
+            float hb = (mask[b] >= 0.01f) ? h[m] : h[b];
+            float hc = (mask[c] >= 0.01f) ? h[m] : h[c];
+            float hd = (mask[d] >= 0.01f) ? h[m] : h[d];
+
+            float mv = v[m] * decay;
+            float Fm = h[m] * g;
+            float Favg = (ha + hb + hc + hd) * g * 0.25f;
+            mv += Favg - Fm;
+            float mh = std::max(0.0f, h[m] + mv);
+
+            //If the cell's height was reduced to 0, then zero out its velocity
+            newV[m] = (mh > 0.0f) ? mv : 0.0f;
+            newH[m] = mh;
+        }
+    }
+}
+
+void stepExplicit(CPUWaterGrid &grid, const CPUSolverSettings &settings)
+{
+    stepExplicitCells(grid.velocities.data(), grid.heights.data(), grid.masks.data(), grid.scratchA.data(),
+                      grid.scratchB.data(), grid.width, grid.height, 0, 0, grid.width, grid.height, settings);
+    grid.velocities.swap(grid.scratchA);
+    grid.heights.swap(grid.scratchB);
+}
+
+//-----------------------------------------------------------------
+//Implicit solver
+//-----------------------------------------------------------------
+//Shrink the explicit step to nothing and the model is a damped wave equation, in explicit steps:
+//    dv/dt = -lambda v - g L h,    dh/dt = v
+//with lambda = -ln(decay), and L h = h - the average of the neighbours under the explicit solver's
+//edge and barrier rules. Every wave of L is a damped oscillator with a closed form, so a step of any
+//length can be taken exactly by applying functions of L to L h and v. Those are fitted with Chebyshev
+//series and run with Clenshaw's recurrence, one neighbour sweep per term. Waves neither lag nor
+//blow up, whatever the rate. The terms grow with the step (5 at 240 steps a second, 8 at 60), and a
+//step that would need too many is split.
+
+//Fits the series over L's whole range, [0, 2], dropping terms below tolerance. Returns false if it
+//needs more than MAX_TERMS. The sums at L = 0 are then pinned to their exact values, so still water
+//stays still and the volume only changes as the explicit solver's does, by the sum of v.
+static bool fitImplicitSeries(float gravity, float decay, double steps, double tolerance, ImplicitSeries &series)
+{
+    const int nodes = 2 * ImplicitSeries::MAX_TERMS;
+    const double pi = 3.14159265358979323846;
+    double g = gravity;
+    double mu = -std::log((double)decay) * 0.5;
+    double damping = std::exp(-mu * steps);
+
+    //At each node, y = g L, and the oscillator's frequency is sqrt(y - mu^2)
+    double values[4][nodes];
+    double x[nodes];
+    for (int j = 0; j < nodes; j++)
+    {
+        x[j] = std::cos(pi * (j + 0.5) / nodes);
+        double y = g * (1.0 + x[j]);
+        double w2 = y - mu * mu;
+        double cs, sn;
+        if (w2 > 0.0)
+        {
+            double w = std::sqrt(w2);
+            cs = std::cos(w * steps);
+            sn = std::sin(w * steps) / w;
+        }
+        else if (w2 < 0.0)
+        {
+            double w = std::sqrt(-w2);
+            cs = std::cosh(w * steps);
+            sn = std::sinh(w * steps) / w;
+        }
+        else
+        {
+            cs = 1.0;
+            sn = steps;
+        }
+        values[0][j] = g * (damping * (cs + mu * sn) - 1.0) / y;
+        values[1][j] = damping * sn;
+        values[2][j] = -g * damping * sn;
+        values[3][j] = damping * (cs - mu * sn);
+    }
+
+    //The polynomials at the nodes, T(k) = 2 x T(k - 1) - T(k - 2)
+    double coefficients[4][ImplicitSeries::MAX_TERMS];
+    double previous[nodes], current[nodes];
+    std::fill(previous, previous + nodes, 0.0);
+    std::fill(current, current + nodes, 1.0);
+    series.terms = 1;
+    for (int k = 0; k < ImplicitSeries::MAX_TERMS; k++)
+    {
+        for (int f = 0; f < 4; f++)
+        {
+            double sum = 0.0;
+            for (int j = 0; j < nodes; j++)
+                sum += values[f][j] * current[j];
+            coefficients[f][k] = sum * (k == 0 ? 1.0 : 2.0) / nodes;
+            if (std::fabs(coefficients[f][k]) > tolerance)
+                series.terms = k + 1;
+        }
+        for (int j = 0; j < nodes; j++)
+        {
+            double next = (k == 0) ? x[j] : 2.0 * x[j] * current[j] - previous[j];
+            previous[j] = current[j];
+            current[j] = next;
+        }
+    }
+
+    //hv and vv at L = 0. hl and vl only ever see L h, which is 0 there.
+    double still[2] = { (mu > 0.0) ? (1.0 - damping * damping) / (2.0 * mu) : steps, damping * damping };
+    for (int f = 1; f < 4; f += 2)
+    {
+        double atZero = 0.0;
+        for (int k = 0; k < series.terms; k++)
+            atZero += (k % 2 == 0) ? coefficients[f][k] : -coefficients[f][k];
+        coefficients[f][0] += still[f / 2] - atZero;
+    }
+
+    float *outputs[4] = { series.hl, series.hv, series.vl, series.vv };
+    for (int f = 0; f < 4; f++)
+        for (int k = 0; k < series.terms; k++)
+            outputs[f][k] = (float)coefficients[f][k];
+    return series.terms < ImplicitSeries::MAX_TERMS;
+}
+
+//One term of Clenshaw's recurrence, with L - 1 = -average as its variable:
+//    q = c L h + d v - factor * 4 average(p) - q
+//where factor is 1/2, or 1/4 for the last one run (k = 0). For term k, p holds term k + 1 and q comes
+//in holding term k + 2, which it's overwritten with.
+struct ImplicitTerm
+{
+    const float *h, *v, *mask, *pH, *pV;
+    float *qH, *qV;
+    float hl, hv, vl, vv, factor;
+};
+
+//Cells [x0, x1) of one row, whose neighbours are offset by left, right, up and down. Barriers count
+//as the cell itself, as in the explicit solver, and hold 0 in p and q. Uses SSE2 where it's available.
+static void implicitRow(const ImplicitTerm &t, int row, int x0, int x1, int left, int right, int up, int down)
+{
+    const float *h = t.h + row;
+    const float *v = t.v + row;
+    const float *mask = t.mask + row;
+    const float *pH = t.pH + row;
+    const float *pV = t.pV + row;
+    float *qH = t.qH + row;
+    float *qV = t.qV + row;
+    int x = x0;
+#ifdef CPU_SOLVER_SSE2
+    const __m128 blocking = _mm_set1_ps(0.01f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 quarter = _mm_set1_ps(0.25f);
+    const __m128 hl = _mm_set1_ps(t.hl), hv = _mm_set1_ps(t.hv);
+    const __m128 vl = _mm_set1_ps(t.vl), vv = _mm_set1_ps(t.vv);
+    const __m128 factor = _mm_set1_ps(t.factor);
+    for (; x + 4 <= x1; x += 4)
+    {
+        __m128 ba = _mm_cmpge_ps(_mm_loadu_ps(mask + x + left), blocking);
+        __m128 bb = _mm_cmpge_ps(_mm_loadu_ps(mask + x + right), blocking);
+        __m128 bc = _mm_cmpge_ps(_mm_loadu_ps(mask + x + up), blocking);
+        __m128 bd = _mm_cmpge_ps(_mm_loadu_ps(mask + x + down), blocking);
+        __m128 blocked = _mm_add_ps(_mm_add_ps(_mm_and_ps(ba, one), _mm_and_ps(bb, one)),
+                                    _mm_add_ps(_mm_and_ps(bc, one), _mm_and_ps(bd, one)));
+        __m128 hm = _mm_loadu_ps(h + x);
+        __m128 neighbours = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(ba, _mm_loadu_ps(h + x + left)),
+                                                  _mm_andnot_ps(bb, _mm_loadu_ps(h + x + right))),
+                                       _mm_add_ps(_mm_andnot_ps(bc, _mm_loadu_ps(h + x + up)),
+                                                  _mm_andnot_ps(bd, _mm_loadu_ps(h + x + down))));
+        __m128 laplacian = _mm_sub_ps(hm, _mm_mul_ps(quarter, _mm_add_ps(neighbours, _mm_mul_ps(blocked, hm))));
+        __m128 sumH = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(pH + x + left), _mm_loadu_ps(pH + x + right)),
+                                 _mm_add_ps(_mm_loadu_ps(pH + x + up), _mm_loadu_ps(pH + x + down)));
+        __m128 sumV = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(pV + x + left), _mm_loadu_ps(pV + x + right)),
+                                 _mm_add_ps(_mm_loadu_ps(pV + x + up), _mm_loadu_ps(pV + x + down)));
+        sumH = _mm_add_ps(sumH, _mm_mul_ps(blocked, _mm_loadu_ps(pH + x)));
+        sumV = _mm_add_ps(sumV, _mm_mul_ps(blocked, _mm_loadu_ps(pV + x)));
+        __m128 vm = _mm_loadu_ps(v + x);
+        __m128 newH = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(hl, laplacian), _mm_mul_ps(hv, vm)),
+                                 _mm_add_ps(_mm_mul_ps(factor, sumH), _mm_loadu_ps(qH + x)));
+        __m128 newV = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(vl, laplacian), _mm_mul_ps(vv, vm)),
+                                 _mm_add_ps(_mm_mul_ps(factor, sumV), _mm_loadu_ps(qV + x)));
+        __m128 open = _mm_cmple_ps(_mm_loadu_ps(mask + x), zero);
+        _mm_storeu_ps(qH + x, _mm_and_ps(open, newH));
+        _mm_storeu_ps(qV + x, _mm_and_ps(open, newV));
+    }
+#endif
+    for (; x < x1; x++)
+    {
+        if (mask[x] > 0.0f)
+        {
+            qH[x] = 0.0f;
+            qV[x] = 0.0f;
+            continue;
+        }
+
+        float ha = (mask[x + left] >= 0.01f) ? h[x] : h[x + left];
+        float hb = (mask[x + right] >= 0.01f) ? h[x] : h[x + right];
+        float hc = (mask[x + up] >= 0.01f) ? h[x] : h[x + up];
+        float hd = (mask[x + down] >= 0.01f) ? h[x] : h[x + down];
+        float blocked = (float)((mask[x + left] >= 0.01f) + (mask[x + right] >= 0.01f) +
+                                (mask[x + up] >= 0.01f) + (mask[x + down] >= 0.01f));
+        float laplacian = h[x] - (ha + hb + hc + hd) * 0.25f;
+        float sumH = pH[x + left] + pH[x + right] + pH[x + up] + pH[x + down] + blocked * pH[x];
+        float sumV = pV[x + left] + pV[x + right] + pV[x + up] + pV[x + down] + blocked * pV[x];
+        qH[x] = t.hl * laplacian + t.hv * v[x] - (t.factor * sumH + qH[x]);
+        qV[x] = t.vl * laplacian + t.vv * v[x] - (t.factor * sumV + qV[x]);
+    }
+}
+
+static void implicitTerm(const ImplicitTerm &term, int width, int height)
+{
+    for (int y = 0; y < height; y++)
+    {
+        int row = y * width;
+        int up = (std::min(y + 1, height - 1) - y) * width;
+        int down = (std::max(y - 1, 0) - y) * width;
+        if (width == 1)
+        {
+            implicitRow(term, row, 0, 1, 0, 0, up, down);
+            continue;
+        }
+        implicitRow(term, row, 0, 1, 0, 1, up, down);
+        implicitRow(term, row, 1, width - 1, -1, 1, up, down);
+        implicitRow(term, row, width - 1, width, -1, 0, up, down);
+    }
+}
+
+//Sum of values over the cell's neighbours, leaving out the edges
+static float sumNeighbours(const CPUWaterGrid &grid, const float *values, int x, int y)
+{
+    float sum = 0.0f;
+    if (x > 0)
+        sum += values[grid.index(x - 1, y)];
+    if (x < grid.width - 1)
+        sum += values[grid.index(x + 1, y)];
+    if (y > 0)
+        sum += values[grid.index(x, y - 1)];
+    if (y < grid.height - 1)
+        sum += values[grid.index(x, y + 1)];
+    return sum;
+}
+
+//A step can leave a cell below zero where a trough is deeper than its water. Clamping it back up
+//would add water, so instead it borrows what it's short from its neighbours, each giving the same
+//share of its water. What they can't cover, out past the edge of the water, is taken off every wet
+//cell in proportion to its depth, so the volume never changes. Velocities are left alone: they sum
+//to zero, and zeroing the dry ones as the explicit solver does would let the volume creep up.
+static void repayOverdrafts(CPUWaterGrid &grid, float *water, float *share)
+{
+    float *h = &grid.heights[0];
+    const float *mask = &grid.masks[0];
+    double volume = 0.0;
+    for (std::size_t m = 0; m < grid.heights.size(); m++)
+    {
+        volume += h[m];
+        water[m] = (mask[m] >= 0.01f) ? 0.0f : std::max(h[m], 0.0f);
+    }
+
+    for (int y = 0; y < grid.height; y++)
+    {
+        for (int x = 0; x < grid.width; x++)
+        {
+            int m = grid.index(x, y);
+            float available = (h[m] < 0.0f) ? sumNeighbours(grid, water, x, y) : 0.0f;
+            share[m] = (available > 0.0f) ? std::min(-h[m] / available, 1.0f) : 0.0f;
+        }
+    }
+
+    double wet = 0.0;
+    for (int y = 0; y < grid.height; y++)
+    {
+        for (int x = 0; x < grid.width; x++)
+        {
+            int m = grid.index(x, y);
+            h[m] = std::max(h[m], 0.0f) * std::max(1.0f - sumNeighbours(grid, share, x, y), 0.0f);
+            wet += h[m];
+        }
+    }
+
+    if (wet <= 0.0)
+        return;
+    float scale = (float)std::max(volume / wet, 0.0);
+    for (std::size_t m = 0; m < grid.heights.size(); m++)
+        h[m] *= scale;
+}
+
+//The terms run from the last to the first, each pair of scratch channels taking its turn as p and q
+static void stepImplicitSeries(CPUWaterGrid &grid, const ImplicitSeries &series)
+{
+    std::size_t cells = grid.heights.size();
+    float *h = &grid.heights[0];
+    float *v = &grid.velocities[0];
+    const float *mask = &grid.masks[0];
+    float *pH = &grid.scratchA[0], *pV = &grid.scratchB[0];
+    float *qH = &grid.scratchC[0], *qV = &grid.scratchD[0];
+    std::fill(pH, pH + cells, 0.0f);
+    std::fill(pV, pV + cells, 0.0f);
+    std::fill(qH, qH + cells, 0.0f);
+    std::fill(qV, qV + cells, 0.0f);
+    for (int k = series.terms - 1; k >= 0; k--)
+    {
+        ImplicitTerm term = { h, v, mask, pH, pV, qH, qV, series.hl[k], series.hv[k], series.vl[k], series.vv[k],
+                              (k == 0) ? 0.25f : 0.5f };
+        implicitTerm(term, grid.width, grid.height);
+        std::swap(pH, qH);
+        std::swap(pV, qV);
+    }
+
+    bool overdrawn = false;
+    for (std::size_t m = 0; m < cells; m++)
+    {
+        bool open = !(mask[m] > 0.0f);
+        h[m] = open ? h[m] + pH[m] : 0.0f;
+        v[m] = open ? pV[m] : 0.0f;
+        overdrawn = overdrawn || h[m] < 0.0f;
+    }
+    if (overdrawn)
+        repayOverdrafts(grid, qH, qV);
+}
+
+int implicitSeries(const CPUSolverSettings &settings, float stepsPerSecond, ImplicitSeries &series)
+{
+    double steps = EXPLICIT_STEPS_PER_SECOND / stepsPerSecond;
+    int parts = 1;
+    while (!fitImplicitSeries(settings.gravity, settings.decay, steps / parts, 1e-6, series))
+        parts *= 2;
+    return parts;
+}
+
+void stepImplicit(CPUWaterGrid &grid, const CPUSolverSettings &settings, float stepsPerSecond)
+{
+    if (grid.width <= 0 || grid.height <= 0)
+        return;
+    ImplicitSeries series;
+    int parts = implicitSeries(settings, stepsPerSecond, series);
+    for (int part = 0; part < parts; part++)
+        stepImplicitSeries(grid, series);
+}
+
+//-----------------------------------------------------------------
+//Diagnostics
+//-----------------------------------------------------------------
+//Four cells at a time within a row. Each row is summed in floats and then added up in doubles,
+//which keeps the totals accurate on big grids.
+WaterDiagnostics reduceDiagnostics(const CPUWaterGrid &grid)
+{
+    double volume = 0.0;
+    double kineticEnergy = 0.0;
+    double activeCells = 0.0;
+    float maxVelocity = 0.0f;
+
+    for (int y = 0; y < grid.height; y++)
+    {
+        const float *v = &grid.velocities[grid.index(0, y)];
+        const float *h = &grid.heights[grid.index(0, y)];
+        float rowVolume = 0.0f;
+        float rowEnergy = 0.0f;
+        float rowActive = 0.0f;
+        int x = 0;
+#ifdef CPU_SOLVER_SSE2
+        __m128 volumeSum = _mm_setzero_ps();
+        __m128 energySum = _mm_setzero_ps();
+        __m128 activeSum = _mm_setzero_ps();
+        __m128 velocityMax = _mm_setzero_ps();
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        const __m128 threshold = _mm_set1_ps(ACTIVE_VELOCITY);
+        const __m128 one = _mm_set1_ps(1.0f);
+        for (; x + 4 <= grid.width; x += 4)
+        {
+            __m128 velocity = _mm_loadu_ps(v + x);
+            __m128 speed = _mm_andnot_ps(signMask, velocity);
+            volumeSum = _mm_add_ps(volumeSum, _mm_loadu_ps(h + x));
+            energySum = _mm_add_ps(energySum, _mm_mul_ps(velocity, velocity));
+            activeSum = _mm_add_ps(activeSum, _mm_and_ps(_mm_cmpgt_ps(speed, threshold), one));
+            velocityMax = _mm_max_ps(velocityMax, speed);
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, volumeSum);
+        rowVolume = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        _mm_storeu_ps(lanes, energySum);
+        rowEnergy = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        _mm_storeu_ps(lanes, activeSum);
+        rowActive = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        _mm_storeu_ps(lanes, velocityMax);
+        maxVelocity = std::max(maxVelocity, std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3])));
+#endif
+        for (; x < grid.width; x++)
+        {
+            float speed = std::fabs(v[x]);
+            rowVolume += h[x];
+            rowEnergy += v[x] * v[x];
+            rowActive += (speed > ACTIVE_VELOCITY) ? 1.0f : 0.0f;
+            maxVelocity = std::max(maxVelocity, speed);
+        }
+        volume += rowVolume;
+        kineticEnergy += rowEnergy;
+        activeCells += rowActive;
+    }
+
+    WaterDiagnostics diagnostics;
+    diagnostics.volume = (float)volume;
+    diagnostics.kineticEnergy = (float)(kineticEnergy * 0.5);
+    diagnostics.maxVelocity = maxVelocity;
+    diagnostics.activeCells = (float)activeCells;
+    return diagnostics;
+}
+
+//-----------------------------------------------------------------
+//Injecting, sampling and resampling
+//-----------------------------------------------------------------
+void injectWater(CPUWaterGrid &grid, float x, float y, float radius, float amount)
+{
+    int minX = std::max(0, (int)std::floor((x - radius) * grid.width));
+    int maxX = std::min(grid.width - 1, (int)std::ceil((x + radius) * grid.width));
+    int minY = std::max(0, (int)std::floor((y - radius) * grid.height));
+    int maxY = std::min(grid.height - 1, (int)std::ceil((y + radius) * grid.height));
+    for (int cellY = minY; cellY <= maxY; cellY++)
+    {
+        for (int cellX = minX; cellX <= maxX; cellX++)
+        {
+            int i = grid.index(cellX, cellY);
+            float dx = (cellX + 0.5f) / grid.width - x;
+            float dy = (cellY + 0.5f) / grid.height - y;
+            if (grid.masks[i] > 0.0f || dx * dx + dy * dy > radius * radius)
+                continue;
+            grid.heights[i] = std::max(0.0f, grid.heights[i] + amount);
+        }
+    }
+}
+
+void sampleGrid(const CPUWaterGrid &grid, float x, float y, float *velocity, float *height)
+{
+    //Texel centers are at (i + 0.5) / size, like GL_LINEAR with GL_CLAMP_TO_EDGE
+    float cellX = std::min(std::max(x * grid.width - 0.5f, 0.0f), (float)(grid.width - 1));
+    float cellY = std::min(std::max(y * grid.height - 0.5f, 0.0f), (float)(grid.height - 1));
+    int x0 = (int)cellX;
+    int y0 = (int)cellY;
+    int x1 = std::min(x0 + 1, grid.width - 1);
+    int y1 = std::min(y0 + 1, grid.height - 1);
+    float fx = cellX - x0;
+    float fy = cellY - y0;
+
+    const GridChannel *channels[2] = { &grid.velocities, &grid.heights };
+    float *results[2] = { velocity, height };
+    for (int c = 0; c < 2; c++)
+    {
+        const GridChannel &values = *channels[c];
+        float bottom = values[grid.index(x0, y0)] + (values[grid.index(x1, y0)] - values[grid.index(x0, y0)]) * fx;
+        float top = values[grid.index(x0, y1)] + (values[grid.index(x1, y1)] - values[grid.index(x0, y1)]) * fx;
+        if (results[c])
+            *results[c] = bottom + (top - bottom) * fy;
+    }
+}
+
+void resampleGrid(const CPUWaterGrid &source, CPUWaterGrid &target)
+{
+    float scaleX = (float)source.width / target.width;
+    float scaleY = (float)source.height / target.height;
+    for (int y = 0; y < target.height; y++)
+    {
+        for (int x = 0; x < target.width; x++)
+        {
+            int i = target.index(x, y);
+            target.masks[i] = 0.0f;
+            if (scaleX <= 1.0f && scaleY <= 1.0f)
+            {
+                sampleGrid(source, (x + 0.5f) / target.width, (y + 0.5f) / target.height,
+                           &target.velocities[i], &target.heights[i]);
+                continue;
+            }
+
+            //Every source cell whose center is inside this cell
+            int minX = (int)std::floor(x * scaleX);
+            int maxX = std::max(minX, (int)std::ceil((x + 1) * scaleX) - 1);
+            int minY = (int)std::floor(y * scaleY);
+            int maxY = std::max(minY, (int)std::ceil((y + 1) * scaleY) - 1);
+            maxX = std::min(maxX, source.width - 1);
+            maxY = std::min(maxY, source.height - 1);
+            float velocity = 0.0f;
+            float height = 0.0f;
+            for (int sourceY = minY; sourceY <= maxY; sourceY++)
+            {
+                for (int sourceX = minX; sourceX <= maxX; sourceX++)
+                {
+                    velocity += source.velocities[source.index(sourceX, sourceY)];
+                    height += source.heights[source.index(sourceX, sourceY)];
+                }
+            }
+            float count = (float)((maxX - minX + 1) * (maxY - minY + 1));
+            target.velocities[i] = velocity / count;
+            target.heights[i] = height / count;
+        }
+    }
+}
+
+void copyGridState(const CPUWaterGrid &source, CPUWaterGrid &target)
+{
+    if (target.width != source.width || target.height != source.height)
+        target.resize(source.width, source.height);
+    std::copy(source.velocities.begin(), source.velocities.end(), target.velocities.begin());
+    std::copy(source.heights.begin(), source.heights.end(), target.heights.begin());
+    std::copy(source.masks.begin(), source.masks.end(), target.masks.begin());
+}
+
+void applyMask(CPUWaterGrid &grid, const unsigned char *mask)
+{
+    for (std::size_t i = 0; i < grid.masks.size(); i++)
+    {
+        grid.masks[i] = mask ? mask[i] / 255.0f : 0.0f;
+        if (grid.masks[i] > 0.0f)
+        {
+            grid.velocities[i] = 0.0f;
+            grid.heights[i] = 0.0f;
+        }
+    }
+}
+
+void resizeGrid(CPUWaterGrid &grid, int width, int height)
+{
+    CPUWaterGrid resized;
+    resized.resize(width, height);
+    resampleGrid(grid, resized);
+    grid.swap(resized);
+}
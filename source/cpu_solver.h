@@ -0,0 +1,161 @@
+#ifndef _CPU_SOLVER_H_
+#define _CPU_SOLVER_H_
+
+//CPU versions of the water physics. They use the same model and the same units as the shaders,
+//so results can be compared (or swapped) with the GPU directly. Nothing in here touches OpenGL.
+
+#include "memory_arena.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+//Rate the explicit solver's constants were tuned for (physics_dt in main.cpp)
+const float EXPLICIT_STEPS_PER_SECOND = 750.0f;
+
+//Default rate for the implicit solver, one step a frame. Its steps are exact whatever their length, so
+//it's as accurate at 60 steps a second as at 240 (half the explicit solver's error against a finer
+//reference, benchmarks/solver_error.cpp). Each step costs more the longer it is, but on the CPU 60 a
+//second is about a third of the explicit solver's cost per simulated second.
+const float IMPLICIT_STEPS_PER_SECOND = 60.0f;
+
+//Cells moving faster than this (per explicit step) count as active
+const float ACTIVE_VELOCITY = 0.0001f;
+
+struct CPUSolverSettings
+{
+    float gravity = 0.1f;  //Same as GRAVITY in water_physics.frag
+    float decay = 0.998f;  //Same as DECAY, per explicit step
+};
+
+//One channel of a CPUWaterGrid: a block of the grid's arena, indexed like the std::vector it used to
+//be. It never allocates, and only the grid can point it somewhere else.
+class GridChannel
+{
+public:
+    GridChannel() : values(NULL), count(0) {}
+
+    float &operator[](std::size_t i) { return values[i]; }
+    const float &operator[](std::size_t i) const { return values[i]; }
+    float *data() { return values; }
+    const float *data() const { return values; }
+    float *begin() { return values; }
+    const float *begin() const { return values; }
+    float *end() { return values + count; }
+    const float *end() const { return values + count; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    //Both have to be in the same grid
+    void swap(GridChannel &other)
+    {
+        std::swap(values, other.values);
+        std::swap(count, other.count);
+    }
+
+private:
+    friend struct CPUWaterGrid;
+    GridChannel(const GridChannel &);
+    GridChannel &operator=(const GridChannel &);
+
+    float *values;
+    std::size_t count;
+};
+
+//Same layout as a height texture, split into one array per channel. Row major, width * height cells.
+//Every channel lives in one MemoryArena owned by the grid, each on its own cache line.
+struct CPUWaterGrid
+{
+    int width = 0;
+    int height = 0;
+    GridChannel velocities; //Red channel. Always per explicit (1/750 s) step.
+    GridChannel heights;    //Green channel
+    GridChannel masks;      //Blue channel. Anything above 0 is a barrier.
+
+    //Scratch space so that stepping never has to allocate
+    GridChannel scratchA;
+    GridChannel scratchB;
+    GridChannel scratchC;   //Only stepImplicit() uses C and D
+    GridChannel scratchD;
+
+    CPUWaterGrid() {}
+    CPUWaterGrid(const CPUWaterGrid &other);
+    CPUWaterGrid &operator=(const CPUWaterGrid &other);
+
+    //Zeroes every channel. The pages are first touched here, so the thread that steps a grid should
+    //be the one that sizes it. Only maps new memory if the old won't fit. Without zero, the channels
+    //are left untouched for the caller to zero (CPUStepper::prepare() spreads that over its threads).
+    void resize(int newWidth, int newHeight, bool zero = true);
+    void swap(CPUWaterGrid &other);
+    int index(int x, int y) const { return y * width + x; }
+
+    //Where the memory came from, for benchmarks and logging
+    const MemoryArena &memory() const { return arena; }
+
+private:
+    MemoryArena arena;
+};
+
+//Totals over a grid, for watching drift and activity. Same layout as the output of water_reduce.comp.
+struct WaterDiagnostics
+{
+    float volume = 0.0f;        //Sum of heights
+    float kineticEnergy = 0.0f; //Sum of velocity squared / 2
+    float maxVelocity = 0.0f;   //Largest absolute velocity
+    float activeCells = 0.0f;   //Cells moving faster than ACTIVE_VELOCITY
+};
+
+//One step of water_physics.frag
+void stepExplicit(CPUWaterGrid &grid, const CPUSolverSettings &settings);
+
+//stepExplicit() for the cells in [x0, x1) x [y0, y1) of a width x height grid's channels, written to
+//newV and newH. Neighbours are clamped to the grid, as they are there. CPUStepper tiles with it.
+void stepExplicitCells(const float *v, const float *h, const float *mask, float *newV, float *newH,
+                       int width, int height, int x0, int y0, int x1, int y1, const CPUSolverSettings &settings);
+
+//One step of water_implicit.comp, covering 1/stepsPerSecond seconds. Takes the limit of stepExplicit()
+//as its steps shrink, exactly over the whole step, so it's stable at any rate. Keeps the volume: a cell
+//a trough takes below zero borrows from the water around it rather than being clamped.
+void stepImplicit(CPUWaterGrid &grid, const CPUSolverSettings &settings, float stepsPerSecond);
+
+//Coefficients of the Chebyshev series an implicit step runs, the same on the CPU and the GPU. With
+//L h = h - the average of the neighbours (barriers counting as the cell itself):
+//    h += hl(L) L h + hv(L) v,    v = vl(L) L h + vv(L) v
+struct ImplicitSeries
+{
+    static const int MAX_TERMS = 48;
+    int terms;
+    float hl[MAX_TERMS];
+    float hv[MAX_TERMS];
+    float vl[MAX_TERMS];
+    float vv[MAX_TERMS];
+};
+
+//The series for one step at stepsPerSecond. Returns how many times to run it to cover that step,
+//usually 1, more if it was split to keep the series under MAX_TERMS.
+int implicitSeries(const CPUSolverSettings &settings, float stepsPerSecond, ImplicitSeries &series);
+
+//Same numbers as water_reduce.comp. Uses SSE2 where it's available.
+WaterDiagnostics reduceDiagnostics(const CPUWaterGrid &grid);
+
+//The brush from water_physics.frag: adds amount to the height of every open cell within radius of
+//(x, y). Positions are texture coordinates, (0, 0) to (1, 1).
+void injectWater(CPUWaterGrid &grid, float x, float y, float radius, float amount);
+
+//Bilinear sample of velocity (x) and height (y) at a position in texture coordinates, clamped to the edges
+void sampleGrid(const CPUWaterGrid &grid, float x, float y, float *velocity, float *height);
+
+//Copies source into target, which already has its new size. Shrinking averages every source cell
+//under a target cell, growing is bilinear, like resample_shader.frag. Masks are not copied.
+void resampleGrid(const CPUWaterGrid &source, CPUWaterGrid &target);
+
+//Copies velocities, heights and masks, resizing target to match if it has to
+void copyGridState(const CPUWaterGrid &source, CPUWaterGrid &target);
+
+//width * height bytes, nonzero is a barrier (and loses its water). NULL clears every barrier.
+void applyMask(CPUWaterGrid &grid, const unsigned char *mask);
+
+//resampleGrid() in place. The masks are cleared.
+void resizeGrid(CPUWaterGrid &grid, int width, int height);
+
+#endif // _CPU_SOLVER_H_
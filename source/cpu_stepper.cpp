@@ -0,0 +1,460 @@
+#include "cpu_stepper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <thread>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+CPUStepper::CPUStepper() : grid(NULL), solver(NULL), blockSteps(1), tilesX(0), tileCount(0), tileWidth(0), tileHeight(0),
+                           velocityCopy(NULL), heightCopy(NULL)
+{
+}
+
+CPUStepper::~CPUStepper()
+{
+    release();
+}
+
+void CPUStepper::init(const CPUStepTuning &tuning)
+{
+    release();
+    settings = tuning;
+    settings.threads = std::max(settings.threads, 1);
+    settings.blockSteps = std::max(settings.blockSteps, 1);
+    settings.tileHeight = std::max(settings.tileHeight, 1);
+    settings.tileWidth = std::max(settings.tileWidth, 0);
+
+    for (int i = 0; i < settings.threads; i++)
+        scratch.push_back(new MemoryArena());
+    pool.start(settings.threads);
+}
+
+void CPUStepper::release()
+{
+    pool.stop();
+    for (std::size_t i = 0; i < scratch.size(); i++)
+        delete scratch[i];
+    scratch.clear();
+}
+
+//Tiles are numbered row by row, so each thread's run of them is a band of whole rows where it can be
+void CPUStepper::layoutTiles(int width, int height)
+{
+    tileWidth = settings.tileWidth > 0 ? std::min(settings.tileWidth, width) : width;
+    tileHeight = std::min(settings.tileHeight, height);
+    tilesX = (width + tileWidth - 1) / tileWidth;
+    tileCount = tilesX * ((height + tileHeight - 1) / tileHeight);
+}
+
+void CPUStepper::prepare(CPUWaterGrid &water, int width, int height)
+{
+    if (scratch.empty())
+        init(settings);
+    water.resize(width, height, false);
+    if (width <= 0 || height <= 0)
+        return;
+    grid = &water;
+    layoutTiles(width, height);
+    pool.parallel(tileCount, zeroTask, this);
+}
+
+void CPUStepper::resize(CPUWaterGrid &water, int width, int height)
+{
+    CPUWaterGrid resized;
+    prepare(resized, width, height);
+    resampleGrid(water, resized);
+    water.swap(resized);
+}
+
+bool CPUStepper::startBlocks(CPUWaterGrid &water, const CPUSolverSettings &solverSettings)
+{
+    if (water.width <= 0 || water.height <= 0)
+        return false;
+    if (scratch.empty())
+        init(settings);
+    grid = &water;
+    solver = &solverSettings;
+    velocityCopy = NULL;
+    heightCopy = NULL;
+    layoutTiles(water.width, water.height);
+    return true;
+}
+
+void CPUStepper::runBlock(int steps)
+{
+    blockSteps = steps;
+    pool.parallel(tileCount, stepTask, this);
+    grid->velocities.swap(grid->scratchA);
+    grid->heights.swap(grid->scratchB);
+}
+
+void CPUStepper::step(CPUWaterGrid &water, const CPUSolverSettings &solverSettings, int steps)
+{
+    step(water, solverSettings, steps, NULL, NULL);
+}
+
+void CPUStepper::step(CPUWaterGrid &water, const CPUSolverSettings &solverSettings, int steps, float *velocities, float *heights)
+{
+    if (!startBlocks(water, solverSettings))
+        return;
+    for (int done = 0; done < steps; done += blockSteps)
+    {
+        if (done + settings.blockSteps >= steps)
+        {
+            velocityCopy = velocities;
+            heightCopy = heights;
+        }
+        runBlock(std::min(settings.blockSteps, steps - done));
+    }
+    velocityCopy = NULL;
+    heightCopy = NULL;
+}
+
+//The steps are spread as evenly as they go over the blocks
+void CPUStepper::stepInPlace(CPUWaterGrid &water, const CPUSolverSettings &solverSettings, int steps)
+{
+    if (steps <= 0 || !startBlocks(water, solverSettings))
+        return;
+    int blocks = (steps + settings.blockSteps - 1) / settings.blockSteps;
+    if (blocks % 2 == 1 && steps > 1)
+        blocks++;
+    for (int i = 0; i < blocks; i++)
+        runBlock((int)((long long)steps * (i + 1) / blocks - (long long)steps * i / blocks));
+}
+
+void CPUStepper::stepTask(void *context, int thread, int begin, int end)
+{
+    CPUStepper &stepper = *(CPUStepper *)context;
+    for (int tile = begin; tile < end; tile++)
+        stepper.stepTile(thread, tile);
+}
+
+void CPUStepper::zeroTask(void *context, int /*thread*/, int begin, int end)
+{
+    CPUStepper &stepper = *(CPUStepper *)context;
+    for (int tile = begin; tile < end; tile++)
+        stepper.zeroTile(tile);
+}
+
+//All seven channels, over the tile's own cells
+void CPUStepper::zeroTile(int tile)
+{
+    CPUWaterGrid &water = *grid;
+    int x0 = (tile % tilesX) * tileWidth;
+    int y0 = (tile / tilesX) * tileHeight;
+    int x1 = std::min(x0 + tileWidth, water.width);
+    int y1 = std::min(y0 + tileHeight, water.height);
+    GridChannel *channels[7] = { &water.velocities, &water.heights, &water.masks, &water.scratchA, &water.scratchB,
+                                 &water.scratchC, &water.scratchD };
+    for (int c = 0; c < 7; c++)
+        for (int y = y0; y < y1; y++)
+            std::fill(&(*channels[c])[water.index(x0, y)], &(*channels[c])[water.index(x0, y)] + (x1 - x0), 0.0f);
+}
+
+//One tile through the whole block. Reads the grid's channels and writes its own cells of scratchA and
+//scratchB, which the block swaps in once every tile is done, and of the copies if there are any.
+void CPUStepper::stepTile(int index, int tile)
+{
+    CPUWaterGrid &water = *grid;
+    int x0 = (tile % tilesX) * tileWidth;
+    int y0 = (tile / tilesX) * tileHeight;
+    int x1 = std::min(x0 + tileWidth, water.width);
+    int y1 = std::min(y0 + tileHeight, water.height);
+    int k = blockSteps;
+    if (k == 1)
+    {
+        stepExplicitCells(water.velocities.data(), water.heights.data(), water.masks.data(), water.scratchA.data(),
+                          water.scratchB.data(), water.width, water.height, x0, y0, x1, y1, *solver);
+        for (int y = y0; velocityCopy && y < y1; y++)
+        {
+            std::size_t row = (std::size_t)y * water.width + x0;
+            std::copy(&water.scratchA[row], &water.scratchA[row] + (x1 - x0), velocityCopy + row);
+            std::copy(&water.scratchB[row], &water.scratchB[row] + (x1 - x0), heightCopy + row);
+        }
+        return;
+    }
+
+    //The tile and k cells around it, as far as the grid goes. At the grid's edges the window's edges
+    //are the grid's, so clamping there is the same; everywhere else the cells that clamp are never
+    //read by the step after.
+    int windowX0 = std::max(x0 - k, 0);
+    int windowY0 = std::max(y0 - k, 0);
+    int windowX1 = std::min(x1 + k, water.width);
+    int windowY1 = std::min(y1 + k, water.height);
+    int windowWidth = windowX1 - windowX0;
+    int windowHeight = windowY1 - windowY0;
+    std::size_t cells = (std::size_t)windowWidth * windowHeight;
+
+    MemoryArena &arena = *scratch[index];
+    std::size_t bytes = MemoryArena::paddedBytes(cells * sizeof(float)) * 5;
+    if (bytes > arena.capacity() && !arena.reserve(bytes))
+        throw std::bad_alloc();
+    arena.reset();
+    float *v = arena.allocatePadded<float>(cells);
+    float *h = arena.allocatePadded<float>(cells);
+    float *newV = arena.allocatePadded<float>(cells);
+    float *newH = arena.allocatePadded<float>(cells);
+    float *mask = arena.allocatePadded<float>(cells);
+
+    for (int y = windowY0; y < windowY1; y++)
+    {
+        std::size_t from = (std::size_t)y * water.width + windowX0;
+        std::size_t to = (std::size_t)(y - windowY0) * windowWidth;
+        std::copy(&water.velocities[from], &water.velocities[from] + windowWidth, v + to);
+        std::copy(&water.heights[from], &water.heights[from] + windowWidth, h + to);
+        std::copy(&water.masks[from], &water.masks[from] + windowWidth, mask + to);
+    }
+
+    //Each step only needs to cover what the steps after it still read: the tile and one cell less around it
+    for (int s = 1; s <= k; s++)
+    {
+        int margin = k - s;
+        stepExplicitCells(v, h, mask, newV, newH, windowWidth, windowHeight,
+                          std::max(x0 - margin, windowX0) - windowX0, std::max(y0 - margin, windowY0) - windowY0,
+                          std::min(x1 + margin, windowX1) - windowX0, std::min(y1 + margin, windowY1) - windowY0,
+                          *solver);
+        std::swap(v, newV);
+        std::swap(h, newH);
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        std::size_t from = (std::size_t)(y - windowY0) * windowWidth + (x0 - windowX0);
+        std::size_t to = (std::size_t)y * water.width + x0;
+        std::copy(v + from, v + from + (x1 - x0), &water.scratchA[to]);
+        std::copy(h + from, h + from + (x1 - x0), &water.scratchB[to]);
+        if (velocityCopy)
+        {
+            std::copy(v + from, v + from + (x1 - x0), velocityCopy + to);
+            std::copy(h + from, h + from + (x1 - x0), heightCopy + to);
+        }
+    }
+}
+
+//-----------------------------------------------------------------
+//Tuning
+//-----------------------------------------------------------------
+//Milliseconds per step, over at least trialSeconds after a block to warm up
+static float timeTuning(CPUWaterGrid &grid, const CPUSolverSettings &solver, const CPUStepTuning &tuning, float trialSeconds)
+{
+    CPUStepper stepper;
+    stepper.init(tuning);
+    stepper.step(grid, solver, tuning.blockSteps);
+
+    int steps = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0.0);
+    while (elapsed.count() < trialSeconds || steps < 2 * tuning.blockSteps)
+    {
+        stepper.step(grid, solver, tuning.blockSteps);
+        steps += tuning.blockSteps;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return (float)(elapsed.count() * 1000.0 / steps);
+}
+
+static const int TUNING_PARAMETERS = 4;
+
+static int &tuningParameter(CPUStepTuning &tuning, int parameter)
+{
+    int *parameters[TUNING_PARAMETERS] = { &tuning.threads, &tuning.tileHeight, &tuning.tileWidth, &tuning.blockSteps };
+    return *parameters[parameter];
+}
+
+//Searched one parameter at a time, with the others at the best so far, until a pass changes nothing
+CPUStepTuning tuneStepper(int width, int height, float trialSeconds)
+{
+    CPUWaterGrid grid;
+    grid.resize(width, height);
+    std::fill(grid.heights.begin(), grid.heights.end(), 2.0f);
+    injectWater(grid, 0.3f, 0.5f, 0.2f, 1.0f);
+    CPUSolverSettings solver;
+
+    int hardwareThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+    std::vector<int> threadChoices;
+    for (int threads = 1; threads < hardwareThreads; threads *= 2)
+        threadChoices.push_back(threads);
+    threadChoices.push_back(hardwareThreads);
+    std::vector<int> widthChoices = { 0 };
+    for (int tileWidth = 128; tileWidth < width; tileWidth *= 2)
+        widthChoices.push_back(tileWidth);
+    std::vector<int> heightChoices;
+    for (int tileHeight = 8; tileHeight < height * 2 && tileHeight <= 256; tileHeight *= 2)
+        heightChoices.push_back(tileHeight);
+    std::vector<int> blockChoices = { 1, 2, 4, 8, 16 };
+
+    CPUStepTuning best;
+    best.threads = hardwareThreads;
+    best.msPerStep = timeTuning(grid, solver, best, trialSeconds);
+
+    std::vector<int> *choices[TUNING_PARAMETERS] = { &threadChoices, &heightChoices, &widthChoices, &blockChoices };
+    for (int pass = 0; pass < 3; pass++)
+    {
+        bool changed = false;
+        for (int p = 0; p < TUNING_PARAMETERS; p++)
+        {
+            for (std::size_t i = 0; i < choices[p]->size(); i++)
+            {
+                if (tuningParameter(best, p) == (*choices[p])[i])
+                    continue;
+                CPUStepTuning trial = best;
+                tuningParameter(trial, p) = (*choices[p])[i];
+                trial.msPerStep = timeTuning(grid, solver, trial, trialSeconds);
+                if (trial.msPerStep < best.msPerStep)
+                {
+                    best = trial;
+                    changed = true;
+                }
+            }
+        }
+        if (!changed)
+            break;
+    }
+    return best;
+}
+
+//-----------------------------------------------------------------
+//Tuning file
+//-----------------------------------------------------------------
+//One line per machine and grid size:
+//    width height tileWidth tileHeight threads blockSteps msPerStep<tab>machine
+std::string stepperMachineName()
+{
+    std::string name;
+#ifdef _WIN32
+    const char *identifier = getenv("PROCESSOR_IDENTIFIER");
+    if (identifier)
+        name = identifier;
+#else
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (name.empty() && std::getline(cpuinfo, line))
+    {
+        std::size_t start = line.find_first_not_of(" \t", line.find(':') + 1);
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos && start != std::string::npos)
+            name = line.substr(start);
+    }
+#endif
+    if (name.empty())
+        name = "unknown CPU";
+    std::replace(name.begin(), name.end(), '\t', ' ');
+    char threads[32];
+    snprintf(threads, sizeof(threads), ", %u threads", std::max(std::thread::hardware_concurrency(), 1u));
+    return name + threads;
+}
+
+std::string stepperTuningFile()
+{
+    const char *file = getenv("WATERBLOCK_TUNING_FILE");
+    if (file && *file)
+        return file;
+#ifdef _WIN32
+    const char *cache = getenv("LOCALAPPDATA");
+    if (cache && *cache)
+        return std::string(cache) + "\\waterblock\\cpu_tuning.txt";
+#else
+    const char *cache = getenv("XDG_CACHE_HOME");
+    if (cache && *cache)
+        return std::string(cache) + "/waterblock/cpu_tuning.txt";
+    const char *home = getenv("HOME");
+    if (home && *home)
+        return std::string(home) + "/.cache/waterblock/cpu_tuning.txt";
+#endif
+    return "cpu_tuning.txt";
+}
+
+//Reads one line, if it's for this machine
+static bool parseTuningLine(const std::string &line, const std::string &machine, int &width, int &height, CPUStepTuning &tuning)
+{
+    std::size_t tab = line.find('\t');
+    if (line.empty() || line[0] == '#' || tab == std::string::npos || line.compare(tab + 1, std::string::npos, machine) != 0)
+        return false;
+    return sscanf(line.c_str(), "%d %d %d %d %d %d %f", &width, &height, &tuning.tileWidth, &tuning.tileHeight,
+                  &tuning.threads, &tuning.blockSteps, &tuning.msPerStep) == 7 &&
+           tuning.tileWidth >= 0 && tuning.tileHeight > 0 && tuning.threads > 0 && tuning.blockSteps > 0;
+}
+
+bool loadStepperTuning(int width, int height, CPUStepTuning &tuning)
+{
+    std::ifstream file(stepperTuningFile().c_str());
+    std::string machine = stepperMachineName();
+    std::string line;
+    while (std::getline(file, line))
+    {
+        int lineWidth, lineHeight;
+        CPUStepTuning lineTuning;
+        if (parseTuningLine(line, machine, lineWidth, lineHeight, lineTuning) && lineWidth == width && lineHeight == height)
+        {
+            tuning = lineTuning;
+            return true;
+        }
+    }
+    return false;
+}
+
+//Every directory on the way to path
+static void makeDirectories(const std::string &path)
+{
+    for (std::size_t i = 1; i < path.size(); i++)
+    {
+        if (path[i] != '/' && path[i] != '\\')
+            continue;
+#ifdef _WIN32
+        _mkdir(path.substr(0, i).c_str());
+#else
+        mkdir(path.substr(0, i).c_str(), 0755);
+#endif
+    }
+}
+
+bool saveStepperTuning(int width, int height, const CPUStepTuning &tuning)
+{
+    std::string path = stepperTuningFile();
+    std::string machine = stepperMachineName();
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(path.c_str());
+        std::string line;
+        while (std::getline(file, line))
+        {
+            int lineWidth, lineHeight;
+            CPUStepTuning lineTuning;
+            bool replaced = parseTuningLine(line, machine, lineWidth, lineHeight, lineTuning) &&
+                            lineWidth == width && lineHeight == height;
+            if (!replaced && !line.empty() && line[0] != '#')
+                lines.push_back(line);
+        }
+    }
+
+    char entry[128];
+    snprintf(entry, sizeof(entry), "%d %d %d %d %d %d %g\t", width, height, tuning.tileWidth, tuning.tileHeight,
+             tuning.threads, tuning.blockSteps, tuning.msPerStep);
+    lines.push_back(entry + machine);
+
+    makeDirectories(path);
+    std::ofstream file(path.c_str(), std::ios::trunc);
+    file << "#width height tileWidth tileHeight threads blockSteps msPerStep<tab>machine\n";
+    for (std::size_t i = 0; i < lines.size(); i++)
+        file << lines[i] << "\n";
+    return (bool)file;
+}
+
+CPUStepTuning stepperTuningFor(int width, int height, bool tune)
+{
+    CPUStepTuning tuning;
+    if (loadStepperTuning(width, height, tuning) || !tune)
+        return tuning;
+    tuning = tuneStepper(width, height);
+    saveStepperTuning(width, height, tuning);
+    return tuning;
+}
@@ -0,0 +1,114 @@
+#ifndef _CPU_STEPPER_H_
+#define _CPU_STEPPER_H_
+
+//The explicit CPU solver, tiled, temporally blocked and spread over threads. A block of steps is run
+//one tile at a time: each tile copies itself plus blockSteps cells of its neighbours into scratch,
+//runs every step of the block there while it's in cache, and writes its own cells back. The halo
+//is worked out again by every tile that needs it, so tiles never wait on each other inside a block,
+//and the results are exactly stepExplicit()'s. Every thread steps the same run of tiles each block,
+//and prepare() has it zero them first, so their pages are on its NUMA node.
+//
+//What's fastest depends on the caches and the core count, so tuneStepper() times short trials over
+//the choices for one grid size. The winners are kept per machine in a small text file, which
+//loadStepperTuning() reads back on later runs.
+//
+//    CPUStepper stepper;
+//    stepper.init(stepperTuningFor(width, height, true)); //Tunes, once per machine and size
+//    stepper.prepare(grid, width, height);
+//    stepper.step(grid, settings, steps);
+
+#include "cpu_solver.h"
+#include "worker_pool.h"
+
+#include <string>
+#include <vector>
+
+struct CPUStepTuning
+{
+    int tileWidth = 0;    //Cells, 0 for whole rows
+    int tileHeight = 64;
+    int threads = 1;      //The caller is one of them
+    int blockSteps = 1;   //Steps run on a tile before moving on
+    float msPerStep = 0.0f; //What the tuner measured, 0 if it didn't
+};
+
+class CPUStepper
+{
+public:
+    CPUStepper();
+    ~CPUStepper();
+
+    //Starts tuning.threads - 1 workers, stopping any from before
+    void init(const CPUStepTuning &tuning);
+    void release();
+    const CPUStepTuning &tuning() const { return settings; }
+
+    //Sizes grid, zeroed, with each thread zeroing the tiles it'll step. Again after an init() that
+    //changes the tiles or the threads, or the pages stay where they were.
+    void prepare(CPUWaterGrid &grid, int width, int height);
+
+    //resizeGrid(), into a grid prepare()d by this stepper
+    void resize(CPUWaterGrid &grid, int width, int height);
+
+    //steps calls of stepExplicit(), blockSteps at a time
+    void step(CPUWaterGrid &grid, const CPUSolverSettings &solver, int steps);
+
+    //step(), with the last block also writing the velocities and heights it ends on into these
+    //width * height arrays while they're still in cache, such as an upload buffer (GridTextures)
+    void step(CPUWaterGrid &grid, const CPUSolverSettings &solver, int steps, float *velocityCopy, float *heightCopy);
+
+    //step(), in an even number of blocks unless steps is 1, so velocities and heights end up back in
+    //the memory they started in (each block swaps them with scratch). Some blocks are shorter.
+    void stepInPlace(CPUWaterGrid &grid, const CPUSolverSettings &solver, int steps);
+
+private:
+    CPUStepper(const CPUStepper &);
+    CPUStepper &operator=(const CPUStepper &);
+
+    void layoutTiles(int width, int height);
+    bool startBlocks(CPUWaterGrid &grid, const CPUSolverSettings &solver);
+    void runBlock(int steps);
+    void stepTile(int index, int tile);
+    void zeroTile(int tile);
+    static void stepTask(void *context, int thread, int begin, int end);
+    static void zeroTask(void *context, int thread, int begin, int end);
+
+    CPUStepTuning settings;
+
+    //The block under way
+    CPUWaterGrid *grid;
+    const CPUSolverSettings *solver;
+    int blockSteps;
+    int tilesX;
+    int tileCount;
+    int tileWidth;
+    int tileHeight;
+    float *velocityCopy; //Where the block also writes its results, or NULL
+    float *heightCopy;
+
+    //Each thread's scratch, first touched by the thread itself
+    std::vector<MemoryArena *> scratch;
+    WorkerPool pool;
+};
+
+//Times trialSeconds of steps for each choice, one parameter at a time, on a width x height pool
+//with a wave running through it. A few dozen trials, so a few seconds for a large grid.
+CPUStepTuning tuneStepper(int width, int height, float trialSeconds = 0.05f);
+
+//The tuning saved for this machine and grid size, if there is one
+bool loadStepperTuning(int width, int height, CPUStepTuning &tuning);
+
+//Adds or replaces this machine's tuning for the grid size
+bool saveStepperTuning(int width, int height, const CPUStepTuning &tuning);
+
+//The saved tuning for this machine and grid size. Failing that, with tune set, a fresh one (which is
+//saved), otherwise the defaults, which step like stepExplicit() on one thread.
+CPUStepTuning stepperTuningFor(int width, int height, bool tune);
+
+//Where the tunings are kept: WATERBLOCK_TUNING_FILE if it's set, otherwise waterblock/cpu_tuning.txt
+//in the user's cache directory. Entries are marked with the CPU they were tuned on, so a file shared
+//between machines only gives each the ones that are its own.
+std::string stepperTuningFile();
+std::string stepperMachineName();
+
+#endif // _CPU_STEPPER_H_
@@ -0,0 +1,261 @@
+#include "fft.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FFT_SSE2
+#endif
+
+const int BLOCK_WIDTH = 16; //Lines transformed together, a cache line of floats across
+
+FFT2D::FFT2D() : n(0), log2n(0), fieldsReal(NULL), fieldsImaginary(NULL), fieldCount(0), sign(1.0f)
+{
+}
+
+FFT2D::~FFT2D()
+{
+    release();
+}
+
+bool FFT2D::init(int size, int threads)
+{
+    release();
+    if (size < 4 || (size & (size - 1)) != 0)
+        return false;
+
+    n = size;
+    log2n = 0;
+    while ((1 << log2n) < n)
+        log2n++;
+
+    reversed.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        int r = 0;
+        for (int bit = 0; bit < log2n; bit++)
+            r |= ((i >> bit) & 1) << (log2n - 1 - bit);
+        reversed[i] = r;
+    }
+
+    twiddleReal.resize(n / 2);
+    twiddleImaginary.resize(n / 2);
+    for (int k = 0; k < n / 2; k++)
+    {
+        double angle = 2.0 * 3.14159265358979323846 * k / n;
+        twiddleReal[k] = (float)std::cos(angle);
+        twiddleImaginary[k] = (float)std::sin(angle);
+    }
+
+    //No more threads than there are blocks of columns to go around
+    if (threads <= 0)
+        threads = std::max((int)std::thread::hardware_concurrency(), 1);
+    threads = std::min(threads, n / std::min(BLOCK_WIDTH, n));
+    scratch.resize(n * n * 2);
+    pool.start(threads);
+    return true;
+}
+
+void FFT2D::release()
+{
+    pool.stop();
+    n = 0;
+}
+
+void FFT2D::inverse(float *const *real, float *const *imaginary, int count)
+{
+    transform(real, imaginary, count, 1.0f);
+}
+
+void FFT2D::forward(float *const *real, float *const *imaginary, int count)
+{
+    transform(real, imaginary, count, -1.0f);
+}
+
+//Columns, then rows
+void FFT2D::transform(float *const *real, float *const *imaginary, int count, float direction)
+{
+    fieldsReal = real;
+    fieldsImaginary = imaginary;
+    fieldCount = count;
+    sign = direction;
+
+    int blocks = n / std::min(BLOCK_WIDTH, n);
+    parallel(blocks, columnsTask, this);
+    parallel(blocks, rowsTask, this);
+}
+
+//One radix 2 butterfly across width lines: a + w * b and a - w * b
+static void butterfly(float *aReal, float *aImaginary, float *bReal, float *bImaginary, int width,
+                      float wReal, float wImaginary)
+{
+#ifdef FFT_SSE2
+    const __m128 wr = _mm_set1_ps(wReal);
+    const __m128 wi = _mm_set1_ps(wImaginary);
+    for (int x = 0; x < width; x += 4)
+    {
+        __m128 xr = _mm_loadu_ps(bReal + x);
+        __m128 xi = _mm_loadu_ps(bImaginary + x);
+        __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, wr), _mm_mul_ps(xi, wi));
+        __m128 ti = _mm_add_ps(_mm_mul_ps(xr, wi), _mm_mul_ps(xi, wr));
+        __m128 ur = _mm_loadu_ps(aReal + x);
+        __m128 ui = _mm_loadu_ps(aImaginary + x);
+        _mm_storeu_ps(aReal + x, _mm_add_ps(ur, tr));
+        _mm_storeu_ps(aImaginary + x, _mm_add_ps(ui, ti));
+        _mm_storeu_ps(bReal + x, _mm_sub_ps(ur, tr));
+        _mm_storeu_ps(bImaginary + x, _mm_sub_ps(ui, ti));
+    }
+#else
+    for (int x = 0; x < width; x++)
+    {
+        float tr = bReal[x] * wReal - bImaginary[x] * wImaginary;
+        float ti = bReal[x] * wImaginary + bImaginary[x] * wReal;
+        float ur = aReal[x];
+        float ui = aImaginary[x];
+        aReal[x] = ur + tr;
+        aImaginary[x] = ui + ti;
+        bReal[x] = ur - tr;
+        bImaginary[x] = ui - ti;
+    }
+#endif
+}
+
+//Transforms width lines at once, interleaved: element i of line j is at i * width + j, already in
+//bit reversed order
+void FFT2D::transformBlock(float *real, float *imaginary, int width) const
+{
+    for (int half = 1; half < n; half *= 2)
+    {
+        int stride = n / (2 * half); //Through the twiddles
+        for (int start = 0; start < n; start += 2 * half)
+        {
+            for (int k = 0; k < half; k++)
+            {
+                int a = (start + k) * width;
+                int b = a + half * width;
+                butterfly(real + a, imaginary + a, real + b, imaginary + b, width,
+                          twiddleReal[k * stride], sign * twiddleImaginary[k * stride]);
+            }
+        }
+    }
+}
+
+//Every column in blocks [begin, end) of every field. A block is copied out into its own scratch, so
+//the butterflies work on contiguous memory rather than rows a power of two apart.
+void FFT2D::columnsTask(void *context, int begin, int end)
+{
+    FFT2D &fft = *(FFT2D *)context;
+    const int n = fft.n;
+    const int width = std::min(BLOCK_WIDTH, n);
+    for (int field = 0; field < fft.fieldCount; field++)
+    {
+        for (int block = begin; block < end; block++)
+        {
+            float *real = fft.fieldsReal[field] + block * width;
+            float *imaginary = fft.fieldsImaginary[field] + block * width;
+            float *scratchReal = &fft.scratch[block * width * n * 2];
+            float *scratchImaginary = scratchReal + width * n;
+            for (int i = 0; i < n; i++)
+            {
+                std::copy(real + i * n, real + i * n + width, scratchReal + fft.reversed[i] * width);
+                std::copy(imaginary + i * n, imaginary + i * n + width, scratchImaginary + fft.reversed[i] * width);
+            }
+            fft.transformBlock(scratchReal, scratchImaginary, width);
+            for (int i = 0; i < n; i++)
+            {
+                std::copy(scratchReal + i * width, scratchReal + (i + 1) * width, real + i * n);
+                std::copy(scratchImaginary + i * width, scratchImaginary + (i + 1) * width, imaginary + i * n);
+            }
+        }
+    }
+}
+
+//A 4x4 tile: the four floats at source, source + stride, ... go down the columns of the rows at
+//target + to[0], target + to[1], ...
+static void transpose4(const float *source, int stride, float *target, const int *to)
+{
+#ifdef FFT_SSE2
+    __m128 a = _mm_loadu_ps(source);
+    __m128 b = _mm_loadu_ps(source + stride);
+    __m128 c = _mm_loadu_ps(source + stride * 2);
+    __m128 d = _mm_loadu_ps(source + stride * 3);
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    _mm_storeu_ps(target + to[0], a);
+    _mm_storeu_ps(target + to[1], b);
+    _mm_storeu_ps(target + to[2], c);
+    _mm_storeu_ps(target + to[3], d);
+#else
+    for (int y = 0; y < 4; y++)
+    {
+        for (int x = 0; x < 4; x++)
+            target[to[x] + y] = source[y * stride + x];
+    }
+#endif
+}
+
+//Every row in blocks [begin, end). Rows are transposed into the scratch on the way in, so they're
+//transformed like columns.
+void FFT2D::rowsTask(void *context, int begin, int end)
+{
+    FFT2D &fft = *(FFT2D *)context;
+    const int n = fft.n;
+    const int width = std::min(BLOCK_WIDTH, n);
+    for (int field = 0; field < fft.fieldCount; field++)
+    {
+        for (int block = begin; block < end; block++)
+        {
+            float *real = fft.fieldsReal[field] + block * width * n;
+            float *imaginary = fft.fieldsImaginary[field] + block * width * n;
+            float *scratchReal = &fft.scratch[block * width * n * 2];
+            float *scratchImaginary = scratchReal + width * n;
+            for (int i = 0; i < n; i += 4)
+            {
+                for (int row = 0; row < width; row += 4)
+                {
+                    int from = row * n + i;
+                    int to[4] = { fft.reversed[i] * width + row, fft.reversed[i + 1] * width + row,
+                                  fft.reversed[i + 2] * width + row, fft.reversed[i + 3] * width + row };
+                    transpose4(real + from, n, scratchReal, to);
+                    transpose4(imaginary + from, n, scratchImaginary, to);
+                }
+            }
+            fft.transformBlock(scratchReal, scratchImaginary, width);
+            for (int i = 0; i < n; i += 4)
+            {
+                for (int row = 0; row < width; row += 4)
+                {
+                    int from = i * width + row;
+                    int to[4] = { row * n + i, (row + 1) * n + i, (row + 2) * n + i, (row + 3) * n + i };
+                    transpose4(scratchReal + from, width, real, to);
+                    transpose4(scratchImaginary + from, width, imaginary, to);
+                }
+            }
+        }
+    }
+}
+
+//FFT2D's tasks don't take the thread, so they go through the pool with it dropped
+struct FFTTask
+{
+    FFT2D::Task task;
+    void *context;
+};
+
+static void runFFTTask(void *context, int /*thread*/, int begin, int end)
+{
+    const FFTTask &fftTask = *(const FFTTask *)context;
+    fftTask.task(fftTask.context, begin, end);
+}
+
+void FFT2D::parallel(int count, Task task, void *context)
+{
+    if (count < 2)
+    {
+        task(context, 0, count);
+        return;
+    }
+    FFTTask fftTask = { task, context };
+    pool.parallel(count, runFFTTask, &fftTask);
+}
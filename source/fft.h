@@ -0,0 +1,65 @@
+#ifndef _FFT_H_
+#define _FFT_H_
+
+//Square 2D complex FFTs on the CPU, for the ocean's spectrum (water_ocean.h). Radix 2, with the real
+//and imaginary parts in separate arrays. Lines are transformed sixteen at a time, four to an SSE2
+//register: each block of columns (or rows, transposed on the way) is copied into scratch in bit
+//reversed order, transformed there, and copied back. The blocks are split over a few threads.
+//
+//    FFT2D fft;
+//    fft.init(256);
+//    float *real[] = { ... }, *imaginary[] = { ... }; //size * size floats each, row major
+//    fft.inverse(real, imaginary, 2);
+
+#include "worker_pool.h"
+
+#include <vector>
+
+class FFT2D
+{
+public:
+    FFT2D();
+    ~FFT2D();
+
+    //size is a power of two, at least 4. threads 0 is one per hardware thread; the caller is one of them.
+    bool init(int size, int threads = 0);
+    void release();
+    int size() const { return n; }
+    int threads() const { return pool.threads(); }
+
+    //Transforms each of count fields in place: out(x, y) = sum of in(u, v) * e^(2 pi i (ux + vy) / size).
+    //Not scaled. forward() is the same with e^(-2 pi i ...).
+    void inverse(float *const *real, float *const *imaginary, int count);
+    void forward(float *const *real, float *const *imaginary, int count);
+
+    //Runs task(context, begin, end) over [0, count) in slices, one per thread, and waits for them all.
+    //The FFTs' own threads, for whatever goes with them.
+    typedef void (*Task)(void *context, int begin, int end);
+    void parallel(int count, Task task, void *context);
+
+private:
+    FFT2D(const FFT2D &);
+    FFT2D &operator=(const FFT2D &);
+
+    void transform(float *const *real, float *const *imaginary, int count, float direction);
+    void transformBlock(float *real, float *imaginary, int width) const;
+    static void columnsTask(void *context, int begin, int end);
+    static void rowsTask(void *context, int begin, int end);
+
+    int n;
+    int log2n;
+    std::vector<int> reversed;       //Bit reversed index of every row
+    std::vector<float> twiddleReal;  //e^(2 pi i k / size), k below size / 2
+    std::vector<float> twiddleImaginary;
+    std::vector<float> scratch;      //A block's worth for every block
+
+    //The transform under way
+    float *const *fieldsReal;
+    float *const *fieldsImaginary;
+    int fieldCount;
+    float sign; //1 for inverse, -1 for forward
+
+    WorkerPool pool;
+};
+
+#endif // _FFT_H_
@@ -0,0 +1,141 @@
+#include "frame_stats.h"
+
+#include <algorithm>
+
+//Nearest rank, so every percentile is a frame that actually happened. Reorders values.
+static FramePercentiles percentiles(float *values, int count)
+{
+    FramePercentiles result;
+    if (count == 0)
+        return result;
+
+    const float fractions[3] = { 0.50f, 0.95f, 0.99f };
+    float *targets[3] = { &result.p50, &result.p95, &result.p99 };
+    for (int i = 0; i < 3; i++)
+    {
+        int rank = (int)(fractions[i] * count + 0.999999f) - 1;
+        rank = std::min(std::max(rank, 0), count - 1);
+        std::nth_element(values, values + rank, values + count);
+        *targets[i] = values[rank];
+    }
+    result.max = *std::max_element(values, values + count);
+    return result;
+}
+
+FrameStats::FrameStats()
+{
+    clear();
+}
+
+void FrameStats::clear()
+{
+    next = 0;
+    filled = 0;
+    havePresent = false;
+    inputPending = false;
+}
+
+void FrameStats::input()
+{
+    if (!inputPending)
+        inputTime = Clock::now();
+    inputPending = true;
+}
+
+void FrameStats::presented(double physicsMs, int physicsSteps)
+{
+    Clock::time_point now = Clock::now();
+    if (!havePresent)
+    {
+        //The first swap only starts the clock
+        lastPresent = now;
+        havePresent = true;
+        inputPending = false;
+        return;
+    }
+
+    FrameTiming &frame = frames[next];
+    frame.frameMs = std::chrono::duration<float, std::milli>(now - lastPresent).count();
+    frame.physicsMs = (float)physicsMs;
+    frame.physicsSteps = physicsSteps;
+    frame.latencyMs = inputPending ? std::chrono::duration<float, std::milli>(now - inputTime).count() : -1.0f;
+
+    next = (next + 1) % CAPACITY;
+    if (filled < CAPACITY)
+        filled++;
+    lastPresent = now;
+    inputPending = false;
+}
+
+void FrameStats::restart()
+{
+    havePresent = false;
+}
+
+int FrameStats::count() const
+{
+    return filled;
+}
+
+const FrameTiming &FrameStats::recent(int age) const
+{
+    return frames[(next - 1 - age + 2 * CAPACITY) % CAPACITY];
+}
+
+FrameSummary FrameStats::summary() const
+{
+    FrameSummary result;
+    result.frames = filled;
+    if (filled == 0)
+        return result;
+
+    //Scratch on the stack, since picking percentiles reorders it
+    float values[CAPACITY];
+    long long steps = 0;
+    for (int i = 0; i < filled; i++)
+    {
+        values[i] = frames[i].frameMs;
+        steps += frames[i].physicsSteps;
+    }
+    result.frameMs = percentiles(values, filled);
+    result.stepsPerFrame = (float)steps / filled;
+
+    for (int i = 0; i < filled; i++)
+        values[i] = frames[i].physicsMs;
+    result.physicsMs = percentiles(values, filled);
+
+    int latencies = 0;
+    for (int i = 0; i < filled; i++)
+    {
+        if (frames[i].latencyMs >= 0.0f)
+            values[latencies++] = frames[i].latencyMs;
+    }
+    result.latencySamples = latencies;
+    result.latencyMs = percentiles(values, latencies);
+    return result;
+}
+
+static void printPercentiles(FILE *out, const char *name, const FramePercentiles &values, bool valid, bool comma)
+{
+    if (valid)
+    {
+        fprintf(out, "\"%s\": {\"p50\": %.4g, \"p95\": %.4g, \"p99\": %.4g, \"max\": %.4g}%s",
+                name, values.p50, values.p95, values.p99, values.max, comma ? "," : "");
+    }
+    else
+        fprintf(out, "\"%s\": null%s", name, comma ? "," : "");
+}
+
+void FrameStats::printJSON(FILE *out, const char *indent) const
+{
+    FrameSummary stats = summary();
+    fprintf(out, "%s{\"frames\": %d, \"stepsPerFrame\": %.4g, \"latencySamples\": %d,\n", indent,
+            stats.frames, stats.stepsPerFrame, stats.latencySamples);
+    fprintf(out, "%s ", indent);
+    printPercentiles(out, "frameMs", stats.frameMs, stats.frames > 0, true);
+    fprintf(out, "\n%s ", indent);
+    printPercentiles(out, "physicsMs", stats.physicsMs, stats.frames > 0, true);
+    fprintf(out, "\n%s ", indent);
+    printPercentiles(out, "latencyMs", stats.latencyMs, stats.latencySamples > 0, false);
+    fprintf(out, "}\n");
+}
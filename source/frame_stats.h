@@ -0,0 +1,76 @@
+#ifndef _FRAME_STATS_H_
+#define _FRAME_STATS_H_
+
+//Per-frame timings for spotting stutter, which an average frame rate hides. The last CAPACITY frames
+//are kept in a ring, with nothing allocated per frame, and summarized as percentiles on request.
+//
+//    FrameStats stats;
+//    ...                                  //On a brush event
+//    stats.input();
+//    ...                                  //Right after the swap
+//    stats.presented(physicsMs, physicsSteps);
+//
+//Input latency is from the first input() since the last frame to the swap that follows it, so it
+//covers the wait for the event to be handled as well as the frame itself.
+
+#include <chrono>
+#include <cstdio>
+
+struct FrameTiming
+{
+    float frameMs = 0.0f;   //Swap to swap
+    float physicsMs = 0.0f;
+    int physicsSteps = 0;
+    float latencyMs = -1.0f; //Negative if there was no input to present this frame
+};
+
+struct FramePercentiles
+{
+    float p50 = 0.0f;
+    float p95 = 0.0f;
+    float p99 = 0.0f;
+    float max = 0.0f;
+};
+
+struct FrameSummary
+{
+    int frames = 0;
+    int latencySamples = 0;
+    float stepsPerFrame = 0.0f;
+    FramePercentiles frameMs;
+    FramePercentiles physicsMs;
+    FramePercentiles latencyMs;
+};
+
+class FrameStats
+{
+public:
+    static const int CAPACITY = 600; //Ten seconds at 60 frames a second
+
+    FrameStats();
+    void clear();
+
+    void input();
+    void presented(double physicsMs, int physicsSteps);
+    void restart(); //The time since the last swap wasn't a frame (the loop was waiting for input)
+
+    int count() const;
+    const FrameTiming &recent(int age) const; //0 is the newest
+    FrameSummary summary() const;
+
+    //The summary as a JSON object, in the same layout as the benchmarks' output
+    void printJSON(FILE *out, const char *indent = "") const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    FrameTiming frames[CAPACITY];
+    int next;
+    int filled;
+    Clock::time_point lastPresent;
+    bool havePresent;
+    Clock::time_point inputTime;
+    bool inputPending;
+};
+
+#endif // _FRAME_STATS_H_
@@ -0,0 +1,399 @@
+#include "image_loading.h"
+
+const unsigned int MIP_CACHE_VERSION = 1; //Bump when the cached layout or the filter changes
+bool mipChainCache = true;
+
+//-----------------------------------------------------------------
+//Mip chains
+//-----------------------------------------------------------------
+static bool readFile(const std::string &fileName, std::vector<unsigned char> &data)
+{
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    if (!file)
+        return false;
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !data.empty();
+}
+
+//A 2x2 box filter, like glGenerateMipmap. Odd rows and columns at the far edge are counted twice.
+static void buildMipChain(MipChain &chain)
+{
+    while (chain.back().width > 1 || chain.back().height > 1)
+    {
+        const MipLevel &source = chain.back();
+        MipLevel level;
+        level.width = std::max(1u, source.width / 2);
+        level.height = std::max(1u, source.height / 2);
+        level.pixels.resize(level.width * level.height * 4);
+        for (unsigned int y = 0; y < level.height; y++)
+        {
+            const unsigned char *row0 = &source.pixels[std::min(y * 2, source.height - 1) * source.width * 4];
+            const unsigned char *row1 = &source.pixels[std::min(y * 2 + 1, source.height - 1) * source.width * 4];
+            unsigned char *out = &level.pixels[y * level.width * 4];
+            for (unsigned int x = 0; x < level.width; x++)
+            {
+                unsigned int x0 = std::min(x * 2, source.width - 1) * 4;
+                unsigned int x1 = std::min(x * 2 + 1, source.width - 1) * 4;
+                for (int c = 0; c < 4; c++)
+                    out[x * 4 + c] = (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+            }
+        }
+        chain.push_back(level);
+    }
+}
+
+//Level count, then each level's width, height and pixels
+static void packMipChain(const MipChain &chain, std::vector<unsigned char> &data)
+{
+    std::size_t size = sizeof(unsigned int);
+    for (std::size_t i = 0; i < chain.size(); i++)
+        size += 2 * sizeof(unsigned int) + chain[i].pixels.size();
+    data.resize(size);
+
+    unsigned char *out = &data[0];
+    unsigned int count = (unsigned int)chain.size();
+    std::memcpy(out, &count, sizeof(count));
+    out += sizeof(count);
+    for (std::size_t i = 0; i < chain.size(); i++)
+    {
+        std::memcpy(out, &chain[i].width, sizeof(unsigned int));
+        std::memcpy(out + sizeof(unsigned int), &chain[i].height, sizeof(unsigned int));
+        out += 2 * sizeof(unsigned int);
+        std::memcpy(out, &chain[i].pixels[0], chain[i].pixels.size());
+        out += chain[i].pixels.size();
+    }
+}
+
+static bool unpackMipChain(const std::vector<unsigned char> &data, MipChain &chain)
+{
+    std::size_t offset = sizeof(unsigned int);
+    unsigned int count;
+    if (data.size() < offset)
+        return false;
+    std::memcpy(&count, &data[0], sizeof(count));
+
+    chain.clear();
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (data.size() - offset < 2 * sizeof(unsigned int))
+            return false;
+        MipLevel level;
+        std::memcpy(&level.width, &data[offset], sizeof(unsigned int));
+        std::memcpy(&level.height, &data[offset + sizeof(unsigned int)], sizeof(unsigned int));
+        offset += 2 * sizeof(unsigned int);
+
+        std::size_t bytes = (std::size_t)level.width * level.height * 4;
+        if (bytes == 0 || data.size() - offset < bytes)
+            return false;
+        level.pixels.assign(data.begin() + offset, data.begin() + offset + bytes);
+        offset += bytes;
+        chain.push_back(level);
+    }
+    return count > 0 && offset == data.size();
+}
+
+//The cache file is named after the image, and keyed by its contents
+bool loadMipChain(const std::string &imageName, bool mipmaps, MipChain &chain)
+{
+    std::vector<unsigned char> file;
+    if (!readFile(imageName, file))
+        return false;
+
+    unsigned long long key = hashBytes(&MIP_CACHE_VERSION, sizeof(MIP_CACHE_VERSION));
+    key = hashBytes(&mipmaps, sizeof(mipmaps), key);
+    key = hashBytes(&file[0], file.size(), key);
+    char cacheName[48];
+    std::snprintf(cacheName, sizeof(cacheName), "image_%016llx%s.bin",
+                  hashBytes(imageName.c_str(), imageName.size()), mipmaps ? "_mips" : "");
+
+    std::vector<unsigned char> cached;
+    if (mipChainCache && readCacheFile(cacheName, key, cached) && unpackMipChain(cached, chain))
+        return true;
+
+    sf::Image image;
+    if (!image.loadFromMemory(&file[0], file.size()))
+        return false;
+    chain.assign(1, MipLevel());
+    chain[0].width = image.getSize().x;
+    chain[0].height = image.getSize().y;
+    chain[0].pixels.assign(image.getPixelsPtr(), image.getPixelsPtr() + chain[0].width * chain[0].height * 4);
+    if (mipmaps)
+        buildMipChain(chain);
+
+    if (mipChainCache)
+    {
+        packMipChain(chain, cached);
+        writeCacheFile(cacheName, key, &cached[0], cached.size());
+    }
+    return true;
+}
+
+//Returns what it takes up on the GPU, for the registry
+static unsigned long long uploadMipChain(GLenum target, int format, const MipChain &chain)
+{
+    unsigned long long bytes = 0;
+    for (std::size_t i = 0; i < chain.size(); i++)
+    {
+        glTexImage2D(target, (int)i, format, chain[i].width, chain[i].height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &chain[i].pixels[0]);
+        bytes += textureBytes(Vector2u(chain[i].width, chain[i].height), format);
+    }
+    return bytes;
+}
+
+//-----------------------------------------------------------------
+//Textures
+//-----------------------------------------------------------------
+static void textureParameters2D()
+{
+    //Set the texture wrapping options
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    //Set the texture filtering options
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+static void textureParametersCube()
+{
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+}
+
+static const char *cubeSuffix[6] = {
+    "_right.png",
+    "_left.png",
+    "_top.png",
+    "_bottom.png",
+    "_front.png",
+    "_back.png"
+};
+
+bool texture2D(const char* imageName, int format, unsigned int *glTexture)
+{
+    //Load the image, with its mip chain
+    MipChain chain;
+    if (!loadMipChain(imageName, true, chain))
+    {
+        std::cout << "Failed to Load Image: " << imageName << std::endl;
+        return false;
+    }
+
+    glGenTextures(1, glTexture);
+    bindTexture(GL_TEXTURE_2D, *glTexture);
+    trackGPUResource(GPU_TEXTURE, *glTexture, uploadMipChain(GL_TEXTURE_2D, format, chain), imageName);
+    textureParameters2D();
+    bindTexture(GL_TEXTURE_2D, 0);
+
+    return true;
+}
+
+//aka cubemap
+void textureCube(std::string imageName, unsigned int *glTexture)
+{
+    glGenTextures(1, glTexture);
+    bindTexture(GL_TEXTURE_CUBE_MAP, *glTexture);
+
+    unsigned long long bytes = 0;
+    for(unsigned int i = 0; i < 6; i++)
+    {
+        MipChain face;
+        if (!loadMipChain(imageName + cubeSuffix[i], false, face))
+        {
+            std::cout << "Failed to Load Image: " << imageName << std::endl;
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            continue;
+        }
+        bytes += uploadMipChain(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, GL_RGB, face);
+    }
+    trackGPUResource(GPU_TEXTURE, *glTexture, bytes, imageName);
+
+    textureParametersCube();
+    bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+
+//-----------------------------------------------------------------
+//TextureStreamer
+//-----------------------------------------------------------------
+TextureStreamer::TextureStreamer() : unfilled(0), stopping(false)
+{
+}
+
+TextureStreamer::~TextureStreamer()
+{
+    stop();
+}
+
+void TextureStreamer::start(unsigned int threads)
+{
+    if (!workers.empty())
+        return;
+    if (threads == 0)
+        threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+
+    stopping = false;
+    for (unsigned int i = 0; i < threads; i++)
+        workers.push_back(std::thread(&TextureStreamer::work, this));
+}
+
+void TextureStreamer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAdded.notify_all();
+    for (std::size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+    jobs.clear();
+}
+
+//Each worker takes the next image, and decodes it with the lock let go
+void TextureStreamer::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        while (jobs.empty() && !stopping)
+            jobAdded.wait(lock);
+        if (stopping)
+            return;
+
+        Job job = jobs.front();
+        jobs.pop_front();
+        std::string fileName = textures[job.texture].fileNames[job.image];
+        lock.unlock();
+
+        MipChain chain;
+        loadMipChain(fileName, job.mipmaps, chain); //Left empty if it failed, which fill() reports
+
+        lock.lock();
+        StreamedTexture &streamed = textures[job.texture];
+        streamed.images[job.image].swap(chain);
+        if (--streamed.waiting == 0)
+        {
+            ready.push_back(job.texture);
+            imageFinished.notify_all();
+        }
+    }
+}
+
+//A mid grey pixel until the image arrives
+void TextureStreamer::texture2D(const char *imageName, int format, unsigned int *glTexture)
+{
+    const unsigned char placeholder[4] = { 128, 128, 128, 255 };
+    glGenTextures(1, glTexture);
+    bindTexture(GL_TEXTURE_2D, *glTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+    trackGPUResource(GPU_TEXTURE, *glTexture, textureBytes(Vector2u(1), format), imageName);
+    textureParameters2D();
+    bindTexture(GL_TEXTURE_2D, 0);
+
+    if (workers.empty())
+        start();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        StreamedTexture streamed;
+        streamed.texture = *glTexture;
+        streamed.target = GL_TEXTURE_2D;
+        streamed.format = format;
+        streamed.fileNames.push_back(imageName);
+        streamed.images.resize(1);
+        streamed.waiting = 1;
+        textures.push_back(streamed);
+
+        Job job = { textures.size() - 1, 0, true };
+        jobs.push_back(job);
+    }
+    unfilled++;
+    jobAdded.notify_one();
+}
+
+//A pale blue sky until the faces arrive. They're filled in together, so a cube is never incomplete.
+void TextureStreamer::textureCube(const std::string &imageName, unsigned int *glTexture)
+{
+    const unsigned char placeholder[4] = { 150, 180, 210, 255 };
+    glGenTextures(1, glTexture);
+    bindTexture(GL_TEXTURE_CUBE_MAP, *glTexture);
+    for (unsigned int i = 0; i < 6; i++)
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+    trackGPUResource(GPU_TEXTURE, *glTexture, 6 * textureBytes(Vector2u(1), GL_RGB), imageName);
+    textureParametersCube();
+    bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    if (workers.empty())
+        start();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        StreamedTexture streamed;
+        streamed.texture = *glTexture;
+        streamed.target = GL_TEXTURE_CUBE_MAP;
+        streamed.format = GL_RGB;
+        for (int i = 0; i < 6; i++)
+            streamed.fileNames.push_back(imageName + cubeSuffix[i]);
+        streamed.images.resize(6);
+        streamed.waiting = 6;
+        textures.push_back(streamed);
+
+        for (int i = 0; i < 6; i++)
+        {
+            Job job = { textures.size() - 1, i, false };
+            jobs.push_back(job);
+        }
+    }
+    unfilled++;
+    jobAdded.notify_all();
+}
+
+//No worker touches a texture once it's ready, so it's filled in without the lock
+void TextureStreamer::fill(StreamedTexture &streamed)
+{
+    bindTexture(streamed.target, streamed.texture);
+    unsigned long long bytes = 0;
+    for (std::size_t i = 0; i < streamed.images.size(); i++)
+    {
+        if (streamed.images[i].empty())
+        {
+            std::cout << "Failed to Load Image: " << streamed.fileNames[i] << std::endl;
+            bytes += textureBytes(Vector2u(1), streamed.format);
+            continue;
+        }
+        GLenum target = GL_TEXTURE_2D;
+        if (streamed.target == GL_TEXTURE_CUBE_MAP)
+            target = GL_TEXTURE_CUBE_MAP_POSITIVE_X + (GLenum)i;
+        bytes += uploadMipChain(target, streamed.format, streamed.images[i]);
+        MipChain().swap(streamed.images[i]);
+    }
+    trackGPUResource(GPU_TEXTURE, streamed.texture, bytes, streamed.fileNames[0]);
+    bindTexture(streamed.target, 0);
+    fetchGLErrors("Error filling in a streamed texture:");
+}
+
+int TextureStreamer::update()
+{
+    std::vector<std::size_t> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.swap(ready);
+    }
+    for (std::size_t i = 0; i < finished.size(); i++)
+        fill(textures[finished[i]]);
+    unfilled -= (int)finished.size();
+    return unfilled;
+}
+
+void TextureStreamer::finish()
+{
+    while (update() > 0)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (workers.empty())
+            return; //Stopped, so nothing is coming
+        while (ready.empty())
+            imageFinished.wait(lock);
+    }
+}
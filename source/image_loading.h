@@ -0,0 +1,92 @@
+#ifndef _IMAGE_LOADING_H_
+#define _IMAGE_LOADING_H_
+
+//Textures loaded from image files. These use SFML to decode the images, so they belong to the demo
+//rather than the WaterBlock library.
+
+#include "common.h"
+#include <SFML/Graphics.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+//An image as RGBA8, level 0 first, each level half the size of the one before down to 1x1
+struct MipLevel
+{
+    unsigned int width;
+    unsigned int height;
+    std::vector<unsigned char> pixels;
+};
+typedef std::vector<MipLevel> MipChain;
+
+//Decodes imageName, and with mipmaps builds the rest of the chain. Whatever is built goes in the
+//disk cache (see common.h), so next time an unchanged image is read back rather than decoded.
+//Safe to call from any thread.
+extern bool mipChainCache; //False decodes every image, and doesn't write the cache either
+bool loadMipChain(const std::string &imageName, bool mipmaps, MipChain &chain);
+
+bool texture2D(const char* imageName, int format, unsigned int *glTexture);
+void textureCube(std::string imageName, unsigned int *glTexture);
+
+//Images decoded on a pool of worker threads while the GL thread gets on with everything else. Each
+//texture is created straight away with a placeholder in it, so the first frames can draw with it,
+//and update() fills it in once all of its images are ready.
+//
+//    streamer.start();
+//    streamer.texture2D("images/tile.png", GL_RGB, &tileTexture);
+//    ...
+//    streamer.update(); //Every frame
+class TextureStreamer
+{
+public:
+    TextureStreamer();
+    ~TextureStreamer();
+
+    void start(unsigned int threads = 0); //0 is one per hardware thread, less the GL thread
+    void stop();                          //Textures that haven't been filled in keep their placeholders
+
+    //Same textures as the functions above, once update() has filled them in
+    void texture2D(const char *imageName, int format, unsigned int *glTexture);
+    void textureCube(const std::string &imageName, unsigned int *glTexture);
+
+    int update();  //Fills in every texture whose images are ready. Returns how many are still waiting.
+    void finish(); //Waits for every texture, and fills them all in
+
+private:
+    TextureStreamer(const TextureStreamer &);
+    TextureStreamer &operator=(const TextureStreamer &);
+
+    struct StreamedTexture
+    {
+        unsigned int texture;
+        GLenum target;                //GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP
+        int format;
+        std::vector<std::string> fileNames;
+        std::vector<MipChain> images; //One, or a cube's six faces
+        int waiting;                  //Images the workers haven't finished
+    };
+
+    struct Job
+    {
+        std::size_t texture;
+        int image;
+        bool mipmaps;
+    };
+
+    void work();
+    void fill(StreamedTexture &streamed);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable jobAdded;
+    std::condition_variable imageFinished;
+    std::deque<Job> jobs;
+    std::deque<StreamedTexture> textures; //A deque, so adding one never moves the others
+    std::vector<std::size_t> ready;       //Textures with all their images, waiting for update()
+    int unfilled;
+    bool stopping;
+};
+
+#endif // _IMAGE_LOADING_H_
@@ -6,63 +6,205 @@
 //------------------------------------------------------------------
 
 #include "common.h"
+#include "frame_stats.h"
+#include "image_loading.h"
+#include "water_block.h"
+#include "water_block_gl.h"
+#include "water_thread.h"
+#include "water_batch.h"
+#include "water_history.h"
+#include "water_ocean.h"
+
+#include <iomanip>
+#include <limits>
 
 bool windowOpen = true;
 
 //Shaders
-ShaderProgram drawingShader;
 ShaderProgram imageShader;
-ShaderProgram waterPhysicsShader;
 ShaderProgram waterSurfaceShader;
 ShaderProgram shapeShader;
 ShaderProgram flatShader;
 ShaderProgram cubemapShader;
+ShaderProgram resampleShader;
+ShaderProgram regridShader;
+ShaderProgram imageArrayShader;
+
+//Nested grid physics variants, picked by combining the flags below
+const int PHYSICS_BRUSH = 1;        //First step of a frame, paints the brush and copies in the mask
+const int PHYSICS_SURFACE_DATA = 2; //Last step of a frame, writes the grid's surfaceDataTexture
 
 //Vertex arrays
-unsigned int fullscreenVAO;
-unsigned int waterBlockVAO;
+VertexArrayHandle fullscreenVAO;
+VertexArrayHandle waterBlockVAO;
 unsigned int waterBlockElements;
-unsigned int poolVAO;
+VertexArrayHandle poolVAO;
+VertexArrayHandle cubemapVAO;
+VertexArrayHandle oceanVAO; //The far field, a plane much larger than the water's
+unsigned int oceanElements;
+
+//Every wall of every barrier configuration is built once. A configuration is a run of them.
+const int BARRIER_CONFIGURATIONS = 4; //The first has no walls
+const int barrierFirst[BARRIER_CONFIGURATIONS] = { 0, 0, 2, 4 };
+const int barrierCounts[BARRIER_CONFIGURATIONS] = { 0, 2, 2, 3 };
+VertexArrayHandle barrierWalls[7];
 int barrierCount = 0;
 int barrierConfiguartion = 0;
-unsigned int barrierVAOs[3];
-unsigned int cubemapVAO;
 
 //Framebuffers
-unsigned int waterFBO; //For the textures used to run the water simulation (color, mask, and height)
-unsigned int sceneFBO; //For the texture used to store scene information (scene, depth)
+FramebufferHandle waterFBO; //For averaging the nested grids back into the main simulation
+FramebufferHandle sceneFBO; //The scene and water are rendered once into this, then shown on screen (frame, frameDepth)
+
+//The water itself (see water_block.h). Its settings are compiled into the physics shaders as
+//constants, so changing them here (or imageRes on the command line) is all it takes. E cycles
+//between the backends: the explicit solver on the GPU, which is only stable at small steps and so
+//runs at 750 steps a second, the implicit one, which takes one exact step a frame however long it
+//is, the CPU, and the CPU on a thread of its own, which renders whatever it last finished.
+WaterBlock water;
+WaterBlockSettings waterSettings;
+const char *backendNames[] = { "fragment", "compute", "CPU", "CPU thread" };
+
+//Nested grids. The main simulation becomes a coarse grid over all of the water, and a few finer
+//grids follow whatever needs detail: the brush, and the water nearest the camera. They step along
+//with the coarse grid, trading boundaries with it every step, so the cost depends on how much
+//detail there is rather than on how much water there is. GL fragment backend only.
+struct NestedGrid
+{
+    Vector2u origin; //Lower left corner, in coarse cells
+    Vector2 focus;   //Center of what it's following, in coarse texture coordinates
+    unsigned int FBO;
+    unsigned int heightTextures[2];
+    unsigned int surfaceDataTexture;
+    unsigned int currentTexture;
+};
+const int NESTED_GRID_COUNT = 2; //Must match water_surface.vert/.frag
+const int NESTED_BRUSH = 0;
+const int NESTED_CAMERA = 1;
+bool nestedGrids = false;
+unsigned int nestedRefinement = 4; //Fine cells per coarse cell, along each side
+Vector2u nestedRes(128);           //Fine cells in each nested grid
+NestedGrid nestedGridList[NESTED_GRID_COUNT];
+
+//A batch of small, independent pools (see water_batch.h), shown tiled in the preview instead of the
+//main simulation while it's on. Each one has its own mask and settings.
+bool batchMode = false;
+WaterBatch waterBatch;
+const unsigned int batchTiles = 4; //Pools per side of the preview
+Vector2u batchPoolRes(64);
+
+//Open water around the grid (see water_ocean.h), out to well past the far clip. The grid blends into
+//it near its edges, and the pool walls go. O cycles it off, then on the CPU, then on the GPU. Either
+//way it's a fixed cost a frame, however much of the world it covers.
+bool oceanMode = false;
+WaterOcean ocean;
+OceanSettings oceanSettings;
+const char *oceanEngineNames[] = { "CPU FFT", "GPU FFT" };
+Vector2 oceanPlaneSize(256.0, 256.0);
+Vector2 oceanPlaneDensity(128.0, 128.0);
+const float OCEAN_BLEND = 0.15f; //The band inside the grid's edges where it fades into the ocean, in texture coordinates
+double oceanSeconds = 0.0;
+
+//The water's last few seconds (see water_history.h), recorded while H has it on. Holding Backspace
+//runs the water back through them at the speed they were recorded, and letting go carries on from
+//there. Every record reads the water back, so it starts out off.
+WaterHistorySettings rewindSettings()
+{
+    WaterHistorySettings settings;
+    settings.keyFrameInterval = 8; //Rewinding seeks backwards every frame, from the key frame before
+    return settings;
+}
+bool historyMode = false;
+bool rewinding = false;
+WaterHistory rewindHistory(rewindSettings());
+CPUWaterGrid rewindGrid;
+const double REWIND_RECORDS_PER_SECOND = 30.0;
+double rewindRecordTimer = 0.0;
+unsigned long long rewindStep = 0; //Steps since recording started, or as far back as the rewind has got
+
+//Diagnostics (volume, energy and activity) are reduced on the GPU every few frames, and read
+//back a frame or two later so the CPU never waits on them.
+int diagnosticsInterval = 10; //Frames
+BufferHandle reducePartialsBuffer;
+unsigned int reducePartialsCount = 0;
+GPUReadback diagnosticsReadback;
+WaterDiagnostics diagnostics;
+
+//The simulation resolution can change at runtime, either by hand or automatically to hold
+//a budget of GPU time spent on physics (in ms per second of real time).
+const unsigned int minImageRes = 16;
+const unsigned int maxImageRes = 4096;
+bool autoResolution = false;
+double physicsBudget = 250.0;
 
 //Textures
+Vector2 waterPlaneSize(16.0, 16.0); //The simulation is stretched over this, in world units
 Vector2u imageRes(128.0);
-unsigned int colorTexture;
-unsigned int maskTexture;
-unsigned int heightTextures[2];
-unsigned int surfaceDataTexture;
-unsigned int sceneTexture;
-unsigned int depthTexture;
-unsigned int tileTexture;
-unsigned int cubemapTexture;
-
-//For calculating FPS
-GLulong frameCount = 0;
-sf::Clock fpsClock;
-sf::Time fpsTime = fpsClock.getElapsedTime();
-sf::Time previousTime = fpsTime;
-int calculateFPS()
+TextureHandle maskTexture; //The barriers are drawn into this, then handed to the water
+TextureHandle frameTexture;
+TextureHandle frameDepthTexture;
+TextureHandle sceneTexture;
+TextureHandle depthTexture;
+Vector2u sceneRes(512, 600); //The 3D view's size times renderScale, see resizeSceneTargets()
+TextureHandle tileTexture;
+TextureHandle cubemapTexture;
+
+//The tile and sky images are decoded on worker threads and filled in over the first few frames,
+//so the first frame doesn't wait on them
+TextureStreamer textureStreamer;
+bool texturesStreaming = true;
+
+//Every frame's time, physics time and steps, and how long brush input takes to reach the screen.
+//F shows the last few seconds of frame times as a graph.
+FrameStats frameStats;
+bool frameGraph = false;
+const float FRAME_GRAPH_SCALE = 3.0f; //Pixels per millisecond
+double benchmarkSeconds = 0.0;        //With "-benchmark", run this long without sleeping, then print the frame stats
+
+//The window is split down the middle: the simulation preview on the left, the 3D view on the right.
+//The scene and the water surface are rendered at renderScale of the 3D view and scaled up into it.
+//With dynamic resolution on (R), renderScale follows the GPU time those take, to hold renderBudget,
+//so a slower GPU shades fewer pixels rather than dropping frames. It moves in whole steps, so the
+//targets are only rebuilt when it really has to change.
+Vector2u windowSize(1024, 600);
+bool dynamicResolution = true;
+double renderBudget = 8.0; //GPU ms a frame for the scene and the water surface
+float renderScale = 1.0f;
+const float MIN_RENDER_SCALE = 0.5f;
+const float RENDER_SCALE_STEP = 0.125f;
+GPUTimer renderTimer;
+double renderMs = 0.0;       //Smoothed over the last few frames
+int renderScaleCooldown = 0; //Frames before the scale can move again, so the timings catch up with it
+
+Vector2u previewSize()
 {
-    frameCount++;
+    return Vector2u(windowSize.x / 2, windowSize.y);
+}
 
-    //Get the number of milliseconds since start
-    fpsTime = fpsClock.getElapsedTime();
-    int timeInterval = fpsTime.asMilliseconds() - previousTime.asMilliseconds();
+Vector2u viewportSize()
+{
+    return Vector2u(windowSize.x - windowSize.x / 2, windowSize.y);
+}
 
-    if(timeInterval > 1000)
+//Bars for the frame graph, one per frame, green within a 60Hz frame, yellow within two, red beyond.
+//The lines mark 60Hz and 30Hz.
+void updateFrameGraph(sf::VertexArray &graph, float bottom)
+{
+    int count = frameStats.count();
+    for (int i = 0; i < FrameStats::CAPACITY; i++)
     {
-        previousTime = fpsTime;
-        frameCount = 0;
+        float ms = (i < count) ? frameStats.recent(i).frameMs : 0.0f;
+        sf::Color color = (ms <= 17.0f) ? sf::Color::Green : (ms <= 34.0f) ? sf::Color::Yellow : sf::Color::Red;
+        float x = 5.0f + (FrameStats::CAPACITY - 1 - i) * 0.5f;
+        graph[i * 2] = sf::Vertex(sf::Vector2f(x, bottom), color);
+        graph[i * 2 + 1] = sf::Vertex(sf::Vector2f(x, bottom - std::min(ms, 100.0f) * FRAME_GRAPH_SCALE), color);
+    }
+    const float lines[2] = { 1000.0f / 60.0f, 1000.0f / 30.0f };
+    for (int i = 0; i < 2; i++)
+    {
+        float y = bottom - lines[i] * FRAME_GRAPH_SCALE;
+        graph[FrameStats::CAPACITY * 2 + i * 2] = sf::Vertex(sf::Vector2f(5.0f, y), sf::Color::White);
+        graph[FrameStats::CAPACITY * 2 + i * 2 + 1] = sf::Vertex(sf::Vector2f(5.0f + FrameStats::CAPACITY * 0.5f, y), sf::Color::White);
     }
-
-    return frameCount / (timeInterval / 1000.0f);
 }
 
 void initGL()
@@ -82,15 +224,14 @@ void initGL()
     glEnable(GL_CULL_FACE);
 
     //Blending
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    setBlending(true, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     //Create a couple of new framebuffers for doing additional rendering.
-    glGenFramebuffers(1, &waterFBO);
-    glGenFramebuffers(1, &sceneFBO);
+    *waterFBO.replace() = newFramebuffer("nested grid averaging");
+    *sceneFBO.replace() = newFramebuffer("scene");
 
     //Set default framebuffer
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    bindFramebuffer(0);
 
     fetchGLErrors("Error initializing OpenGL:");
 }
@@ -111,14 +252,12 @@ void initShaders()
     waterSurfaceShader.setUniform("scene_texture", 2);
     waterSurfaceShader.setUniform("depth_texture", 3);
     waterSurfaceShader.setUniform("cubemap_texture", 4);
-
-    //Shader for drawing color into a texture with the mouse
-    shader.vShaderFile = "shaders/drawing_shader.vert";
-    shader.fShaderFile = "shaders/drawing_shader.frag";
-    drawingShader.programID = LoadShaders(shader);
-    //Samplers
-    drawingShader.setUniform("mask_texture", 0);
-    drawingShader.setUniform("height_texture", 1);
+    waterSurfaceShader.setUniform("nestedHeight_textures[0]", 5);
+    waterSurfaceShader.setUniform("nestedHeight_textures[1]", 6);
+    waterSurfaceShader.setUniform("nestedSurfaceData_textures[0]", 7);
+    waterSurfaceShader.setUniform("nestedSurfaceData_textures[1]", 8);
+    waterSurfaceShader.setUniform("oceanHeight_texture", 9);
+    waterSurfaceShader.setUniform("oceanSurfaceData_texture", 10);
 
     //Shader for displaying a texture image
     shader.vShaderFile = "shaders/image_shader.vert";
@@ -127,13 +266,13 @@ void initShaders()
     //Sampler
     imageShader.setUniform("color_texture", 0);
 
-    //Shader for our water physics
-    shader.vShaderFile = "shaders/water_physics.vert";
-    shader.fShaderFile = "shaders/water_physics.frag";
-    waterPhysicsShader.programID = LoadShaders(shader);
-    //Samplers
-    waterPhysicsShader.setUniform("height_texture", 0);
-    waterPhysicsShader.setUniform("mask_texture", 1);
+    //Shader for displaying every layer of a texture array
+    shader.vShaderFile = "shaders/image_shader.vert";
+    shader.fShaderFile = "shaders/image_array.frag";
+    imageArrayShader.programID = LoadShaders(shader);
+    //Sampler
+    imageArrayShader.setUniform("color_texture", 0);
+    imageArrayShader.setUniform("tiles", (int)batchTiles);
 
     //Shader for drawing our solid geometry
     shader.vShaderFile = "shaders/shape_shader.vert";
@@ -149,6 +288,21 @@ void initShaders()
     //Samplers
     cubemapShader.setUniform("cubemap_texture", 0);
 
+    //Shader for copying the simulation into textures of a new size
+    shader.vShaderFile = "shaders/image_shader.vert";
+    shader.fShaderFile = "shaders/resample_shader.frag";
+    resampleShader.programID = LoadShaders(shader);
+    //Sampler
+    resampleShader.setUniform("source_texture", 0);
+
+    //Shader for moving the nested grids
+    shader.vShaderFile = "shaders/image_shader.vert";
+    shader.fShaderFile = "shaders/nested_regrid.frag";
+    regridShader.programID = LoadShaders(shader);
+    //Samplers
+    regridShader.setUniform("fine_texture", 0);
+    regridShader.setUniform("coarse_texture", 1);
+
     //Shader for drawing shapes into our mask texture
     shader.vShaderFile = "shaders/flat_shader.vert";
     shader.fShaderFile = "shaders/flat_shader.frag";
@@ -158,13 +312,55 @@ void initShaders()
     fetchGLErrors("Error in shader initialization:");
 }
 
+//Shaders for the nested grids' physics. Only the first step of a frame draws with the mouse, only
+//the last step writes out surface data, and the grid size and physics constants are baked in, so
+//each combination gets its own program. They're compiled the first time they're asked for.
+//Gravity is scaled so that waves cross them at the same speed (in world units) as they cross the
+//coarse grid.
+Vector2u nestedGridSize();
+ShaderProgram &nestedPhysicsShader(int flags)
+{
+    Vector2u size = nestedGridSize();
+    ShaderVariant variant("shaders/water_physics.vert", "shaders/water_physics.frag");
+    variant.define("NESTED");
+    variant.define("GRID_WIDTH", (float)size.x);
+    variant.define("GRID_HEIGHT", (float)size.y);
+    variant.define("COARSE_WIDTH", (float)imageRes.x);
+    variant.define("COARSE_HEIGHT", (float)imageRes.y);
+    variant.define("GRAVITY", waterSettings.gravity * nestedRefinement * nestedRefinement);
+    variant.define("NORMAL_SCALE", (float)nestedRefinement);
+    variant.define("DECAY", waterSettings.decay);
+    variant.define("MASK", barrierCount > 0 ? 1 : 0);
+    variant.define("PRECISION", "highp");
+    variant.sampler("height_texture", 0);
+    variant.sampler("coarse_texture", 2);
+    if (flags & PHYSICS_BRUSH)
+    {
+        variant.define("BRUSH");
+        variant.sampler("mask_texture", 1);
+    }
+    if (flags & PHYSICS_SURFACE_DATA)
+        variant.define("SURFACE_DATA");
+
+    return loadShaderVariant(variant);
+}
+
+//Reduction passes for the diagnostics, see water_reduce.comp
+ShaderProgram &waterReduceShader(bool final)
+{
+    ShaderVariant variant("shaders/water_reduce.comp");
+    variant.define(final ? "FINAL" : "PARTIAL");
+    variant.define("ACTIVE_VELOCITY", ACTIVE_VELOCITY);
+    variant.sampler("height_texture", 0);
+    return loadShaderVariant(variant);
+}
+
 void initGeometry()
 {
     //-----------------------------------------------------
     //Setup VAO for drawing textures to
     //-----------------------------------------------------
-    glGenVertexArrays(1, &fullscreenVAO);
-    glBindVertexArray(fullscreenVAO);
+    *fullscreenVAO.replace() = newVertexArray("fullscreen quad");
 
     float vertices[] = {
         -1.0, -1.0, 0.0,   0.0, 0.0,
@@ -178,28 +374,40 @@ void initGeometry()
     };
 
     unsigned int buffers[2];
-    glGenBuffers(2, buffers);
-    glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    buffers[0] = newBuffer(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW, "fullscreen quad vertices");
 
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5*sizeof(float), (GLvoid*)(0));
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5*sizeof(float), (GLvoid*)(3*sizeof(float)));
     glEnableVertexAttribArray(1);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    buffers[1] = newBuffer(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW, "fullscreen quad indices");
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    bindVertexArray(0);
+
+    //The vertex array keeps its buffers alive by itself, so they go when it does
+    deleteBuffers(2, buffers);
+    trackGPUResource(GPU_VERTEX_ARRAY, fullscreenVAO, sizeof(vertices) + sizeof(indices), "fullscreen quad");
 
     //Create a plane for our water
-    Vector2 planeSize(16.0, 16.0);
     Vector2 planeDensity(48.0, 48.0);
-    newPlane(planeSize, planeDensity, &waterBlockVAO, &waterBlockElements);
+    newPlane(waterPlaneSize, planeDensity, waterBlockVAO.replace(), &waterBlockElements);
+    newPlane(oceanPlaneSize, oceanPlaneDensity, oceanVAO.replace(), &oceanElements);
 
     //Setup other geometry
-    newCube(Vector3(0.0), Vector3(1.0), &cubemapVAO);
-    newCube(Vector3(0.0, 5.0, 0.0), Vector3(8.0, 5, 8.0), &poolVAO, -1.0f); //Flip normals for this shape
+    newCube(Vector3(0.0), Vector3(1.0), cubemapVAO.replace());
+    newCube(Vector3(0.0, 5.0, 0.0), Vector3(8.0, 5, 8.0), poolVAO.replace(), -1.0f); //Flip normals for this shape
+
+    //Barrier walls. One wall in the middle:
+    newCube(Vector3(0.0, 5.0, 0.0), Vector3(1, 5.0, 8.0), barrierWalls[0].replace());
+    newCube(Vector3(0.5, 5.0, 0.0), Vector3(1, 5.0, 2.0), barrierWalls[1].replace());
+    //Two walls with a small space in between:
+    newCube(Vector3(0.0, 5.0, -4.5), Vector3(1, 5.0, 3.5), barrierWalls[2].replace());
+    newCube(Vector3(0.0, 5.0, 4.5), Vector3(1, 5.0, 3.5), barrierWalls[3].replace());
+    //Three walls making up a zigzag:
+    newCube(Vector3(4.0, 5.0, 1.0), Vector3(1.0, 5.0, 7.0), barrierWalls[4].replace());
+    newCube(Vector3(0.0, 5.0, -1.0), Vector3(1, 5.0, 7.0), barrierWalls[5].replace());
+    newCube(Vector3(-4.0, 5.0, 1.0), Vector3(1.0, 5.0, 7.0), barrierWalls[6].replace());
 
     fetchGLErrors("Problem with geometry generation:");
 
@@ -207,71 +415,69 @@ void initGeometry()
     //Textures
     //-----------------------------------------------------
     //texture2D("images/mask.png", GL_RGB, &maskTexture);
-    texture2D(imageRes, GL_RGB16F, NULL, &colorTexture);
-    texture2D(imageRes, GL_RGB, NULL, &maskTexture);
-    texture2D(imageRes, GL_RGB32F, NULL, &heightTextures[0]);
-    texture2D(imageRes, GL_RGB32F, NULL, &heightTextures[1]);
-    texture2D(imageRes, GL_RGB16F, NULL, &surfaceDataTexture);
-    texture2D("images/tile.png", GL_RGB, &tileTexture);
-    textureCube("images/cubemap/park", &cubemapTexture);
-    //We want these the same size as the window to prevent artifacts
-    texture2D(Vector2(512.0, 600.0), GL_RGB, NULL, &sceneTexture);
-    texture2D(Vector2(512.0, 600.0), GL_DEPTH_COMPONENT, NULL, &depthTexture);
+    texture2D(imageRes, GL_RGB, NULL, maskTexture.replace());
+    textureStreamer.texture2D("images/tile.png", GL_RGB, tileTexture.replace());
+    textureStreamer.textureCube("images/cubemap/park", cubemapTexture.replace());
+    //We want these the same size as the 3D view to prevent artifacts. The frame textures are what
+    //we render into, the scene textures are copies of them that the water surface samples from.
+    texture2D(sceneRes, GL_RGB, NULL, frameTexture.replace());
+    texture2D(sceneRes, GL_DEPTH_COMPONENT, NULL, frameDepthTexture.replace());
+    texture2D(sceneRes, GL_RGB, NULL, sceneTexture.replace());
+    texture2D(sceneRes, GL_DEPTH_COMPONENT, NULL, depthTexture.replace());
     fetchGLErrors("Error generating textures:");
 }
 
-//Setup some example barrier configurations
-void cycleBarriers()
+//Rebuilds the scene's targets at the 3D view's size times renderScale, if that's changed
+void resizeSceneTargets()
 {
-    //Not the most efficient, but I didn't setup model matrices to alter so. . .
-    glDeleteVertexArrays(barrierCount, barrierVAOs);
+    Vector2u res = glm::max(Vector2u(Vector2(viewportSize()) * renderScale + 0.5f), Vector2u(16));
+    if (res == sceneRes)
+        return;
+    sceneRes = res;
+    texture2D(sceneRes, GL_RGB, NULL, frameTexture.replace());
+    texture2D(sceneRes, GL_DEPTH_COMPONENT, NULL, frameDepthTexture.replace());
+    texture2D(sceneRes, GL_RGB, NULL, sceneTexture.replace());
+    texture2D(sceneRes, GL_DEPTH_COMPONENT, NULL, depthTexture.replace());
+    fetchGLErrors("Error resizing the scene targets:");
+}
 
-    barrierConfiguartion++;
-    if (barrierConfiguartion > 3)
-    {
-        barrierCount = 0;
-        barrierConfiguartion = 0;
+//Steps the render scale toward the budget, down as soon as it's over and up only when the next step
+//is predicted to fit with room to spare. Fill costs go with the pixel count, the square of the scale.
+void updateRenderScale(double gpuMs)
+{
+    renderMs += (gpuMs - renderMs) * 0.1;
+    if (!dynamicResolution || --renderScaleCooldown > 0)
         return;
-    }
 
-    switch (barrierConfiguartion)
-    {
-    case 1:
-        {
-            //One wall in the middle
-            newCube(Vector3(0.0, 5.0, 0.0), Vector3(1, 5.0, 8.0), &barrierVAOs[0]);
-            newCube(Vector3(0.5, 5.0, 0.0), Vector3(1, 5.0, 2.0), &barrierVAOs[1]);
-            barrierCount = 2;
-            break;
-        }
-    case 2:
-        {
-            //Two walls with a small space in between
-            newCube(Vector3(0.0, 5.0, -4.5), Vector3(1, 5.0, 3.5), &barrierVAOs[0]);
-            newCube(Vector3(0.0, 5.0, 4.5), Vector3(1, 5.0, 3.5), &barrierVAOs[1]);
-            barrierCount = 2;
-            break;
-        }
-    case 3:
-        {
-            //Three walls making up a zigzag
-            newCube(Vector3(4.0, 5.0, 1.0), Vector3(1.0, 5.0, 7.0), &barrierVAOs[0]);
-            newCube(Vector3(0.0, 5.0, -1.0), Vector3(1, 5.0, 7.0), &barrierVAOs[1]);
-            newCube(Vector3(-4.0, 5.0, 1.0), Vector3(1.0, 5.0, 7.0), &barrierVAOs[2]);
-            barrierCount = 3;
-            break;
-        }
-    default:
-        break;
-    }
+    float scale = renderScale;
+    float up = std::min(scale + RENDER_SCALE_STEP, 1.0f);
+    if (renderMs > renderBudget && scale > MIN_RENDER_SCALE)
+        scale = std::max(scale - RENDER_SCALE_STEP, MIN_RENDER_SCALE);
+    else if (renderMs * (up * up) / (scale * scale) < renderBudget * 0.85)
+        scale = up;
+    if (scale == renderScale)
+        return;
+
+    renderMs *= (scale * scale) / (renderScale * renderScale);
+    renderScale = scale;
+    renderScaleCooldown = 30;
+    resizeSceneTargets();
+}
+
+//Step through the example barrier configurations built in initGeometry
+void cycleBarriers()
+{
+    barrierConfiguartion++;
+    if (barrierConfiguartion >= BARRIER_CONFIGURATIONS)
+        barrierConfiguartion = 0;
+    barrierCount = barrierCounts[barrierConfiguartion];
 }
 
 void bakeMaskTexture()
 {
-    unsigned int FBO;
-    glGenFramebuffers(1, &FBO);
+    FramebufferHandle FBO(newFramebuffer("mask baking"));
 
-    glViewport(0.0f, 0.0f, imageRes.x, imageRes.y);
+    setViewport(0, 0, imageRes.x, imageRes.y);
 
     //Setup an orthographic view from above
     //Set to the dimensions of the water plane
@@ -279,24 +485,307 @@ void bakeMaskTexture()
     Matrix4 orthoViewMat = glm::lookAt(Vector3(0.0f, 50.0f, 0.0f), Vector3(0.0f), Vector3(0.0f, 0.0f, -1.0f));
 
     //Draw the geometry
-    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, maskTexture, 0);
+    bindFramebuffer(FBO);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, maskTexture);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     flatShader.setUniform("ModelViewProjection_mat", orthoProjMat*orthoViewMat*Matrix4(1.0));
     flatShader.enable();
     enableTexture2D(0, tileTexture);
     for (int i = 0; i < barrierCount; i++)
     {
-        glBindVertexArray(barrierVAOs[i]);
+        bindVertexArray(barrierWalls[barrierFirst[barrierConfiguartion] + i]);
         glDrawArrays(GL_TRIANGLES, 0, 36);
     }
-    glBindVertexArray(0);
+    countGLCalls(barrierCount + 1);
+    bindVertexArray(0);
     disableTexture(0);
 
-    glDeleteFramebuffers(1, &FBO);
+    //The water takes its mask from the CPU, so that every backend can use it
+    std::vector<unsigned char> mask(imageRes.x * imageRes.y);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, imageRes.x, imageRes.y, GL_RED, GL_UNSIGNED_BYTE, &mask[0]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    countGLCalls(1);
+    water.setMask(&mask[0]);
+
+    FBO.reset();
     fetchGLErrors("Error baking barriers into mask texture:");
 }
 
+//Keep a resolution within what we (and the GPU) can handle
+Vector2u clampImageRes(Vector2u res)
+{
+    int maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    unsigned int maxRes = std::min(maxImageRes, (unsigned int)maxTextureSize);
+    res.x = std::max(minImageRes, std::min(maxRes, res.x));
+    res.y = std::max(minImageRes, std::min(maxRes, res.y));
+    return res;
+}
+
+//-----------------------------------------------------------------
+//Nested grids
+//-----------------------------------------------------------------
+//Size of a nested grid in coarse cells. All of them are the same size.
+Vector2u nestedCoarseSize()
+{
+    return glm::min(nestedRes / nestedRefinement, imageRes);
+}
+
+//Size of a nested grid in its own (fine) cells
+Vector2u nestedGridSize()
+{
+    return nestedCoarseSize() * nestedRefinement;
+}
+
+//Where a nested grid sits, in the coarse grid's texture coordinates
+Vector2 nestedOriginCoords(const NestedGrid &grid)
+{
+    return Vector2(grid.origin) / Vector2(imageRes);
+}
+
+Vector2 nestedExtentCoords()
+{
+    return Vector2(nestedCoarseSize()) / Vector2(imageRes);
+}
+
+//Center a nested grid on its focus, as close as it can get without leaving the coarse grid
+Vector2u nestedOriginFor(Vector2 focus)
+{
+    Vector2u size = nestedCoarseSize();
+    Vector2 corner = focus * Vector2(imageRes) - Vector2(size) * 0.5f;
+    Vector2 maxCorner = Vector2(imageRes - size);
+    corner = glm::clamp(glm::floor(corner + 0.5f), Vector2(0.0f), maxCorner);
+    return Vector2u(corner);
+}
+
+//Move a nested grid by whole coarse cells. What it already had is kept, and anything newly
+//covered is filled in from the coarse grid. With keepContents false it all comes from the coarse grid.
+void moveNestedGrid(NestedGrid &grid, Vector2u newOrigin, unsigned int coarseTexture, bool keepContents)
+{
+    Vector2u size = nestedGridSize();
+    Vector2 previousOrigin = keepContents ? nestedOriginCoords(grid) : Vector2(-2.0f);
+    grid.origin = newOrigin;
+
+    GLenum attachments[] = { GL_COLOR_ATTACHMENT0 };
+    unsigned int nextTexture = 1 - grid.currentTexture;
+    bindFramebuffer(grid.FBO);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, grid.heightTextures[nextTexture]);
+    drawBuffers(1, attachments);
+    setViewport(0, 0, size.x, size.y);
+    bindVertexArray(fullscreenVAO);
+    regridShader.setUniform("fineOrigin", nestedOriginCoords(grid));
+    regridShader.setUniform("previousOrigin", previousOrigin);
+    regridShader.setUniform("fineExtent", nestedExtentCoords());
+    regridShader.enable();
+    enableTexture2D(0, grid.heightTextures[grid.currentTexture]);
+    enableTexture2D(1, coarseTexture);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    countGLCalls(1);
+    disableTexture(1);
+    disableTexture(0);
+    grid.currentTexture = nextTexture;
+}
+
+void createNestedGrids(unsigned int coarseTexture)
+{
+    Vector2u size = nestedGridSize();
+    for (int i = 0; i < NESTED_GRID_COUNT; i++)
+    {
+        NestedGrid &grid = nestedGridList[i];
+        grid.FBO = newFramebuffer("nested grid");
+        texture2D(size, GL_RGBA32F, NULL, &grid.heightTextures[0]);
+        texture2D(size, GL_RGBA32F, NULL, &grid.heightTextures[1]);
+        texture2D(size, GL_RGB16F, NULL, &grid.surfaceDataTexture);
+        grid.currentTexture = 0;
+        bindFramebuffer(grid.FBO);
+        framebufferTexture2D(GL_COLOR_ATTACHMENT1, grid.surfaceDataTexture);
+        moveNestedGrid(grid, nestedOriginFor(grid.focus), coarseTexture, false);
+    }
+    fetchGLErrors("Error creating nested grids:");
+}
+
+void releaseNestedGrids()
+{
+    for (int i = 0; i < NESTED_GRID_COUNT; i++)
+    {
+        NestedGrid &grid = nestedGridList[i];
+        deleteFramebuffers(1, &grid.FBO);
+        deleteTextures(2, grid.heightTextures);
+        deleteTextures(1, &grid.surfaceDataTexture);
+    }
+}
+
+//One step of every nested grid, run right after the same step of the coarse grid. The fine grids
+//read their edges from the coarse grid as it was before the step (coarseTexture), then are averaged
+//back into the coarse grid's result (coarseNextTexture) so it sees their detail.
+void stepNestedGrids(ShaderProgram &physicsShader, bool surfaceData, unsigned int coarseTexture, unsigned int coarseNextTexture)
+{
+    GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    Vector2u size = nestedGridSize();
+    bindVertexArray(fullscreenVAO);
+    enableTexture2D(2, coarseTexture);
+    for (int i = 0; i < NESTED_GRID_COUNT; i++)
+    {
+        NestedGrid &grid = nestedGridList[i];
+        unsigned int nextTexture = 1 - grid.currentTexture;
+        physicsShader.setUniform("fineOrigin", nestedOriginCoords(grid));
+        physicsShader.setUniform("fineExtent", nestedExtentCoords());
+        physicsShader.enable();
+        bindFramebuffer(grid.FBO);
+        setViewport(0, 0, size.x, size.y);
+        enableTexture2D(0, grid.heightTextures[grid.currentTexture]);
+        framebufferTexture2D(GL_COLOR_ATTACHMENT0, grid.heightTextures[nextTexture]);
+        drawBuffers(surfaceData ? 2 : 1, attachments);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+        countGLCalls(1);
+        grid.currentTexture = nextTexture;
+    }
+
+    //Last grid first, so the first one wins where they overlap (as in water_surface.vert)
+    Vector2u coarseSize = nestedCoarseSize();
+    bindFramebuffer(waterFBO);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, coarseNextTexture);
+    drawBuffers(1, attachments);
+    resampleShader.setUniform("targetSize", Vector2(coarseSize));
+    resampleShader.enable();
+    for (int i = NESTED_GRID_COUNT - 1; i >= 0; i--)
+    {
+        NestedGrid &grid = nestedGridList[i];
+        setViewport(grid.origin.x, grid.origin.y, coarseSize.x, coarseSize.y);
+        enableTexture2D(0, grid.heightTextures[grid.currentTexture]);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+        countGLCalls(1);
+    }
+    disableTexture(2);
+}
+
+//Runs the nested grids after every step of the water, which calls this with their shaders (one per
+//combination of PHYSICS_ flags). The water's own mask is still on unit 1 for the brush step.
+void nestedStepCallback(int step, int steps, void *data)
+{
+    ShaderProgram **shaders = (ShaderProgram **)data;
+    int variant = 0;
+    if (step == 0)
+        variant |= PHYSICS_BRUSH;
+    if (step == steps - 1)
+        variant |= PHYSICS_SURFACE_DATA;
+
+    GLWaterBackend *backend = static_cast<GLWaterBackend *>(water.backend());
+    stepNestedGrids(*shaders[variant], (variant & PHYSICS_SURFACE_DATA) != 0, backend->previousHeightTexture(), backend->heightTexture());
+}
+
+//Sixteen pools, each a little different. Gravity goes up from row to row and decay from column to
+//column, and the columns take turns between open water, a pillar, a wall with a gap and a broken ring.
+void createPoolBatch()
+{
+    unsigned int pools = batchTiles * batchTiles;
+    WaterBatchSettings batchSettings;
+    batchSettings.bodySize = batchPoolRes;
+    batchSettings.bodies = pools;
+    batchSettings.startHeight = 0.5f;
+    batchSettings.shaderDirectory = waterSettings.shaderDirectory;
+    waterBatch.init(batchSettings);
+
+    std::vector<unsigned char> mask(batchPoolRes.x * batchPoolRes.y);
+    for (unsigned int i = 0; i < pools; i++)
+    {
+        unsigned int row = i / batchTiles;
+        unsigned int column = i % batchTiles;
+        waterBatch.settings[i].gravity = 0.05f + 0.05f * row;
+        waterBatch.settings[i].decay = 0.999f - 0.001f * column;
+
+        for (unsigned int y = 0; y < batchPoolRes.y; y++)
+        {
+            for (unsigned int x = 0; x < batchPoolRes.x; x++)
+            {
+                Vector2 coords = (Vector2(x, y) + 0.5f) / Vector2(batchPoolRes);
+                float center = glm::distance(coords, Vector2(0.5f));
+                bool barrier = false;
+                if (column == 1)
+                    barrier = center < 0.15f;
+                else if (column == 2)
+                    barrier = fabs(coords.x - 0.5f) < 0.04f && fabs(coords.y - 0.5f) > 0.15f;
+                else if (column == 3)
+                    barrier = center > 0.3f && center < 0.36f && coords.y < 0.7f;
+                mask[y * batchPoolRes.x + x] = barrier ? 255 : 0;
+            }
+        }
+        waterBatch.setMask(i, &mask[0]);
+    }
+}
+
+//Reduce a height texture down to its diagnostics, into the next readback buffer. Each 16x16 block
+//becomes one partial total, and then one group adds those up.
+void queueDiagnostics(unsigned int heightTexture)
+{
+    unsigned int resultBuffer = diagnosticsReadback.begin();
+    if (!resultBuffer)
+        return;
+
+    Vector2u groups = (imageRes + 15u) / 16u;
+    unsigned int partialCount = groups.x * groups.y;
+    if (partialCount > reducePartialsCount)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, reducePartialsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, partialCount * 4 * sizeof(float), NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        trackGPUResource(GPU_BUFFER, reducePartialsBuffer, partialCount * 4 * sizeof(float), "diagnostics partial sums");
+        reducePartialsCount = partialCount;
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, reducePartialsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, resultBuffer);
+
+    waterReduceShader(false).enable();
+    enableTexture2D(0, heightTexture);
+    glDispatchCompute(groups.x, groups.y, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    ShaderProgram &finalShader = waterReduceShader(true);
+    finalShader.setUniform("partialCount", (int)partialCount);
+    finalShader.enable();
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    diagnosticsReadback.end();
+    disableTexture(0);
+    countGLCalls(8);
+    fetchGLErrors("Error reducing diagnostics:");
+}
+
+//Change the simulation resolution without losing what's in it. The water resamples itself
+//(averaged when shrinking), and the barriers are baked into a new mask of the same size.
+void resizeSimulation(Vector2u newRes)
+{
+    newRes = clampImageRes(newRes);
+    if (!water.resize(newRes.x, newRes.y))
+        return;
+    rewindHistory.clear(); //Rewinding doesn't change the size back
+
+    texture2D(newRes, GL_RGB, NULL, maskTexture.replace());
+    imageRes = newRes;
+
+    bakeMaskTexture();
+
+    //The nested grids are sized and placed in coarse cells, so they start over from the new grid
+    if (nestedGrids)
+    {
+        releaseNestedGrids();
+        createNestedGrids(water.bindForRendering(0, 1));
+        disableTexture(1);
+        disableTexture(0);
+    }
+    fetchGLErrors("Error resizing the simulation:");
+}
+
+//Scale both sides of the grid by the same amount, keeping them on multiples of 16
+Vector2u scaleImageRes(Vector2u res, float scale)
+{
+    Vector2u scaled;
+    scaled.x = (unsigned int)(res.x * scale + 8.0f) / 16 * 16;
+    scaled.y = (unsigned int)(res.y * scale + 8.0f) / 16 * 16;
+    return clampImageRes(scaled);
+}
+
 void drawScene(Vector3 cameraPos, Matrix4 viewMat, Matrix4 projectionMat)
 {
     //Draw the skybox
@@ -306,38 +795,72 @@ void drawScene(Vector3 cameraPos, Matrix4 viewMat, Matrix4 projectionMat)
     cubemapShader.enable();
     enableTextureCube(0, cubemapTexture);
     glFrontFace(GL_CW); //Draw this cube's faces facing inward
-    glBindVertexArray(cubemapVAO);
+    bindVertexArray(cubemapVAO);
     glDrawArrays(GL_TRIANGLES, 0, 36);
-    glBindVertexArray(0);
     glFrontFace(GL_CCW);
-    disableTexture(0);
     glDepthMask(GL_TRUE);
+    countGLCalls(5);
     fetchGLErrors("Error drawing skybox:");
 
-        //Draw the pool
+        //Draw the pool. Out on the ocean there's no pool to draw.
     shapeShader.setUniform("cameraPos", cameraPos);
     shapeShader.setUniform("ModelViewProjection_mat", projectionMat*viewMat*Matrix4(1.0));
     shapeShader.enable();
     enableTexture2D(0, tileTexture);
-    glFrontFace(GL_CW); //Draw this cube's faces facing inward
-    glBindVertexArray(poolVAO);
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-    glFrontFace(GL_CCW);
+    if (!oceanMode)
+    {
+        glFrontFace(GL_CW); //Draw this cube's faces facing inward
+        bindVertexArray(poolVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 36);
+        glFrontFace(GL_CCW);
+        countGLCalls(3);
+    }
     fetchGLErrors("Error drawing pool geometry:");
 
     //Draw barrier geometry
     for (int i = 0; i < barrierCount; i++)
     {
-        glBindVertexArray(barrierVAOs[i]);
+        bindVertexArray(barrierWalls[barrierFirst[barrierConfiguartion] + i]);
         glDrawArrays(GL_TRIANGLES, 0, 36);
     }
-    glBindVertexArray(0);
+    countGLCalls(barrierCount);
     disableTexture(0);
     fetchGLErrors("Error drawing barrier geometry:");
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    //Startup is timed from here to the first frame on screen
+    sf::Clock startupClock;
+
+    //"-nocache" builds every program and mip chain from scratch, for timing a cold start
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-nocache") == 0)
+        {
+            programBinaryCache = false;
+            mipChainCache = false;
+        }
+    }
+
+    //Simulation resolution can be set with "-res 256" or "-res 256x128"
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-res") == 0)
+        {
+            unsigned int width = 0, height = 0;
+            int count = sscanf(argv[i + 1], "%ux%u", &width, &height);
+            if (count == 1)
+                height = width;
+            if (count >= 1 && width > 0 && height > 0)
+                imageRes = Vector2u(width, height);
+        }
+
+        //"-benchmark 10" runs for ten seconds, then prints the frame stats as JSON and exits
+        if (strcmp(argv[i], "-benchmark") == 0)
+            benchmarkSeconds = atof(argv[i + 1]);
+    }
+
     //Create context
     sf::ContextSettings settings;
     settings.depthBits = 24;
@@ -345,13 +868,27 @@ int main()
     settings.antialiasingLevel = 1;
     settings.majorVersion = 4.4;
     settings.minorVersion = 3.1;
-    sf::VideoMode vMode(1024, 600, 32);
+    sf::VideoMode vMode(windowSize.x, windowSize.y, 32);
     sf::RenderWindow window(vMode, "Water Block", sf::Style::Default, settings);
 
-    //Initialize!
+    //Initialize! The water's programs are built in create(), so they're timed with the rest.
     initGL();
+    textureStreamer.start();
+    sf::Clock shaderClock;
     initShaders();
+    double shaderMs = shaderClock.getElapsedTime().asMicroseconds() / 1000.0;
     initGeometry();
+    waterSettings.width = imageRes.x;
+    waterSettings.height = imageRes.y;
+    waterSettings.tuneCPU = true; //The first switch to a CPU backend at a new size tunes it, once per machine
+    shaderClock.restart();
+    if (!water.create(WATER_BACKEND_GL_FRAGMENT, waterSettings))
+        std::cout << "Error creating the water simulation" << std::endl;
+    shaderMs += shaderClock.getElapsedTime().asMicroseconds() / 1000.0;
+    bool firstFrame = true;
+    *reducePartialsBuffer.replace() = newBuffer(GL_SHADER_STORAGE_BUFFER, 0, NULL, GL_DYNAMIC_COPY, "diagnostics partial sums");
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    diagnosticsReadback.init(sizeof(WaterDiagnostics));
 
     //Setup the text boxes we want for displaying helpful information
     //-------------------------------------------------------------------------------
@@ -362,6 +899,8 @@ int main()
     sf::Text loopCountTextbox("Physics Loops: 750", font, 16);
     sf::Text calcMSSecondTextbox("Physics Calc Time: 0", font, 16);
     sf::Text calcMSFrameTextbox("Physics Calc Time: 0", font, 16);
+    sf::Text glCallsTextbox("GL Calls: 0", font, 16);
+    sf::Text gridTextbox("Grid: 128x128", font, 16);
     fpsTextbox.setFillColor(sf::Color::Yellow);
     fpsTextbox.setPosition(5.0f, 5.0f);
     loopCountTextbox.setFillColor(sf::Color::Yellow);
@@ -370,9 +909,34 @@ int main()
     calcMSSecondTextbox.setPosition(5.0f, 45.0f);
     calcMSFrameTextbox.setFillColor(sf::Color::Yellow);
     calcMSFrameTextbox.setPosition(5.0f, 65.0f);
+    glCallsTextbox.setFillColor(sf::Color::Yellow);
+    glCallsTextbox.setPosition(5.0f, 85.0f);
+    gridTextbox.setFillColor(sf::Color::Yellow);
+    gridTextbox.setPosition(5.0f, 105.0f);
+    sf::Text diagnosticsTextbox("Volume: 0", font, 16);
+    diagnosticsTextbox.setFillColor(sf::Color::Yellow);
+    diagnosticsTextbox.setPosition(5.0f, 125.0f);
+    sf::Text memoryTextbox("GPU Memory: 0", font, 16);
+    memoryTextbox.setFillColor(sf::Color::Yellow);
+    memoryTextbox.setPosition(5.0f, 145.0f);
+    sf::Text frameTextbox("Frame Time: 0", font, 16);
+    frameTextbox.setFillColor(sf::Color::Yellow);
+    frameTextbox.setPosition(5.0f, 165.0f);
+    sf::Text renderTextbox("Render: 512x600", font, 16);
+    renderTextbox.setFillColor(sf::Color::Yellow);
+    renderTextbox.setPosition(5.0f, 185.0f);
+    sf::VertexArray frameGraphLines(sf::Lines, FrameStats::CAPACITY * 2 + 4); //Made once, refilled each frame
+    int framesThisSecond = 0;
+    float lastVolume = 0.0f;
+    unsigned int diagnosticsFrame = 0;
     unsigned int physicsLoops = 0;
+    double physicsCells = 0; //Cells updated, over all grids
     double physics_msPerSecond = 0;
     double physics_msPerFrame = 0;
+    double physics_gpuMsPerSecond = 0;
+    GPUTimer physicsTimer;
+    physicsTimer.init();
+    renderTimer.init();
 
     int infoIndex = 0;
     const int infoCount = 7;
@@ -392,7 +956,7 @@ int main()
         "Reflection     : "
     };
 
-    //Default values. cameraPosition is given to shapeShader, brush values to drawingShader,
+    //Default values. cameraPosition is given to shapeShader, brush values to the water physics,
     //and everything else to waterSurfaceShader.
     float infoValue[] = {
         30.0f, 0.15f, 25.0f, 0.75f, 0.0f, 0.25f, 0.35f
@@ -407,9 +971,15 @@ int main()
     for (int i = 0; i < infoCount; i++)
     {
         infoString[i].setFillColor(sf::Color::White);
-        infoString[i].setPosition(520.0f, lineSpace);
+        infoString[i].setPosition(previewSize().x + 8.0f, lineSpace);
         lineSpace += 15.0f;
     }
+
+    //What the info strings show, so they're only rebuilt when something changes
+    float shownInfoValue[infoCount];
+    for (int i = 0; i < infoCount; i++)
+        shownInfoValue[i] = std::numeric_limits<float>::quiet_NaN();
+    int shownInfoIndex = -1;
     //-------------------------------------------------------------------------------
 
     //Initialize the clock
@@ -417,9 +987,8 @@ int main()
     sf::Clock secondClock;
     double delta = 0.0;
 
-    //750 water physics loops per second
-    const double physics_dt = 1.0 / 750.0;
-    double accumulator = 0.0;
+    //The water keeps its own fixed timestep, see WaterBlock::advance()
+    double batchAccumulator = 0.0; //The pool batch always runs at the explicit rate
 
     //Setup our 3D view
     Vector2u currentMousePos, lastMousePos = Vector2(sf::Mouse::getPosition(window).x, sf::Mouse::getPosition(window).y);
@@ -429,12 +998,14 @@ int main()
     float rotationX = 0.0f;
     float rotationY = 0.0f;
     Matrix4 modelMatrix = Matrix4(1.0);
-    Matrix4 projectionMatrix = glm::perspective(glm::radians(45.0f), 512.0f / 600.0f, 0.1f, 100.0f);
+    Matrix4 projectionMatrix = glm::perspective(glm::radians(45.0f), (float)viewportSize().x / viewportSize().y, 0.1f, 100.0f);
     Matrix4 viewMatrix = glm::lookAt(cameraPosition, viewCenter, Vector3(0.0, 1.0, 0.0));
 
-    //Index for ping-ponging textures
-    GLushort currentTexture = 0;
-    GLushort nextTexture = 1;
+    //The brush is painted in on the next physics step. If a frame runs no steps, what it added
+    //carries over to the next one that does, and the nested grids need to know about it too.
+    bool leftMouseDown = false;
+    float nestedBrushAmount = 0.0f;
+    unsigned long long threadedSteps = 0; //Steps the simulation thread had taken as of last frame
 
     //Do we need to update the barrier mask texture?
     bool updateMask = true;
@@ -442,6 +1013,12 @@ int main()
     //User input
     bool rightMouseDown = false;
 
+    //Once the water is asleep and nothing else is changing, the frame sleeps too: the loop waits for
+    //the next event instead of drawing the same picture again
+    bool frameAsleep = false;
+    bool hudAsleep = false; //What the HUD shows, so the frame that's held shows it
+    Matrix4 lastViewMatrix = viewMatrix;
+
     while (windowOpen)
     {
         //Delta
@@ -450,16 +1027,16 @@ int main()
 
         //Update FPS and text
         //---------------------------------------------------------
-        int fps = calculateFPS();
-        if (secondClock.getElapsedTime().asMilliseconds() > 999)
+        framesThisSecond++;
+        if (secondClock.getElapsedTime().asMilliseconds() > 999 || water.asleep() != hudAsleep)
         {
             std::stringstream ss;
-            ss << fps;
+            ss << (int)(framesThisSecond / secondClock.getElapsedTime().asSeconds() + 0.5f);
             sf::String textString = ss.str();
             fpsTextbox.setString("FPS: " + textString);
 
             ss.str("");
-            ss << physicsLoops;
+            ss << physicsLoops << " (" << physicsCells / 1000000.0 << "M cells)";
             textString = ss.str();
             loopCountTextbox.setString("Physics Loops: " + textString);
 
@@ -473,27 +1050,135 @@ int main()
             textString = ss.str();
             calcMSFrameTextbox.setString("Physics Calc Time: " + textString + "ms/frame");
 
+            //Calls from the last full frame
+            GLCallStats glCalls = getGLCallStats();
+            ss.str("");
+            ss << glCalls.issued << " (" << glCalls.skipped << " skipped)";
+            textString = ss.str();
+            glCallsTextbox.setString("GL Calls: " + textString + "/frame");
+
+            //Hold the physics budget by stepping the resolution down quickly and back up slowly.
+            //The gap between the two thresholds keeps it from bouncing between two sizes. Sleeping
+            //water costs nothing, which says nothing about what it would cost awake.
+            if (autoResolution && !water.asleep())
+            {
+                double physicsCost = physics_gpuMsPerSecond;
+                if (water.backendType() == WATER_BACKEND_CPU)
+                    physicsCost = physics_msPerSecond;
+                else if (water.backendType() == WATER_BACKEND_CPU_THREADED)
+                    physicsCost = static_cast<ThreadedWaterBackend *>(water.backend())->simulationMsPerSecond();
+                Vector2u newRes = imageRes;
+                if (physicsCost > physicsBudget)
+                    newRes = scaleImageRes(imageRes, 0.8f);
+                else if (physicsCost < physicsBudget * 0.4)
+                    newRes = scaleImageRes(imageRes, 1.25f);
+                if (newRes != imageRes)
+                    resizeSimulation(newRes);
+            }
+
+            ss.str("");
+            ss << imageRes.x << "x" << imageRes.y;
+            if (nestedGrids)
+                ss << " + " << NESTED_GRID_COUNT << "x" << nestedGridSize().x << "x" << nestedGridSize().y << " nested";
+            ss << " (" << (int)physics_gpuMsPerSecond << "ms/s GPU";
+            ss << (autoResolution ? ", auto" : "");
+            if (batchMode)
+                ss << ", " << waterBatch.bodyCount << " pools of " << batchPoolRes.x << "x" << batchPoolRes.y;
+            if (oceanMode)
+                ss << ", " << oceanSettings.size << "x" << oceanSettings.size << " ocean on the " << oceanEngineNames[ocean.engine()];
+            ss << ", " << backendNames[water.backendType()];
+            if (historyMode)
+            {
+                const WaterHistoryStats &history = rewindHistory.stats();
+                ss << ", " << (int)((history.newestStep - history.oldestStep) * 10 / water.stepsPerSecond()) / 10.0
+                   << "s history in " << (history.usedBytes >> 20) << "/" << (history.budgetBytes >> 20) << "MB";
+                if (rewinding)
+                    ss << ", seek " << (int)(history.lastSeekMs * 10.0f) / 10.0 << "ms";
+            }
+            ss << (water.asleep() ? ", asleep)" : ")");
+            hudAsleep = water.asleep();
+            textString = ss.str();
+            gridTextbox.setString("Grid: " + textString);
+            physics_gpuMsPerSecond = 0.0;
+
+            //Volume drift is over the last second, so the brush shows up in it too
+            float volumeDrift = (lastVolume > 0.0f) ? (diagnostics.volume - lastVolume) / lastVolume * 100.0f : 0.0f;
+            lastVolume = diagnostics.volume;
+            ss.str("");
+            ss << diagnostics.volume << " (" << volumeDrift << "%/s), Energy: " << diagnostics.kineticEnergy;
+            ss << ", Max Velocity: " << diagnostics.maxVelocity << ", Active: " << (int)diagnostics.activeCells;
+            textString = ss.str();
+            diagnosticsTextbox.setString("Volume: " + textString);
+
+            //Everything made through the resource helpers, so a leak shows up as this creeping upward
+            GPUMemoryReport memory = getGPUMemoryReport();
+            ss.str("");
+            ss << std::fixed << std::setprecision(1) << memory.totalBytes / 1048576.0 << "MB (";
+            for (int i = 0; i < GPU_RESOURCE_TYPES; i++)
+            {
+                if (i == GPU_FRAMEBUFFER)
+                    continue; //Framebuffers own no memory of their own
+                ss << (i ? ", " : "") << memory.count[i] << " " << gpuResourceTypeName((GPUResourceType)i) << "s";
+                ss << " " << memory.bytes[i] / 1048576.0 << "MB";
+            }
+            ss << ")";
+            textString = ss.str();
+            memoryTextbox.setString("GPU Memory: " + textString);
+
+            //Over the last few seconds of frames, so a single hitch still shows in p99 for a while
+            FrameSummary frames = frameStats.summary();
+            ss.str("");
+            ss << frames.frameMs.p50 << "/" << frames.frameMs.p95 << "/" << frames.frameMs.p99 << "ms, Physics: ";
+            ss << frames.physicsMs.p50 << "/" << frames.physicsMs.p95 << "/" << frames.physicsMs.p99 << "ms, ";
+            ss << frames.stepsPerFrame << " steps/frame, Latency: ";
+            if (frames.latencySamples > 0)
+                ss << frames.latencyMs.p50 << "/" << frames.latencyMs.p95 << "/" << frames.latencyMs.p99 << "ms";
+            else
+                ss << "-";
+            textString = ss.str();
+            frameTextbox.setString("Frame Time (p50/p95/p99): " + textString);
+
+            ss.str("");
+            ss << sceneRes.x << "x" << sceneRes.y << " (" << (int)(renderScale * 100.0f + 0.5f) << "%, " << renderMs << "ms GPU";
+            ss << (dynamicResolution ? ", dynamic)" : ")");
+            textString = ss.str();
+            renderTextbox.setString("Render: " + textString);
+
             secondClock.restart();
+            framesThisSecond = 0;
             physicsLoops = 0;
+            physicsCells = 0;
             physics_msPerSecond = 0.0;
             physics_msPerFrame = 0.0;
         }
 
         for (int i = 0; i < infoCount; i++)
         {
-            std::stringstream ss;
-            ss << infoValue[i];
-            sf::String valueString = ss.str();
-            infoString[i].setString(originString[i] + valueString);
+            if (infoValue[i] != shownInfoValue[i])
+            {
+                std::stringstream ss;
+                ss << infoValue[i];
+                sf::String valueString = ss.str();
+                infoString[i].setString(originString[i] + valueString);
+                shownInfoValue[i] = infoValue[i];
+            }
 
             //Highlight which field is selected
-            if (i == infoIndex)
-                infoString[i].setFillColor(sf::Color::Yellow);
-            else
-                infoString[i].setFillColor(sf::Color::White);
+            if (infoIndex != shownInfoIndex)
+                infoString[i].setFillColor(i == infoIndex ? sf::Color::Yellow : sf::Color::White);
         }
+        shownInfoIndex = infoIndex;
         //---------------------------------------------------------
 
+        resetGLCallStats();
+
+        //Fill in whichever streamed textures are ready
+        if (texturesStreaming && textureStreamer.update() == 0)
+        {
+            texturesStreaming = false;
+            std::cout << "Textures streamed in after " << startupClock.getElapsedTime().asMilliseconds() << "ms" << std::endl;
+        }
+
         //Bake all barrier objects into the mask texture
         if (updateMask)
         {
@@ -502,20 +1187,22 @@ int main()
         }
 
         //Use some mouse info as uniforms so we can draw to a texture
-        glViewport(0.0f, 0.0f, imageRes.x, imageRes.y);
         currentMousePos = Vector2(sf::Mouse::getPosition(window).x, sf::Mouse::getPosition(window).y);
-        float mouseX = (float)(sf::Mouse::getPosition(window).x/512.0);
-        float mouseY = 1.0f - (float)(sf::Mouse::getPosition(window).y/600.0);
-
-        drawingShader.setUniform("mousePosition", Vector2(mouseX, mouseY));
-        drawingShader.setUniform("delta", (float)delta);
+        float mouseX = (float)(sf::Mouse::getPosition(window).x/(double)previewSize().x);
+        float mouseY = 1.0f - (float)(sf::Mouse::getPosition(window).y/(double)previewSize().y);
 
         rotationX = 0.0;
         rotationY = 0.0;
 
         //Handle input
         sf::Event event;
-        while (window.pollEvent(event))
+        bool gotEvent = frameAsleep ? window.waitEvent(event) : window.pollEvent(event);
+        if (frameAsleep)
+        {
+            deltaClock.restart(); //The time spent waiting isn't owed to the water
+            frameStats.restart(); //Nor is it a frame
+        }
+        for (; gotEvent; gotEvent = window.pollEvent(event))
         {
             switch (event.type)
             {
@@ -524,6 +1211,17 @@ int main()
                     windowOpen = false;
                     break;
                 }
+            case sf::Event::Resized:
+                {
+                    //Keep SFML's text at one pixel a unit, and the 3D view's aspect and targets in step
+                    windowSize = Vector2u(std::max(event.size.width, 32u), std::max(event.size.height, 16u));
+                    window.setView(sf::View(sf::FloatRect(0.0f, 0.0f, (float)windowSize.x, (float)windowSize.y)));
+                    projectionMatrix = glm::perspective(glm::radians(45.0f), (float)viewportSize().x / viewportSize().y, 0.1f, 100.0f);
+                    for (int i = 0; i < infoCount; i++)
+                        infoString[i].setPosition(previewSize().x + 8.0f, infoString[i].getPosition().y);
+                    resizeSceneTargets();
+                    break;
+                }
             case sf::Event::KeyPressed:
                 {
                     if (event.key.code == sf::Keyboard::Space)
@@ -532,6 +1230,18 @@ int main()
                         cycleBarriers();
                         updateMask = true;
                     }
+                    if (event.key.code == sf::Keyboard::F)
+                        frameGraph = !frameGraph;
+                    if (event.key.code == sf::Keyboard::R)
+                    {
+                        //Toggle dynamic resolution. Off, the scene is rendered at the 3D view's full size.
+                        dynamicResolution = !dynamicResolution;
+                        if (!dynamicResolution)
+                        {
+                            renderScale = 1.0f;
+                            resizeSceneTargets();
+                        }
+                    }
                     if (event.key.code == sf::Keyboard::Z)
                     {
                         //Turn off barriers
@@ -539,6 +1249,82 @@ int main()
                         cycleBarriers();
                         updateMask = true;
                     }
+                    if (event.key.code == sf::Keyboard::PageUp || event.key.code == sf::Keyboard::PageDown)
+                    {
+                        //Double or halve the simulation resolution. With shift held only the width
+                        //changes, for non-square grids.
+                        Vector2u newRes = imageRes;
+                        bool up = (event.key.code == sf::Keyboard::PageUp);
+                        newRes.x = up ? newRes.x * 2 : newRes.x / 2;
+                        if (!event.key.shift)
+                            newRes.y = up ? newRes.y * 2 : newRes.y / 2;
+                        resizeSimulation(newRes);
+                    }
+                    if (event.key.code == sf::Keyboard::A)
+                    {
+                        //Let the resolution follow the physics budget
+                        autoResolution = !autoResolution;
+                    }
+                    if (event.key.code == sf::Keyboard::E)
+                    {
+                        //Cycle through the backends. The water carries over to each one.
+                        water.setBackend((WaterBackendType)((water.backendType() + 1) % 4));
+
+                        //Nested grids only run with the GL fragment backend
+                        if (nestedGrids && water.backendType() != WATER_BACKEND_GL_FRAGMENT)
+                        {
+                            releaseNestedGrids();
+                            nestedGrids = false;
+                        }
+                    }
+                    if (event.key.code == sf::Keyboard::B)
+                    {
+                        //Toggle the pool batch, which takes over the preview and the brush
+                        batchMode = !batchMode;
+                        batchAccumulator = 0.0;
+                        if (batchMode)
+                            createPoolBatch();
+                        else
+                            waterBatch.release();
+                    }
+                    if (event.key.code == sf::Keyboard::O)
+                    {
+                        //Cycle the ocean: off, FFTs on the CPU, FFTs on the GPU
+                        if (!oceanMode)
+                            oceanMode = ocean.create(oceanSettings, OCEAN_CPU);
+                        else if (ocean.engine() == OCEAN_CPU)
+                            oceanMode = ocean.create(oceanSettings, OCEAN_GPU);
+                        else
+                            oceanMode = false;
+                        if (!oceanMode)
+                            ocean.release();
+                    }
+                    if (event.key.code == sf::Keyboard::H)
+                    {
+                        //Toggle recording the history, starting it afresh
+                        historyMode = !historyMode;
+                        rewindHistory.clear();
+                        rewindStep = 0;
+                        rewindRecordTimer = 0.0;
+                    }
+                    if (event.key.code == sf::Keyboard::N)
+                    {
+                        //Toggle the nested grids, which start out as copies of the coarse grid
+                        nestedGrids = !nestedGrids;
+                        if (nestedGrids)
+                        {
+                            water.setBackend(WATER_BACKEND_GL_FRAGMENT);
+                            for (int i = 0; i < NESTED_GRID_COUNT; i++)
+                                nestedGridList[i].focus = Vector2(0.5f);
+                            createNestedGrids(water.bindForRendering(0, 1));
+                            disableTexture(1);
+                            disableTexture(0);
+                        }
+                        else
+                        {
+                            releaseNestedGrids();
+                        }
+                    }
                     if (event.key.code == sf::Keyboard::Left)
                     {
                         //Allow the user to use either the arrow keys OR the mouse-wheel to adjust values
@@ -594,6 +1380,8 @@ int main()
                 }
             case sf::Event::MouseMoved:
                 {
+                    if (leftMouseDown)
+                        frameStats.input();
                     if (rightMouseDown)
                     {
                         rotationX = ((float)currentMousePos.x - (float)lastMousePos.x) * 0.5;
@@ -608,7 +1396,8 @@ int main()
                 {
                     if (event.mouseButton.button == sf::Mouse::Left)
                     {
-                        drawingShader.setUniform("mouseBtnDown", 1);
+                        leftMouseDown = true;
+                        frameStats.input();
                     }
                     if (event.mouseButton.button == sf::Mouse::Right)
                     {
@@ -620,7 +1409,7 @@ int main()
             case sf::Event::MouseButtonReleased:
                 {
                     rightMouseDown = false;
-                    drawingShader.setUniform("mouseBtnDown", 0);
+                    leftMouseDown = false;
                     break;
                 }
             default:
@@ -646,28 +1435,6 @@ int main()
         Matrix4 uniformMatrix = projectionMatrix * viewMatrix * modelMatrix;
         //---------------------------------------------------
 
-        //Setup for drawing into an intermediate color texture. Since we reuse this Framebuffer Object,
-        //make sure the second attachment is reset back to none (GL_NONE).
-        GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_NONE };
-        glBindFramebuffer(GL_FRAMEBUFFER, waterFBO);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, heightTextures[1], 0);
-        glDrawBuffers(2, attachments);
-
-        //Draw our mouse painting. The contents of maskTexture are stored in colorTexture's blue
-        //channel, and are stored in a height texture which cuts down on additional sampling
-        //in the physics shader.
-        glClear(GL_COLOR_BUFFER_BIT);
-        drawingShader.setUniform("brushSize", infoValue[1]);
-        drawingShader.setUniform("brushPower", infoValue[2]);
-        drawingShader.enable();
-        enableTexture2D(0, maskTexture);
-        enableTexture2D(1, heightTextures[0]); //Sample the previous height texture
-        glBindVertexArray(fullscreenVAO);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-        //glBindVertexArray(0); //Leave fullscreenVAO bound until after the physics loop is done with it
-        disableTexture(0);
-        fetchGLErrors("Error after drawing stage:");
-
         //--------------------------------------------------------
         //Water physics loop
         //--------------------------------------------------------
@@ -681,88 +1448,175 @@ int main()
         //hundreds/thousands of frames per second.
         unsigned int physicsStartTime = deltaClock.getElapsedTime().asMicroseconds();
 
-        accumulator += delta;
+        //The preview shows the pools while the batch is on, so the brush goes to whichever one is under
+        //the mouse. Otherwise it goes to the water.
+        int batchSteps = 0;
+        if (batchMode)
+        {
+            if (leftMouseDown && mouseX >= 0.0f && mouseX < 1.0f && mouseY >= 0.0f && mouseY < 1.0f)
+            {
+                Vector2 tileCoords = Vector2(mouseX, mouseY) * (float)batchTiles;
+                unsigned int pool = (unsigned int)tileCoords.y * batchTiles + (unsigned int)tileCoords.x;
+                waterBatch.brush(pool, glm::fract(tileCoords), infoValue[1] * batchTiles, infoValue[2] * (float)delta);
+            }
+
+            batchAccumulator += delta;
+            batchSteps = (int)(batchAccumulator * EXPLICIT_STEPS_PER_SECOND);
+            batchAccumulator -= batchSteps / (double)EXPLICIT_STEPS_PER_SECOND;
+        }
+        else if (leftMouseDown)
+        {
+            water.inject(mouseX, mouseY, infoValue[1], infoValue[2] * (float)delta);
+            nestedBrushAmount += infoValue[2] * (float)delta;
+        }
 
-        //Second target for rendering
-        attachments[1] = GL_COLOR_ATTACHMENT1;
+        //Keep the nested grids on what they're following. One follows the brush while it's over the
+        //simulation preview, the other the edge of the water nearest the camera. They step along with
+        //the water, from its step callback.
+        ShaderProgram *nestedShaders[4];
+        if (nestedGrids)
+        {
+            if (mouseX >= 0.0f && mouseX <= 1.0f && mouseY >= 0.0f && mouseY <= 1.0f)
+                nestedGridList[NESTED_BRUSH].focus = Vector2(mouseX, mouseY);
+            Vector2 halfPlane = waterPlaneSize * 0.5f;
+            Vector2 nearest = glm::clamp(Vector2(cameraPosition.x, cameraPosition.z), -halfPlane, halfPlane);
+            nestedGridList[NESTED_CAMERA].focus = Vector2(nearest.x + halfPlane.x, halfPlane.y - nearest.y) / waterPlaneSize;
+
+            unsigned int coarseTexture = static_cast<GLWaterBackend *>(water.backend())->heightTexture();
+            for (int i = 0; i < NESTED_GRID_COUNT; i++)
+            {
+                Vector2u newOrigin = nestedOriginFor(nestedGridList[i].focus);
+                if (newOrigin != nestedGridList[i].origin)
+                    moveNestedGrid(nestedGridList[i], newOrigin, coarseTexture, true);
+            }
 
-        while (accumulator >= physics_dt)
+            //Look the variants up once per frame rather than once per step
+            for (int i = 0; i < 4; i++)
+                nestedShaders[i] = &nestedPhysicsShader(i);
+            for (int i = PHYSICS_BRUSH; i < 4; i += 2)
+            {
+                nestedShaders[i]->setUniform("mousePosition", Vector2(mouseX, mouseY));
+                nestedShaders[i]->setUniform("brushSize", infoValue[1]);
+                nestedShaders[i]->setUniform("brushAmount", nestedBrushAmount);
+            }
+        }
+        water.setStepCallback(nestedGrids ? nestedStepCallback : NULL, nestedShaders);
+
+        physics_gpuMsPerSecond += physicsTimer.poll();
+        physicsTimer.begin();
+
+        //Rewinding takes the place of stepping. Whatever was recorded after where it stops is forgotten.
+        bool wasRewinding = rewinding;
+        rewinding = historyMode && sf::Keyboard::isKeyPressed(sf::Keyboard::BackSpace) && !rewindHistory.empty();
+        int physicsSteps = 0;
+        if (rewinding)
         {
-            //Run our water physics
-            waterPhysicsShader.enable();
-            enableTexture2D(0, heightTextures[currentTexture]);
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, heightTextures[nextTexture], 0);
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, surfaceDataTexture, 0);
-            glDrawBuffers(2, attachments);
-            glClear(GL_COLOR_BUFFER_BIT);
-            //glBindVertexArray(fullscreenVAO);
-            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-            //glBindVertexArray(0);
-            disableTexture(1);
-            disableTexture(0);
+            unsigned long long back = (unsigned long long)(delta * water.stepsPerSecond());
+            unsigned long long oldest = rewindHistory.oldestStep();
+            unsigned long long target = (rewindStep > oldest + back) ? rewindStep - back : oldest;
+            if (rewindHistory.restore(target, rewindGrid, &rewindStep))
+                water.backend()->writeState(rewindGrid);
+        }
+        else
+            physicsSteps = water.advance(delta);
+        if (wasRewinding && !rewinding)
+        {
+            rewindHistory.discardAfter(rewindStep);
+            water.wake();
+        }
+        if (physicsSteps > 0)
+            nestedBrushAmount = 0.0f;
 
-            accumulator -= physics_dt;
+        //The simulation thread keeps its own time, so count the steps it actually took
+        if (water.backendType() == WATER_BACKEND_CPU_THREADED)
+        {
+            unsigned long long taken = static_cast<ThreadedWaterBackend *>(water.backend())->stepsTaken();
+            physicsSteps = (taken >= threadedSteps) ? (int)(taken - threadedSteps) : (int)taken;
+            threadedSteps = taken;
+        }
+        physicsLoops += physicsSteps;
+        physicsCells += (double)physicsSteps * imageRes.x * imageRes.y;
 
-            //Ping-pong textures
-            currentTexture++;
-            nextTexture++;
-            if (currentTexture > 1)
-                currentTexture = 0;
-            if (nextTexture > 1)
-                nextTexture = 0;
+        //Recorded a few times a second, after the brush has gone in, whenever the water has moved on
+        if (historyMode && !rewinding)
+        {
+            rewindStep += physicsSteps;
+            rewindRecordTimer += delta;
+            if (rewindRecordTimer >= 1.0 / REWIND_RECORDS_PER_SECOND &&
+                (rewindHistory.empty() || rewindStep > rewindHistory.newestStep()))
+            {
+                rewindRecordTimer = 0.0;
+                water.backend()->readState(rewindGrid);
+                rewindHistory.record(rewindStep, rewindGrid);
+            }
+        }
+        if (nestedGrids)
+            physicsCells += (double)physicsSteps * NESTED_GRID_COUNT * nestedGridSize().x * nestedGridSize().y;
 
-            physicsLoops++;
+        //Every pool in one dispatch per step
+        if (batchMode)
+        {
+            waterBatch.step(batchSteps);
+            physicsCells += (double)batchSteps * waterBatch.bodyCount * batchPoolRes.x * batchPoolRes.y;
+        }
 
-            fetchGLErrors("Error in physics loop:");
+        //The ocean is a few FFTs a frame, whatever the frame's length
+        if (oceanMode)
+        {
+            oceanSeconds += delta;
+            ocean.update(oceanSeconds);
         }
-        glBindVertexArray(0);
+
+        physicsTimer.end();
 
         //Calculate the time it took for the physics step as both ms/frame, and total ms taken out of a second.
         physics_msPerFrame = (deltaClock.getElapsedTime().asMicroseconds() - physicsStartTime) / 1000.0;
         physics_msPerSecond += physics_msPerFrame;
+
+        //Diagnostics for the HUD. Whatever finished since last frame is picked up first.
+        if (diagnosticsReadback.poll(&diagnostics))
+            water.observe(diagnostics);
+        if (diagnosticsFrame++ % diagnosticsInterval == 0)
+        {
+            queueDiagnostics(water.bindForRendering(0, 1));
+            disableTexture(1);
+        }
         //--------------------------------------------------------
         //--------------------------------------------------------
         //--------------------------------------------------------
 
-        //Render the scene into "sceneTexture", and capture scene depth into "depthTexture"
+        //Render the scene once into "frameTexture", capturing its depth in "frameDepthTexture"
         //--------------------------------------------------------
-        //In this example, "sceneTexture" has all of the objects in the scene (or at least the
-        //ones that could be seen underwater) rendered into it while also saving the zBuffer contents.
-        //This texture is passed to the waterSurfaceShader where it, along with depthTexture, are
-        //used to create the visual surface effects.
-        glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneTexture, 0);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
-        glViewport(0.0, 0.0, 512.0, 600.0);
+        //In this example, the frame has all of the objects in the scene (or at least the ones that
+        //could be seen underwater) rendered into it while also saving the zBuffer contents. These are
+        //copied into "sceneTexture" and "depthTexture", which are passed to the waterSurfaceShader
+        //to create the visual surface effects. A texture can't be sampled while it's being rendered
+        //to, but a copy is far cheaper than drawing the whole scene a second time.
+        //The render scale moves on the GPU time of a frame or two ago, before anything is drawn at it
+        if (renderTimer.poll() > 0.0)
+            updateRenderScale(renderTimer.lastMs);
+        renderTimer.begin();
+
+        GLenum attachments[] = { GL_COLOR_ATTACHMENT0 };
+        bindFramebuffer(sceneFBO);
+        framebufferTexture2D(GL_COLOR_ATTACHMENT0, frameTexture);
+        framebufferTexture2D(GL_DEPTH_ATTACHMENT, frameDepthTexture);
+        drawBuffers(1, attachments);
+        setViewport(0, 0, sceneRes.x, sceneRes.y);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        countGLCalls(1);
         fetchGLErrors("Problem setting up framebuffer for scene render:");
 
         drawScene(cameraPosition, viewMatrix, projectionMatrix);
-        //--------------------------------------------------------
-
-        //-----------------------------------------------------
-        //View Output
-        //-----------------------------------------------------
-
-        //Display desired texture preview on the left side of the screen.  .  .
-        glBindFramebuffer(GL_FRAMEBUFFER, 0); //Default framebuffer
-        glViewport(0.0, 0.0, 512.0, 600.0);
-
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        imageShader.enable();
-        enableTexture2D(0, heightTextures[0]);
-        glBindVertexArray(fullscreenVAO);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-        glBindVertexArray(0);
-        disableTexture(0);
-        fetchGLErrors("Problem drawing texture preview:");
 
-        //. . . and draw the 3D results on the right
-        glViewport(512.0, 0.0, 512.0, 600.0);
-        drawScene(cameraPosition, viewMatrix, projectionMatrix);
+        copyTexture2D(sceneRes, frameTexture, sceneTexture);
+        copyTexture2D(sceneRes, frameDepthTexture, depthTexture);
+        countGLCalls(2);
+        fetchGLErrors("Problem copying scene for refraction:");
+        //--------------------------------------------------------
 
-        //Draw our WaterBlock. The heightmap texture is used in the vertex shader to alter the
-        //geometry. The other 4 are used in the fragment shader for extra visual juiciness.
+        //Draw our WaterBlock on top of the scene. The heightmap texture is used in the vertex shader
+        //to alter the geometry. The other 4 are used in the fragment shader for extra visual juiciness.
         //-----------------------------------------------------------------
         waterSurfaceShader.setUniform("cameraPos", cameraPosition);
         waterSurfaceShader.setUniform("ModelViewProjection_mat", uniformMatrix);
@@ -771,59 +1625,181 @@ int main()
         waterSurfaceShader.setUniform("refractionStrength", infoValue[5]);
         waterSurfaceShader.setUniform("reflectionStrength", infoValue[6]);
         waterSurfaceShader.enable();
-        enableTexture2D(0, heightTextures[0]);
-        enableTexture2D(1, surfaceDataTexture);
+        water.bindForRendering(0, 1);
         enableTexture2D(2, sceneTexture);
         enableTexture2D(3, depthTexture);
         enableTextureCube(4, cubemapTexture);
+        waterSurfaceShader.setUniform("nestedCount", nestedGrids ? NESTED_GRID_COUNT : 0);
+        waterSurfaceShader.setUniform("ocean", (int)oceanMode);
+        waterSurfaceShader.setUniform("farField", 0);
+        float oceanFarLod = 0.0f;
+        if (oceanMode)
+        {
+            //Level with the grid's water, at whatever mip matches the far field's vertex spacing
+            float cellSize = oceanSettings.tileSize / oceanSettings.size;
+            float vertexSpacing = oceanPlaneSize.x / oceanPlaneDensity.x;
+            waterSurfaceShader.setUniform("oceanTileSize", oceanSettings.tileSize);
+            waterSurfaceShader.setUniform("oceanLevel", diagnostics.volume / (imageRes.x * imageRes.y));
+            waterSurfaceShader.setUniform("oceanBlend", OCEAN_BLEND);
+            waterSurfaceShader.setUniform("oceanLod", 0.0f);
+            waterSurfaceShader.setUniform("gridSize", waterPlaneSize);
+            oceanFarLod = std::max(std::log2(vertexSpacing / cellSize), 0.0f);
+            ocean.bindForRendering(9, 10);
+        }
+        for (int i = 0; i < NESTED_GRID_COUNT && nestedGrids; i++)
+        {
+            std::string index = "[" + std::to_string(i) + "]";
+            waterSurfaceShader.setUniform(("nestedOrigins" + index).c_str(), nestedOriginCoords(nestedGridList[i]));
+            waterSurfaceShader.setUniform(("nestedExtents" + index).c_str(), nestedExtentCoords());
+            enableTexture2D(5 + i, nestedGridList[i].heightTextures[nestedGridList[i].currentTexture]);
+            enableTexture2D(7 + i, nestedGridList[i].surfaceDataTexture);
+        }
         //glDisable(GL_CULL_FACE); //Double-sided water surface
-        glBindVertexArray(waterBlockVAO);
+        bindVertexArray(waterBlockVAO);
         glDrawElements(GL_TRIANGLES, waterBlockElements, GL_UNSIGNED_SHORT, 0);
-        glBindVertexArray(0);
+        countGLCalls(1);
+        if (oceanMode)
+        {
+            waterSurfaceShader.setUniform("farField", 1);
+            waterSurfaceShader.setUniform("oceanLod", oceanFarLod);
+            bindVertexArray(oceanVAO);
+            glDrawElements(GL_TRIANGLES, oceanElements, GL_UNSIGNED_SHORT, 0);
+            countGLCalls(1);
+            disableTexture(10);
+            disableTexture(9);
+        }
         //glEnable(GL_CULL_FACE);
+        for (int i = 5; i < 9 && nestedGrids; i++)
+            disableTexture(i);
         disableTexture(4);
         disableTexture(3);
         disableTexture(2);
         disableTexture(1);
         disableTexture(0);
+        renderTimer.end();
         fetchGLErrors("Error drawing water:");
+        //-----------------------------------------------------------------
+
+        //-----------------------------------------------------
+        //View Output
+        //-----------------------------------------------------
+
+        //Display desired texture preview on the left side of the screen.  .  .
+        bindFramebuffer(0); //Default framebuffer
+        setViewport(0, 0, previewSize().x, previewSize().y);
+
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        if (batchMode)
+        {
+            imageArrayShader.enable();
+            enableTextureArray(0, waterBatch.currentHeightTexture());
+        }
+        else
+        {
+            imageShader.enable();
+            water.bindForRendering(0, 1);
+            disableTexture(1);
+        }
+        bindVertexArray(fullscreenVAO);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+        countGLCalls(2);
+        disableTexture(0);
+        fetchGLErrors("Problem drawing texture preview:");
+
+        //. . . and put the finished 3D frame on the right
+        blitFramebuffer(sceneFBO, sceneRes, 0, previewSize().x, 0, viewportSize());
+        fetchGLErrors("Problem presenting the scene:");
         //-----------------------------------------------------
         //-----------------------------------------------------
         //-----------------------------------------------------
 
-        //Draw text boxes
+        //Draw text boxes. SFML needs our VAO out of the way, and leaves GL state we can't track.
+        bindVertexArray(0);
         window.pushGLStates();
         window.draw(fpsTextbox);
         window.draw(loopCountTextbox);
         window.draw(calcMSSecondTextbox);
         window.draw(calcMSFrameTextbox);
+        window.draw(glCallsTextbox);
+        window.draw(gridTextbox);
+        window.draw(diagnosticsTextbox);
+        window.draw(memoryTextbox);
+        window.draw(frameTextbox);
+        window.draw(renderTextbox);
+        if (frameGraph)
+        {
+            updateFrameGraph(frameGraphLines, windowSize.y - 5.0f);
+            window.draw(frameGraphLines);
+        }
         for (int i = 0; i < infoCount; i++)
             window.draw(infoString[i]);
         window.popGLStates();
+        invalidateGLState();
+        setBlending(true, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); //popGLStates put it back, but the cache can't know that
 
         //Swap buffers and display
         //glFlush();
         window.display();
         fetchGLErrors("Error with final display:");
+        frameStats.presented(physics_msPerFrame, physicsSteps);
 
+        //Waits for the first frame to actually finish, just this once
+        if (firstFrame)
+        {
+            glFinish();
+            ProgramCacheStats programs = getProgramCacheStats();
+            std::cout << "First frame after " << startupClock.getElapsedTime().asMilliseconds() << "ms (";
+            std::cout << shaderMs << "ms building " << programs.loaded + programs.compiled << " programs, ";
+            std::cout << programs.loaded << " of them from the binary cache)" << std::endl;
+            firstFrame = false;
+        }
+
+        frameAsleep = water.asleep() && hudAsleep && !texturesStreaming && !batchMode && !oceanMode && !rewinding && benchmarkSeconds <= 0.0 && !leftMouseDown && !rightMouseDown && viewMatrix == lastViewMatrix;
+        lastViewMatrix = viewMatrix;
+
+        if (benchmarkSeconds > 0.0 && startupClock.getElapsedTime().asSeconds() > benchmarkSeconds)
+        {
+            frameStats.printJSON(stdout);
+            windowOpen = false;
+        }
     }
 
     //Cleanup a bit
-    glDeleteBuffers(1, &waterFBO);
-    glDeleteBuffers(1, &sceneFBO);
-    glDeleteVertexArrays(1, &fullscreenVAO);
-    glDeleteVertexArrays(1, &waterBlockVAO);
-    glDeleteVertexArrays(1, &poolVAO);
-    glDeleteVertexArrays(1, &cubemapVAO);
-    glDeleteVertexArrays(barrierCount, barrierVAOs);
-    glDeleteTextures(1, &maskTexture);
-    glDeleteTextures(1, &colorTexture);
-    glDeleteTextures(2, heightTextures);
-    glDeleteTextures(1, &surfaceDataTexture);
-    glDeleteTextures(1, &sceneTexture);
-    glDeleteTextures(1, &depthTexture);
-    glDeleteTextures(1, &tileTexture);
-    glDeleteTextures(1, &cubemapTexture);
+    textureStreamer.stop();
+    physicsTimer.release();
+    renderTimer.release();
+    diagnosticsReadback.release();
+    if (batchMode)
+        waterBatch.release();
+    reducePartialsBuffer.reset();
+    water.destroy();
+    if (nestedGrids)
+        releaseNestedGrids();
+    ocean.release();
+    waterFBO.reset();
+    sceneFBO.reset();
+    fullscreenVAO.reset();
+    waterBlockVAO.reset();
+    poolVAO.reset();
+    cubemapVAO.reset();
+    oceanVAO.reset();
+    for (int i = 0; i < 7; i++)
+        barrierWalls[i].reset();
+    maskTexture.reset();
+    frameTexture.reset();
+    frameDepthTexture.reset();
+    sceneTexture.reset();
+    depthTexture.reset();
+    tileTexture.reset();
+    cubemapTexture.reset();
+    ShaderProgram *programs[] = { &imageShader, &waterSurfaceShader, &shapeShader, &flatShader,
+                                  &cubemapShader, &resampleShader, &regridShader, &imageArrayShader };
+    for (int i = 0; i < 8; i++)
+        programs[i]->release();
+    releaseShaderVariants();
+
+    //Anything still registered now was made and never deleted
+    reportGPULeaks();
 
     //Get any last errors before closing out
     if (fetchGLErrors("Error after cleanup:"))
@@ -0,0 +1,177 @@
+#include "memory_arena.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<int> arenaPages(ARENA_TRANSPARENT_HUGE_PAGES);
+
+void MemoryArena::setPages(ArenaPages pages)
+{
+    arenaPages = pages;
+}
+
+ArenaPages MemoryArena::pages()
+{
+    return (ArenaPages)arenaPages.load();
+}
+
+MemoryArena::MemoryArena() : base(NULL), size(0), offset(0), mode(ARENA_HEAP), heapBlock(NULL)
+{
+}
+
+MemoryArena::~MemoryArena()
+{
+    release();
+}
+
+static std::size_t roundUp(std::size_t bytes, std::size_t multiple)
+{
+    return (bytes + multiple - 1) / multiple * multiple;
+}
+
+#ifdef _WIN32
+//Large pages need SeLockMemoryPrivilege, which hardly anyone has, so they quietly fall back to
+//normal pages. There's no transparent version.
+static char *mapPages(std::size_t &bytes, ArenaPages &mode)
+{
+    if (mode == ARENA_EXPLICIT_HUGE_PAGES)
+    {
+        std::size_t large = GetLargePageMinimum();
+        if (large > 0)
+        {
+            std::size_t largeBytes = roundUp(bytes, large);
+            void *memory = VirtualAlloc(NULL, largeBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (memory)
+            {
+                bytes = largeBytes;
+                return (char *)memory;
+            }
+        }
+    }
+    mode = ARENA_PAGES;
+    bytes = roundUp(bytes, 4096);
+    return (char *)VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void unmapPages(char *memory, std::size_t bytes)
+{
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+#else
+static char *mapPages(std::size_t &bytes, ArenaPages &mode)
+{
+#ifdef MAP_HUGETLB
+    if (mode == ARENA_EXPLICIT_HUGE_PAGES)
+    {
+        std::size_t hugeBytes = roundUp(bytes, MemoryArena::HUGE_PAGE_SIZE);
+        void *memory = mmap(NULL, hugeBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+        {
+            bytes = hugeBytes;
+            return (char *)memory;
+        }
+        mode = ARENA_TRANSPARENT_HUGE_PAGES; //The pool is empty (vm.nr_hugepages)
+    }
+#else
+    if (mode == ARENA_EXPLICIT_HUGE_PAGES)
+        mode = ARENA_TRANSPARENT_HUGE_PAGES;
+#endif
+
+#ifdef MADV_HUGEPAGE
+    //Only worth it for something at least a huge page big. Rounding up to whole huge pages lets the
+    //kernel back all of it, not just the middle.
+    if (mode == ARENA_TRANSPARENT_HUGE_PAGES && bytes >= MemoryArena::HUGE_PAGE_SIZE)
+    {
+        bytes = roundUp(bytes, MemoryArena::HUGE_PAGE_SIZE);
+        void *memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return NULL;
+        madvise(memory, bytes, MADV_HUGEPAGE);
+        return (char *)memory;
+    }
+#endif
+
+    mode = ARENA_PAGES;
+    bytes = roundUp(bytes, (std::size_t)sysconf(_SC_PAGESIZE));
+    void *memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (memory == MAP_FAILED) ? NULL : (char *)memory;
+}
+
+static void unmapPages(char *memory, std::size_t bytes)
+{
+    munmap(memory, bytes);
+}
+#endif
+
+bool MemoryArena::reserve(std::size_t bytes)
+{
+    release();
+    if (bytes == 0)
+        return true;
+
+    mode = pages();
+    bytes = roundUp(bytes, ALIGNMENT);
+    if (mode == ARENA_HEAP)
+    {
+        heapBlock = malloc(bytes + ALIGNMENT);
+        if (!heapBlock)
+            return false;
+        base = (char *)(((std::uintptr_t)heapBlock + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+    }
+    else
+    {
+        base = mapPages(bytes, mode);
+        if (!base)
+            return false;
+    }
+    size = bytes;
+    offset = 0;
+    return true;
+}
+
+void MemoryArena::release()
+{
+    if (heapBlock)
+        free(heapBlock);
+    else if (base)
+        unmapPages(base, size);
+    base = NULL;
+    heapBlock = NULL;
+    size = 0;
+    offset = 0;
+}
+
+void MemoryArena::swap(MemoryArena &other)
+{
+    std::swap(base, other.base);
+    std::swap(size, other.size);
+    std::swap(offset, other.offset);
+    std::swap(mode, other.mode);
+    std::swap(heapBlock, other.heapBlock);
+}
+
+void *MemoryArena::allocate(std::size_t bytes)
+{
+    std::size_t block = blockBytes(bytes);
+    if (!base || block > size - offset)
+        return NULL;
+    void *memory = base + offset;
+    offset += block;
+    return memory;
+}
+
+void MemoryArena::reset()
+{
+    offset = 0;
+}
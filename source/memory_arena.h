@@ -0,0 +1,87 @@
+#ifndef _MEMORY_ARENA_H_
+#define _MEMORY_ARENA_H_
+
+//Memory for the CPU solvers' grids. An arena is one page aligned reservation, carved into blocks
+//that each start on a cache line, and handed back all at once. A 2048x2048 grid is five channels and
+//its scratch in one mapping, which on huge pages takes a few dozen TLB entries instead of thousands.
+//
+//Pages are mapped untouched, so each one lands on the NUMA node of the thread that first writes it.
+//Whoever steps a grid should be the one to size it (CPUWaterGrid::resize() zeroes every channel).
+//CPUStepper::prepare() goes further, having each of its threads zero the tiles it steps.
+//
+//    MemoryArena arena;
+//    arena.reserve(bytes);                      //Nothing is touched yet
+//    float *heights = arena.allocate<float>(cells);
+//    ...
+//    arena.reset();                             //Everything goes at once, the pages stay mapped
+
+#include <cstddef>
+
+enum ArenaPages
+{
+    ARENA_HEAP,                   //The plain heap, aligned by hand. What the grids used before.
+    ARENA_PAGES,                  //Mapped straight from the OS, in normal pages
+    ARENA_TRANSPARENT_HUGE_PAGES, //Mapped, then advised onto huge pages (Linux THP) when it's big enough
+    ARENA_EXPLICIT_HUGE_PAGES     //From the reserved huge page pool, falling back to the above if it's empty
+};
+
+class MemoryArena
+{
+public:
+    static const std::size_t ALIGNMENT = 64;               //Every block starts on a cache line
+    static const std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    MemoryArena();
+    ~MemoryArena();
+
+    //Maps at least bytes, untouched, in the current pages() mode. Anything already reserved goes first.
+    bool reserve(std::size_t bytes);
+    void release();
+    void swap(MemoryArena &other);
+
+    //The next block, or NULL if there's no room. The arena never grows, so nothing it's handed out
+    //ever moves.
+    void *allocate(std::size_t bytes);
+    template <typename T>
+    T *allocate(std::size_t count) { return (T *)allocate(count * sizeof(T)); }
+    void reset();
+
+    std::size_t used() const { return offset; }
+    std::size_t capacity() const { return size; }
+    ArenaPages backing() const { return mode; } //What it actually got, after any fallback
+
+    //Bytes a block takes in an arena, rounded up to the alignment
+    static std::size_t blockBytes(std::size_t bytes) { return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+    //Blocks that are read together shouldn't be a power of two apart: the same offset into each then
+    //falls in the same cache set, and on huge pages (physically contiguous) that holds for every
+    //level of cache. On a power of two grid, channels carved back to back are exactly that, which
+    //made stepping 2.6 to 2.8 times slower. allocatePadded() leaves a page and a few cache lines after
+    //its block, so consecutive padded blocks are staggered; paddedBytes() is what it takes.
+    static const std::size_t PADDING = 4096 + 3 * ALIGNMENT;
+    static std::size_t paddedBytes(std::size_t bytes) { return blockBytes(bytes) + PADDING; }
+    template <typename T>
+    T *allocatePadded(std::size_t count)
+    {
+        T *block = allocate<T>(count);
+        if (block)
+            allocate(PADDING);
+        return block;
+    }
+
+    //What every reserve() from now on asks for. ARENA_TRANSPARENT_HUGE_PAGES to start with.
+    static void setPages(ArenaPages pages);
+    static ArenaPages pages();
+
+private:
+    MemoryArena(const MemoryArena &);
+    MemoryArena &operator=(const MemoryArena &);
+
+    char *base;
+    std::size_t size;
+    std::size_t offset;
+    ArenaPages mode;
+    void *heapBlock; //ARENA_HEAP: what malloc() returned, before aligning
+};
+
+#endif // _MEMORY_ARENA_H_
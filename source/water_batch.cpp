@@ -0,0 +1,116 @@
+#include "water_batch.h"
+
+//Start every body as still water at the same height, with no barriers
+void WaterBatch::init(const WaterBatchSettings &batchSettings)
+{
+    size = batchSettings.bodySize;
+    bodyCount = batchSettings.bodies;
+    shaderDirectory = batchSettings.shaderDirectory;
+    const float startHeight = batchSettings.startHeight;
+    currentTexture = 0;
+    settings.assign(bodyCount, BatchBodySettings());
+    settingsChanged = true;
+
+    textureArray(size, bodyCount, GL_RGBA32F, &heightTextures[0]);
+    textureArray(size, bodyCount, GL_RGBA32F, &heightTextures[1]);
+    textureArray(size, bodyCount, GL_R8, &maskTexture);
+
+    std::vector<float> still(size.x * size.y * 4 * bodyCount, 0.0f);
+    for (std::size_t i = 0; i < still.size(); i += 4)
+        still[i + 1] = startHeight;
+    std::vector<unsigned char> open(size.x * size.y * bodyCount, 0);
+    bindTexture(GL_TEXTURE_2D_ARRAY, heightTextures[0]);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, size.x, size.y, bodyCount, GL_RGBA, GL_FLOAT, &still[0]);
+    bindTexture(GL_TEXTURE_2D_ARRAY, maskTexture);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, size.x, size.y, bodyCount, GL_RED, GL_UNSIGNED_BYTE, &open[0]);
+    bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    settingsBuffer = newBuffer(GL_SHADER_STORAGE_BUFFER, bodyCount * sizeof(BatchBodySettings), NULL, GL_DYNAMIC_DRAW, "water batch settings");
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    fetchGLErrors("Error creating water batch:");
+}
+
+void WaterBatch::release()
+{
+    deleteTextures(2, heightTextures);
+    deleteTextures(1, &maskTexture);
+    deleteBuffers(1, &settingsBuffer);
+    bodyCount = 0;
+}
+
+//Nonzero values are barriers. The mask is picked up by the next step.
+void WaterBatch::setMask(unsigned int body, const unsigned char *mask)
+{
+    bindTexture(GL_TEXTURE_2D_ARRAY, maskTexture);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, body, size.x, size.y, 1, GL_RED, GL_UNSIGNED_BYTE, mask);
+    bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+//Add water to (or take it from) one body on its next step
+void WaterBatch::brush(unsigned int body, Vector2 position, float brushSize, float amount)
+{
+    settings[body].brushX = position.x;
+    settings[body].brushY = position.y;
+    settings[body].brushSize = brushSize;
+    settings[body].brushAmount += amount;
+    settingsChanged = true;
+}
+
+static ShaderProgram &waterBatchShader(const std::string &shaderDirectory, Vector2u size, bool brush)
+{
+    std::string computeFile = shaderDirectory + "water_batch.comp";
+    ShaderVariant variant(computeFile.c_str());
+    variant.define("GRID_WIDTH", (float)size.x);
+    variant.define("GRID_HEIGHT", (float)size.y);
+    variant.sampler("height_texture", 0);
+    if (brush)
+    {
+        variant.define("BRUSH");
+        variant.sampler("mask_texture", 1);
+    }
+    return loadShaderVariant(variant);
+}
+
+//One dispatch per step covers every body. Like the single simulation, the first step folds in the
+//brush and the masks, and the others only move water around.
+void WaterBatch::step(int steps)
+{
+    if (steps <= 0 || bodyCount == 0)
+        return;
+
+    //Settings only go to the GPU when something changed. Brushes only last one step, so if any were
+    //used, the cleared amounts go up next time.
+    if (settingsChanged)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, settingsBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bodyCount * sizeof(BatchBodySettings), &settings[0]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        settingsChanged = false;
+        for (unsigned int i = 0; i < bodyCount; i++)
+        {
+            if (settings[i].brushAmount != 0.0f)
+                settingsChanged = true;
+            settings[i].brushAmount = 0.0f;
+        }
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, settingsBuffer);
+    enableTextureArray(1, maskTexture);
+
+    ShaderProgram &brushShader = waterBatchShader(shaderDirectory, size, true);
+    ShaderProgram &stepShader = waterBatchShader(shaderDirectory, size, false);
+    for (int i = 0; i < steps; i++)
+    {
+        unsigned int nextTexture = 1 - currentTexture;
+        (i == 0 ? brushShader : stepShader).enable();
+        enableTextureArray(0, heightTextures[currentTexture]);
+        bindImageTexture(0, heightTextures[nextTexture], GL_RGBA32F, true);
+        glDispatchCompute((size.x + 7) / 8, (size.y + 7) / 8, bodyCount);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        countGLCalls(2);
+        currentTexture = nextTexture;
+    }
+    disableTexture(1);
+    disableTexture(0);
+    fetchGLErrors("Error stepping water batch:");
+}
@@ -0,0 +1,54 @@
+#ifndef _WATER_BATCH_H_
+#define _WATER_BATCH_H_
+
+//Many small, independent bodies of water of the same size, simulated together. Each body is one layer
+//of a texture array with its own mask and its own settings, and every body is stepped by a single
+//compute dispatch (shaders/water_batch.comp). Bind, dispatch and barrier costs are paid once per step
+//for the whole batch, instead of once per body.
+
+#include "common.h"
+
+#include <string>
+
+//The batch as a whole
+struct WaterBatchSettings
+{
+    Vector2u bodySize = Vector2u(64);
+    unsigned int bodies = 1;
+    float startHeight = 0.5f;                 //Every body starts still at this height, with no barriers
+    const char *shaderDirectory = "shaders/"; //Where water_batch.comp is, with the trailing slash
+};
+
+//One body's settings. Laid out to match the Body struct in water_batch.comp (two vec4s).
+struct BatchBodySettings
+{
+    float gravity = 0.1f;
+    float decay = 0.998f;
+    float brushSize = 0.0f;
+    float brushAmount = 0.0f; //Height added under the brush on the next step (power * time held)
+    float brushX = 0.0f;      //Brush position in texture coordinates
+    float brushY = 0.0f;
+    float unused[2] = { 0.0f, 0.0f };
+};
+
+struct WaterBatch
+{
+    Vector2u size;
+    unsigned int bodyCount = 0;
+    unsigned int heightTextures[2]; //GL_TEXTURE_2D_ARRAY, velocity, height and mask like heightTextures in main.cpp
+    unsigned int maskTexture;       //GL_TEXTURE_2D_ARRAY, anything above 0 is a barrier
+    unsigned int settingsBuffer;    //One BatchBodySettings per body
+    unsigned int currentTexture = 0;
+    std::vector<BatchBodySettings> settings;
+    bool settingsChanged = true;
+    std::string shaderDirectory;
+
+    void init(const WaterBatchSettings &batchSettings);
+    void release();
+    void setMask(unsigned int body, const unsigned char *mask); //bodySize.x * bodySize.y values
+    void brush(unsigned int body, Vector2 position, float brushSize, float amount);
+    void step(int steps);
+    unsigned int currentHeightTexture() const { return heightTextures[currentTexture]; }
+};
+
+#endif // _WATER_BATCH_H_
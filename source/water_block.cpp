@@ -0,0 +1,386 @@
+#include "water_block.h"
+
+#ifdef WATERBLOCK_WITH_GL
+#include "common.h"
+#include "water_block_gl.h"
+#endif
+#include "cpu_stepper.h"
+#include "water_thread.h"
+
+#include <iostream>
+
+//-----------------------------------------------------------------
+//CPU backend
+//-----------------------------------------------------------------
+//The solvers from cpu_solver.cpp. With OpenGL available, bindForRendering() uploads the state into
+//textures laid out like the GL backends' (see GridTextures). Once they exist, the stepper writes its
+//last block straight into the next upload.
+class CPUWaterBackend : public WaterBackend
+{
+public:
+    CPUWaterBackend() : uploaded(false) {}
+
+    bool create(const WaterBlockSettings &settings)
+    {
+        solver.gravity = settings.gravity;
+        solver.decay = settings.decay;
+        implicit = settings.implicit;
+        implicitStepsPerSecond = settings.implicitStepsPerSecond;
+        stepper.init(stepperTuningFor(settings.width, settings.height, settings.tuneCPU));
+        stepper.prepare(grid, settings.width, settings.height);
+        uploaded = false;
+#ifdef WATERBLOCK_WITH_GL
+        textures.shaderDirectory = settings.shaderDirectory;
+#endif
+        return true;
+    }
+
+    void destroy()
+    {
+        stepper.release();
+#ifdef WATERBLOCK_WITH_GL
+        textures.release();
+#endif
+    }
+
+    float stepsPerSecond() const
+    {
+        return implicit ? implicitStepsPerSecond : EXPLICIT_STEPS_PER_SECOND;
+    }
+
+    //Every injection goes in before the first step, like the brush on the GPU. Without a callback to
+    //call after each step, explicit steps all go to the stepper at once.
+    void step(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData)
+    {
+        int batch = (implicit || callback) ? 1 : steps;
+        for (int i = 0; i < steps; i += batch)
+        {
+            if (i == 0)
+            {
+                for (std::size_t j = 0; j < injections.size(); j++)
+                    injectWater(grid, injections[j].x, injections[j].y, injections[j].radius, injections[j].amount);
+                injections.clear();
+            }
+
+            if (implicit)
+                stepImplicit(grid, solver, implicitStepsPerSecond);
+            else
+            {
+                float *planes = uploadPlanes(i + batch >= steps);
+                stepper.step(grid, solver, batch, planes, planes ? planes + (std::size_t)grid.width * grid.height : NULL);
+            }
+
+            if (callback)
+                callback(i, steps, callbackData);
+        }
+        if (steps > 0)
+            uploaded = false;
+    }
+
+    void setMask(const unsigned char *mask)
+    {
+        applyMask(grid, mask);
+        gridChanged();
+    }
+
+    void readState(CPUWaterGrid &state)
+    {
+        copyGridState(grid, state);
+    }
+
+    void writeState(const CPUWaterGrid &state)
+    {
+        copyGridState(state, grid);
+        gridChanged();
+    }
+
+    bool resize(unsigned int width, unsigned int height)
+    {
+        CPUStepTuning tuning;
+        if (loadStepperTuning(width, height, tuning))
+            stepper.init(tuning);
+        stepper.resize(grid, width, height);
+        gridChanged();
+        return true;
+    }
+
+    unsigned int bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit)
+    {
+#ifdef WATERBLOCK_WITH_GL
+        if (!uploaded)
+            textures.upload(grid);
+        uploaded = true;
+        textures.bind(heightUnit, surfaceDataUnit);
+        return textures.heightTexture;
+#else
+        (void)heightUnit;
+        (void)surfaceDataUnit;
+        return 0;
+#endif
+    }
+
+private:
+    //The next upload's planes (velocities, then heights) for the last batch of a step, once there
+    //are textures to upload to, otherwise NULL
+    float *uploadPlanes(bool lastBatch)
+    {
+#ifdef WATERBLOCK_WITH_GL
+        textures.planesWritten = lastBatch && textures.heightTexture;
+        if (textures.planesWritten)
+            return textures.planes(grid.width, grid.height);
+#else
+        (void)lastBatch;
+#endif
+        return NULL;
+    }
+
+    //Changed other than by a step, masks and all
+    void gridChanged()
+    {
+        uploaded = false;
+#ifdef WATERBLOCK_WITH_GL
+        textures.planesWritten = false;
+        textures.masksChanged = true;
+#endif
+    }
+
+    CPUWaterGrid grid;
+    CPUSolverSettings solver;
+    CPUStepper stepper;
+    bool implicit;
+    float implicitStepsPerSecond;
+    bool uploaded;
+#ifdef WATERBLOCK_WITH_GL
+    GridTextures textures;
+#endif
+};
+
+WaterBackend *newWaterBackend(WaterBackendType type)
+{
+    if (type == WATER_BACKEND_CPU)
+        return new CPUWaterBackend();
+    if (type == WATER_BACKEND_CPU_THREADED)
+        return new ThreadedWaterBackend();
+#ifdef WATERBLOCK_WITH_GL
+    return new GLWaterBackend(type);
+#else
+    std::cout << "WaterBlock was built without OpenGL, only the CPU backend is available" << std::endl;
+    return NULL;
+#endif
+}
+
+//-----------------------------------------------------------------
+//WaterBlock
+//-----------------------------------------------------------------
+const unsigned long long NOT_CALM = ~0ull;
+
+WaterBlock::WaterBlock()
+{
+    currentBackend = NULL;
+    type = WATER_BACKEND_CPU;
+    accumulator = 0.0;
+    stepCallback = NULL;
+    stepCallbackData = NULL;
+    stepsTaken = 0;
+    calmSince = NOT_CALM;
+    sleeping = false;
+}
+
+WaterBlock::~WaterBlock()
+{
+    destroy();
+}
+
+bool WaterBlock::create(WaterBackendType backendType, const WaterBlockSettings &settings)
+{
+    destroy();
+    currentBackend = newWaterBackend(backendType);
+    if (!currentBackend)
+        return false;
+    if (!currentBackend->create(settings))
+    {
+        std::cout << "Failed to create a water backend" << std::endl;
+        delete currentBackend;
+        currentBackend = NULL;
+        return false;
+    }
+    type = backendType;
+    blockSettings = settings;
+    accumulator = 0.0;
+    injections.clear();
+    maskCells.clear();
+    stepsTaken = 0;
+    calmSince = NOT_CALM;
+    sleeping = false;
+    return true;
+}
+
+void WaterBlock::destroy()
+{
+    if (!currentBackend)
+        return;
+    currentBackend->destroy();
+    delete currentBackend;
+    currentBackend = NULL;
+}
+
+//Backends that share their state (the two GL ones) just switch over. Anything else goes through a
+//full copy of the state.
+bool WaterBlock::setBackend(WaterBackendType newType)
+{
+    if (!currentBackend)
+        return false;
+    if (newType == type)
+        return true;
+    wake();
+
+    if (!currentBackend->switchType(newType))
+    {
+        CPUWaterGrid state;
+        currentBackend->readState(state);
+        WaterBackend *newBackend = newWaterBackend(newType);
+        if (!newBackend || !newBackend->create(blockSettings))
+        {
+            std::cout << "Failed to switch water backends" << std::endl;
+            delete newBackend;
+            return false;
+        }
+        newBackend->writeState(state);
+        currentBackend->destroy();
+        delete currentBackend;
+        currentBackend = newBackend;
+    }
+    type = newType;
+    accumulator = 0.0;
+    return true;
+}
+
+float WaterBlock::stepsPerSecond() const
+{
+    return currentBackend ? currentBackend->stepsPerSecond() : EXPLICIT_STEPS_PER_SECOND;
+}
+
+int WaterBlock::advance(double seconds)
+{
+    if (!currentBackend || sleeping)
+        return 0;
+
+    double stepTime = 1.0 / currentBackend->stepsPerSecond();
+    accumulator += seconds;
+    int steps = (int)(accumulator / stepTime);
+    accumulator -= steps * stepTime;
+    step(steps);
+    return steps;
+}
+
+void WaterBlock::step(int steps)
+{
+    if (currentBackend && steps > 0)
+    {
+        currentBackend->step(steps, injections, stepCallback, stepCallbackData);
+        stepsTaken += steps;
+    }
+}
+
+//Injections wait for the next step. Holding a brush still over several frames adds up into one.
+void WaterBlock::inject(float x, float y, float radius, float amount)
+{
+    wake();
+    if (!injections.empty())
+    {
+        WaterInjection &last = injections.back();
+        if (last.x == x && last.y == y && last.radius == radius)
+        {
+            last.amount += amount;
+            return;
+        }
+    }
+    WaterInjection injection = { x, y, radius, amount };
+    injections.push_back(injection);
+}
+
+void WaterBlock::setMask(const unsigned char *mask)
+{
+    wake();
+    if (mask)
+        maskCells.assign(mask, mask + (std::size_t)blockSettings.width * blockSettings.height);
+    else
+        maskCells.clear();
+    if (currentBackend)
+        currentBackend->setMask(mask);
+}
+
+void WaterBlock::query(const float *positions, int count, WaterSample *samples)
+{
+    if (!currentBackend)
+        return;
+    currentBackend->readState(queryGrid);
+    for (int i = 0; i < count; i++)
+        sampleGrid(queryGrid, positions[i * 2], positions[i * 2 + 1], &samples[i].velocity, &samples[i].height);
+}
+
+WaterDiagnostics WaterBlock::diagnostics()
+{
+    if (!currentBackend)
+        return WaterDiagnostics();
+    currentBackend->readState(queryGrid);
+    WaterDiagnostics totals = reduceDiagnostics(queryGrid);
+    observe(totals);
+    return totals;
+}
+
+//Calm from the first calm diagnostics on, as long as nothing faster comes in. The diagnostics
+//can lag a few frames behind, which only makes it sleep a few frames later.
+void WaterBlock::observe(const WaterDiagnostics &diagnostics)
+{
+    if (!currentBackend || sleeping)
+        return;
+    if (diagnostics.maxVelocity >= blockSettings.sleepVelocity || !injections.empty())
+    {
+        calmSince = NOT_CALM;
+        return;
+    }
+    if (calmSince == NOT_CALM)
+        calmSince = stepsTaken;
+    if (blockSettings.sleepSteps > 0 && stepsTaken - calmSince >= blockSettings.sleepSteps)
+    {
+        sleeping = true;
+        accumulator = 0.0;
+        currentBackend->setPaused(true);
+    }
+}
+
+void WaterBlock::wake()
+{
+    calmSince = NOT_CALM;
+    if (!sleeping)
+        return;
+    sleeping = false;
+    accumulator = 0.0;
+    if (currentBackend)
+        currentBackend->setPaused(false);
+}
+
+bool WaterBlock::resize(unsigned int width, unsigned int height)
+{
+    if (!currentBackend || (width == blockSettings.width && height == blockSettings.height))
+        return false;
+    wake();
+    if (!currentBackend->resize(width, height))
+        return false;
+    blockSettings.width = width;
+    blockSettings.height = height;
+    maskCells.clear();
+    return true;
+}
+
+unsigned int WaterBlock::bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit)
+{
+    return currentBackend ? currentBackend->bindForRendering(heightUnit, surfaceDataUnit) : 0;
+}
+
+void WaterBlock::setStepCallback(WaterStepCallback callback, void *data)
+{
+    stepCallback = callback;
+    stepCallbackData = data;
+}
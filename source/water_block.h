@@ -0,0 +1,159 @@
+#ifndef _WATER_BLOCK_H_
+#define _WATER_BLOCK_H_
+
+//WaterBlock is the water simulation on its own, without the demo around it. Each instance owns
+//everything it uses (textures, framebuffers and buffers, or CPU arrays), so several can run side by
+//side, and the CPU backend runs without any OpenGL context at all.
+//
+//    WaterBlock water;
+//    water.create(WATER_BACKEND_GL_FRAGMENT, settings);
+//    water.inject(0.5f, 0.5f, 0.1f, 2.0f);  //Adds water on the next step
+//    water.advance(frameSeconds);           //Runs as many fixed steps as fit
+//    water.bindForRendering(0, 1);          //Height texture on unit 0, surface data on unit 1
+//
+//Positions are texture coordinates over the whole grid, (0, 0) to (1, 1).
+//
+//Water that has gone still falls asleep and stops stepping (see observe()), and anything that
+//changes it wakes it up again. While it's asleep, advance() returns 0 and the last frame drawn is
+//still right, so an application with nothing else going on can stop drawing too.
+
+#include "cpu_solver.h"
+
+#include <vector>
+
+enum WaterBackendType
+{
+    WATER_BACKEND_GL_FRAGMENT, //Explicit solver as a fragment shader (water_physics.frag)
+    WATER_BACKEND_GL_COMPUTE,  //Implicit solver as compute shaders (water_implicit.comp)
+    WATER_BACKEND_CPU,         //Either solver, from cpu_solver.cpp
+    WATER_BACKEND_CPU_THREADED //The same on a thread of its own, with its own clock (water_thread.h)
+};
+
+struct WaterBlockSettings
+{
+    unsigned int width = 128;
+    unsigned int height = 128;
+    float gravity = 0.1f;
+    float decay = 0.998f;                  //Per explicit (1/750 s) step
+    bool implicit = false;                 //CPU backends only. GL compute is always implicit, GL fragment never is.
+    float implicitStepsPerSecond = IMPLICIT_STEPS_PER_SECOND;
+    const char *shaderDirectory = "shaders/";
+    float sleepVelocity = ACTIVE_VELOCITY; //Water is calm while its fastest cell is slower than this
+    unsigned int sleepSteps = 750;         //Steps it has to stay calm for before it sleeps, 0 never sleeps
+    bool tuneCPU = false;                  //CPU backends: tune the explicit solver's tiles and threads for this size,
+                                           //if this machine hasn't already (see cpu_stepper.h). Takes a few seconds.
+};
+
+//Water added (or taken away) under a circle on the next step
+struct WaterInjection
+{
+    float x;
+    float y;
+    float radius;
+    float amount; //Height added to every cell under the circle
+};
+
+struct WaterSample
+{
+    float height;
+    float velocity; //Per explicit step
+};
+
+//Called after every step, with the step's index and the number of steps in this batch
+typedef void (*WaterStepCallback)(int step, int steps, void *data);
+
+//What every backend provides. WaterBlock is what applications use; this is for adding backends, or
+//for getting at one backend's specifics (see water_block_gl.h).
+class WaterBackend
+{
+public:
+    virtual ~WaterBackend() {}
+
+    virtual bool create(const WaterBlockSettings &settings) = 0;
+    virtual void destroy() = 0;
+    virtual float stepsPerSecond() const = 0;
+
+    //Applies and removes the injections it gets to
+    virtual void step(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData) = 0;
+
+    //width * height values, nonzero is a barrier. NULL clears every barrier.
+    virtual void setMask(const unsigned char *mask) = 0;
+
+    //Complete copies of the state, for queries and for moving between backends. GPU backends stall here.
+    virtual void readState(CPUWaterGrid &grid) = 0;
+    virtual void writeState(const CPUWaterGrid &grid) = 0;
+
+    //Resamples the water to a new size. The mask is cleared.
+    virtual bool resize(unsigned int width, unsigned int height) = 0;
+
+    //Returns the height texture, or 0 without OpenGL
+    virtual unsigned int bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit) = 0;
+
+    //Switch between types that share their state, without copying it. False if it can't.
+    virtual bool switchType(WaterBackendType /*type*/) { return false; }
+
+    //For backends that step on their own clock (the threaded one), which stop stepping while paused
+    virtual void setPaused(bool /*paused*/) {}
+};
+
+class WaterBlock
+{
+public:
+    WaterBlock();
+    ~WaterBlock();
+
+    bool create(WaterBackendType type, const WaterBlockSettings &settings);
+    void destroy();
+
+    //Moves the water over to another backend
+    bool setBackend(WaterBackendType type);
+
+    //Runs as many fixed steps as fit into the time given (plus what was left over last time)
+    int advance(double seconds);
+    void step(int steps);
+    void inject(float x, float y, float radius, float amount);
+    void setMask(const unsigned char *mask);
+
+    //Bilinear samples at count positions (x, y pairs). On the GPU backends this waits for the GPU.
+    void query(const float *positions, int count, WaterSample *samples);
+    WaterDiagnostics diagnostics(); //Also observed, see observe()
+
+    //Tells the water how fast it's moving, from diagnostics however they were reduced (they can be a
+    //few frames old). Once it has been calm for settings().sleepSteps steps with no injections
+    //waiting, it falls asleep.
+    void observe(const WaterDiagnostics &diagnostics);
+    bool asleep() const { return sleeping; }
+    void wake(); //Injections, masks, resizes and switching backends all wake it by themselves
+
+    bool resize(unsigned int width, unsigned int height);
+    unsigned int bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit);
+    void setStepCallback(WaterStepCallback callback, void *data);
+
+    WaterBackendType backendType() const { return type; }
+    WaterBackend *backend() const { return currentBackend; }
+    const unsigned char *mask() const { return maskCells.empty() ? NULL : &maskCells[0]; } //Last setMask, NULL for none
+    const WaterBlockSettings &settings() const { return blockSettings; }
+    float stepsPerSecond() const;
+
+private:
+    WaterBlock(const WaterBlock &);
+    WaterBlock &operator=(const WaterBlock &);
+
+    WaterBackend *currentBackend;
+    WaterBackendType type;
+    WaterBlockSettings blockSettings;
+    double accumulator;
+    std::vector<WaterInjection> injections;
+    std::vector<unsigned char> maskCells;
+    WaterStepCallback stepCallback;
+    void *stepCallbackData;
+    CPUWaterGrid queryGrid;
+    unsigned long long stepsTaken;
+    unsigned long long calmSince; //stepsTaken when it was first seen calm, or NOT_CALM
+    bool sleeping;
+};
+
+//Backends the library was built with. The GL ones need WATERBLOCK_WITH_GL, and a current context.
+WaterBackend *newWaterBackend(WaterBackendType type);
+
+#endif // _WATER_BLOCK_H_
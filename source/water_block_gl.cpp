@@ -0,0 +1,605 @@
+#include "water_block_gl.h"
+
+#include <cstring>
+
+//Passes of the implicit water physics (water_implicit.comp)
+const int IMPLICIT_PREPARE = 0;
+const int IMPLICIT_TERM = 1;
+const int IMPLICIT_SHARE = 2;
+const int IMPLICIT_REPAY = 3;
+const int IMPLICIT_FINAL = 4;
+const int IMPLICIT_SCALE = 5;
+
+//A quad over the whole grid, for the passes drawn as fragments
+static unsigned int newGridQuad(unsigned int buffers[2])
+{
+    float vertices[] = {
+        -1.0, -1.0, 0.0,   0.0, 0.0,
+        1.0, -1.0, 0.0,  1.0, 0.0,
+        1.0, 1.0, 0.0,  1.0, 1.0,
+        -1.0, 1.0, 0.0,  0.0, 1.0
+    };
+    GLushort indices[] = {
+        0, 1, 2,
+        2, 3, 0
+    };
+    unsigned int VAO = newVertexArray("water quad");
+    buffers[0] = newBuffer(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW, "water quad vertices");
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5*sizeof(float), (GLvoid*)(0));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5*sizeof(float), (GLvoid*)(3*sizeof(float)));
+    glEnableVertexAttribArray(1);
+    buffers[1] = newBuffer(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW, "water quad indices");
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    bindVertexArray(0);
+    return VAO;
+}
+
+//Surface data from a finished height texture on unit 0, drawn to colour attachment 1
+static ShaderProgram &surfaceDataShader(const std::string &shaderDirectory, Vector2u size)
+{
+    std::string vertexFile = shaderDirectory + "water_physics.vert";
+    std::string fragmentFile = shaderDirectory + "water_surface_data.frag";
+    ShaderVariant variant(vertexFile.c_str(), fragmentFile.c_str());
+    variant.define("GRID_WIDTH", (float)size.x);
+    variant.define("GRID_HEIGHT", (float)size.y);
+    variant.sampler("height_texture", 0);
+    return loadShaderVariant(variant);
+}
+
+GLWaterBackend::GLWaterBackend(WaterBackendType type)
+{
+    compute = (type == WATER_BACKEND_GL_COMPUTE);
+    hasMask = false;
+    FBO = 0;
+    quadVAO = 0;
+    currentTexture = 0;
+}
+
+bool GLWaterBackend::create(const WaterBlockSettings &newSettings)
+{
+    settings = newSettings;
+    shaderDirectory = settings.shaderDirectory;
+    size = Vector2u(settings.width, settings.height);
+    hasMask = false;
+
+    quadVAO = newGridQuad(quadBuffers);
+    FBO = newFramebuffer("water");
+    createTextures();
+
+    //Start out still and empty, rather than with whatever the driver hands back
+    CPUWaterGrid empty;
+    empty.resize(size.x, size.y);
+    writeState(empty);
+
+    return !fetchGLErrors("Error creating GL water backend:");
+}
+
+void GLWaterBackend::destroy()
+{
+    if (!FBO)
+        return;
+    releaseTextures();
+    deleteFramebuffers(1, &FBO);
+    deleteVertexArrays(1, &quadVAO);
+    deleteBuffers(2, quadBuffers);
+    FBO = 0;
+    quadVAO = 0;
+}
+
+void GLWaterBackend::createTextures()
+{
+    //RGBA rather than RGB so the implicit passes can use them as images
+    texture2D(size, GL_RGBA32F, NULL, &heightTextures[0]);
+    texture2D(size, GL_RGBA32F, NULL, &heightTextures[1]);
+    texture2D(size, GL_RGB16F, NULL, &surfaceData);
+    texture2D(size, GL_R8, NULL, &maskTexture);
+    texture2D(size, GL_RG32F, NULL, &termTextures[0]);
+    texture2D(size, GL_RG32F, NULL, &termTextures[1]);
+    currentTexture = 0;
+
+    //One partial sum per 8x8 group of the implicit passes, then the whole
+    unsigned int groups = ((size.x + 7) / 8) * ((size.y + 7) / 8);
+    sumBuffers[0] = newBuffer(GL_SHADER_STORAGE_BUFFER, groups * 2 * sizeof(float), NULL, GL_DYNAMIC_COPY, "implicit water partial sums");
+    sumBuffers[1] = newBuffer(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(float), NULL, GL_DYNAMIC_COPY, "implicit water sums");
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    bindFramebuffer(FBO);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT1, surfaceData);
+}
+
+void GLWaterBackend::releaseTextures()
+{
+    bindFramebuffer(FBO);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, 0);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT1, 0);
+    deleteTextures(2, heightTextures);
+    deleteTextures(1, &surfaceData);
+    deleteTextures(1, &maskTexture);
+    deleteTextures(2, termTextures);
+    deleteBuffers(2, sumBuffers);
+}
+
+float GLWaterBackend::stepsPerSecond() const
+{
+    return compute ? settings.implicitStepsPerSecond : EXPLICIT_STEPS_PER_SECOND;
+}
+
+bool GLWaterBackend::switchType(WaterBackendType type)
+{
+    if (type != WATER_BACKEND_GL_FRAGMENT && type != WATER_BACKEND_GL_COMPUTE)
+        return false;
+    compute = (type == WATER_BACKEND_GL_COMPUTE);
+    return true;
+}
+
+std::string GLWaterBackend::shaderPath(const char *file) const
+{
+    return shaderDirectory + file;
+}
+
+//Only the first step of a frame draws the brush, only the last step writes out surface data, and
+//the grid size and physics constants are baked in, so each combination gets its own program.
+//They're compiled the first time they're asked for.
+ShaderProgram &GLWaterBackend::physicsShader(bool brush, bool surfaceData)
+{
+    std::string vertexFile = shaderPath("water_physics.vert");
+    std::string fragmentFile = shaderPath("water_physics.frag");
+    ShaderVariant variant(vertexFile.c_str(), fragmentFile.c_str());
+    variant.define("GRID_WIDTH", (float)size.x);
+    variant.define("GRID_HEIGHT", (float)size.y);
+    variant.define("GRAVITY", settings.gravity);
+    variant.define("DECAY", settings.decay);
+    variant.define("MASK", hasMask ? 1 : 0);
+    variant.define("PRECISION", "highp");
+    variant.sampler("height_texture", 0);
+    if (brush)
+    {
+        variant.define("BRUSH");
+        variant.sampler("mask_texture", 1);
+    }
+    if (surfaceData)
+        variant.define("SURFACE_DATA");
+
+    return loadShaderVariant(variant);
+}
+
+//Same idea for the implicit passes. Only the prepare pass samples textures, and only it draws the
+//brush. The series' coefficients change with the rate, so they're uniforms rather than baked in.
+ShaderProgram &GLWaterBackend::implicitShader(int pass, bool brush)
+{
+    const char *passNames[] = { "PREPARE", "TERM", "SHARE", "REPAY", "FINAL", "SCALE" };
+
+    std::string computeFile = shaderPath("water_implicit.comp");
+    ShaderVariant variant(computeFile.c_str());
+    variant.define(passNames[pass]);
+    variant.define("GRID_WIDTH", (float)size.x);
+    variant.define("GRID_HEIGHT", (float)size.y);
+    variant.define("MASK", hasMask ? 1 : 0);
+    if (pass == IMPLICIT_PREPARE)
+    {
+        variant.sampler("height_texture", 0);
+        if (brush)
+        {
+            variant.define("BRUSH");
+            variant.sampler("mask_texture", 1);
+        }
+    }
+
+    return loadShaderVariant(variant);
+}
+
+//Surface data for the implicit passes, drawn after the last step
+ShaderProgram &GLWaterBackend::surfaceDataShader()
+{
+    return ::surfaceDataShader(shaderDirectory, size);
+}
+
+ShaderProgram &GLWaterBackend::resampleShader()
+{
+    std::string vertexFile = shaderPath("image_shader.vert");
+    std::string fragmentFile = shaderPath("resample_shader.frag");
+    ShaderVariant variant(vertexFile.c_str(), fragmentFile.c_str());
+    variant.sampler("source_texture", 0);
+    return loadShaderVariant(variant);
+}
+
+void GLWaterBackend::step(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData)
+{
+    if (steps <= 0)
+        return;
+    if (compute)
+        stepCompute(steps, injections, callback, callbackData);
+    else
+        stepFragment(steps, injections, callback, callbackData);
+}
+
+//Takes the next injection for a brush step, or an empty one
+static WaterInjection nextInjection(std::vector<WaterInjection> &injections)
+{
+    WaterInjection injection = { 0.0f, 0.0f, 0.0f, 0.0f };
+    if (!injections.empty())
+    {
+        injection = injections.front();
+        injections.erase(injections.begin());
+    }
+    return injection;
+}
+
+//The first step paints the brush into the height texture, and the contents of maskTexture are
+//stored in its blue channel, which cuts down on additional sampling in the other steps. Only the
+//last step needs to write the second target, surfaceData. Every texel gets written, so there's no
+//need to clear first. State is set again every step, as the callback may draw elsewhere.
+void GLWaterBackend::stepFragment(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData)
+{
+    GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    for (int step = 0; step < steps; step++)
+    {
+        bool brush = (step == 0 || !injections.empty());
+        bool lastStep = (step == steps - 1);
+        ShaderProgram &shader = physicsShader(brush, lastStep);
+        if (brush)
+        {
+            WaterInjection injection = nextInjection(injections);
+            shader.setUniform("mousePosition", Vector2(injection.x, injection.y));
+            shader.setUniform("brushSize", injection.radius);
+            shader.setUniform("brushAmount", injection.amount);
+        }
+
+        unsigned int nextTexture = 1 - currentTexture;
+        bindFramebuffer(FBO);
+        setViewport(0, 0, size.x, size.y);
+        bindVertexArray(quadVAO);
+        shader.enable();
+        enableTexture2D(0, heightTextures[currentTexture]);
+        enableTexture2D(1, maskTexture);
+        framebufferTexture2D(GL_COLOR_ATTACHMENT0, heightTextures[nextTexture]);
+        drawBuffers(lastStep ? 2 : 1, attachments);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+        countGLCalls(1);
+
+        //Ping-pong textures
+        currentTexture = nextTexture;
+
+        if (callback)
+            callback(step, steps, callbackData);
+
+        fetchGLErrors("Error in physics loop:");
+    }
+    disableTexture(1);
+    disableTexture(0);
+}
+
+//The implicit passes write straight into the next height texture as an image (see water_implicit.comp):
+//the prepare pass, one per term of the series, and four that repay overdrawn cells without changing
+//the volume. Every pass needs the previous one's writes to be visible, so there's a barrier after each
+//dispatch. A step the series had to be split for ping-pongs once per part.
+void GLWaterBackend::stepCompute(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData)
+{
+    CPUSolverSettings solver;
+    solver.gravity = settings.gravity;
+    solver.decay = settings.decay;
+    ImplicitSeries series;
+    int parts = implicitSeries(solver, settings.implicitStepsPerSecond, series);
+    unsigned int groupsX = (size.x + 7) / 8;
+    unsigned int groupsY = (size.y + 7) / 8;
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sumBuffers[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, sumBuffers[1]);
+    countGLCalls(2);
+    for (int step = 0; step < steps; step++)
+    {
+        unsigned int nextTexture = 1 - currentTexture;
+        for (int part = 0; part < parts; part++)
+        {
+            bool brush = (part == 0 && (step == 0 || !injections.empty()));
+            ShaderProgram &prepareShader = implicitShader(IMPLICIT_PREPARE, brush);
+            if (brush)
+            {
+                WaterInjection injection = nextInjection(injections);
+                prepareShader.setUniform("mousePosition", Vector2(injection.x, injection.y));
+                prepareShader.setUniform("brushSize", injection.radius);
+                prepareShader.setUniform("brushAmount", injection.amount);
+            }
+
+            prepareShader.enable();
+            enableTexture2D(0, heightTextures[currentTexture]);
+            enableTexture2D(1, maskTexture);
+            bindImageTexture(0, heightTextures[nextTexture], GL_RGBA32F);
+            glDispatchCompute(groupsX, groupsY, 1);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+            countGLCalls(2);
+
+            //Each term is written over the one two before it
+            int previous = 0;
+            ShaderProgram &termShader = implicitShader(IMPLICIT_TERM, false);
+            for (int k = series.terms - 1; k >= 0; k--)
+            {
+                termShader.setUniform("heightCoefficients", Vector2(series.hl[k], series.hv[k]));
+                termShader.setUniform("velocityCoefficients", Vector2(series.vl[k], series.vv[k]));
+                termShader.setUniform("factor", (k == 0) ? 0.25f : 0.5f);
+                termShader.setUniform("laterTerms", series.terms - 1 - k);
+                bindImageTexture(1, termTextures[previous], GL_RG32F);
+                bindImageTexture(2, termTextures[1 - previous], GL_RG32F);
+                glDispatchCompute(groupsX, groupsY, 1);
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+                countGLCalls(2);
+                previous = 1 - previous;
+            }
+
+            bindImageTexture(1, termTextures[previous], GL_RG32F);
+            bindImageTexture(2, termTextures[1 - previous], GL_RG32F);
+            implicitShader(IMPLICIT_SHARE, false).enable();
+            glDispatchCompute(groupsX, groupsY, 1);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+            implicitShader(IMPLICIT_REPAY, false).enable();
+            glDispatchCompute(groupsX, groupsY, 1);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+            ShaderProgram &finalShader = implicitShader(IMPLICIT_FINAL, false);
+            finalShader.setUniform("partialCount", (int)(groupsX * groupsY));
+            glDispatchCompute(1, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            implicitShader(IMPLICIT_SCALE, false).enable();
+            glDispatchCompute(groupsX, groupsY, 1);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+            countGLCalls(8);
+
+            //Ping-pong textures
+            currentTexture = nextTexture;
+            nextTexture = 1 - nextTexture;
+        }
+
+        //Surface data from the finished heights. Colour attachment 0 is the texture that's
+        //not being sampled, and isn't drawn to.
+        if (step == steps - 1)
+        {
+            GLenum surfaceAttachments[] = { GL_NONE, GL_COLOR_ATTACHMENT1 };
+            bindFramebuffer(FBO);
+            setViewport(0, 0, size.x, size.y);
+            bindVertexArray(quadVAO);
+            surfaceDataShader().enable();
+            enableTexture2D(0, heightTextures[currentTexture]);
+            framebufferTexture2D(GL_COLOR_ATTACHMENT0, heightTextures[nextTexture]);
+            drawBuffers(2, surfaceAttachments);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+            countGLCalls(1);
+        }
+
+        if (callback)
+            callback(step, steps, callbackData);
+
+        fetchGLErrors("Error in implicit physics loop:");
+    }
+    disableTexture(1);
+    disableTexture(0);
+}
+
+//Nonzero values are barriers. They're copied into the height texture on the next step.
+void GLWaterBackend::setMask(const unsigned char *mask)
+{
+    std::vector<unsigned char> open;
+    if (!mask)
+    {
+        open.assign(size.x * size.y, 0);
+        mask = &open[0];
+    }
+
+    bool anyBarriers = false;
+    for (unsigned int i = 0; i < size.x * size.y && !anyBarriers; i++)
+        anyBarriers = (mask[i] != 0);
+    hasMask = anyBarriers;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    bindTexture(GL_TEXTURE_2D, maskTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size.x, size.y, GL_RED, GL_UNSIGNED_BYTE, mask);
+    bindTexture(GL_TEXTURE_2D, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    fetchGLErrors("Error setting the water mask:");
+}
+
+//Waits for every step queued so far
+void GLWaterBackend::readState(CPUWaterGrid &grid)
+{
+    if (grid.width != (int)size.x || grid.height != (int)size.y)
+        grid.resize(size.x, size.y);
+
+    std::vector<float> pixels(size.x * size.y * 4);
+    bindTexture(GL_TEXTURE_2D, heightTextures[currentTexture]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &pixels[0]);
+    bindTexture(GL_TEXTURE_2D, 0);
+    for (std::size_t i = 0; i < grid.heights.size(); i++)
+    {
+        grid.velocities[i] = pixels[i * 4 + 0];
+        grid.heights[i] = pixels[i * 4 + 1];
+        grid.masks[i] = pixels[i * 4 + 2];
+    }
+    fetchGLErrors("Error reading back the water:");
+}
+
+void GLWaterBackend::writeState(const CPUWaterGrid &grid)
+{
+    if (grid.width != (int)size.x || grid.height != (int)size.y)
+    {
+        releaseTextures();
+        size = Vector2u(grid.width, grid.height);
+        createTextures();
+    }
+
+    std::vector<float> pixels(size.x * size.y * 4);
+    std::vector<unsigned char> mask(size.x * size.y);
+    for (std::size_t i = 0; i < grid.heights.size(); i++)
+    {
+        pixels[i * 4 + 0] = grid.velocities[i];
+        pixels[i * 4 + 1] = grid.heights[i];
+        pixels[i * 4 + 2] = grid.masks[i];
+        pixels[i * 4 + 3] = 1.0f;
+        mask[i] = (unsigned char)(std::min(std::max(grid.masks[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+    }
+    bindTexture(GL_TEXTURE_2D, heightTextures[currentTexture]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size.x, size.y, GL_RGBA, GL_FLOAT, &pixels[0]);
+    bindTexture(GL_TEXTURE_2D, 0);
+    setMask(&mask[0]);
+}
+
+//The current state is resampled into new textures (averaged when shrinking), along with the
+//surface data so there's something to draw before the next step
+bool GLWaterBackend::resize(unsigned int width, unsigned int height)
+{
+    unsigned int oldTextures[] = { heightTextures[0], heightTextures[1], surfaceData, maskTexture, termTextures[0], termTextures[1] };
+    unsigned int oldBuffers[] = { sumBuffers[0], sumBuffers[1] };
+    unsigned int sources[2] = { heightTextures[currentTexture], surfaceData };
+    size = Vector2u(width, height);
+    createTextures();
+
+    GLenum attachments[] = { GL_COLOR_ATTACHMENT0 };
+    ShaderProgram &shader = resampleShader();
+    bindFramebuffer(FBO);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT1, 0);
+    drawBuffers(1, attachments);
+    setViewport(0, 0, size.x, size.y);
+    bindVertexArray(quadVAO);
+    shader.setUniform("targetSize", Vector2(size));
+    shader.enable();
+
+    unsigned int targets[2] = { heightTextures[0], surfaceData };
+    for (int i = 0; i < 2; i++)
+    {
+        enableTexture2D(0, sources[i]);
+        framebufferTexture2D(GL_COLOR_ATTACHMENT0, targets[i]);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+        countGLCalls(1);
+    }
+    disableTexture(0);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, 0);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT1, surfaceData);
+    deleteTextures(6, oldTextures);
+    deleteBuffers(2, oldBuffers);
+    setMask(NULL);
+
+    return !fetchGLErrors("Error resizing the water:");
+}
+
+unsigned int GLWaterBackend::bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit)
+{
+    enableTexture2D(heightUnit, heightTextures[currentTexture]);
+    enableTexture2D(surfaceDataUnit, surfaceData);
+    return heightTextures[currentTexture];
+}
+
+//-----------------------------------------------------------------
+//Textures for the CPU backends
+//-----------------------------------------------------------------
+//Puts the planes back together as a height texture, on colour attachment 0
+static ShaderProgram &gridPlanesShader(const std::string &shaderDirectory)
+{
+    std::string vertexFile = shaderDirectory + "water_physics.vert";
+    std::string fragmentFile = shaderDirectory + "water_grid_planes.frag";
+    ShaderVariant variant(vertexFile.c_str(), fragmentFile.c_str());
+    variant.sampler("planes", 0);
+    return loadShaderVariant(variant);
+}
+
+//The buffer's three planes are the array's layers, so one call uploads them all
+float *GridTextures::planes(int width, int height)
+{
+    if (heightTexture && (size.x != (unsigned int)width || size.y != (unsigned int)height))
+        release();
+    if (!heightTexture)
+    {
+        size = Vector2u(width, height);
+        texture2D(size, GL_RGBA32F, NULL, &heightTexture);
+        texture2D(size, GL_RGB16F, NULL, &surfaceDataTexture);
+        textureArray(size, 3, GL_R32F, &planeTexture);
+        pixels.init(size.x * size.y * 3 * sizeof(float));
+        FBO = newFramebuffer("grid textures");
+        quadVAO = newGridQuad(quadBuffers);
+        masksChanged = true;
+        planesWritten = false;
+    }
+    if (!nextPlanes)
+        nextPlanes = (float *)pixels.slot();
+    return nextPlanes;
+}
+
+//Whatever the stepper didn't write is copied in as whole planes, then the GPU does the rest: the
+//height texture first, then the surface data from it. The caller may be partway through a draw of
+//its own, so its bindings are put back.
+void GridTextures::upload(const CPUWaterGrid &grid)
+{
+    float *data = planes(grid.width, grid.height);
+    std::size_t cells = (std::size_t)grid.width * grid.height;
+    if (!planesWritten)
+    {
+        memcpy(data, grid.velocities.data(), cells * sizeof(float));
+        memcpy(data + cells, grid.heights.data(), cells * sizeof(float));
+    }
+    if (masksChanged)
+        memcpy(data + cells * 2, grid.masks.data(), cells * sizeof(float));
+
+    pixels.begin();
+    bindTexture(GL_TEXTURE_2D_ARRAY, planeTexture);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, size.x, size.y, masksChanged ? 3 : 2, GL_RED, GL_FLOAT, pixels.pixels(0));
+    pixels.end();
+    nextPlanes = NULL;
+    planesWritten = false;
+    masksChanged = false;
+
+    GLDrawBindings bindings = currentDrawBindings();
+    GLenum heightAttachments[] = { GL_COLOR_ATTACHMENT0 };
+    bindFramebuffer(FBO);
+    setViewport(0, 0, size.x, size.y);
+    bindVertexArray(quadVAO);
+    gridPlanesShader(shaderDirectory).enable();
+    enableTextureArray(0, planeTexture);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, heightTexture);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT1, 0);
+    drawBuffers(1, heightAttachments);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    //The height texture comes off the framebuffer before it's sampled
+    GLenum surfaceAttachments[] = { GL_NONE, GL_COLOR_ATTACHMENT1 };
+    surfaceDataShader(shaderDirectory, size).enable();
+    enableTexture2D(0, heightTexture);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, 0);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT1, surfaceDataTexture);
+    drawBuffers(2, surfaceAttachments);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
+    countGLCalls(3);
+    disableTexture(0);
+    setDrawBindings(bindings);
+    fetchGLErrors("Error uploading the water:");
+}
+
+void GridTextures::bind(unsigned int heightUnit, unsigned int surfaceDataUnit)
+{
+    enableTexture2D(heightUnit, heightTexture);
+    enableTexture2D(surfaceDataUnit, surfaceDataTexture);
+}
+
+void GridTextures::release()
+{
+    if (!heightTexture)
+        return;
+    bindFramebuffer(FBO);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, 0);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT1, 0);
+    deleteFramebuffers(1, &FBO);
+    deleteVertexArrays(1, &quadVAO);
+    deleteBuffers(2, quadBuffers);
+    deleteTextures(1, &heightTexture);
+    deleteTextures(1, &surfaceDataTexture);
+    deleteTextures(1, &planeTexture);
+    pixels.release();
+    heightTexture = 0;
+    surfaceDataTexture = 0;
+    planeTexture = 0;
+    FBO = 0;
+    quadVAO = 0;
+    nextPlanes = NULL;
+    planesWritten = false;
+    masksChanged = true;
+}
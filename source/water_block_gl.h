@@ -0,0 +1,102 @@
+#ifndef _WATER_BLOCK_GL_H_
+#define _WATER_BLOCK_GL_H_
+
+//The two OpenGL backends. They keep the water in the same pair of ping-pong height textures, so
+//switching between them (WaterBlock::setBackend) carries the water over without copying it.
+//  WATER_BACKEND_GL_FRAGMENT runs the explicit solver, one draw per step (water_physics.frag)
+//  WATER_BACKEND_GL_COMPUTE runs the implicit solver, a dispatch per term of its series (water_implicit.comp)
+
+#include "common.h"
+#include "water_block.h"
+
+#include <string>
+
+class GLWaterBackend : public WaterBackend
+{
+public:
+    GLWaterBackend(WaterBackendType type);
+
+    bool create(const WaterBlockSettings &settings);
+    void destroy();
+    float stepsPerSecond() const;
+
+    //Injections go in one per step, the first on the first step. The last step writes the surface data.
+    void step(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData);
+    void setMask(const unsigned char *mask);
+    void readState(CPUWaterGrid &grid);
+    void writeState(const CPUWaterGrid &grid);
+    bool resize(unsigned int width, unsigned int height);
+    unsigned int bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit);
+    bool switchType(WaterBackendType type);
+
+    //For drawing more into the simulation from a step callback (the demo's nested grids). During
+    //the callback, heightTexture() holds the step's result and previousHeightTexture() what it started from.
+    unsigned int heightTexture() const { return heightTextures[currentTexture]; }
+    unsigned int previousHeightTexture() const { return heightTextures[1 - currentTexture]; }
+    unsigned int surfaceDataTexture() const { return surfaceData; }
+    unsigned int barrierTexture() const { return maskTexture; }
+    Vector2u resolution() const { return size; }
+
+    //The fragment backend's physics program for a step (the brush, surface data, both or neither)
+    ShaderProgram &physicsShader(bool brush, bool surfaceData);
+
+private:
+    ShaderProgram &implicitShader(int pass, bool brush);
+    ShaderProgram &surfaceDataShader();
+    ShaderProgram &resampleShader();
+    std::string shaderPath(const char *file) const;
+    void createTextures();
+    void releaseTextures();
+    void stepFragment(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData);
+    void stepCompute(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData);
+
+    bool compute;
+    WaterBlockSettings settings;
+    std::string shaderDirectory;
+    Vector2u size;
+    bool hasMask;
+
+    unsigned int FBO;
+    unsigned int quadVAO;
+    unsigned int quadBuffers[2];
+    unsigned int heightTextures[2]; //Velocity, height and mask, like the CPU grid's channels
+    unsigned int currentTexture;
+    unsigned int surfaceData;       //Normals and speed, for rendering
+    unsigned int maskTexture;       //GL_R8, copied into the height texture on the brush steps
+    unsigned int termTextures[2];   //Implicit only, terms of the series (GL_RG32F), then repayments
+    unsigned int sumBuffers[2];     //Implicit only, partial and whole sums of the volume
+};
+
+//Textures holding a grid that lives on the CPU, laid out like the GL backends' (velocity, height
+//and mask, plus surface data from water_surface_data.frag). For the CPU backends. Only the channels
+//go up, as planes of floats (the mask only when it's changed), through persistently mapped pixel
+//buffers so they don't wait on the GPU; the textures are drawn from them there.
+//
+//    float *next = textures.planes(width, height); //Velocities, then heights
+//    stepper.step(grid, solver, steps, next, next + width * height);
+//    textures.planesWritten = true;
+//    ...
+//    textures.upload(grid);                         //Copies whatever wasn't written
+struct GridTextures
+{
+    unsigned int heightTexture = 0;
+    unsigned int surfaceDataTexture = 0;
+    unsigned int planeTexture = 0; //GL_R32F array: velocities, heights and masks
+    unsigned int FBO = 0;
+    unsigned int quadVAO = 0;
+    unsigned int quadBuffers[2];
+    Vector2u size;
+    GPUUpload pixels;
+    float *nextPlanes = NULL;
+    std::string shaderDirectory = "shaders/";
+
+    bool planesWritten = false; //The velocities and heights in planes() are the grid's
+    bool masksChanged = true;   //Set when the grid's masks change
+
+    float *planes(int width, int height); //Where the next upload comes from. Creates or resizes the textures to fit.
+    void upload(const CPUWaterGrid &grid);
+    void bind(unsigned int heightUnit, unsigned int surfaceDataUnit);
+    void release();
+};
+
+#endif // _WATER_BLOCK_GL_H_
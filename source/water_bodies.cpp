@@ -0,0 +1,423 @@
+#include "water_bodies.h"
+#ifdef WATERBLOCK_WITH_GL
+#include "water_block_gl.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WATER_BODIES_SSE2
+#endif
+
+//-----------------------------------------------------------------
+//CPU pass
+//-----------------------------------------------------------------
+//Totals over the open cells under a footprint
+struct FootprintSums
+{
+    float submerged = 0.0f;
+    float wetted = 0.0f;
+    float velocity = 0.0f; //Of the wetted cells
+    float height = 0.0f;
+    float pushX = 0.0f;    //Submerged depth times the surface normal
+    float pushY = 0.0f;
+    float open = 0.0f;
+};
+
+//Cells whose centers are inside the footprint. False if there are none.
+static bool footprintCells(const FloatingBody &body, int width, int height, int &x0, int &y0, int &x1, int &y1)
+{
+    x0 = std::max((int)std::ceil((body.x - body.halfWidth) * width - 0.5f), 0);
+    y0 = std::max((int)std::ceil((body.y - body.halfHeight) * height - 0.5f), 0);
+    x1 = std::min((int)std::floor((body.x + body.halfWidth) * width - 0.5f), width - 1);
+    y1 = std::min((int)std::floor((body.y + body.halfHeight) * height - 0.5f), height - 1);
+    return x0 <= x1 && y0 <= y1;
+}
+
+//The surface normal as the surface data has it: neighbours past the edges or in a barrier count as the cell itself
+static float neighbourHeight(const CPUWaterGrid &grid, int m, int n)
+{
+    return (grid.masks[n] >= 0.01f) ? grid.heights[m] : grid.heights[n];
+}
+
+static void sumCell(const CPUWaterGrid &grid, int x, int y, const FloatingBody &body, FootprintSums &sums)
+{
+    int m = grid.index(x, y);
+    if (grid.masks[m] > 0.0f)
+        return;
+    float height = grid.heights[m];
+    float submerged = std::min(std::max(height - body.bottom, 0.0f), body.thickness);
+    float wet = submerged > 0.0f ? 1.0f : 0.0f;
+    float normalX = neighbourHeight(grid, m, grid.index(std::max(x - 1, 0), y)) -
+                    neighbourHeight(grid, m, grid.index(std::min(x + 1, grid.width - 1), y));
+    float normalY = neighbourHeight(grid, m, grid.index(x, std::max(y - 1, 0))) -
+                    neighbourHeight(grid, m, grid.index(x, std::min(y + 1, grid.height - 1)));
+    sums.submerged += submerged;
+    sums.wetted += wet;
+    sums.velocity += wet * grid.velocities[m];
+    sums.height += height;
+    sums.pushX += submerged * normalX;
+    sums.pushY += submerged * normalY;
+    sums.open += 1.0f;
+}
+
+#ifdef WATER_BODIES_SSE2
+static float addLanes(__m128 value)
+{
+    float lanes[4];
+    _mm_storeu_ps(lanes, value);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+//A neighbour's height, or the cell's own where the neighbour is a barrier
+static __m128 neighbourHeights(const float *heights, const float *masks, __m128 own)
+{
+    __m128 barrier = _mm_cmpge_ps(_mm_loadu_ps(masks), _mm_set1_ps(0.01f));
+    return _mm_or_ps(_mm_and_ps(barrier, own), _mm_andnot_ps(barrier, _mm_loadu_ps(heights)));
+}
+#endif
+
+//Cells x0 to x1 of row y. Four at a time away from the left and right edges, where the neighbours are all in the row.
+static void sumRow(const CPUWaterGrid &grid, int y, int x0, int x1, const FloatingBody &body, FootprintSums &sums)
+{
+    int x = x0;
+    if (x == 0)
+        sumCell(grid, x++, y, body, sums);
+#ifdef WATER_BODIES_SSE2
+    const int row = grid.index(0, y);
+    const int above = grid.index(0, std::max(y - 1, 0));
+    const int below = grid.index(0, std::min(y + 1, grid.height - 1));
+    const float *h = &grid.heights[0];
+    const float *v = &grid.velocities[0];
+    const float *k = &grid.masks[0];
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 bottom = _mm_set1_ps(body.bottom);
+    const __m128 thickness = _mm_set1_ps(body.thickness);
+    __m128 submergedSum = zero;
+    __m128 wettedSum = zero;
+    __m128 velocitySum = zero;
+    __m128 heightSum = zero;
+    __m128 pushXSum = zero;
+    __m128 pushYSum = zero;
+    __m128 openSum = zero;
+    const int end = std::min(x1, grid.width - 2);
+    for (; x + 3 <= end; x += 4)
+    {
+        const int m = row + x;
+        __m128 open = _mm_cmple_ps(_mm_loadu_ps(k + m), zero);
+        __m128 height = _mm_loadu_ps(h + m);
+        __m128 submerged = _mm_and_ps(open, _mm_min_ps(_mm_max_ps(_mm_sub_ps(height, bottom), zero), thickness));
+        __m128 wet = _mm_and_ps(_mm_cmpgt_ps(submerged, zero), one);
+        __m128 normalX = _mm_sub_ps(neighbourHeights(h + m - 1, k + m - 1, height), neighbourHeights(h + m + 1, k + m + 1, height));
+        __m128 normalY = _mm_sub_ps(neighbourHeights(h + above + x, k + above + x, height), neighbourHeights(h + below + x, k + below + x, height));
+        submergedSum = _mm_add_ps(submergedSum, submerged);
+        wettedSum = _mm_add_ps(wettedSum, wet);
+        velocitySum = _mm_add_ps(velocitySum, _mm_mul_ps(wet, _mm_loadu_ps(v + m)));
+        heightSum = _mm_add_ps(heightSum, _mm_and_ps(open, height));
+        pushXSum = _mm_add_ps(pushXSum, _mm_mul_ps(submerged, normalX));
+        pushYSum = _mm_add_ps(pushYSum, _mm_mul_ps(submerged, normalY));
+        openSum = _mm_add_ps(openSum, _mm_and_ps(open, one));
+    }
+    sums.submerged += addLanes(submergedSum);
+    sums.wetted += addLanes(wettedSum);
+    sums.velocity += addLanes(velocitySum);
+    sums.height += addLanes(heightSum);
+    sums.pushX += addLanes(pushXSum);
+    sums.pushY += addLanes(pushYSum);
+    sums.open += addLanes(openSum);
+#endif
+    for (; x <= x1; x++)
+        sumCell(grid, x, y, body, sums);
+}
+
+static BodyForces forcesFromSums(const FootprintSums &sums, const FloatingBody &body, const BodyCouplingSettings &settings)
+{
+    BodyForces forces;
+    float meanVelocity = sums.wetted > 0.0f ? sums.velocity / sums.wetted : 0.0f;
+    forces.submergedVolume = sums.submerged;
+    forces.buoyancy = settings.density * settings.gravity * sums.submerged;
+    forces.drag = settings.drag * sums.wetted * (meanVelocity * EXPLICIT_STEPS_PER_SECOND - body.verticalVelocity);
+    forces.verticalForce = forces.buoyancy + forces.drag - body.mass * settings.gravity;
+
+    //The normals are height differences over two cells, so half of them is the slope
+    forces.pushX = 0.5f * settings.density * settings.gravity * sums.pushX;
+    forces.pushY = 0.5f * settings.density * settings.gravity * sums.pushY;
+    forces.waterHeight = sums.open > 0.0f ? sums.height / sums.open : 0.0f;
+    forces.wettedCells = sums.wetted;
+    return forces;
+}
+
+void computeBodyForces(const CPUWaterGrid &grid, const FloatingBody *bodies, int count,
+                       const BodyCouplingSettings &settings, BodyForces *forces)
+{
+    for (int i = 0; i < count; i++)
+    {
+        FootprintSums sums;
+        int x0, y0, x1, y1;
+        if (footprintCells(bodies[i], grid.width, grid.height, x0, y0, x1, y1))
+        {
+            for (int y = y0; y <= y1; y++)
+                sumRow(grid, y, x0, x1, bodies[i], sums);
+        }
+        forces[i] = forcesFromSums(sums, bodies[i], settings);
+    }
+}
+
+//-----------------------------------------------------------------
+//WaterBodies
+//-----------------------------------------------------------------
+WaterBodies::WaterBodies()
+{
+    cpuResults = false;
+#ifdef WATERBLOCK_WITH_GL
+    bodyBuffer = 0;
+    bodyCapacity = 0;
+    circleBuffer = 0;
+    circleCapacity = 0;
+    FBO = 0;
+    emptyVAO = 0;
+    readbackBodies = 0;
+#endif
+}
+
+WaterBodies::~WaterBodies()
+{
+    release();
+}
+
+void WaterBodies::release()
+{
+#ifdef WATERBLOCK_WITH_GL
+    unsigned int buffers[] = { bodyBuffer, circleBuffer };
+    deleteBuffers(2, buffers);
+    bodyBuffer = circleBuffer = 0;
+    bodyCapacity = circleCapacity = 0;
+    if (FBO)
+        deleteFramebuffers(1, &FBO);
+    if (emptyVAO)
+        deleteVertexArrays(1, &emptyVAO);
+    FBO = emptyVAO = 0;
+    if (readbackBodies)
+        readback.release();
+    readbackBodies = 0;
+#endif
+    cpuResults = false;
+}
+
+//The GL backends run the pass on the GPU, against the textures they already have. The CPU backends
+//have the water on the CPU, so the pass runs there, on a copy of the newest state.
+void WaterBodies::update(WaterBlock &water)
+{
+    if (bodies.empty() || !water.backend())
+        return;
+    if (settings.displace)
+        displace(water);
+
+    WaterBackendType type = water.backendType();
+    if (type == WATER_BACKEND_CPU || type == WATER_BACKEND_CPU_THREADED)
+    {
+        water.backend()->readState(grid);
+        cpuForces.resize(bodies.size());
+        computeBodyForces(grid, &bodies[0], (int)bodies.size(), settings, &cpuForces[0]);
+        cpuResults = true;
+        return;
+    }
+#ifdef WATERBLOCK_WITH_GL
+    dispatch(water);
+#endif
+}
+
+bool WaterBodies::results(std::vector<BodyForces> &forces)
+{
+    bool found = false;
+    if (cpuResults)
+    {
+        newest = cpuForces;
+        cpuResults = false;
+        found = true;
+    }
+#ifdef WATERBLOCK_WITH_GL
+    else if (readbackBodies)
+    {
+        newest.resize(readbackBodies);
+        found = readback.poll(&newest[0]);
+    }
+#endif
+    if (found)
+        forces = newest;
+    return found;
+}
+
+//Open cells with their centers inside a circle, which are the cells injectWater and water_displace.frag change
+static int coveredCells(const WaterBlock &water, float x, float y, float radius)
+{
+    const int width = (int)water.settings().width;
+    const int height = (int)water.settings().height;
+    const unsigned char *mask = water.mask();
+    int minX = std::max(0, (int)std::floor((x - radius) * width));
+    int maxX = std::min(width - 1, (int)std::ceil((x + radius) * width));
+    int minY = std::max(0, (int)std::floor((y - radius) * height));
+    int maxY = std::min(height - 1, (int)std::ceil((y + radius) * height));
+    int covered = 0;
+    for (int cellY = minY; cellY <= maxY; cellY++)
+    {
+        for (int cellX = minX; cellX <= maxX; cellX++)
+        {
+            float dx = (cellX + 0.5f) / width - x;
+            float dy = (cellY + 0.5f) / height - y;
+            if (dx * dx + dy * dy <= radius * radius && !(mask && mask[cellY * width + cellX]))
+                covered++;
+        }
+    }
+    return covered;
+}
+
+//Water a body has pushed aside since last time (by the newest results handed out) comes out from
+//under it, and goes into the disc twice its size around it (which takes in the cells under it too).
+//Each amount is spread over the open cells it actually covers, so the two cancel out, apart from
+//where a body takes out more than is there: the CPU backends stop at empty, and the GL ones go
+//below it. The GL backends get every circle in one additive draw; the CPU backends take them as
+//injections on the next step.
+void WaterBodies::displace(WaterBlock &water)
+{
+    const std::size_t count = std::min(bodies.size(), newest.size());
+    displaced.resize(count, 0.0f);
+    circles.clear();
+    for (std::size_t i = 0; i < count; i++)
+    {
+        float change = newest[i].submergedVolume - displaced[i];
+        displaced[i] = newest[i].submergedVolume;
+        float radius = std::max(bodies[i].halfWidth, bodies[i].halfHeight);
+        if (change == 0.0f || radius <= 0.0f)
+            continue;
+        int innerCells = coveredCells(water, bodies[i].x, bodies[i].y, radius);
+        int outerCells = coveredCells(water, bodies[i].x, bodies[i].y, 2.0f * radius);
+        if (innerCells == 0 || outerCells == 0)
+            continue;
+        WaterInjection inner = { bodies[i].x, bodies[i].y, radius, -change / innerCells };
+        WaterInjection outer = { bodies[i].x, bodies[i].y, 2.0f * radius, change / outerCells };
+        circles.push_back(inner);
+        circles.push_back(outer);
+    }
+    if (circles.empty())
+        return;
+
+    WaterBackendType type = water.backendType();
+    if (type == WATER_BACKEND_CPU || type == WATER_BACKEND_CPU_THREADED)
+    {
+        for (std::size_t i = 0; i < circles.size(); i++)
+            water.inject(circles[i].x, circles[i].y, circles[i].radius, circles[i].amount);
+        return;
+    }
+#ifdef WATERBLOCK_WITH_GL
+    splat(water);
+#endif
+}
+
+#ifdef WATERBLOCK_WITH_GL
+//Fills a shader storage buffer, growing it if it has to
+static void uploadBuffer(unsigned int &buffer, unsigned int &capacity, const void *data, unsigned int bytes, const char *description)
+{
+    if (!buffer)
+        glGenBuffers(1, &buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    if (bytes > capacity)
+    {
+        glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, data, GL_DYNAMIC_DRAW);
+        trackGPUResource(GPU_BUFFER, buffer, bytes, description);
+        capacity = bytes;
+    }
+    else
+    {
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bytes, data);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+//One group per body, reading the backend's height and surface data textures, straight into the next
+//readback buffer. If every readback buffer is still in flight, this frame is skipped.
+void WaterBodies::dispatch(WaterBlock &water)
+{
+    unsigned int count = (unsigned int)bodies.size();
+    if (count != readbackBodies)
+    {
+        if (readbackBodies)
+            readback.release();
+        readback.init(count * sizeof(BodyForces));
+        readbackBodies = count;
+    }
+    unsigned int resultBuffer = readback.begin();
+    if (!resultBuffer)
+        return;
+
+    uploadBuffer(bodyBuffer, bodyCapacity, &bodies[0], count * sizeof(FloatingBody), "floating bodies");
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, bodyBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, resultBuffer);
+
+    std::string computeFile = std::string(water.settings().shaderDirectory) + "water_bodies.comp";
+    ShaderVariant variant(computeFile.c_str());
+    variant.define("EXPLICIT_STEPS_PER_SECOND", EXPLICIT_STEPS_PER_SECOND);
+    variant.sampler("height_texture", 0);
+    variant.sampler("surface_data", 1);
+    ShaderProgram &shader = loadShaderVariant(variant);
+    shader.setUniform("density", settings.density);
+    shader.setUniform("gravity", settings.gravity);
+    shader.setUniform("dragCoefficient", settings.drag);
+    shader.enable();
+
+    water.bindForRendering(0, 1);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    glDispatchCompute(count, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    readback.end();
+    disableTexture(1);
+    disableTexture(0);
+    countGLCalls(6);
+    fetchGLErrors("Error computing body forces:");
+}
+
+//Adds the displacement circles straight into the backend's current height texture, blending them
+//in additively so overlapping circles add up (water_displace.vert). Barriers are left out, as
+//injectWater leaves them out.
+void WaterBodies::splat(WaterBlock &water)
+{
+    GLWaterBackend *backend = static_cast<GLWaterBackend *>(water.backend());
+    Vector2u size = backend->resolution();
+    uploadBuffer(circleBuffer, circleCapacity, &circles[0], (unsigned int)(circles.size() * sizeof(WaterInjection)), "displacement circles");
+    if (!FBO)
+    {
+        FBO = newFramebuffer("displacement");
+        emptyVAO = newVertexArray("displacement");
+    }
+
+    std::string vertexFile = std::string(water.settings().shaderDirectory) + "water_displace.vert";
+    std::string fragmentFile = std::string(water.settings().shaderDirectory) + "water_displace.frag";
+    ShaderVariant variant(vertexFile.c_str(), fragmentFile.c_str());
+    variant.sampler("mask", 0);
+    loadShaderVariant(variant).enable();
+    enableTexture2D(0, backend->barrierTexture());
+
+    //The demo leaves blending on for its overlays, so whatever's set is put back afterwards
+    GLBlending blending = currentBlending();
+    setBlending(true, GL_ONE, GL_ONE);
+
+    GLenum attachments[] = { GL_COLOR_ATTACHMENT0 };
+    bindFramebuffer(FBO);
+    framebufferTexture2D(GL_COLOR_ATTACHMENT0, backend->heightTexture());
+    drawBuffers(1, attachments);
+    setViewport(0, 0, size.x, size.y);
+    bindVertexArray(emptyVAO);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, circleBuffer);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)circles.size());
+    bindVertexArray(0);
+    bindFramebuffer(0);
+
+    setBlending(blending);
+    disableTexture(0);
+    countGLCalls(2);
+    fetchGLErrors("Error displacing water:");
+}
+#endif
@@ -0,0 +1,107 @@
+#ifndef _WATER_BODIES_H_
+#define _WATER_BODIES_H_
+
+//Forces on many floating bodies at once, without reading back any heights per body. Every body's
+//footprint goes into one pass over the height field: one compute dispatch (shaders/water_bodies.comp)
+//on the GL backends, or one SSE2 pass on the CPU backends. All the results come back together, in
+//one buffer that's read without waiting on the GPU, so they're a frame or two behind.
+//
+//    WaterBodies coupling;
+//    coupling.bodies = ...;           //Footprints, updated from your physics every frame
+//    coupling.update(water);          //Starts the pass
+//    if (coupling.results(forces))    //Newest finished results, one per body
+//        ...
+//
+//Footprints are axis aligned boxes. Horizontally, units are cells; vertically, the water's height units.
+
+#include "water_block.h"
+#ifdef WATERBLOCK_WITH_GL
+#include "common.h"
+#endif
+
+#include <vector>
+
+//Laid out to match the Body struct in water_bodies.comp (two vec4s)
+struct FloatingBody
+{
+    float x = 0.5f;           //Center, in texture coordinates
+    float y = 0.5f;
+    float halfWidth = 0.05f;  //Half the footprint's size, in texture coordinates
+    float halfHeight = 0.05f;
+    float bottom = 0.0f;      //Height of the body's underside
+    float thickness = 1.0f;   //From the underside to the top
+    float mass = 1.0f;
+    float verticalVelocity = 0.0f; //Height units per second, for drag
+};
+
+//Laid out to match the Forces struct in water_bodies.comp (two vec4s)
+struct BodyForces
+{
+    float submergedVolume = 0.0f; //Cells times height units below the surface
+    float buoyancy = 0.0f;        //Up, density * gravity * submergedVolume
+    float drag = 0.0f;            //Vertical, against the body's speed relative to the water's
+    float verticalForce = 0.0f;   //Buoyancy and drag, less the body's weight
+    float pushX = 0.0f;           //Horizontal, down the surface's slope
+    float pushY = 0.0f;
+    float waterHeight = 0.0f;     //Mean height of the open cells under the footprint
+    float wettedCells = 0.0f;     //Cells under the footprint the body is in the water over
+};
+
+struct BodyCouplingSettings
+{
+    float density = 1.0f;  //Mass of water per cell times height unit
+    float gravity = 9.8f;
+    float drag = 0.5f;     //Per wetted cell, per height unit per second of relative speed
+    bool displace = false; //Push water out from under bodies as they sink in, and let it back as they rise
+};
+
+//The CPU pass, for a grid that's on the CPU. Same numbers as water_bodies.comp.
+void computeBodyForces(const CPUWaterGrid &grid, const FloatingBody *bodies, int count,
+                       const BodyCouplingSettings &settings, BodyForces *forces);
+
+class WaterBodies
+{
+public:
+    WaterBodies();
+    ~WaterBodies();
+    void release();
+
+    BodyCouplingSettings settings;
+    std::vector<FloatingBody> bodies;
+
+    //Starts computing the forces on every body from the water as it is now. With settings.displace,
+    //also injects the water the bodies have pushed aside since last time.
+    void update(WaterBlock &water);
+
+    //The newest results that have finished, one per body. False if there's nothing new.
+    bool results(std::vector<BodyForces> &forces);
+
+private:
+    WaterBodies(const WaterBodies &);
+    WaterBodies &operator=(const WaterBodies &);
+
+    void displace(WaterBlock &water);
+
+    std::vector<BodyForces> newest;      //Last results handed out, for displacement
+    std::vector<float> displaced;        //Submerged volume each body's displacement was last made for
+    std::vector<WaterInjection> circles; //This update's displacement
+    CPUWaterGrid grid;
+    std::vector<BodyForces> cpuForces;
+    bool cpuResults;
+
+#ifdef WATERBLOCK_WITH_GL
+    void dispatch(WaterBlock &water);
+    void splat(WaterBlock &water);
+
+    unsigned int bodyBuffer;
+    unsigned int bodyCapacity;   //Bytes
+    unsigned int circleBuffer;
+    unsigned int circleCapacity; //Bytes
+    unsigned int FBO;
+    unsigned int emptyVAO;
+    GPUReadback readback;
+    unsigned int readbackBodies; //Bodies the readback buffers are sized for
+#endif
+};
+
+#endif // _WATER_BODIES_H_
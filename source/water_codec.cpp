@@ -0,0 +1,570 @@
+#include "water_codec.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WATER_CODEC_SSE2
+#endif
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_X64) || defined(_M_IX86) || defined(_M_ARM64)
+#define WATER_CODEC_LITTLE_ENDIAN //The bit reader can load 8 bytes at once
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//A coded frame:
+//  'W' 'S', version, 0
+//  frame number, number of the frame it's coded against (or CODEC_KEY_FRAME), 32 bits each
+//  width, height, 16 bits each
+//  one bit per tile, row by row, set if the tile changed
+//  the changed tiles' channels, one after another. Each starts with 5 bits of Rice parameter (or
+//  UNCHANGED_CHANNEL, and nothing more), followed by its cells' differences, zigzag and Rice coded.
+//Numbers are little endian, and bits go into bytes lowest first.
+const unsigned char CODEC_VERSION = 1;
+const std::size_t HEADER_SIZE = 16;
+const int CHANNELS = 3;
+const int TILE_CELLS = CODEC_TILE_SIZE * CODEC_TILE_SIZE;
+const uint32_t UNCHANGED_CHANNEL = 31;
+const uint32_t MAX_RICE_PARAMETER = 30;
+const uint32_t RICE_ESCAPE = 24; //This many ones is followed by the whole value, in 32 bits
+
+//-----------------------------------------------------------------
+//Bits
+//-----------------------------------------------------------------
+//Index of the lowest set bit. value can't be 0.
+static inline uint32_t trailingZeros(uint64_t value)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return index;
+#elif defined(__GNUC__)
+    return (uint32_t)__builtin_ctzll(value);
+#else
+    uint32_t index = 0;
+    while (!(value & 1))
+    {
+        value >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+struct BitWriter
+{
+    std::vector<unsigned char> &bytes;
+    uint64_t bits;
+    int count;
+
+    BitWriter(std::vector<unsigned char> &output) : bytes(output), bits(0), count(0) {}
+
+    //Up to 32 bits at a time. Bytes go out four at a time.
+    void write(uint32_t value, int bitCount)
+    {
+        bits |= (uint64_t)(value & (uint32_t)((1ull << bitCount) - 1)) << count;
+        count += bitCount;
+        if (count >= 32)
+        {
+            const unsigned char word[4] = { (unsigned char)bits, (unsigned char)(bits >> 8), (unsigned char)(bits >> 16),
+                                            (unsigned char)(bits >> 24) };
+            bytes.insert(bytes.end(), word, word + 4);
+            bits >>= 32;
+            count -= 32;
+        }
+    }
+
+    void writeRice(uint32_t value, uint32_t k)
+    {
+        uint32_t quotient = value >> k;
+        if (quotient >= RICE_ESCAPE)
+        {
+            write((1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+            write(value, 32);
+            return;
+        }
+
+        //Ones ended by a zero, then the low k bits, in one write when they fit
+        const uint32_t ones = (1u << quotient) - 1;
+        if (quotient + 1 + k <= 32)
+        {
+            const uint64_t low = value & ((1u << k) - 1);
+            write((uint32_t)(ones | (low << (quotient + 1))), quotient + 1 + k);
+            return;
+        }
+        write(ones, quotient + 1);
+        write(value, k);
+    }
+
+    void flush()
+    {
+        for (; count > 0; count -= 8)
+        {
+            bytes.push_back((unsigned char)bits);
+            bits >>= 8;
+        }
+        bits = 0;
+        count = 0;
+    }
+};
+
+//Reading past the end gives zeros, and overran() reports it afterwards
+struct BitReader
+{
+    const unsigned char *data;
+    std::size_t size;
+    std::size_t position;
+    uint64_t bits;
+    int count;
+    uint64_t consumed;
+
+    BitReader(const unsigned char *bytes, std::size_t byteCount)
+        : data(bytes), size(byteCount), position(0), bits(0), count(0), consumed(0) {}
+
+    //At least 56 bits. Bits above count may already hold the bytes after them, which loading them
+    //again doesn't change.
+    void refill()
+    {
+#ifdef WATER_CODEC_LITTLE_ENDIAN
+        if (position + 8 <= size)
+        {
+            uint64_t word;
+            memcpy(&word, data + position, 8);
+            bits |= word << count;
+            const int bytes = (63 - count) >> 3;
+            position += bytes;
+            count += bytes * 8;
+            return;
+        }
+#endif
+        while (count <= 56)
+        {
+            uint64_t byte = position < size ? data[position] : 0;
+            position++;
+            bits |= byte << count;
+            count += 8;
+        }
+    }
+
+    uint32_t read(int bitCount)
+    {
+        if (count < bitCount)
+            refill();
+        uint32_t value = (uint32_t)(bits & ((1ull << bitCount) - 1));
+        bits >>= bitCount;
+        count -= bitCount;
+        consumed += bitCount;
+        return value;
+    }
+
+    uint32_t readRice(uint32_t k)
+    {
+        refill(); //Enough for every one before the escape, and the zero after them
+        const uint64_t zeros = ~bits;
+        const uint32_t quotient = zeros ? std::min(trailingZeros(zeros), RICE_ESCAPE) : RICE_ESCAPE;
+        bits >>= quotient;
+        count -= quotient;
+        consumed += quotient;
+        if (quotient == RICE_ESCAPE)
+            return read(32);
+        bits >>= 1;
+        count--;
+        consumed++;
+        return (quotient << k) | read(k);
+    }
+
+    bool overran() const { return consumed > (uint64_t)size * 8; }
+};
+
+static void put16(std::vector<unsigned char> &output, uint32_t value)
+{
+    output.push_back((unsigned char)value);
+    output.push_back((unsigned char)(value >> 8));
+}
+
+static void put32(std::vector<unsigned char> &output, uint32_t value)
+{
+    put16(output, value & 0xFFFF);
+    put16(output, value >> 16);
+}
+
+static uint32_t get16(const unsigned char *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *data)
+{
+    return get16(data) | (get16(data + 2) << 16);
+}
+
+//Smallest Rice parameter that keeps the ones short, from the mean of the values
+static uint32_t riceParameter(uint64_t sum, int count)
+{
+    uint32_t k = 0;
+    while (k < MAX_RICE_PARAMETER && ((uint64_t)count << (k + 1)) < sum)
+        k++;
+    return k;
+}
+
+//-----------------------------------------------------------------
+//Quantizing and differences
+//-----------------------------------------------------------------
+//Rounds to the nearest step. Clamped to 2^30 steps either way, so differences always fit in 32 bits.
+static void quantize(const float *values, int count, float step, int32_t *quantized)
+{
+    const float scale = 1.0f / step;
+    const float limit = 1073741824.0f;
+    int i = 0;
+#ifdef WATER_CODEC_SSE2
+    const __m128 scale4 = _mm_set1_ps(scale);
+    const __m128 upper = _mm_set1_ps(limit);
+    const __m128 lower = _mm_set1_ps(-limit);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 value = _mm_mul_ps(_mm_loadu_ps(values + i), scale4);
+        value = _mm_max_ps(_mm_min_ps(value, upper), lower);
+        _mm_storeu_si128((__m128i *)(quantized + i), _mm_cvtps_epi32(value));
+    }
+#endif
+    for (; i < count; i++)
+        quantized[i] = (int32_t)std::lrint(std::min(std::max(values[i] * scale, -limit), limit));
+}
+
+static void dequantize(const int32_t *quantized, std::size_t count, float step, float *values)
+{
+    std::size_t i = 0;
+#ifdef WATER_CODEC_SSE2
+    const __m128 step4 = _mm_set1_ps(step);
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps(values + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(quantized + i))), step4));
+#endif
+    for (; i < count; i++)
+        values[i] = (float)quantized[i] * step;
+}
+
+//Differences from reference, zigzag coded (0, -1, 1, -2... become 0, 1, 2, 3...) so that small ones
+//stay small. Adds them up into sum, and returns true if any are nonzero.
+static bool differences(const int32_t *current, const int32_t *reference, int count, uint32_t *coded, uint64_t *sum)
+{
+    uint32_t any = 0;
+    uint64_t total = 0;
+    int i = 0;
+#ifdef WATER_CODEC_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i any4 = zero;
+    __m128i total2 = zero;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i difference = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(current + i)),
+                                           _mm_loadu_si128((const __m128i *)(reference + i)));
+        __m128i zigzag = _mm_xor_si128(_mm_slli_epi32(difference, 1), _mm_srai_epi32(difference, 31));
+        _mm_storeu_si128((__m128i *)(coded + i), zigzag);
+        any4 = _mm_or_si128(any4, zigzag);
+        total2 = _mm_add_epi64(total2, _mm_add_epi64(_mm_unpacklo_epi32(zigzag, zero), _mm_unpackhi_epi32(zigzag, zero)));
+    }
+    uint32_t anyLanes[4];
+    uint64_t totalLanes[2];
+    _mm_storeu_si128((__m128i *)anyLanes, any4);
+    _mm_storeu_si128((__m128i *)totalLanes, total2);
+    any = anyLanes[0] | anyLanes[1] | anyLanes[2] | anyLanes[3];
+    total = totalLanes[0] + totalLanes[1];
+#endif
+    for (; i < count; i++)
+    {
+        uint32_t difference = (uint32_t)current[i] - (uint32_t)reference[i];
+        uint32_t zigzag = (difference << 1) ^ (uint32_t)((int32_t)difference >> 31);
+        coded[i] = zigzag;
+        any |= zigzag;
+        total += zigzag;
+    }
+    *sum += total;
+    return any != 0;
+}
+
+//Inverse of differences()
+static void undoDifferences(const uint32_t *coded, const int32_t *reference, int count, int32_t *current)
+{
+    int i = 0;
+#ifdef WATER_CODEC_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i zigzag = _mm_loadu_si128((const __m128i *)(coded + i));
+        __m128i difference = _mm_xor_si128(_mm_srli_epi32(zigzag, 1), _mm_sub_epi32(zero, _mm_and_si128(zigzag, one)));
+        _mm_storeu_si128((__m128i *)(current + i), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(reference + i)), difference));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        uint32_t difference = (coded[i] >> 1) ^ (0u - (coded[i] & 1));
+        current[i] = (int32_t)((uint32_t)reference[i] + difference);
+    }
+}
+
+static const float *gridChannel(const CPUWaterGrid &grid, int channel)
+{
+    const GridChannel &values = channel == 0 ? grid.velocities : (channel == 1 ? grid.heights : grid.masks);
+    return values.data();
+}
+
+static float channelStep(const WaterCodecSettings &settings, int channel)
+{
+    return channel == 0 ? settings.velocityStep : (channel == 1 ? settings.heightStep : settings.maskStep);
+}
+
+//-----------------------------------------------------------------
+//Encoder
+//-----------------------------------------------------------------
+WaterEncoder::WaterEncoder(const WaterCodecSettings &codecSettings)
+{
+    settings = codecSettings;
+    nextFrame = 0;
+    baseFrame = CODEC_KEY_FRAME;
+    residuals.resize(CHANNELS * TILE_CELLS);
+}
+
+void WaterEncoder::acknowledge(uint32_t frame)
+{
+    if (history[frame % CODEC_HISTORY].frame != frame || history[frame % CODEC_HISTORY].values.empty())
+        return;
+    if (baseFrame == CODEC_KEY_FRAME || (int32_t)(frame - baseFrame) > 0)
+        baseFrame = frame;
+}
+
+void WaterEncoder::reset()
+{
+    baseFrame = CODEC_KEY_FRAME;
+}
+
+uint32_t WaterEncoder::encode(const CPUWaterGrid &grid, std::vector<unsigned char> &output)
+{
+    const int cells = grid.width * grid.height;
+    if (nextFrame == CODEC_KEY_FRAME)
+        nextFrame = 0;
+    current.frame = nextFrame++;
+    current.width = grid.width;
+    current.height = grid.height;
+    current.values.resize(CHANNELS * cells);
+    for (int channel = 0; channel < CHANNELS; channel++)
+        quantize(gridChannel(grid, channel), cells, channelStep(settings, channel), &current.values[channel * cells]);
+
+    //The acknowledged frame, if it's still around and the grid hasn't changed size since
+    const QuantizedFrame *reference = &keyFrame;
+    uint32_t base = CODEC_KEY_FRAME;
+    if (baseFrame != CODEC_KEY_FRAME)
+    {
+        const QuantizedFrame &candidate = history[baseFrame % CODEC_HISTORY];
+        if (candidate.frame == baseFrame && candidate.width == grid.width && candidate.height == grid.height)
+        {
+            reference = &candidate;
+            base = baseFrame;
+        }
+    }
+    if (reference == &keyFrame && keyFrame.values.size() != current.values.size())
+        keyFrame.values.assign(current.values.size(), 0);
+
+    output.push_back('W');
+    output.push_back('S');
+    output.push_back(CODEC_VERSION);
+    output.push_back(0);
+    put32(output, current.frame);
+    put32(output, base);
+    put16(output, grid.width);
+    put16(output, grid.height);
+
+    const int tilesX = (grid.width + CODEC_TILE_SIZE - 1) / CODEC_TILE_SIZE;
+    const int tilesY = (grid.height + CODEC_TILE_SIZE - 1) / CODEC_TILE_SIZE;
+    const std::size_t bitmap = output.size();
+    output.resize(bitmap + (tilesX * tilesY + 7) / 8, 0);
+
+    BitWriter writer(output);
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            const int x0 = tx * CODEC_TILE_SIZE;
+            const int y0 = ty * CODEC_TILE_SIZE;
+            const int columns = std::min(CODEC_TILE_SIZE, grid.width - x0);
+            const int rows = std::min(CODEC_TILE_SIZE, grid.height - y0);
+            const int tileCells = columns * rows;
+
+            bool changed[CHANNELS];
+            uint64_t sums[CHANNELS];
+            bool tileChanged = false;
+            for (int channel = 0; channel < CHANNELS; channel++)
+            {
+                changed[channel] = false;
+                sums[channel] = 0;
+                for (int y = 0; y < rows; y++)
+                {
+                    const int offset = channel * cells + (y0 + y) * grid.width + x0;
+                    changed[channel] |= differences(&current.values[offset], &reference->values[offset], columns,
+                                                    &residuals[channel * TILE_CELLS + y * columns], &sums[channel]);
+                }
+                tileChanged |= changed[channel];
+            }
+            if (!tileChanged)
+                continue;
+
+            const int tile = ty * tilesX + tx;
+            output[bitmap + tile / 8] |= (unsigned char)(1 << (tile % 8));
+            for (int channel = 0; channel < CHANNELS; channel++)
+            {
+                if (!changed[channel])
+                {
+                    writer.write(UNCHANGED_CHANNEL, 5);
+                    continue;
+                }
+                uint32_t k = riceParameter(sums[channel], tileCells);
+                writer.write(k, 5);
+                const uint32_t *coded = &residuals[channel * TILE_CELLS];
+                for (int i = 0; i < tileCells; i++)
+                    writer.writeRice(coded[i], k);
+            }
+        }
+    }
+    writer.flush();
+
+    //Kept to code later frames against, once it's acknowledged
+    const uint32_t number = current.frame;
+    std::swap(history[number % CODEC_HISTORY], current);
+    return number;
+}
+
+//-----------------------------------------------------------------
+//Decoder
+//-----------------------------------------------------------------
+WaterDecoder::WaterDecoder(const WaterCodecSettings &codecSettings)
+{
+    settings = codecSettings;
+    residuals.resize(TILE_CELLS);
+}
+
+bool WaterDecoder::decode(const unsigned char *data, std::size_t size, CPUWaterGrid &grid, uint32_t *frame)
+{
+    if (size < HEADER_SIZE || data[0] != 'W' || data[1] != 'S' || data[2] != CODEC_VERSION)
+    {
+        std::cout << "Not a water sync frame" << std::endl;
+        return false;
+    }
+    const uint32_t number = get32(data + 4);
+    const uint32_t base = get32(data + 8);
+
+    //The header can't be trusted any more than the rest, so everything sized from it is checked
+    //before anything is allocated
+    const int width = (int)get16(data + 12);
+    const int height = (int)get16(data + 14);
+    if (width == 0 || height == 0 || width > settings.maxSize || height > settings.maxSize)
+    {
+        std::cout << "Water sync frame " << number << " is damaged, or " << width << " x " << height
+                  << " is larger than the decoder takes" << std::endl;
+        return false;
+    }
+    const std::size_t cells = (std::size_t)width * height;
+    const int tilesX = (width + CODEC_TILE_SIZE - 1) / CODEC_TILE_SIZE;
+    const int tilesY = (height + CODEC_TILE_SIZE - 1) / CODEC_TILE_SIZE;
+    const std::size_t tileCount = (std::size_t)tilesX * tilesY;
+    const std::size_t bitmapSize = (tileCount + 7) / 8;
+    if (size < HEADER_SIZE + bitmapSize)
+    {
+        std::cout << "Water sync frame " << number << " is damaged" << std::endl;
+        return false;
+    }
+    const unsigned char *bitmap = data + HEADER_SIZE;
+
+    //Every changed tile takes at least a 5 bit header per channel
+    std::size_t changedTiles = 0;
+    for (std::size_t tile = 0; tile < tileCount; tile++)
+        changedTiles += (bitmap[tile / 8] >> (tile % 8)) & 1;
+    const std::size_t payloadSize = size - HEADER_SIZE - bitmapSize;
+    if (changedTiles * CHANNELS * 5 > payloadSize * 8)
+    {
+        std::cout << "Water sync frame " << number << " is damaged" << std::endl;
+        return false;
+    }
+
+    const QuantizedFrame *reference = &keyFrame;
+    if (base == CODEC_KEY_FRAME)
+    {
+        if (keyFrame.values.size() != CHANNELS * cells)
+            keyFrame.values.assign(CHANNELS * cells, 0);
+    }
+    else
+    {
+        const QuantizedFrame &candidate = history[base % CODEC_HISTORY];
+        if (candidate.frame != base || candidate.width != width || candidate.height != height || candidate.values.empty())
+        {
+            std::cout << "Water sync frame " << number << " needs frame " << base << ", which we don't have" << std::endl;
+            return false;
+        }
+        reference = &candidate;
+    }
+
+    //Unchanged tiles and channels are copied from the reference as they come up, rather than the
+    //whole frame up front
+    current.values.resize(CHANNELS * cells);
+    BitReader reader(bitmap + bitmapSize, payloadSize);
+    for (int ty = 0; ty < tilesY; ty++)
+    {
+        for (int tx = 0; tx < tilesX; tx++)
+        {
+            const std::size_t tile = (std::size_t)ty * tilesX + tx;
+            const bool tileChanged = (bitmap[tile / 8] >> (tile % 8)) & 1;
+            const int x0 = tx * CODEC_TILE_SIZE;
+            const int y0 = ty * CODEC_TILE_SIZE;
+            const int columns = std::min(CODEC_TILE_SIZE, width - x0);
+            const int rows = std::min(CODEC_TILE_SIZE, height - y0);
+            for (int channel = 0; channel < CHANNELS; channel++)
+            {
+                uint32_t k = tileChanged ? reader.read(5) : UNCHANGED_CHANNEL;
+                if (k == UNCHANGED_CHANNEL)
+                {
+                    for (int y = 0; y < rows; y++)
+                    {
+                        const std::size_t offset = channel * cells + (std::size_t)(y0 + y) * width + x0;
+                        memcpy(&current.values[offset], &reference->values[offset], columns * sizeof(int32_t));
+                    }
+                    continue;
+                }
+                if (k > MAX_RICE_PARAMETER || reader.overran())
+                {
+                    std::cout << "Water sync frame " << number << " is damaged" << std::endl;
+                    return false;
+                }
+                for (int i = 0; i < columns * rows; i++)
+                    residuals[i] = reader.readRice(k);
+                for (int y = 0; y < rows; y++)
+                {
+                    const std::size_t offset = channel * cells + (std::size_t)(y0 + y) * width + x0;
+                    undoDifferences(&residuals[y * columns], &reference->values[offset], columns, &current.values[offset]);
+                }
+            }
+        }
+    }
+    if (reader.overran())
+    {
+        std::cout << "Water sync frame " << number << " is damaged" << std::endl;
+        return false;
+    }
+
+    if (grid.width != width || grid.height != height)
+        grid.resize(width, height);
+    dequantize(&current.values[0], cells, settings.velocityStep, &grid.velocities[0]);
+    dequantize(&current.values[cells], cells, settings.heightStep, &grid.heights[0]);
+    dequantize(&current.values[2 * cells], cells, settings.maskStep, &grid.masks[0]);
+
+    current.frame = number;
+    current.width = width;
+    current.height = height;
+    std::swap(history[number % CODEC_HISTORY], current);
+    if (frame)
+        *frame = number;
+    return true;
+}
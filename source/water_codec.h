@@ -0,0 +1,82 @@
+#ifndef _WATER_CODEC_H_
+#define _WATER_CODEC_H_
+
+//Compact, lossy coding of a CPUWaterGrid, for streaming the water from the process that simulates
+//it to viewers (see benchmarks/sync_codec.cpp). Velocities, heights and masks are quantized to
+//fixed steps, and every frame is coded as its difference from a frame the viewer has acknowledged.
+//The grid is split into 16x16 tiles. Tiles that haven't changed are skipped, and the rest are Rice
+//coded, which suits the small differences water makes from one frame to the next. Without an
+//acknowledged frame to start from, a frame is coded against all zeros (a key frame).
+//
+//Quantizing and differencing (and their inverses on the decoding side) use SSE2 where it's available.
+
+#include "cpu_solver.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//Both ends must use the same settings
+struct WaterCodecSettings
+{
+    float velocityStep = 1.0f / 16384.0f;
+    float heightStep = 1.0f / 4096.0f;
+    float maskStep = 1.0f / 255.0f;
+    int maxSize = 4096; //Widest or tallest grid the decoder takes. Anything bigger is treated as damaged.
+};
+
+//One frame after quantizing: all of the velocities, then the heights, then the masks
+struct QuantizedFrame
+{
+    uint32_t frame = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<int32_t> values;
+};
+
+const int CODEC_TILE_SIZE = 16;
+const int CODEC_HISTORY = 16; //Frames each end keeps around to code against
+const uint32_t CODEC_KEY_FRAME = 0xFFFFFFFF;
+
+class WaterEncoder
+{
+public:
+    WaterEncoder(const WaterCodecSettings &settings = WaterCodecSettings());
+
+    //Appends one coded frame to output, and returns its number
+    uint32_t encode(const CPUWaterGrid &grid, std::vector<unsigned char> &output);
+
+    //The viewer has this frame, so later frames can be coded against it
+    void acknowledge(uint32_t frame);
+
+    //The next frame is a key frame, for a viewer that's joining or lost its place
+    void reset();
+
+private:
+    WaterCodecSettings settings;
+    QuantizedFrame history[CODEC_HISTORY]; //Frames sent, in slot frame % CODEC_HISTORY
+    QuantizedFrame current;
+    QuantizedFrame keyFrame; //All zeros, what key frames are coded against
+    uint32_t nextFrame;
+    uint32_t baseFrame; //Newest acknowledged frame, or CODEC_KEY_FRAME
+    std::vector<uint32_t> residuals;
+};
+
+class WaterDecoder
+{
+public:
+    WaterDecoder(const WaterCodecSettings &settings = WaterCodecSettings());
+
+    //Decodes one frame into grid. False if it's damaged, or was coded against a frame we don't have
+    //(which calls for a WaterEncoder::reset()).
+    bool decode(const unsigned char *data, std::size_t size, CPUWaterGrid &grid, uint32_t *frame = NULL);
+
+private:
+    WaterCodecSettings settings;
+    QuantizedFrame history[CODEC_HISTORY]; //Frames decoded, in slot frame % CODEC_HISTORY
+    QuantizedFrame current;
+    QuantizedFrame keyFrame;
+    std::vector<uint32_t> residuals;
+};
+
+#endif // _WATER_CODEC_H_
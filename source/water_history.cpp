@@ -0,0 +1,211 @@
+#include "water_history.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+WaterHistory::WaterHistory(const WaterHistorySettings &historySettings)
+    : settings(historySettings), encoder(historySettings.codec), decoder(historySettings.codec)
+{
+    settings.keyFrameInterval = std::max(settings.keyFrameInterval, 1);
+    ring.resize(settings.budgetBytes);
+    statistics.budgetBytes = settings.budgetBytes;
+    clear();
+}
+
+void WaterHistory::clear()
+{
+    records.clear();
+    head = 0;
+    usedBytes = 0;
+    sinceKeyFrame = 0;
+    needKeyFrame = true;
+    recordWidth = 0;
+    recordHeight = 0;
+    lastFrame = 0;
+    decoded = false;
+    decodedStep = 0;
+    statistics.usedBytes = 0;
+    statistics.records = 0;
+    statistics.keyFrames = 0;
+    statistics.oldestStep = 0;
+    statistics.newestStep = 0;
+}
+
+bool WaterHistory::overlaps(std::size_t offset, std::size_t size) const
+{
+    for (std::size_t i = 0; i < records.size(); i++)
+    {
+        if (records[i].offset < offset + size && offset < records[i].offset + records[i].size)
+            return true;
+    }
+    return false;
+}
+
+//The oldest key frame, and the records coded against it
+void WaterHistory::dropOldest()
+{
+    do
+    {
+        usedBytes -= records.front().size;
+        statistics.keyFrames -= records.front().keyFrame ? 1 : 0;
+        records.pop_front();
+    } while (!records.empty() && !records.front().keyFrame);
+}
+
+std::size_t WaterHistory::find(unsigned long long step) const
+{
+    std::size_t first = 0, last = records.size();
+    while (last - first > 1)
+    {
+        std::size_t middle = (first + last) / 2;
+        if (records[middle].step <= step)
+            first = middle;
+        else
+            last = middle;
+    }
+    return first;
+}
+
+bool WaterHistory::record(unsigned long long step, const CPUWaterGrid &grid)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!records.empty() && step <= records.back().step)
+    {
+        if (step == 0)
+            clear();
+        else
+            discardAfter(step - 1);
+    }
+    if (grid.width != recordWidth || grid.height != recordHeight)
+        needKeyFrame = true;
+
+    //A record coded against one that had to make room for it starts again as a key frame
+    bool keyFrame = needKeyFrame || sinceKeyFrame >= settings.keyFrameInterval;
+    std::size_t offset = 0;
+    while (true)
+    {
+        if (keyFrame)
+            encoder.reset();
+        else
+            encoder.acknowledge(lastFrame);
+        coded.clear();
+        uint32_t frame = encoder.encode(grid, coded);
+        if (coded.size() > ring.size())
+        {
+            std::cout << "A water history record is " << coded.size() << " bytes, more than the whole budget of "
+                      << ring.size() << std::endl;
+            needKeyFrame = true;
+            return false;
+        }
+
+        offset = (head + coded.size() <= ring.size()) ? head : 0;
+        while (!records.empty() && overlaps(offset, coded.size()))
+            dropOldest();
+        lastFrame = frame;
+        if (keyFrame || !records.empty())
+            break;
+        keyFrame = true;
+    }
+
+    memcpy(&ring[offset], &coded[0], coded.size());
+    Record added = { step, offset, coded.size(), keyFrame };
+    records.push_back(added);
+    head = offset + coded.size();
+    usedBytes += coded.size();
+    sinceKeyFrame = keyFrame ? 1 : sinceKeyFrame + 1;
+    needKeyFrame = false;
+    recordWidth = grid.width;
+    recordHeight = grid.height;
+
+    statistics.usedBytes = usedBytes;
+    statistics.records = (int)records.size();
+    statistics.keyFrames += keyFrame ? 1 : 0;
+    statistics.oldestStep = records.front().step;
+    statistics.newestStep = step;
+    statistics.rawBytesPerRecord = (double)grid.width * grid.height * 3 * sizeof(float);
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    statistics.lastRecordMs = elapsed.count();
+    return true;
+}
+
+bool WaterHistory::restore(unsigned long long step, CPUWaterGrid &grid, unsigned long long *restoredStep)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (records.empty() || step < records.front().step)
+        return false;
+
+    std::size_t target = find(step);
+    std::size_t key = target;
+    while (!records[key].keyFrame)
+        key--;
+
+    //Carry on from the last seek if it was in the same stretch and no further on. The decoder still
+    //has the record before any it left off at, so it can decode that one again if it has to.
+    std::size_t first = key;
+    if (decoded && decodedStep >= records[key].step && decodedStep <= records[target].step)
+    {
+        std::size_t at = find(decodedStep);
+        first = (at == target) ? target : at + 1;
+    }
+
+    decoded = false;
+    for (std::size_t i = first; i <= target; i++)
+    {
+        if (!decoder.decode(&ring[records[i].offset], records[i].size, grid))
+            return false;
+    }
+    decoded = true;
+    decodedStep = records[target].step;
+    if (restoredStep)
+        *restoredStep = records[target].step;
+
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    statistics.lastSeekMs = elapsed.count();
+    statistics.lastSeekDecodes = (int)(target - first + 1);
+    statistics.lastSeekSteps = 0;
+    return true;
+}
+
+bool WaterHistory::seek(unsigned long long step, CPUWaterGrid &grid, const CPUSolverSettings &solver, bool implicit,
+                        float implicitStepsPerSecond)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    unsigned long long restored = 0;
+    if (!restore(step, grid, &restored))
+        return false;
+
+    int steps = (int)(step - restored);
+    for (int i = 0; i < steps; i++)
+    {
+        if (implicit)
+            stepImplicit(grid, solver, implicitStepsPerSecond);
+        else
+            stepExplicit(grid, solver);
+    }
+
+    std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    statistics.lastSeekMs = elapsed.count();
+    statistics.lastSeekSteps = steps;
+    return true;
+}
+
+void WaterHistory::discardAfter(unsigned long long step)
+{
+    while (!records.empty() && records.back().step > step)
+    {
+        usedBytes -= records.back().size;
+        statistics.keyFrames -= records.back().keyFrame ? 1 : 0;
+        records.pop_back();
+    }
+
+    //The encoder may no longer have the newest record to code against
+    head = records.empty() ? 0 : records.back().offset + records.back().size;
+    needKeyFrame = true;
+    decoded = decoded && decodedStep <= step;
+    statistics.usedBytes = usedBytes;
+    statistics.records = (int)records.size();
+    statistics.oldestStep = oldestStep();
+    statistics.newestStep = newestStep();
+}
@@ -0,0 +1,110 @@
+#ifndef _WATER_HISTORY_H_
+#define _WATER_HISTORY_H_
+
+//The last few seconds of the water, for stepping back through it (rewinding in a game, or finding
+//where something went wrong). Records are coded with the sync codec (water_codec.h): every
+//keyFrameInterval-th one is a key frame, and the ones between are the tiles that changed since the
+//record before. They go into one ring of budgetBytes, allocated up front, and the oldest key frame
+//goes (with everything that depends on it) to make room. The encoder and decoder keep their own
+//CODEC_HISTORY frames to code against on top of that.
+//
+//Seeking decodes from the nearest key frame at or before the step, so it costs at most
+//keyFrameInterval decodes, and scrubbing forward carries on from the last seek. Between records,
+//seek() steps the solver the rest of the way.
+//
+//    WaterHistory history;
+//    history.record(steps, grid);                   //After every frame, say
+//    ...
+//    history.seek(steps - 750, grid, solver);       //One second back
+//    history.discardAfter(steps - 750);             //And carry on from there
+
+#include "cpu_solver.h"
+#include "water_codec.h"
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+struct WaterHistorySettings
+{
+    std::size_t budgetBytes = 32 * 1024 * 1024;
+    int keyFrameInterval = 32;   //Records from one key frame to the next
+    WaterCodecSettings codec;    //How finely records are quantized
+};
+
+struct WaterHistoryStats
+{
+    std::size_t budgetBytes = 0;
+    std::size_t usedBytes = 0;   //Records still held. Up to a record's worth less than the budget, at the end of the ring.
+    int records = 0;
+    int keyFrames = 0;
+    unsigned long long oldestStep = 0;
+    unsigned long long newestStep = 0;
+    double rawBytesPerRecord = 0.0; //The same grid as floats: velocities, heights and masks
+    float lastRecordMs = 0.0f;
+    float lastSeekMs = 0.0f;     //Decoding and re-simulating
+    int lastSeekDecodes = 0;
+    int lastSeekSteps = 0;       //Steps re-simulated
+};
+
+class WaterHistory
+{
+public:
+    WaterHistory(const WaterHistorySettings &settings = WaterHistorySettings());
+
+    //The grid as it is after step. A step at or before the newest record starts a new timeline, and
+    //everything after it goes. False if a single record won't fit in the budget.
+    bool record(unsigned long long step, const CPUWaterGrid &grid);
+
+    //The newest record at or before step, into grid. False if the history doesn't reach back that far.
+    bool restore(unsigned long long step, CPUWaterGrid &grid, unsigned long long *restoredStep = NULL);
+
+    //restore(), then the solver run from that record up to step. Anything injected in between is lost,
+    //so record right after injecting.
+    bool seek(unsigned long long step, CPUWaterGrid &grid, const CPUSolverSettings &solver, bool implicit = false,
+              float implicitStepsPerSecond = IMPLICIT_STEPS_PER_SECOND);
+
+    //Forgets every record after step, so the water can carry on from there
+    void discardAfter(unsigned long long step);
+    void clear();
+
+    bool empty() const { return records.empty(); }
+    unsigned long long oldestStep() const { return records.empty() ? 0 : records.front().step; }
+    unsigned long long newestStep() const { return records.empty() ? 0 : records.back().step; }
+    const WaterHistoryStats &stats() const { return statistics; }
+
+private:
+    struct Record
+    {
+        unsigned long long step;
+        std::size_t offset; //Into the ring
+        std::size_t size;
+        bool keyFrame;
+    };
+
+    bool overlaps(std::size_t offset, std::size_t size) const;
+    void dropOldest();
+    std::size_t find(unsigned long long step) const; //Newest record at or before step
+
+    WaterHistorySettings settings;
+    std::vector<unsigned char> ring;
+    std::deque<Record> records;
+    std::size_t head; //Where the next record goes, if it fits before the end
+    std::size_t usedBytes;
+    int sinceKeyFrame;
+    bool needKeyFrame;
+    int recordWidth; //Of the newest record. A new size needs a key frame.
+    int recordHeight;
+    WaterEncoder encoder;
+    WaterDecoder decoder;
+    std::vector<unsigned char> coded;
+    uint32_t lastFrame;
+
+    //The record the decoder last finished, so seeking forward in the same stretch carries on from it
+    bool decoded;
+    unsigned long long decodedStep;
+
+    WaterHistoryStats statistics;
+};
+
+#endif // _WATER_HISTORY_H_
@@ -0,0 +1,429 @@
+#include "water_ocean.h"
+#include "cpu_solver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+
+const double TWO_PI = 6.28318530717958647692;
+
+//Every wave's frequency is rounded down to a multiple of 2 pi / REPEAT_SECONDS, so the whole surface
+//repeats after that long. Time can then wrap around, and stays small enough for a float on the GPU.
+const double REPEAT_SECONDS = 1024.0;
+
+//-----------------------------------------------------------------
+//Spectrum
+//-----------------------------------------------------------------
+//Wave number of a cell. Cell n / 2 is the zero frequency, so the spectrum is centered.
+static float waveNumber(int cell, int n, float tileSize)
+{
+    return (float)(TWO_PI * (cell - n / 2) / tileSize);
+}
+
+//Phillips spectrum: waves about as long as the wind can raise, running with it. Not scaled, since
+//create() scales the whole spectrum to the wave height asked for.
+static double phillips(double kx, double ky, double windX, double windY, double longest, double shortest)
+{
+    double k2 = kx * kx + ky * ky;
+    if (k2 == 0.0)
+        return 0.0;
+    double alignment = (kx * windX + ky * windY) / std::sqrt(k2);
+    return std::exp(-1.0 / (k2 * longest * longest)) / (k2 * k2) * alignment * alignment *
+           std::exp(-k2 * shortest * shortest);
+}
+
+OceanSpectrum::OceanSpectrum() : n(0), time(0.0), heightTarget(NULL), surfaceTarget(NULL)
+{
+}
+
+bool OceanSpectrum::create(const OceanSettings &settings)
+{
+    release();
+    if (!fft.init(settings.size, settings.threads))
+        return false;
+    oceanSettings = settings;
+    n = settings.size;
+    int cells = n * n;
+    for (int i = 0; i < 3; i++)
+    {
+        real[i].assign(cells, 0.0f);
+        imaginary[i].assign(cells, 0.0f);
+    }
+
+    double windLength = std::sqrt((double)settings.windX * settings.windX + (double)settings.windY * settings.windY);
+    double windX = (windLength > 0.0) ? settings.windX / windLength : 1.0;
+    double windY = (windLength > 0.0) ? settings.windY / windLength : 0.0;
+    double longest = (double)settings.windSpeed * settings.windSpeed / settings.gravity;
+    double shortest = longest * settings.smallWaves;
+
+    //h0(k), a complex Gaussian scaled by the spectrum. The Nyquist row and column are left at zero:
+    //they'd be their own mirror images, which the slopes and displacements can't be.
+    std::mt19937 random(settings.seed);
+    std::vector<double> h0(cells * 2, 0.0);
+    frequencies.assign(cells, 0.0f);
+    for (int y = 0; y < n; y++)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            double kx = waveNumber(x, n, settings.tileSize);
+            double ky = waveNumber(y, n, settings.tileSize);
+            double frequency = std::sqrt(settings.gravity * std::sqrt(kx * kx + ky * ky));
+            frequencies[y * n + x] = (float)(std::floor(frequency * REPEAT_SECONDS / TWO_PI) * TWO_PI / REPEAT_SECONDS);
+
+            //Box-Muller, from the generator's raw output so that every platform draws the same waves
+            double u1 = (random() + 0.5) / 4294967296.0;
+            double u2 = (random() + 0.5) / 4294967296.0;
+            double radius = std::sqrt(-2.0 * std::log(u1));
+            if (x == 0 || y == 0)
+                continue;
+            double amplitude = std::sqrt(phillips(kx, ky, windX, windY, longest, shortest) * 0.5);
+            h0[(y * n + x) * 2 + 0] = radius * std::cos(TWO_PI * u2) * amplitude;
+            h0[(y * n + x) * 2 + 1] = radius * std::sin(TWO_PI * u2) * amplitude;
+        }
+    }
+
+    //By Parseval, the heights' variance at time 0 is the sum of |h0(k) + conj(h0(-k))|^2
+    initial.assign(cells * 4, 0.0f);
+    double variance = 0.0;
+    for (int y = 0; y < n; y++)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            int m = y * n + x;
+            int mirror = ((n - y) % n) * n + (n - x) % n;
+            double re = h0[m * 2] + h0[mirror * 2];
+            double im = h0[m * 2 + 1] - h0[mirror * 2 + 1];
+            variance += re * re + im * im;
+        }
+    }
+    double deviation = settings.waveHeight / 4.0;
+    double scale = (variance > 0.0) ? std::sqrt(deviation * deviation / variance) : 0.0;
+    for (int m = 0; m < cells; m++)
+    {
+        int x = m % n, y = m / n;
+        int mirror = ((n - y) % n) * n + (n - x) % n;
+        initial[m * 4 + 0] = (float)(h0[m * 2] * scale);
+        initial[m * 4 + 1] = (float)(h0[m * 2 + 1] * scale);
+        initial[m * 4 + 2] = (float)(h0[mirror * 2] * scale);
+        initial[m * 4 + 3] = (float)(-h0[mirror * 2 + 1] * scale);
+    }
+    time = 0.0;
+    return true;
+}
+
+void OceanSpectrum::release()
+{
+    fft.release();
+    n = 0;
+}
+
+//h(k, t) = h0(k) e^(i w t) + conj(h0(-k)) e^(-i w t), and from it the velocity, slopes and
+//displacements, for rows [begin, end)
+void OceanSpectrum::spectrumTask(void *context, int begin, int end)
+{
+    OceanSpectrum &ocean = *(OceanSpectrum *)context;
+    const int n = ocean.n;
+    const float tileSize = ocean.oceanSettings.tileSize;
+    for (int y = begin; y < end; y++)
+    {
+        float ky = waveNumber(y, n, tileSize);
+        for (int x = 0; x < n; x++)
+        {
+            int m = y * n + x;
+            float kx = waveNumber(x, n, tileSize);
+            float k = std::sqrt(kx * kx + ky * ky);
+            float w = ocean.frequencies[m];
+            float phase = (float)std::fmod(w * ocean.time, TWO_PI);
+            float c = std::cos(phase);
+            float s = std::sin(phase);
+
+            const float *h0 = &ocean.initial[m * 4];
+            float forwardRe = h0[0] * c - h0[1] * s; //h0(k) e^(i w t)
+            float forwardIm = h0[0] * s + h0[1] * c;
+            float backRe = h0[2] * c + h0[3] * s;    //conj(h0(-k)) e^(-i w t)
+            float backIm = h0[3] * c - h0[2] * s;
+            float hRe = forwardRe + backRe;
+            float hIm = forwardIm + backIm;
+            float velocityRe = -w * (forwardIm - backIm); //i w (forward - back)
+            float velocityIm = w * (forwardRe - backRe);
+
+            //Each pair of real fields goes into one complex one, a + i b
+            ocean.real[0][m] = hRe - velocityIm;
+            ocean.imaginary[0][m] = hIm + velocityRe;
+            ocean.real[1][m] = -kx * hIm - ky * hRe; //i kx h + i (i ky h)
+            ocean.imaginary[1][m] = kx * hRe - ky * hIm;
+            float ux = (k > 0.0f) ? kx / k : 0.0f;   //i (k / |k|) h, toward the crests
+            float uy = (k > 0.0f) ? ky / k : 0.0f;
+            ocean.real[2][m] = -ux * hIm - uy * hRe;
+            ocean.imaginary[2][m] = ux * hRe - uy * hIm;
+        }
+    }
+}
+
+void OceanSpectrum::evaluate(double seconds)
+{
+    time = std::fmod(seconds, REPEAT_SECONDS);
+    fft.parallel(n, spectrumTask, this);
+    float *fieldsReal[3] = { &real[0][0], &real[1][0], &real[2][0] };
+    float *fieldsImaginary[3] = { &imaginary[0][0], &imaginary[1][0], &imaginary[2][0] };
+    fft.inverse(fieldsReal, fieldsImaginary, 3);
+}
+
+//The spectrum is centered, which leaves every other cell's sign flipped
+static float cellSign(int x, int y)
+{
+    return ((x + y) & 1) ? -1.0f : 1.0f;
+}
+
+void OceanSpectrum::readField(OceanField &field) const
+{
+    int cells = n * n;
+    field.size = n;
+    field.heights.resize(cells);
+    field.velocities.resize(cells);
+    field.displacementX.resize(cells);
+    field.displacementY.resize(cells);
+    field.slopeX.resize(cells);
+    field.slopeY.resize(cells);
+    for (int m = 0; m < cells; m++)
+    {
+        float sign = cellSign(m % n, m / n);
+        field.heights[m] = sign * real[0][m];
+        field.velocities[m] = sign * imaginary[0][m];
+        field.slopeX[m] = sign * real[1][m];
+        field.slopeY[m] = sign * imaginary[1][m];
+        field.displacementX[m] = sign * real[2][m] * oceanSettings.choppiness;
+        field.displacementY[m] = sign * imaginary[2][m] * oceanSettings.choppiness;
+    }
+}
+
+void OceanSpectrum::texturesTask(void *context, int begin, int end)
+{
+    OceanSpectrum &ocean = *(OceanSpectrum *)context;
+    const int n = ocean.n;
+    const float choppiness = ocean.oceanSettings.choppiness;
+    const float difference = -2.0f * ocean.oceanSettings.tileSize / n; //Slope to a central difference
+    for (int y = begin; y < end; y++)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            int m = y * n + x;
+            float sign = cellSign(x, y);
+            float velocity = sign * ocean.imaginary[0][m] / EXPLICIT_STEPS_PER_SECOND;
+            float *height = ocean.heightTarget + m * 4;
+            height[0] = velocity;
+            height[1] = sign * ocean.real[0][m];
+            height[2] = sign * ocean.real[2][m] * choppiness;
+            height[3] = sign * ocean.imaginary[2][m] * choppiness;
+            float *surface = ocean.surfaceTarget + m * 4;
+            surface[0] = sign * ocean.real[1][m] * difference;
+            surface[1] = sign * ocean.imaginary[1][m] * difference;
+            surface[2] = std::fabs(velocity);
+            surface[3] = 1.0f;
+        }
+    }
+}
+
+void OceanSpectrum::writeTextures(float *height, float *surfaceData)
+{
+    heightTarget = height;
+    surfaceTarget = surfaceData;
+    fft.parallel(n, texturesTask, this);
+}
+
+#ifdef WATERBLOCK_WITH_GL
+//-----------------------------------------------------------------
+//Textures
+//-----------------------------------------------------------------
+//Repeating, with a full mip chain so the far distance doesn't shimmer
+static unsigned int oceanTexture(int size, GLenum format, const char *description)
+{
+    int levels = 1;
+    while ((size >> levels) > 0)
+        levels++;
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    bindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, levels, format, size, size);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    bindTexture(GL_TEXTURE_2D, 0);
+    countGLCalls(7);
+    trackGPUResource(GPU_TEXTURE, texture, textureBytes(Vector2u(size), format, 1, true), description);
+    return texture;
+}
+
+//Read and written by the compute passes only, one level
+static unsigned int spectrumTexture(int size, const void *data, const char *description)
+{
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    bindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, size, size);
+    if (data)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RGBA, GL_FLOAT, data);
+    bindTexture(GL_TEXTURE_2D, 0);
+    countGLCalls(4);
+    trackGPUResource(GPU_TEXTURE, texture, textureBytes(Vector2u(size), GL_RGBA32F), description);
+    return texture;
+}
+
+WaterOcean::WaterOcean() : oceanEngine(OCEAN_CPU), heightTexture(0), surfaceDataTexture(0), initialTexture(0)
+{
+    spectrumTextures[0] = spectrumTextures[1] = 0;
+}
+
+WaterOcean::~WaterOcean()
+{
+    release();
+}
+
+bool WaterOcean::create(const OceanSettings &settings, OceanEngine engine)
+{
+    release();
+
+    //The GPU engine transforms a line per group, two cells per invocation, in 16x16 tiles
+    if (engine == OCEAN_GPU && (settings.size < 16 || settings.size > 1024))
+    {
+        std::cout << "The GPU ocean needs a size from 16 to 1024, not " << settings.size << std::endl;
+        return false;
+    }
+    if (!spectrum.create(settings))
+    {
+        std::cout << "The ocean's size has to be a power of two, at least 4, not " << settings.size << std::endl;
+        return false;
+    }
+
+    int n = settings.size;
+    oceanEngine = engine;
+    heightTexture = oceanTexture(n, GL_RGBA32F, "ocean heights");
+    surfaceDataTexture = oceanTexture(n, GL_RGBA16F, "ocean surface data");
+    if (engine == OCEAN_CPU)
+    {
+        pixels.init(n * n * 4 * sizeof(float) * 2);
+    }
+    else
+    {
+        initialTexture = spectrumTexture(n, &spectrum.initialSpectrum()[0], "ocean initial spectrum");
+        spectrumTextures[0] = spectrumTexture(n, NULL, "ocean spectrum");
+        spectrumTextures[1] = spectrumTexture(n, NULL, "ocean spectrum");
+    }
+    fetchGLErrors("Error creating the ocean:");
+    return true;
+}
+
+void WaterOcean::release()
+{
+    if (!heightTexture)
+        return;
+    deleteTextures(1, &heightTexture);
+    deleteTextures(1, &surfaceDataTexture);
+    if (oceanEngine == OCEAN_CPU)
+    {
+        pixels.release();
+    }
+    else
+    {
+        deleteTextures(1, &initialTexture);
+        deleteTextures(2, spectrumTextures);
+    }
+    heightTexture = surfaceDataTexture = initialTexture = 0;
+    spectrumTextures[0] = spectrumTextures[1] = 0;
+    spectrum.release();
+}
+
+void WaterOcean::update(double seconds)
+{
+    if (!heightTexture)
+        return;
+    if (oceanEngine == OCEAN_CPU)
+        updateCPU(seconds);
+    else
+        updateGPU(seconds);
+
+    bindTexture(GL_TEXTURE_2D, heightTexture);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    bindTexture(GL_TEXTURE_2D, surfaceDataTexture);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    bindTexture(GL_TEXTURE_2D, 0);
+    countGLCalls(2);
+    fetchGLErrors("Error updating the ocean:");
+}
+
+//The tile is written straight into the upload buffer, then copied into the textures on the GPU
+void WaterOcean::updateCPU(double seconds)
+{
+    int n = spectrum.settings().size;
+    unsigned int heightBytes = n * n * 4 * sizeof(float);
+    spectrum.evaluate(seconds);
+    float *data = (float *)pixels.begin();
+    spectrum.writeTextures(data, data + n * n * 4);
+
+    bindTexture(GL_TEXTURE_2D, heightTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, n, n, GL_RGBA, GL_FLOAT, pixels.pixels(0));
+    bindTexture(GL_TEXTURE_2D, surfaceDataTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, n, n, GL_RGBA, GL_FLOAT, pixels.pixels(heightBytes));
+    pixels.end();
+    countGLCalls(2);
+}
+
+static ShaderProgram &oceanShader(const OceanSettings &settings, const char *pass)
+{
+    std::string computeFile = std::string(settings.shaderDirectory) + "ocean_fft.comp";
+    ShaderVariant variant(computeFile.c_str());
+    variant.define(pass);
+    variant.define("SIZE", settings.size);
+    int log2Size = 0;
+    while ((1 << log2Size) < settings.size)
+        log2Size++;
+    variant.define("LOG2_SIZE", log2Size);
+    variant.define("EXPLICIT_STEPS_PER_SECOND", EXPLICIT_STEPS_PER_SECOND);
+    variant.define("BASE_FREQUENCY", (float)(TWO_PI / REPEAT_SECONDS));
+    return loadShaderVariant(variant);
+}
+
+//Spectrum, rows, columns and the textures, one dispatch each
+void WaterOcean::updateGPU(double seconds)
+{
+    const OceanSettings &settings = spectrum.settings();
+    int n = settings.size;
+    bindImageTexture(0, initialTexture, GL_RGBA32F);
+    bindImageTexture(1, spectrumTextures[0], GL_RGBA32F);
+    bindImageTexture(2, spectrumTextures[1], GL_RGBA32F);
+
+    ShaderProgram &spectrumShader = oceanShader(settings, "SPECTRUM");
+    spectrumShader.setUniform("time", (float)std::fmod(seconds, REPEAT_SECONDS));
+    spectrumShader.setUniform("tileSize", settings.tileSize);
+    spectrumShader.setUniform("gravity", settings.gravity);
+    spectrumShader.enable();
+    glDispatchCompute(n / 16, n / 16, 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    oceanShader(settings, "ROWS").enable();
+    glDispatchCompute(n, 1, 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    oceanShader(settings, "COLUMNS").enable();
+    glDispatchCompute(n, 1, 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    bindImageTexture(3, heightTexture, GL_RGBA32F);
+    bindImageTexture(4, surfaceDataTexture, GL_RGBA16F);
+    ShaderProgram &finishShader = oceanShader(settings, "FINISH");
+    finishShader.setUniform("choppiness", settings.choppiness);
+    finishShader.setUniform("difference", -2.0f * settings.tileSize / n);
+    finishShader.enable();
+    glDispatchCompute(n / 16, n / 16, 1);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+    countGLCalls(16);
+}
+
+void WaterOcean::bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit)
+{
+    enableTexture2D(heightUnit, heightTexture);
+    enableTexture2D(surfaceDataUnit, surfaceDataTexture);
+}
+#endif
@@ -0,0 +1,138 @@
+#ifndef _WATER_OCEAN_H_
+#define _WATER_OCEAN_H_
+
+//Open water too wide to simulate cell by cell, as a sum of waves (Tessendorf, "Simulating Ocean
+//Water"). Each wave's amplitude is drawn once from a wind driven (Phillips) spectrum, and every frame
+//the surface comes out of inverse FFTs of the spectrum at that moment. That's a fixed O(N log N) for
+//a tile that repeats seamlessly, however much of the world it's spread over.
+//
+//The tile comes out in the same layout as a WaterBlock's textures, so water_surface.vert and
+//water_surface.frag draw it with the same code, and blend it into the interactive grid:
+//    height texture: velocity (per explicit step), height, and the horizontal displacement that
+//                    sharpens the crests (where a grid has its mask)
+//    surface data:   the central differences water_physics.frag writes, and speed
+//
+//    WaterOcean ocean;
+//    ocean.create(settings, OCEAN_CPU);
+//    ocean.update(seconds);             //Every frame, with the time since the start
+//    ocean.bindForRendering(9, 10);
+//
+//OCEAN_CPU evaluates the spectrum with FFT2D (fft.h) and streams the tile up; OCEAN_GPU does all of
+//it in compute shaders (shaders/ocean_fft.comp), with nothing crossing the bus after create().
+//OceanSpectrum is the CPU side on its own, and needs no OpenGL.
+
+#include "fft.h"
+#ifdef WATERBLOCK_WITH_GL
+#include "common.h"
+#endif
+
+#include <vector>
+
+enum OceanEngine
+{
+    OCEAN_CPU,
+    OCEAN_GPU
+};
+
+struct OceanSettings
+{
+    int size = 128;           //Cells across the tile, a power of two
+    float tileSize = 64.0f;   //World units across the tile, before it repeats
+    float waveHeight = 0.6f;  //Significant wave height: four times the standard deviation of the heights
+    float windSpeed = 8.0f;   //World units per second. Stronger wind means longer waves.
+    float windX = 1.0f;       //Which way the waves run. Needn't be normalized.
+    float windY = 0.4f;
+    float smallWaves = 0.01f; //Waves shorter than this fraction of the wind's longest are damped out
+    float choppiness = 1.0f;  //How far crests are pulled in horizontally, 0 for round waves
+    float gravity = 9.8f;
+    unsigned int seed = 1;
+    int threads = 0;          //For the CPU engine. 0 is one per hardware thread.
+    const char *shaderDirectory = "shaders/";
+};
+
+//One evaluation of the tile, size * size cells of each, row major
+struct OceanField
+{
+    int size = 0;
+    std::vector<float> heights;
+    std::vector<float> velocities;    //Height units per second
+    std::vector<float> displacementX; //World units, choppiness included
+    std::vector<float> displacementY;
+    std::vector<float> slopeX;        //Height units per world unit
+    std::vector<float> slopeY;
+};
+
+class OceanSpectrum
+{
+public:
+    OceanSpectrum();
+
+    bool create(const OceanSettings &settings);
+    void release();
+    const OceanSettings &settings() const { return oceanSettings; }
+
+    //The surface at a time, in seconds. Fills in the FFTs' output, which the functions below read.
+    void evaluate(double seconds);
+    void readField(OceanField &field) const;
+
+    //The last evaluation in the textures' layout: four floats per cell for the height texture, and
+    //four for the surface data
+    void writeTextures(float *height, float *surfaceData);
+
+    //h0(k) and conj(h0(-k)), four floats per cell, for the GPU engine to start from
+    const std::vector<float> &initialSpectrum() const { return initial; }
+
+private:
+    static void spectrumTask(void *context, int begin, int end);
+    static void texturesTask(void *context, int begin, int end);
+
+    OceanSettings oceanSettings;
+    FFT2D fft;
+    int n;
+    std::vector<float> initial;
+    std::vector<float> frequencies; //Radians per second of every cell's wave
+    double time;
+
+    //Three complex fields, each carrying two real ones: height + i velocity, slope x + i slope y,
+    //displacement x + i displacement y
+    std::vector<float> real[3];
+    std::vector<float> imaginary[3];
+
+    float *heightTarget; //writeTextures() under way
+    float *surfaceTarget;
+};
+
+#ifdef WATERBLOCK_WITH_GL
+class WaterOcean
+{
+public:
+    WaterOcean();
+    ~WaterOcean();
+
+    bool create(const OceanSettings &settings, OceanEngine engine);
+    void release();
+    bool created() const { return heightTexture != 0; }
+    OceanEngine engine() const { return oceanEngine; }
+    const OceanSettings &settings() const { return spectrum.settings(); }
+
+    void update(double seconds);
+    void bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit);
+
+private:
+    WaterOcean(const WaterOcean &);
+    WaterOcean &operator=(const WaterOcean &);
+
+    void updateCPU(double seconds);
+    void updateGPU(double seconds);
+
+    OceanSpectrum spectrum;
+    OceanEngine oceanEngine;
+    unsigned int heightTexture;       //RGBA32F, with mipmaps for the far distance
+    unsigned int surfaceDataTexture;  //RGBA16F, same
+    GPUUpload pixels;                 //CPU engine
+    unsigned int initialTexture;      //GPU engine: RGBA32F, h0(k) and conj(h0(-k))
+    unsigned int spectrumTextures[2]; //GPU engine: RGBA32F, the three complex fields
+};
+#endif
+
+#endif // _WATER_OCEAN_H_
@@ -0,0 +1,178 @@
+#include "water_sweep.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+static const char *barrierNames[SWEEP_BARRIER_LAYOUTS] = { "none", "wall", "gap", "zigzag" };
+
+//The demo's walls (initGeometry() in main.cpp) from above: center x and z, and half their width and
+//length, in world units
+struct SweepWall
+{
+    float x, z, halfX, halfZ;
+};
+static const SweepWall sweepWalls[7] = {
+    { 0.0f, 0.0f, 1.0f, 8.0f }, { 0.5f, 0.0f, 1.0f, 2.0f },
+    { 0.0f, -4.5f, 1.0f, 3.5f }, { 0.0f, 4.5f, 1.0f, 3.5f },
+    { 4.0f, 1.0f, 1.0f, 7.0f }, { 0.0f, -1.0f, 1.0f, 7.0f }, { -4.0f, 1.0f, 1.0f, 7.0f }
+};
+static const int sweepWallFirst[SWEEP_BARRIER_LAYOUTS] = { 0, 0, 2, 4 };
+static const int sweepWallCounts[SWEEP_BARRIER_LAYOUTS] = { 0, 2, 2, 3 };
+static const float SWEEP_MASK_EXTENT = 7.5f; //Half the width of the view the mask is baked from
+
+int SweepGrid::count() const
+{
+    return (int)(std::max<std::size_t>(gravity.size(), 1) * std::max<std::size_t>(decay.size(), 1) *
+                 std::max<std::size_t>(brushSize.size(), 1) * std::max<std::size_t>(brushPower.size(), 1) *
+                 std::max<std::size_t>(barriers.size(), 1));
+}
+
+//Takes the next digit of index in a list's base, or leaves value at its default if the list is empty
+template <typename T>
+static void pick(const std::vector<T> &values, int &index, T &value)
+{
+    if (values.empty())
+        return;
+    value = values[index % values.size()];
+    index /= (int)values.size();
+}
+
+SweepCase SweepGrid::at(int index) const
+{
+    SweepCase parameters;
+    pick(barriers, index, parameters.barriers);
+    pick(brushPower, index, parameters.brushPower);
+    pick(brushSize, index, parameters.brushSize);
+    pick(decay, index, parameters.decay);
+    pick(gravity, index, parameters.gravity);
+    return parameters;
+}
+
+void sweepBarrierMask(int layout, int width, int height, std::vector<unsigned char> &mask)
+{
+    mask.assign(width * height, 0);
+    if (layout < 0 || layout >= SWEEP_BARRIER_LAYOUTS)
+        return;
+    for (int y = 0; y < height; y++)
+    {
+        //The view looks down with -z up, so the bottom row is the +z edge
+        float z = SWEEP_MASK_EXTENT - (y + 0.5f) / height * SWEEP_MASK_EXTENT * 2.0f;
+        for (int x = 0; x < width; x++)
+        {
+            float worldX = (x + 0.5f) / width * SWEEP_MASK_EXTENT * 2.0f - SWEEP_MASK_EXTENT;
+            for (int i = 0; i < sweepWallCounts[layout]; i++)
+            {
+                const SweepWall &wall = sweepWalls[sweepWallFirst[layout] + i];
+                if (std::fabs(worldX - wall.x) <= wall.halfX && std::fabs(z - wall.z) <= wall.halfZ)
+                    mask[y * width + x] = 255;
+            }
+        }
+    }
+}
+
+SweepResult runSweepCase(const SweepCase &parameters, const SweepSettings &settings, CPUWaterGrid &grid)
+{
+    SweepResult result;
+    result.parameters = parameters;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    grid.resize(settings.width, settings.height);
+    std::fill(grid.velocities.begin(), grid.velocities.end(), 0.0f);
+    std::fill(grid.heights.begin(), grid.heights.end(), settings.startHeight);
+    std::vector<unsigned char> mask;
+    sweepBarrierMask(parameters.barriers, settings.width, settings.height, mask);
+    applyMask(grid, &mask[0]);
+
+    CPUSolverSettings solver;
+    solver.gravity = parameters.gravity;
+    solver.decay = parameters.decay;
+    float stepsPerSecond = settings.implicit ? settings.implicitStepsPerSecond : EXPLICIT_STEPS_PER_SECOND;
+
+    //Frame by frame, like the demo: the brush is painted once a frame, then as many fixed steps run as fit
+    int frames = (int)(settings.seconds * settings.frameRate + 0.5f);
+    int brushFrames = (int)(settings.brushSeconds * settings.frameRate + 0.5f);
+    double accumulator = 0.0;
+    double stepTime = 1.0 / stepsPerSecond;
+    float brushVolume = 0.0f;
+    for (int frame = 0; frame < frames && result.stable; frame++)
+    {
+        if (frame < brushFrames)
+            injectWater(grid, settings.brushX, settings.brushY, parameters.brushSize, parameters.brushPower / settings.frameRate);
+
+        accumulator += 1.0 / settings.frameRate;
+        while (accumulator >= stepTime)
+        {
+            if (settings.implicit)
+                stepImplicit(grid, solver, stepsPerSecond);
+            else
+                stepExplicit(grid, solver);
+            accumulator -= stepTime;
+            result.steps++;
+        }
+
+        WaterDiagnostics diagnostics = reduceDiagnostics(grid);
+        if (!std::isfinite(diagnostics.volume) || !std::isfinite(diagnostics.kineticEnergy))
+            result.stable = false;
+        if (frame == brushFrames - 1 || (brushFrames == 0 && frame == 0))
+            brushVolume = diagnostics.volume;
+
+        //Settled from the frame the energy dropped under 1% of the peak so far, and stayed there
+        result.peakKineticEnergy = std::max(result.peakKineticEnergy, diagnostics.kineticEnergy);
+        if (frame < brushFrames || diagnostics.kineticEnergy >= result.peakKineticEnergy * 0.01f)
+            result.settleSeconds = -1.0f;
+        else if (result.settleSeconds < 0.0f)
+            result.settleSeconds = (frame + 1) / settings.frameRate;
+        result.last = diagnostics;
+    }
+
+    result.volumeDrift = (brushVolume > 0.0f) ? (result.last.volume - brushVolume) / brushVolume : 0.0f;
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    result.ms = elapsed.count();
+    return result;
+}
+
+std::vector<SweepResult> runSweep(const SweepGrid &grid, const SweepSettings &settings)
+{
+    int count = grid.count();
+    std::vector<SweepResult> results(count);
+    int threads = settings.threads;
+    if (threads <= 0)
+        threads = std::max((int)std::thread::hardware_concurrency(), 1);
+    threads = std::min(threads, count);
+
+    //Each worker takes the next case until there are none left, so a slow (or unstable) run doesn't
+    //hold up a whole slice of the grid
+    std::atomic<int> next(0);
+    auto work = [&]()
+    {
+        CPUWaterGrid water;
+        for (int i = next++; i < count; i = next++)
+            results[i] = runSweepCase(grid.at(i), settings, water);
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++)
+        workers.push_back(std::thread(work));
+    work();
+    for (std::size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    return results;
+}
+
+void printSweepTable(FILE *out, const std::vector<SweepResult> &results)
+{
+    fprintf(out, "gravity,decay,brushSize,brushPower,barriers,stable,steps,ms,volume,volumeDrift,"
+                 "kineticEnergy,peakKineticEnergy,maxVelocity,activeCells,settleSeconds\n");
+    for (std::size_t i = 0; i < results.size(); i++)
+    {
+        const SweepResult &r = results[i];
+        const SweepCase &p = r.parameters;
+        const char *barriers = (p.barriers >= 0 && p.barriers < SWEEP_BARRIER_LAYOUTS) ? barrierNames[p.barriers] : "?";
+        fprintf(out, "%g,%g,%g,%g,%s,%d,%d,%.3f,%g,%g,%g,%g,%g,%g,%g\n", p.gravity, p.decay, p.brushSize,
+                p.brushPower, barriers, r.stable ? 1 : 0, r.steps, r.ms, r.last.volume,
+                r.volumeDrift, r.last.kineticEnergy, r.peakKineticEnergy, r.last.maxVelocity,
+                r.last.activeCells, r.settleSeconds);
+    }
+}
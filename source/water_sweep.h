@@ -0,0 +1,93 @@
+#ifndef _WATER_SWEEP_H_
+#define _WATER_SWEEP_H_
+
+//Parameter sweeps for tuning the water offline. Every combination in a SweepGrid is an independent
+//headless run on the CPU solver: a flat pool with one of the demo's barrier layouts, the brush held
+//down for a moment, then left to settle. Runs are handed out to one worker per core, each with a
+//grid of its own that it reuses from run to run, and come back as one table.
+//
+//    SweepGrid grid;
+//    grid.gravity = { 0.05f, 0.1f, 0.2f };
+//    grid.decay = { 0.995f, 0.998f };
+//    std::vector<SweepResult> results = runSweep(grid, SweepSettings());
+//    printSweepTable(stdout, results);
+
+#include "cpu_solver.h"
+
+#include <cstdio>
+#include <vector>
+
+//The barrier configurations Space cycles through in the demo
+enum SweepBarriers
+{
+    SWEEP_BARRIERS_NONE,
+    SWEEP_BARRIERS_WALL,   //One wall down the middle, with a stub off it
+    SWEEP_BARRIERS_GAP,    //Two walls with a small gap between them
+    SWEEP_BARRIERS_ZIGZAG, //Three walls making up a zigzag
+    SWEEP_BARRIER_LAYOUTS
+};
+
+//One run's configuration
+struct SweepCase
+{
+    float gravity = 0.1f;
+    float decay = 0.998f;     //Per explicit step
+    float brushSize = 0.15f;  //Radius, in texture coordinates
+    float brushPower = 25.0f; //Height added per second held, like the demo's Brush Power
+    int barriers = SWEEP_BARRIERS_NONE;
+};
+
+//Every combination of these values is one run. An empty list takes SweepCase's default.
+struct SweepGrid
+{
+    std::vector<float> gravity;
+    std::vector<float> decay;
+    std::vector<float> brushSize;
+    std::vector<float> brushPower;
+    std::vector<int> barriers;
+
+    int count() const;
+    SweepCase at(int index) const; //Gravity varies slowest, barriers fastest
+};
+
+//What every run has in common
+struct SweepSettings
+{
+    int width = 128;
+    int height = 128;
+    float startHeight = 2.0f;
+    float seconds = 2.0f;        //Simulated time, brush included
+    float brushSeconds = 0.25f;  //How long the brush is held at the start
+    float brushX = 0.25f;        //Where, in texture coordinates
+    float brushY = 0.5f;
+    float frameRate = 60.0f;     //The brush is painted once a frame, as in the demo
+    bool implicit = false;       //Explicit runs at EXPLICIT_STEPS_PER_SECOND
+    float implicitStepsPerSecond = IMPLICIT_STEPS_PER_SECOND;
+    int threads = 0;             //0 is one per hardware thread
+};
+
+struct SweepResult
+{
+    SweepCase parameters;
+    bool stable = true;          //Stayed finite the whole run. The run stops at the first frame that wasn't.
+    int steps = 0;
+    double ms = 0.0;             //Wall clock time of the run on its worker
+    float volumeDrift = 0.0f;    //Relative change in volume from the end of the brush to the end of the run
+    float peakKineticEnergy = 0.0f;
+    float settleSeconds = -1.0f; //When kinetic energy last fell below 1% of its peak, -1 if it never did
+    WaterDiagnostics last;       //At the end of the run
+};
+
+//Barrier layout in the same cells, bottom row first, as bakeMaskTexture() in the demo reads back
+void sweepBarrierMask(int layout, int width, int height, std::vector<unsigned char> &mask);
+
+//One run, on a grid the caller keeps so that its memory is reused from run to run
+SweepResult runSweepCase(const SweepCase &parameters, const SweepSettings &settings, CPUWaterGrid &grid);
+
+//Every case in the grid, spread over settings.threads workers. Results are in the grid's order.
+std::vector<SweepResult> runSweep(const SweepGrid &grid, const SweepSettings &settings);
+
+//One row per run, comma separated with a header
+void printSweepTable(FILE *out, const std::vector<SweepResult> &results);
+
+#endif // _WATER_SWEEP_H_
@@ -0,0 +1,264 @@
+#include "water_thread.h"
+
+#include <chrono>
+
+ThreadedWaterBackend::ThreadedWaterBackend() : running(false), paused(false)
+{
+    implicit = false;
+    implicitStepsPerSecond = IMPLICIT_STEPS_PER_SECOND;
+    snapshotsPerSecond = 240.0f; //Enough for any display, without copying the grid on every step
+    maskChanges = 0;
+    uploaded = false;
+    uploadedMaskChanges = 0;
+}
+
+//The first snapshot is published before the thread starts, so there's always one to draw. The grid
+//itself is sized by the thread, so that its pages are first touched on the core that steps it.
+bool ThreadedWaterBackend::create(const WaterBlockSettings &settings)
+{
+    solver.gravity = settings.gravity;
+    solver.decay = settings.decay;
+    implicit = settings.implicit;
+    implicitStepsPerSecond = settings.implicitStepsPerSecond;
+    width = settings.width;
+    height = settings.height;
+    stepper.init(stepperTuningFor(width, height, settings.tuneCPU));
+
+    snapshots.writeSlot().grid.resize(width, height);
+    snapshots.publish();
+    uploaded = false;
+#ifdef WATERBLOCK_WITH_GL
+    textures.shaderDirectory = settings.shaderDirectory;
+#endif
+
+    running = true;
+    thread = std::thread(&ThreadedWaterBackend::run, this, settings.width, settings.height);
+    return true;
+}
+
+void ThreadedWaterBackend::destroy()
+{
+    if (thread.joinable())
+    {
+        running = false;
+        thread.join();
+    }
+    stepper.release();
+
+    //Anything the thread didn't get to
+    WaterCommand command;
+    while (commands.pop(command))
+    {
+        delete command.mask;
+        delete command.grid;
+    }
+
+#ifdef WATERBLOCK_WITH_GL
+    textures.release();
+#endif
+}
+
+float ThreadedWaterBackend::stepsPerSecond() const
+{
+    return implicit ? implicitStepsPerSecond : EXPLICIT_STEPS_PER_SECOND;
+}
+
+void ThreadedWaterBackend::setPaused(bool pause)
+{
+    paused = pause;
+}
+
+//-----------------------------------------------------------------
+//Render thread
+//-----------------------------------------------------------------
+//Only waits when the queue is full, which takes hundreds of commands between two steps
+void ThreadedWaterBackend::sendCommand(const WaterCommand &command)
+{
+    while (!commands.push(command))
+        std::this_thread::yield();
+}
+
+void ThreadedWaterBackend::step(int /*steps*/, std::vector<WaterInjection> &injections, WaterStepCallback /*callback*/,
+                                void * /*callbackData*/)
+{
+    std::size_t sent = 0;
+    for (; sent < injections.size(); sent++)
+    {
+        WaterCommand command = { WaterCommand::INJECT, injections[sent], 0, 0, NULL, NULL };
+        if (!commands.push(command))
+            break;
+    }
+    injections.erase(injections.begin(), injections.begin() + sent);
+}
+
+void ThreadedWaterBackend::setMask(const unsigned char *mask)
+{
+    std::vector<unsigned char> *bytes = new std::vector<unsigned char>(width * height, 0);
+    if (mask)
+        bytes->assign(mask, mask + width * height);
+    WaterCommand command = { WaterCommand::SET_MASK, WaterInjection(), width, height, bytes, NULL };
+    sendCommand(command);
+}
+
+void ThreadedWaterBackend::readState(CPUWaterGrid &state)
+{
+    copyGridState(newestSnapshot().grid, state);
+}
+
+void ThreadedWaterBackend::writeState(const CPUWaterGrid &state)
+{
+    CPUWaterGrid *copy = new CPUWaterGrid();
+    copyGridState(state, *copy);
+    width = state.width;
+    height = state.height;
+    WaterCommand command = { WaterCommand::WRITE_STATE, WaterInjection(), 0, 0, NULL, copy };
+    sendCommand(command);
+}
+
+bool ThreadedWaterBackend::resize(unsigned int newWidth, unsigned int newHeight)
+{
+    width = newWidth;
+    height = newHeight;
+    WaterCommand command = { WaterCommand::RESIZE, WaterInjection(), width, height, NULL, NULL };
+    sendCommand(command);
+    return true;
+}
+
+const WaterSnapshot &ThreadedWaterBackend::newestSnapshot()
+{
+    if (snapshots.acquire())
+        uploaded = false;
+    return snapshots.readSlot();
+}
+
+unsigned int ThreadedWaterBackend::bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit)
+{
+#ifdef WATERBLOCK_WITH_GL
+    const WaterSnapshot &snapshot = newestSnapshot();
+    if (snapshot.maskChanges != uploadedMaskChanges)
+        textures.masksChanged = true;
+    if (!uploaded)
+        textures.upload(snapshot.grid);
+    uploaded = true;
+    uploadedMaskChanges = snapshot.maskChanges;
+    textures.bind(heightUnit, surfaceDataUnit);
+    return textures.heightTexture;
+#else
+    (void)heightUnit;
+    (void)surfaceDataUnit;
+    return 0;
+#endif
+}
+
+unsigned long long ThreadedWaterBackend::stepsTaken()
+{
+    return newestSnapshot().steps;
+}
+
+float ThreadedWaterBackend::simulationMsPerSecond()
+{
+    return newestSnapshot().msPerSecond;
+}
+
+//-----------------------------------------------------------------
+//Simulation thread
+//-----------------------------------------------------------------
+void ThreadedWaterBackend::runCommand(WaterCommand &command)
+{
+    switch (command.type)
+    {
+    case WaterCommand::INJECT:
+        injectWater(grid, command.injection.x, command.injection.y, command.injection.radius, command.injection.amount);
+        break;
+    case WaterCommand::SET_MASK:
+        if (command.width == (unsigned int)grid.width && command.height == (unsigned int)grid.height)
+            applyMask(grid, &(*command.mask)[0]);
+        maskChanges++;
+        break;
+    case WaterCommand::WRITE_STATE:
+        copyGridState(*command.grid, grid);
+        maskChanges++;
+        break;
+    case WaterCommand::RESIZE:
+    {
+        CPUStepTuning tuning;
+        if (loadStepperTuning(command.width, command.height, tuning))
+            stepper.init(tuning);
+        stepper.resize(grid, command.width, command.height);
+        maskChanges++;
+        break;
+    }
+    }
+    delete command.mask;
+    delete command.grid;
+}
+
+//Steps are due on a fixed clock, like WaterBlock::advance(). The thread wakes up
+//snapshotsPerSecond times a second, runs every step that's due, and publishes the result. Commands
+//go in before the steps. If it falls far behind, it drops the time rather than trying to catch up.
+void ThreadedWaterBackend::run(int startWidth, int startHeight)
+{
+    typedef std::chrono::steady_clock Clock;
+    const double maxBacklog = 0.25; //Seconds
+
+    Clock::time_point lastTime = Clock::now();
+    Clock::time_point secondStart = lastTime;
+    double accumulator = 0.0;
+    double busySeconds = 0.0;
+    float msPerSecond = 0.0f;
+    unsigned long long steps = 0;
+    std::chrono::duration<double> wakeInterval(1.0 / snapshotsPerSecond);
+    stepper.prepare(grid, startWidth, startHeight);
+
+    while (running)
+    {
+        Clock::time_point now = Clock::now();
+        accumulator += std::chrono::duration<double>(now - lastTime).count();
+        lastTime = now;
+        if (paused)
+            accumulator = 0.0;
+        else if (accumulator > maxBacklog)
+            accumulator = maxBacklog;
+
+        bool changed = false;
+        WaterCommand command;
+        while (commands.pop(command))
+        {
+            runCommand(command);
+            changed = true;
+        }
+
+        double stepTime = 1.0 / stepsPerSecond();
+        int dueSteps = (int)(accumulator / stepTime);
+        accumulator -= dueSteps * stepTime;
+        if (implicit)
+        {
+            for (int i = 0; i < dueSteps; i++)
+                stepImplicit(grid, solver, implicitStepsPerSecond);
+        }
+        else
+            stepper.step(grid, solver, dueSteps);
+        steps += dueSteps;
+
+        Clock::time_point finished = Clock::now();
+        busySeconds += std::chrono::duration<double>(finished - now).count();
+        if (finished - secondStart >= std::chrono::seconds(1))
+        {
+            msPerSecond = (float)(busySeconds * 1000.0 / std::chrono::duration<double>(finished - secondStart).count());
+            busySeconds = 0.0;
+            secondStart = finished;
+        }
+
+        if (dueSteps > 0 || changed)
+        {
+            WaterSnapshot &snapshot = snapshots.writeSlot();
+            copyGridState(grid, snapshot.grid);
+            snapshot.steps = steps;
+            snapshot.msPerSecond = msPerSecond;
+            snapshot.maskChanges = maskChanges;
+            snapshots.publish();
+        }
+
+        std::this_thread::sleep_until(now + std::chrono::duration_cast<Clock::duration>(wakeInterval));
+    }
+}
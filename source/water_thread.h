@@ -0,0 +1,167 @@
+#ifndef _WATER_THREAD_H_
+#define _WATER_THREAD_H_
+
+//The CPU solver on a thread of its own. The simulation thread steps on its own fixed clock and
+//publishes snapshots of the water into a triple buffer, and the render thread always takes the
+//newest one without waiting. Injections, masks and the rest go the other way through a command
+//queue. Neither side ever takes a lock, so rendering costs the same however long the steps take.
+
+#include "cpu_stepper.h"
+#include "water_block.h"
+#ifdef WATERBLOCK_WITH_GL
+#include "water_block_gl.h"
+#endif
+
+#include <atomic>
+#include <thread>
+
+//Three slots: one being written, one being read, and the newest finished one in between. The
+//writer swaps its slot with the middle one when it finishes, and the reader swaps with the middle
+//one only when something new has arrived there, so neither waits on the other.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : back(0), middle(1), front(2) {}
+
+    //Writer side
+    T &writeSlot() { return slots[back]; }
+    void publish() { back = middle.exchange(back | FRESH) & INDEX; }
+
+    //Reader side. True if there was something new, which is then in readSlot().
+    bool acquire()
+    {
+        if (!(middle.load() & FRESH))
+            return false;
+        front = middle.exchange(front) & INDEX;
+        return true;
+    }
+    T &readSlot() { return slots[front]; }
+
+private:
+    static const int INDEX = 3;
+    static const int FRESH = 4;
+
+    T slots[3];
+    int back;
+    std::atomic<int> middle;
+    int front;
+};
+
+//Fixed size queue with one producer and one consumer. Push and pop never block; push fails if full.
+template <typename T, unsigned int Capacity>
+class SPSCQueue
+{
+public:
+    SPSCQueue() : head(0), tail(0) {}
+
+    bool push(const T &item)
+    {
+        unsigned int currentTail = tail.load(std::memory_order_relaxed);
+        unsigned int nextTail = (currentTail + 1) % Capacity;
+        if (nextTail == head.load(std::memory_order_acquire))
+            return false;
+        items[currentTail] = item;
+        tail.store(nextTail, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        unsigned int currentHead = head.load(std::memory_order_relaxed);
+        if (currentHead == tail.load(std::memory_order_acquire))
+            return false;
+        item = items[currentHead];
+        head.store((currentHead + 1) % Capacity, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T items[Capacity];
+    std::atomic<unsigned int> head; //Next to pop, only the consumer moves it
+    std::atomic<unsigned int> tail; //Next to push, only the producer moves it
+};
+
+//Render thread to simulation thread
+struct WaterCommand
+{
+    enum Type { INJECT, SET_MASK, WRITE_STATE, RESIZE };
+    Type type;
+    WaterInjection injection;
+    unsigned int width;               //RESIZE, and the size SET_MASK's mask is for
+    unsigned int height;
+    std::vector<unsigned char> *mask; //SET_MASK. The simulation thread deletes it.
+    CPUWaterGrid *grid;               //WRITE_STATE. The simulation thread deletes it.
+};
+
+//What the simulation thread publishes
+struct WaterSnapshot
+{
+    CPUWaterGrid grid;            //Velocities, heights and masks
+    unsigned long long steps = 0; //Steps taken when it was published
+    float msPerSecond = 0.0f;     //Time spent stepping, over the last second
+    unsigned int maskChanges = 0; //Counts changes to the masks, so they're only uploaded when it moves
+};
+
+class ThreadedWaterBackend : public WaterBackend
+{
+public:
+    ThreadedWaterBackend();
+
+    bool create(const WaterBlockSettings &settings);
+    void destroy();
+    float stepsPerSecond() const;
+
+    //Doesn't step: the simulation thread keeps its own time. This hands it the injections, and
+    //never calls the callback.
+    void step(int steps, std::vector<WaterInjection> &injections, WaterStepCallback callback, void *callbackData);
+    void setMask(const unsigned char *mask);
+
+    //The newest snapshot, so a few milliseconds behind, and not yet showing commands still queued
+    void readState(CPUWaterGrid &grid);
+    void writeState(const CPUWaterGrid &grid);
+    bool resize(unsigned int width, unsigned int height);
+    unsigned int bindForRendering(unsigned int heightUnit, unsigned int surfaceDataUnit);
+
+    //While paused, the thread still runs commands but takes no steps, and doesn't owe any when it resumes
+    void setPaused(bool paused);
+
+    //From the newest snapshot
+    unsigned long long stepsTaken();
+    float simulationMsPerSecond();
+
+private:
+    void run(int startWidth, int startHeight);
+    void sendCommand(const WaterCommand &command);
+    void runCommand(WaterCommand &command);
+    const WaterSnapshot &newestSnapshot();
+
+    static const unsigned int COMMAND_CAPACITY = 256;
+
+    //Shared
+    TripleBuffer<WaterSnapshot> snapshots;
+    SPSCQueue<WaterCommand, COMMAND_CAPACITY> commands;
+    std::atomic<bool> running;
+    std::atomic<bool> paused;
+    std::thread thread;
+
+    //Simulation thread only
+    CPUWaterGrid grid;
+    CPUSolverSettings solver;
+    CPUStepper stepper; //Its workers help the simulation thread with explicit steps
+    bool implicit;
+    float implicitStepsPerSecond;
+    float snapshotsPerSecond;
+    unsigned int maskChanges;
+
+    //Render thread only
+    unsigned int width;  //Size as of the last command sent, which the snapshots may not show yet
+    unsigned int height;
+    bool uploaded;
+    unsigned int uploadedMaskChanges;
+#ifdef WATERBLOCK_WITH_GL
+    GridTextures textures;
+#endif
+};
+
+#endif // _WATER_THREAD_H_
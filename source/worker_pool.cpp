@@ -0,0 +1,84 @@
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool() : job(NULL), jobContext(NULL), jobCount(0), jobNumber(0), jobsRunning(0), stopping(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void WorkerPool::start(int threads)
+{
+    stop();
+    stopping = false;
+    for (int i = 1; i < threads; i++)
+        workers.push_back(std::thread(&WorkerPool::work, this, i));
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobStarted.notify_all();
+    for (std::size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+}
+
+void WorkerPool::parallel(int count, Task task, void *context)
+{
+    int threadCount = threads();
+    if (threadCount == 1)
+    {
+        task(context, 0, 0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = task;
+        jobContext = context;
+        jobCount = count;
+        jobNumber++;
+        jobsRunning = (int)workers.size();
+    }
+    jobStarted.notify_all();
+
+    //The caller takes the first slice
+    int end = count / threadCount;
+    if (end > 0)
+        task(context, 0, 0, end);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    jobFinished.wait(lock, [this] { return jobsRunning == 0; });
+}
+
+void WorkerPool::work(int index)
+{
+    unsigned int seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        jobStarted.wait(lock, [&] { return stopping || jobNumber != seen; });
+        if (stopping)
+            return;
+        seen = jobNumber;
+        Task task = job;
+        void *context = jobContext;
+        int threadCount = (int)workers.size() + 1;
+        int begin = (int)((long long)jobCount * index / threadCount);
+        int end = (int)((long long)jobCount * (index + 1) / threadCount);
+        lock.unlock();
+
+        if (begin < end)
+            task(context, index, begin, end);
+
+        lock.lock();
+        if (--jobsRunning == 0)
+            jobFinished.notify_one();
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+//A few threads that help the caller through one loop at a time. Each loop is split into one slice per
+//thread, always the same slice for the same thread, so data a thread first touched stays on its NUMA
+//node from one loop to the next. The FFTs and the CPU stepper share it.
+//
+//    WorkerPool pool;
+//    pool.start(4);                        //Three workers, plus the caller
+//    pool.parallel(rows, stepRows, &data); //stepRows(&data, thread, begin, end), and back when all are done
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool
+{
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    //Starts threads - 1 workers, stopping any from before. The caller is thread 0.
+    void start(int threads);
+    void stop();
+    int threads() const { return (int)workers.size() + 1; }
+
+    //Runs task(context, thread, begin, end) over [0, count), thread i taking
+    //[count * i / threads, count * (i + 1) / threads), and waits for them all
+    typedef void (*Task)(void *context, int thread, int begin, int end);
+    void parallel(int count, Task task, void *context);
+
+private:
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+
+    void work(int index);
+
+    //Each job is numbered, and a worker runs every job once, then waits for the next
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable jobStarted;
+    std::condition_variable jobFinished;
+    Task job;
+    void *jobContext;
+    int jobCount;
+    unsigned int jobNumber;
+    int jobsRunning;
+    bool stopping;
+};
+
+#endif // _WORKER_POOL_H_